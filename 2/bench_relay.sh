@@ -0,0 +1,38 @@
+#!/bin/bash
+# Relay benchmark: pushes a big file through pipelines of cat and into files,
+# once with the built-in cat and once with /bin/cat. The built-in one moves
+# the data with splice() and copy_file_range(), so its speed should be close
+# to what the kernel can copy.
+#
+# Usage: ./bench_relay.sh [size_mb] [shell]
+
+size_mb=${1:-1024}
+shell=${2:-./a.out}
+dir=$(mktemp -d)
+trap 'rm -rf "$dir"' EXIT
+
+head -c $((size_mb * 1024 * 1024)) /dev/zero > "$dir/in"
+
+run() {
+	local start end
+	start=$(date +%s%N)
+	echo "$1" | "$shell"
+	end=$(date +%s%N)
+	if ! cmp -s "$dir/in" "$dir/out"; then
+		echo "$2: the output differs from the input"
+		exit 1
+	fi
+	awk -v name="$2" -v ns=$((end - start)) -v mb="$size_mb" 'BEGIN {
+		printf("%-28s %8.3f s %10.1f MB/s\n", name, ns / 1e9,
+		       mb / (ns / 1e9))
+	}'
+	rm -f "$dir/out"
+}
+
+in="$dir/in"
+out="$dir/out"
+run "cat $in > $out" "builtin file to file"
+run "/bin/cat $in > $out" "/bin/cat file to file"
+run "cat $in | cat | cat > $out" "builtin 3-stage pipeline"
+run "/bin/cat $in | /bin/cat | /bin/cat > $out" "/bin/cat 3-stage pipeline"
+run "cat $in | cat >> $out" "builtin pipe to append"
@@ -5,6 +5,12 @@
 #include <stdlib.h>
 #include <string.h>
 
+#if defined(__AVX2__)
+#include <immintrin.h>
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
 struct parser {
 	char *buffer;
 	uint32_t size;
@@ -34,9 +40,10 @@ static char *
 token_strdup(const struct token *t)
 {
 	assert(t->type == TOKEN_TYPE_STR);
-	assert(t->size > 0);
+	/* Can be empty when it is quoted, like "". */
 	char *res = malloc(t->size + 1);
-	memcpy(res, t->data, t->size);
+	if (t->size > 0)
+		memcpy(res, t->data, t->size);
 	res[t->size] = 0;
 	return res;
 }
@@ -53,6 +60,20 @@ token_append(struct token *t, char c)
 	t->data[t->size++] = c;
 }
 
+static void
+token_append_n(struct token *t, const char *data, uint32_t size)
+{
+	if (t->capacity - t->size < size) {
+		uint32_t new_capacity = (t->capacity + 1) * 2;
+		if (new_capacity - t->size < size)
+			new_capacity = t->size + size;
+		t->data = realloc(t->data, sizeof(*t->data) * new_capacity);
+		t->capacity = new_capacity;
+	}
+	memcpy(t->data + t->size, data, size);
+	t->size += size;
+}
+
 static void
 token_reset(struct token *t)
 {
@@ -135,6 +156,105 @@ parser_consume(struct parser *p, uint32_t size)
 	p->size -= size;
 }
 
+/**
+ * Character classes for the tokenizer. A character is special in a context
+ * when parse_token() does something else than appending it to the token.
+ */
+enum char_class {
+	/** Special outside of quotes. */
+	CHAR_SPECIAL_PLAIN = 1,
+	/** Special inside of "". */
+	CHAR_SPECIAL_DQUOTE = 2,
+	/** Special inside of ''. */
+	CHAR_SPECIAL_SQUOTE = 4,
+};
+
+static const uint8_t char_classes[256] = {
+	['\''] = CHAR_SPECIAL_PLAIN | CHAR_SPECIAL_SQUOTE,
+	['"'] = CHAR_SPECIAL_PLAIN | CHAR_SPECIAL_DQUOTE,
+	['\\'] = CHAR_SPECIAL_PLAIN | CHAR_SPECIAL_DQUOTE,
+	['&'] = CHAR_SPECIAL_PLAIN,
+	['|'] = CHAR_SPECIAL_PLAIN,
+	['>'] = CHAR_SPECIAL_PLAIN,
+	['#'] = CHAR_SPECIAL_PLAIN,
+	[' '] = CHAR_SPECIAL_PLAIN,
+	['\t'] = CHAR_SPECIAL_PLAIN,
+	['\r'] = CHAR_SPECIAL_PLAIN,
+	['\n'] = CHAR_SPECIAL_PLAIN,
+};
+
+#if defined(__AVX2__)
+
+typedef __m256i scan_vec;
+enum { SCAN_VEC_SIZE = 32 };
+#define scan_load(p) _mm256_loadu_si256((const __m256i *)(p))
+#define scan_eq(v, c) _mm256_cmpeq_epi8((v), _mm256_set1_epi8(c))
+#define scan_or(a, b) _mm256_or_si256((a), (b))
+#define scan_mask(v) ((uint32_t)_mm256_movemask_epi8(v))
+#define SCAN_HAS_VEC 1
+
+#elif defined(__SSE2__)
+
+typedef __m128i scan_vec;
+enum { SCAN_VEC_SIZE = 16 };
+#define scan_load(p) _mm_loadu_si128((const __m128i *)(p))
+#define scan_eq(v, c) _mm_cmpeq_epi8((v), _mm_set1_epi8(c))
+#define scan_or(a, b) _mm_or_si128((a), (b))
+#define scan_mask(v) ((uint32_t)_mm_movemask_epi8(v))
+#define SCAN_HAS_VEC 1
+
+#endif
+
+#ifdef SCAN_HAS_VEC
+
+/** Bit mask of the special characters among SCAN_VEC_SIZE ones. */
+static inline uint32_t
+scan_vec_specials(scan_vec v, char quote)
+{
+	if (quote == '\'')
+		return scan_mask(scan_eq(v, '\''));
+	if (quote == '"')
+		return scan_mask(scan_or(scan_eq(v, '"'), scan_eq(v, '\\')));
+	scan_vec res = scan_or(scan_eq(v, '\''), scan_eq(v, '"'));
+	res = scan_or(res, scan_eq(v, '\\'));
+	res = scan_or(res, scan_or(scan_eq(v, '&'), scan_eq(v, '|')));
+	res = scan_or(res, scan_or(scan_eq(v, '>'), scan_eq(v, '#')));
+	res = scan_or(res, scan_or(scan_eq(v, ' '), scan_eq(v, '\t')));
+	res = scan_or(res, scan_or(scan_eq(v, '\r'), scan_eq(v, '\n')));
+	return scan_mask(res);
+}
+
+#endif
+
+/**
+ * Find the first special character in [pos, end) for the given quote
+ * context. Everything before it can be appended to a token as is. Long
+ * words, quoted strings and comments are scanned by SCAN_VEC_SIZE bytes at
+ * a time when SIMD is available.
+ */
+static const char *
+scan_plain(const char *pos, const char *end, char quote)
+{
+	uint8_t cls;
+	if (quote == 0)
+		cls = CHAR_SPECIAL_PLAIN;
+	else if (quote == '"')
+		cls = CHAR_SPECIAL_DQUOTE;
+	else
+		cls = CHAR_SPECIAL_SQUOTE;
+#ifdef SCAN_HAS_VEC
+	while (end - pos >= SCAN_VEC_SIZE) {
+		uint32_t bits = scan_vec_specials(scan_load(pos), quote);
+		if (bits != 0)
+			return pos + __builtin_ctz(bits);
+		pos += SCAN_VEC_SIZE;
+	}
+#endif
+	while (pos < end && (char_classes[(uint8_t)*pos] & cls) == 0)
+		++pos;
+	return pos;
+}
+
 static uint32_t
 parse_token(const char *pos, const char *end, struct token *out)
 {
@@ -151,6 +271,13 @@ parse_token(const char *pos, const char *end, struct token *out)
 	}
 	char quote = 0;
 	while (pos < end) {
+		const char *run_end = scan_plain(pos, end, quote);
+		if (run_end != pos) {
+			token_append_n(out, pos, run_end - pos);
+			pos = run_end;
+			if (pos == end)
+				break;
+		}
 		char c = *pos;
 		switch(c) {
 		case '\'':
@@ -249,13 +376,21 @@ parse_token(const char *pos, const char *end, struct token *out)
 		case '\r':
 			if (quote != 0)
 				goto append_and_next;
-			assert(out->size > 0);
+			if (out->size == 0) {
+				/* Spaces after a line continuation. */
+				++pos;
+				continue;
+			}
 			out->type = TOKEN_TYPE_STR;
 			return pos + 1 - begin;
 		case '\n':
 			if (quote != 0)
 				goto append_and_next;
-			assert(out->size > 0);
+			if (out->size == 0) {
+				/* A line continuation right before the end. */
+				out->type = TOKEN_TYPE_NEW_LINE;
+				return pos + 1 - begin;
+			}
 			out->type = TOKEN_TYPE_STR;
 			return pos - begin;
 		case '#':
@@ -265,15 +400,11 @@ parse_token(const char *pos, const char *end, struct token *out)
 				out->type = TOKEN_TYPE_STR;
 				return pos - begin;
 			}
-			++pos;
-			while (pos < end) {
-				if (*pos == '\n') {
-					out->type = TOKEN_TYPE_NEW_LINE;
-					return pos + 1 - begin;
-				}
-				++pos;
-			}
-			return 0;
+			pos = memchr(pos, '\n', end - pos);
+			if (pos == NULL)
+				return 0;
+			out->type = TOKEN_TYPE_NEW_LINE;
+			return pos + 1 - begin;
 		default:
 			goto append_and_next;
 		}
@@ -394,9 +525,10 @@ close_and_return:
 		pos += used;
 	}
 	if (token.type == TOKEN_TYPE_NEW_LINE) {
-		assert(line->tail != NULL);
 		parser_consume(p, pos - begin);
-		if (line->tail->type != EXPR_TYPE_COMMAND) {
+		/* Can be empty, like '> file' or just '&'. */
+		if (line->tail == NULL ||
+		    line->tail->type != EXPR_TYPE_COMMAND) {
 			res = PARSER_ERR_ENDS_NOT_WITH_A_COMMAND;
 			goto return_no_line;
 		}
@@ -0,0 +1,170 @@
+/**
+ * Parser benchmark. Generates a corpus of random command lines, then feeds it
+ * into the parser the same way the shell does - by chunks - and pops all the
+ * lines. Reports throughput and allocations per line as one JSON object. It
+ * can be appended to a history file to track the numbers over time.
+ *
+ * Allocations are counted when the benchmark is linked with
+ * utils/heap_help. Run it with HHREPORT=q then, otherwise the heap help
+ * collects a stack trace on each allocation and the throughput is not real.
+ */
+#include "parser.h"
+#include "parser_gen.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+/* Defined only when linked with heap_help. */
+uint64_t
+heaph_get_alloc_count_total(void) __attribute__((weak));
+
+struct bench_result {
+	double seconds;
+	uint64_t allocs;
+	uint64_t lines;
+	uint64_t errors;
+};
+
+static double
+bench_now(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1000000000.0;
+}
+
+static uint64_t
+bench_alloc_count(void)
+{
+	if (heaph_get_alloc_count_total == NULL)
+		return 0;
+	return heaph_get_alloc_count_total();
+}
+
+static void
+bench_run(const char *data, uint32_t size, uint32_t chunk,
+	  struct bench_result *res)
+{
+	memset(res, 0, sizeof(*res));
+	uint64_t allocs = bench_alloc_count();
+	double start = bench_now();
+	struct parser *p = parser_new();
+	for (uint32_t pos = 0; pos < size; pos += chunk) {
+		uint32_t len = size - pos < chunk ? size - pos : chunk;
+		parser_feed(p, data + pos, len);
+		struct command_line *line = NULL;
+		while (true) {
+			enum parser_error err = parser_pop_next(p, &line);
+			if (err != PARSER_ERR_NONE) {
+				++res->errors;
+				continue;
+			}
+			if (line == NULL)
+				break;
+			++res->lines;
+			command_line_delete(line);
+		}
+	}
+	parser_delete(p);
+	res->seconds = bench_now() - start;
+	res->allocs = bench_alloc_count() - allocs;
+}
+
+static void
+usage(const char *name)
+{
+	fprintf(stderr, "Usage: %s [-l lines] [-s seed] [-c chunk] "
+		"[-r rounds] [-w long_word_percent] [-i invalid_percent] "
+		"[-t tag] [-o history_file]\n", name);
+}
+
+int
+main(int argc, char **argv)
+{
+	uint32_t line_count = 20000;
+	uint64_t seed = 1;
+	uint32_t chunk = 1024;
+	uint32_t rounds = 3;
+	int long_word_percent = -1;
+	int invalid_percent = -1;
+	const char *tag = "";
+	const char *history = NULL;
+	int opt;
+	while ((opt = getopt(argc, argv, "l:s:c:r:w:i:t:o:h")) != -1) {
+		switch (opt) {
+		case 'l': line_count = strtoul(optarg, NULL, 10); break;
+		case 's': seed = strtoull(optarg, NULL, 10); break;
+		case 'c': chunk = strtoul(optarg, NULL, 10); break;
+		case 'r': rounds = strtoul(optarg, NULL, 10); break;
+		case 'w': long_word_percent = atoi(optarg); break;
+		case 'i': invalid_percent = atoi(optarg); break;
+		case 't': tag = optarg; break;
+		case 'o': history = optarg; break;
+		default:
+			usage(argv[0]);
+			return opt == 'h' ? 0 : 1;
+		}
+	}
+	if (chunk == 0 || rounds == 0) {
+		usage(argv[0]);
+		return 1;
+	}
+	struct parser_gen g;
+	parser_gen_create(&g, seed);
+	if (long_word_percent >= 0)
+		g.long_word_percent = long_word_percent;
+	if (invalid_percent >= 0)
+		g.invalid_percent = invalid_percent;
+	uint32_t valid_count = 0;
+	for (uint32_t i = 0; i < line_count; ++i)
+		valid_count += parser_gen_line(&g);
+
+	/* The best round is the least affected by the noise. */
+	struct bench_result best;
+	for (uint32_t i = 0; i < rounds; ++i) {
+		struct bench_result res;
+		bench_run(g.data, g.size, chunk, &res);
+		if (i == 0 || res.seconds < best.seconds)
+			best = res;
+	}
+	char json[1024];
+	snprintf(json, sizeof(json), "{\"tag\": \"%s\", \"time\": %lld, "
+		 "\"seed\": %llu, \"lines\": %u, \"valid_lines\": %u, "
+		 "\"bytes\": %u, \"chunk\": %u, \"parsed_lines\": %llu, "
+		 "\"errors\": %llu, \"seconds\": %.6f, \"mb_per_sec\": %.2f, "
+		 "\"lines_per_sec\": %.0f, \"allocs_per_line\": %.3f}",
+		 tag, (long long)time(NULL), (unsigned long long)seed,
+		 line_count, valid_count, g.size, chunk,
+		 (unsigned long long)best.lines,
+		 (unsigned long long)best.errors, best.seconds,
+		 g.size / best.seconds / (1024 * 1024),
+		 line_count / best.seconds,
+		 heaph_get_alloc_count_total == NULL ? -1.0 :
+		 (double)best.allocs / line_count);
+	printf("%s\n", json);
+	int rc = 0;
+	/* The generator knows which lines are broken, the parser must agree. */
+	if (best.lines != valid_count ||
+	    best.errors != line_count - valid_count) {
+		fprintf(stderr, "Parsed %llu lines and %llu errors, expected "
+			"%u and %u\n", (unsigned long long)best.lines,
+			(unsigned long long)best.errors, valid_count,
+			line_count - valid_count);
+		rc = 1;
+	}
+	if (history != NULL) {
+		FILE *f = fopen(history, "a");
+		if (f == NULL) {
+			perror(history);
+			rc = 1;
+		} else {
+			fprintf(f, "%s\n", json);
+			fclose(f);
+		}
+	}
+	parser_gen_destroy(&g);
+	return rc;
+}
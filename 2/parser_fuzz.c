@@ -0,0 +1,250 @@
+/**
+ * Fuzzing of the parser. The entry point is LLVMFuzzerTestOneInput() for
+ * libFuzzer: build with clang -fsanitize=fuzzer -DWITH_LIBFUZZER. Without
+ * libFuzzer the file has an own main() which either replays the files given
+ * in the arguments, or runs the entry point on random lines from parser_gen
+ * with random mutations. It is good to build it with sanitizers then.
+ *
+ * Each parsed line is checked for consistency, and the input is parsed
+ * twice - fed by chunks and all at once - with the results compared. Any
+ * violation aborts.
+ */
+#include "parser.h"
+#include "parser_gen.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define fuzz_assert(cond) do {						\
+	if (!(cond)) {							\
+		fprintf(stderr, "Fuzz check failed, line %d: %s\n",	\
+			__LINE__, #cond);				\
+		abort();						\
+	}								\
+} while (0)
+
+static void
+fuzz_check_line(const struct command_line *line)
+{
+	fuzz_assert(line->head != NULL && line->tail != NULL);
+	fuzz_assert(line->tail->next == NULL);
+	fuzz_assert((line->out_type == OUTPUT_TYPE_STDOUT) ==
+		    (line->out_file == NULL));
+	fuzz_assert(line->out_type == OUTPUT_TYPE_STDOUT ||
+		    line->out_type == OUTPUT_TYPE_FILE_NEW ||
+		    line->out_type == OUTPUT_TYPE_FILE_APPEND);
+	/* Commands and operators alternate, starting and ending with a command. */
+	bool need_command = true;
+	const struct expr *e = line->head;
+	const struct expr *last = NULL;
+	for (; e != NULL; last = e, e = e->next) {
+		if (need_command) {
+			fuzz_assert(e->type == EXPR_TYPE_COMMAND);
+			const struct command *cmd = &e->cmd;
+			fuzz_assert(cmd->exe != NULL);
+			fuzz_assert(cmd->arg_count <= cmd->arg_capacity);
+			for (uint32_t i = 0; i < cmd->arg_count; ++i)
+				fuzz_assert(cmd->args[i] != NULL);
+		} else {
+			fuzz_assert(e->type == EXPR_TYPE_PIPE ||
+				    e->type == EXPR_TYPE_AND ||
+				    e->type == EXPR_TYPE_OR);
+		}
+		need_command = !need_command;
+	}
+	fuzz_assert(last == line->tail);
+	fuzz_assert(!need_command);
+}
+
+/** Everything the parser returned, serialized to compare the runs. */
+struct fuzz_trace {
+	char *data;
+	size_t size;
+	size_t capacity;
+};
+
+static void
+fuzz_trace_append(struct fuzz_trace *t, const void *data, size_t size)
+{
+	if (t->capacity - t->size < size) {
+		t->capacity = (t->capacity + size) * 2;
+		t->data = realloc(t->data, t->capacity);
+	}
+	memcpy(t->data + t->size, data, size);
+	t->size += size;
+}
+
+/** With the terminating zero, so the strings do not glue together. */
+static void
+fuzz_trace_append_str(struct fuzz_trace *t, const char *str)
+{
+	fuzz_trace_append(t, str, strlen(str) + 1);
+}
+
+static void
+fuzz_trace_append_line(struct fuzz_trace *t, const struct command_line *line)
+{
+	for (const struct expr *e = line->head; e != NULL; e = e->next) {
+		fuzz_trace_append(t, &e->type, sizeof(e->type));
+		if (e->type != EXPR_TYPE_COMMAND)
+			continue;
+		fuzz_trace_append_str(t, e->cmd.exe);
+		fuzz_trace_append(t, &e->cmd.arg_count,
+				  sizeof(e->cmd.arg_count));
+		for (uint32_t i = 0; i < e->cmd.arg_count; ++i)
+			fuzz_trace_append_str(t, e->cmd.args[i]);
+	}
+	fuzz_trace_append(t, &line->out_type, sizeof(line->out_type));
+	if (line->out_file != NULL)
+		fuzz_trace_append_str(t, line->out_file);
+	fuzz_trace_append(t, &line->is_background,
+			  sizeof(line->is_background));
+}
+
+static void
+fuzz_drain(struct parser *p, struct fuzz_trace *t)
+{
+	while (true) {
+		struct command_line *line = NULL;
+		enum parser_error err = parser_pop_next(p, &line);
+		if (err != PARSER_ERR_NONE) {
+			fuzz_assert(line == NULL);
+			fuzz_trace_append(t, "E", 1);
+			fuzz_trace_append(t, &err, sizeof(err));
+			continue;
+		}
+		if (line == NULL)
+			return;
+		fuzz_check_line(line);
+		fuzz_trace_append(t, "L", 1);
+		fuzz_trace_append_line(t, line);
+		command_line_delete(line);
+	}
+}
+
+static void
+fuzz_parse(const char *data, size_t size, size_t chunk, struct fuzz_trace *t)
+{
+	struct parser *p = parser_new();
+	for (size_t pos = 0; pos < size; pos += chunk) {
+		size_t len = size - pos < chunk ? size - pos : chunk;
+		parser_feed(p, data + pos, len);
+		fuzz_drain(p, t);
+	}
+	/* Terminate a possibly unfinished last line. */
+	parser_feed(p, "\n", 1);
+	fuzz_drain(p, t);
+	parser_delete(p);
+}
+
+int
+LLVMFuzzerTestOneInput(const uint8_t *data, size_t size)
+{
+	if (size == 0)
+		return 0;
+	/*
+	 * The first byte is the feed chunk size. The parser has to give the
+	 * same results regardless of how the input is split.
+	 */
+	size_t chunk = data[0] % 64 + 1;
+	++data;
+	--size;
+	struct fuzz_trace by_chunks = {NULL, 0, 0};
+	struct fuzz_trace at_once = {NULL, 0, 0};
+	fuzz_parse((const char *)data, size, chunk, &by_chunks);
+	fuzz_parse((const char *)data, size, size + 1, &at_once);
+	fuzz_assert(by_chunks.size == at_once.size);
+	fuzz_assert(by_chunks.size == 0 ||
+		    memcmp(by_chunks.data, at_once.data, at_once.size) == 0);
+	free(by_chunks.data);
+	free(at_once.data);
+	return 0;
+}
+
+#ifndef WITH_LIBFUZZER
+
+enum {
+	FUZZ_DEFAULT_ITERATIONS = 20000,
+	FUZZ_MAX_LINES = 8,
+};
+
+static void
+fuzz_mutate(struct parser_gen *g)
+{
+	static const char special[] = "'\"\\|&>#\n \t";
+	uint32_t count = parser_gen_rand(g) % 4;
+	for (uint32_t i = 0; i < count && g->size > 0; ++i) {
+		uint32_t pos = parser_gen_rand(g) % g->size;
+		uint64_t r = parser_gen_rand(g);
+		if (r % 3 == 0)
+			g->data[pos] = special[r / 3 % (sizeof(special) - 1)];
+		else if (r % 3 == 1)
+			g->data[pos] = r / 3 % 256;
+		else
+			g->size = pos;
+	}
+}
+
+static int
+fuzz_replay(const char *path)
+{
+	FILE *f = fopen(path, "rb");
+	if (f == NULL) {
+		perror(path);
+		return 1;
+	}
+	char *data = NULL;
+	size_t size = 0;
+	size_t capacity = 0;
+	while (true) {
+		if (size == capacity) {
+			capacity = (capacity + 1) * 2;
+			data = realloc(data, capacity);
+		}
+		size_t rc = fread(data + size, 1, capacity - size, f);
+		if (rc == 0)
+			break;
+		size += rc;
+	}
+	fclose(f);
+	LLVMFuzzerTestOneInput((const uint8_t *)data, size);
+	free(data);
+	return 0;
+}
+
+int
+main(int argc, char **argv)
+{
+	if (argc > 1 && strcmp(argv[1], "-n") != 0) {
+		for (int i = 1; i < argc; ++i) {
+			if (fuzz_replay(argv[i]) != 0)
+				return 1;
+		}
+		return 0;
+	}
+	uint64_t iterations = FUZZ_DEFAULT_ITERATIONS;
+	if (argc > 2)
+		iterations = strtoull(argv[2], NULL, 10);
+	struct parser_gen g;
+	parser_gen_create(&g, 42);
+	g.invalid_percent = 30;
+	/* Long words are for the benchmark, here they just slow down. */
+	g.long_word_percent = 0;
+	for (uint64_t i = 0; i < iterations; ++i) {
+		parser_gen_reset(&g);
+		/* Room for the chunk size byte. */
+		parser_gen_line(&g);
+		g.data[0] = parser_gen_rand(&g) % 256;
+		uint32_t lines = parser_gen_rand(&g) % FUZZ_MAX_LINES;
+		for (uint32_t j = 0; j < lines; ++j)
+			parser_gen_line(&g);
+		fuzz_mutate(&g);
+		LLVMFuzzerTestOneInput((const uint8_t *)g.data, g.size);
+	}
+	printf("%llu inputs passed\n", (unsigned long long)iterations);
+	parser_gen_destroy(&g);
+	return 0;
+}
+
+#endif
@@ -0,0 +1,297 @@
+#include "parser_gen.h"
+
+#include <assert.h>
+#include <stdlib.h>
+#include <string.h>
+
+enum {
+	GEN_MAX_ARGS = 6,
+	GEN_MAX_PIPES = 4,
+	GEN_MAX_LOGICAL = 3,
+	GEN_LONG_WORD_MIN = 200,
+	GEN_LONG_WORD_MAX = 2000,
+};
+
+static const char gen_word_chars[] =
+	"abcdefghijklmnopqrstuvwxyzABCDEFGHIJKLMNOPQRSTUVWXYZ0123456789_./-=+,:";
+
+/** Characters which are fine inside of any quotes. */
+static const char gen_quoted_chars[] =
+	"abcdefghijklmnopqrstuvwxyz 0123456789|&>#;()<$*?";
+
+static const char *const gen_operators[] = {"|", "&&", "||"};
+
+void
+parser_gen_create(struct parser_gen *g, uint64_t seed)
+{
+	memset(g, 0, sizeof(*g));
+	/* Zero state would make xorshift produce only zeros. */
+	g->state = seed != 0 ? seed : 0x9e3779b97f4a7c15ULL;
+	g->invalid_percent = 10;
+	g->long_word_percent = 2;
+}
+
+void
+parser_gen_destroy(struct parser_gen *g)
+{
+	free(g->data);
+}
+
+uint64_t
+parser_gen_rand(struct parser_gen *g)
+{
+	/* xorshift64* - fast and good enough for test data. */
+	uint64_t x = g->state;
+	x ^= x >> 12;
+	x ^= x << 25;
+	x ^= x >> 27;
+	g->state = x;
+	return x * 0x2545f4914f6cdd1dULL;
+}
+
+static inline uint32_t
+gen_range(struct parser_gen *g, uint32_t min, uint32_t max)
+{
+	assert(min <= max);
+	return min + parser_gen_rand(g) % (max - min + 1);
+}
+
+static inline bool
+gen_chance(struct parser_gen *g, uint32_t percent)
+{
+	return parser_gen_rand(g) % 100 < percent;
+}
+
+static void
+gen_reserve(struct parser_gen *g, uint32_t size)
+{
+	if (g->capacity - g->size >= size)
+		return;
+	uint32_t new_capacity = (g->capacity + 1) * 2;
+	if (new_capacity - g->size < size)
+		new_capacity = g->size + size;
+	g->data = realloc(g->data, new_capacity);
+	g->capacity = new_capacity;
+}
+
+static inline void
+gen_putc(struct parser_gen *g, char c)
+{
+	gen_reserve(g, 1);
+	g->data[g->size++] = c;
+}
+
+static inline void
+gen_puts(struct parser_gen *g, const char *str)
+{
+	uint32_t len = strlen(str);
+	gen_reserve(g, len);
+	memcpy(g->data + g->size, str, len);
+	g->size += len;
+}
+
+static inline char
+gen_char_from(struct parser_gen *g, const char *set, uint32_t set_size)
+{
+	return set[parser_gen_rand(g) % set_size];
+}
+
+static void
+gen_plain_word(struct parser_gen *g)
+{
+	uint32_t len;
+	if (gen_chance(g, g->long_word_percent))
+		len = gen_range(g, GEN_LONG_WORD_MIN, GEN_LONG_WORD_MAX);
+	else
+		len = gen_range(g, 1, 12);
+	gen_reserve(g, len);
+	for (uint32_t i = 0; i < len; ++i) {
+		g->data[g->size++] = gen_char_from(g, gen_word_chars,
+						   sizeof(gen_word_chars) - 1);
+	}
+}
+
+static void
+gen_quoted_word(struct parser_gen *g, char quote)
+{
+	uint32_t len = gen_range(g, 0, 20);
+	if (gen_chance(g, g->long_word_percent))
+		len = gen_range(g, GEN_LONG_WORD_MIN, GEN_LONG_WORD_MAX);
+	gen_putc(g, quote);
+	for (uint32_t i = 0; i < len; ++i) {
+		uint32_t kind = gen_range(g, 0, 19);
+		if (quote == '"' && kind == 0) {
+			/* Escapes which mean something inside "". */
+			static const char *const escapes[] = {
+				"\\\"", "\\\\", "\\\n", "\\n", "\\t",
+			};
+			gen_puts(g, escapes[gen_range(g, 0, 4)]);
+		} else if (kind == 1) {
+			/* The other quote is just a character here. */
+			gen_putc(g, quote == '"' ? '\'' : '"');
+		} else if (kind == 2) {
+			gen_putc(g, '\n');
+		} else {
+			gen_putc(g, gen_char_from(g, gen_quoted_chars,
+						  sizeof(gen_quoted_chars) - 1));
+		}
+	}
+	gen_putc(g, quote);
+}
+
+static void
+gen_word(struct parser_gen *g)
+{
+	uint32_t kind = gen_range(g, 0, 9);
+	switch (kind) {
+	case 0:
+		gen_quoted_word(g, '\'');
+		return;
+	case 1:
+		gen_quoted_word(g, '"');
+		return;
+	case 2:
+		/* Escaped special characters outside of quotes. */
+		gen_plain_word(g);
+		gen_putc(g, '\\');
+		gen_putc(g, " |&>#'\"\\"[gen_range(g, 0, 7)]);
+		gen_plain_word(g);
+		return;
+	default:
+		gen_plain_word(g);
+		return;
+	}
+}
+
+static void
+gen_space(struct parser_gen *g)
+{
+	uint32_t kind = gen_range(g, 0, 15);
+	if (kind == 0)
+		gen_puts(g, "\\\n");
+	else if (kind == 1)
+		gen_putc(g, '\t');
+	else if (kind == 2)
+		gen_puts(g, "   ");
+	else
+		gen_putc(g, ' ');
+}
+
+static void
+gen_command(struct parser_gen *g)
+{
+	gen_plain_word(g);
+	uint32_t arg_count = gen_range(g, 0, GEN_MAX_ARGS);
+	for (uint32_t i = 0; i < arg_count; ++i) {
+		gen_space(g);
+		gen_word(g);
+	}
+}
+
+/** Operators can be written both with and without spaces around. */
+static void
+gen_operator(struct parser_gen *g, const char *op)
+{
+	if (gen_chance(g, 80))
+		gen_space(g);
+	gen_puts(g, op);
+	if (gen_chance(g, 80))
+		gen_space(g);
+}
+
+static void
+gen_valid_line(struct parser_gen *g)
+{
+	uint32_t logical_count = gen_range(g, 0, GEN_MAX_LOGICAL);
+	for (uint32_t l = 0; l <= logical_count; ++l) {
+		if (l != 0)
+			gen_operator(g, gen_operators[gen_range(g, 1, 2)]);
+		uint32_t pipe_count = gen_range(g, 0, GEN_MAX_PIPES);
+		for (uint32_t p = 0; p <= pipe_count; ++p) {
+			if (p != 0)
+				gen_operator(g, "|");
+			gen_command(g);
+		}
+	}
+	if (gen_chance(g, 20)) {
+		gen_operator(g, gen_chance(g, 50) ? ">" : ">>");
+		gen_word(g);
+	}
+	if (gen_chance(g, 10))
+		gen_operator(g, "&");
+	if (gen_chance(g, 10)) {
+		gen_puts(g, " #");
+		uint32_t len = gen_range(g, 0, 40);
+		for (uint32_t i = 0; i < len; ++i) {
+			gen_putc(g, gen_char_from(g, gen_quoted_chars,
+						  sizeof(gen_quoted_chars) - 1));
+		}
+	}
+}
+
+static void
+gen_invalid_line(struct parser_gen *g)
+{
+	uint32_t kind = gen_range(g, 0, 5);
+	switch (kind) {
+	case 0:
+		/* Operator without the left argument. */
+		gen_operator(g, gen_operators[gen_range(g, 0, 2)]);
+		gen_command(g);
+		break;
+	case 1:
+		/* Operator without the right argument. */
+		gen_command(g);
+		gen_operator(g, gen_operators[gen_range(g, 0, 2)]);
+		break;
+	case 2:
+		/* Two operators in a row. Apart, or '|' '|' is '||'. */
+		gen_command(g);
+		gen_operator(g, gen_operators[gen_range(g, 0, 2)]);
+		gen_putc(g, ' ');
+		gen_operator(g, gen_operators[gen_range(g, 0, 2)]);
+		gen_command(g);
+		break;
+	case 3:
+		/* Redirect to not a file. */
+		gen_command(g);
+		gen_operator(g, ">");
+		gen_operator(g, gen_operators[gen_range(g, 0, 2)]);
+		break;
+	case 4:
+		/* Arguments after a redirect. */
+		gen_command(g);
+		gen_operator(g, ">>");
+		gen_plain_word(g);
+		gen_operator(g, "&");
+		gen_plain_word(g);
+		break;
+	default:
+		/*
+		 * Random garbage. It can happen to be a valid line, or a
+		 * comment, so it goes after an operator without the left
+		 * argument to be an error anyway.
+		 */
+		gen_operator(g, gen_operators[gen_range(g, 0, 2)]);
+		for (uint32_t i = gen_range(g, 1, 60); i > 0; --i) {
+			char c = parser_gen_rand(g) % 256;
+			/* Keep the line boundary where it is expected. */
+			if (c == '\n' || c == '\\' || c == '\'' || c == '"')
+				c = '|';
+			gen_putc(g, c);
+		}
+		break;
+	}
+}
+
+bool
+parser_gen_line(struct parser_gen *g)
+{
+	bool is_valid = !gen_chance(g, g->invalid_percent);
+	if (is_valid)
+		gen_valid_line(g);
+	else
+		gen_invalid_line(g);
+	gen_putc(g, '\n');
+	return is_valid;
+}
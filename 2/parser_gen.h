@@ -0,0 +1,47 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+
+/**
+ * Generator of random command lines for the parser benchmark and fuzzing. It
+ * produces everything the parser understands: plain words, quoted strings,
+ * escapes, line continuations, comments, '|', '&&', '||', '>', '>>', '&'. A
+ * part of the lines can be intentionally broken to exercise the error paths.
+ */
+struct parser_gen {
+	/** Random state. The same seed gives the same lines. */
+	uint64_t state;
+	/** Percent of the lines which have a syntax error. */
+	uint32_t invalid_percent;
+	/** Percent of the words which are long, hundreds of bytes. */
+	uint32_t long_word_percent;
+	/** Output buffer. The lines are appended to it. */
+	char *data;
+	uint32_t size;
+	uint32_t capacity;
+};
+
+void
+parser_gen_create(struct parser_gen *g, uint64_t seed);
+
+void
+parser_gen_destroy(struct parser_gen *g);
+
+uint64_t
+parser_gen_rand(struct parser_gen *g);
+
+/**
+ * Append one line terminated by a new line to the output buffer.
+ * @retval true The line is valid.
+ * @retval false The line has a syntax error.
+ */
+bool
+parser_gen_line(struct parser_gen *g);
+
+/** Drop the accumulated output. */
+static inline void
+parser_gen_reset(struct parser_gen *g)
+{
+	g->size = 0;
+}
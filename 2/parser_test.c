@@ -117,6 +117,29 @@ test_two_words(void)
 	unit_test_finish();
 }
 
+static void
+test_empty_string(void)
+{
+	unit_test_start();
+	struct parser *p = parser_new();
+	struct command_line *line = NULL;
+
+	const char *str = "echo \"\" '' a\n";
+	parser_feed(p, str, strlen(str));
+	unit_check(parser_pop_next(p, &line) == PARSER_ERR_NONE, "parse");
+	struct expr *e = line->head;
+	unit_check(e->type == EXPR_TYPE_COMMAND, "expr type");
+	unit_check(strcmp(e->cmd.exe, "echo") == 0, "exe");
+	unit_check(e->cmd.arg_count == 3, "arg count");
+	unit_check(strcmp(e->cmd.args[0], "") == 0, "arg[0]");
+	unit_check(strcmp(e->cmd.args[1], "") == 0, "arg[1]");
+	unit_check(strcmp(e->cmd.args[2], "a") == 0, "arg[2]");
+	command_line_delete(line);
+
+	parser_delete(p);
+	unit_test_finish();
+}
+
 static void
 test_escape_in_string(void)
 {
@@ -825,6 +848,7 @@ main(void)
 	test_one_word();
 	test_incomplete();
 	test_two_words();
+	test_empty_string();
 	test_escape_in_string();
 	test_output_redirect();
 	test_escape_outside_of_string();
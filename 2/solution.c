@@ -1,71 +1,1999 @@
+#define _GNU_SOURCE
 #include "parser.h"
 
 #include <assert.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdarg.h>
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/signalfd.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
 #include <unistd.h>
 
+/** A child process of the shell which is not reaped yet. */
+struct job {
+	/** 0 means the slot is free. */
+	pid_t pid;
+	/**
+	 * Background jobs are reaped and forgotten right away. Foreground
+	 * ones stay in the table until the shell takes their status.
+	 */
+	bool is_background;
+	bool is_done;
+	/** Exit code, valid when the job is done. */
+	int status;
+};
+
+/**
+ * All not reaped children of the shell. Reaping is event driven: SIGCHLD is
+ * blocked and comes via a signalfd, so the shell waits for its children and
+ * for the input in the same poll(). On each notification all the exited
+ * children are reaped with waitpid(-1, WNOHANG) and found in a hash table by
+ * pid. Hence neither hundreds of background jobs nor long pipelines make the
+ * shell scan all its children, and finished background jobs never stay
+ * zombies until a next command.
+ */
+struct job_table {
+	/** Open addressing hash table with linear probing. */
+	struct job *jobs;
+	uint32_t capacity;
+	uint32_t count;
+	/** How many of the jobs are in background. */
+	uint32_t bg_count;
+	/** Signalfd for SIGCHLD. */
+	int sigfd;
+	/** Signal mask to restore in the children. */
+	sigset_t old_mask;
+};
+
+static int
+job_table_create(struct job_table *t)
+{
+	memset(t, 0, sizeof(*t));
+	sigset_t mask;
+	sigemptyset(&mask);
+	sigaddset(&mask, SIGCHLD);
+	if (sigprocmask(SIG_BLOCK, &mask, &t->old_mask) != 0)
+		return -1;
+	t->sigfd = signalfd(-1, &mask, SFD_NONBLOCK | SFD_CLOEXEC);
+	if (t->sigfd < 0) {
+		sigprocmask(SIG_SETMASK, &t->old_mask, NULL);
+		return -1;
+	}
+	return 0;
+}
+
+static void
+job_table_destroy(struct job_table *t)
+{
+	close(t->sigfd);
+	sigprocmask(SIG_SETMASK, &t->old_mask, NULL);
+	free(t->jobs);
+}
+
+/**
+ * Prepare a forked process for becoming a command. It must not inherit the
+ * blocked SIGCHLD.
+ */
+static void
+job_table_child_prepare(const struct job_table *t)
+{
+	sigprocmask(SIG_SETMASK, &t->old_mask, NULL);
+}
+
+/**
+ * A forked copy of the shell has no children yet. It keeps the signalfd,
+ * which from now on reports the child's own SIGCHLD.
+ */
+static void
+job_table_child_reset(struct job_table *t)
+{
+	free(t->jobs);
+	t->jobs = NULL;
+	t->capacity = 0;
+	t->count = 0;
+	t->bg_count = 0;
+}
+
+static inline uint32_t
+job_table_slot(const struct job_table *t, pid_t pid)
+{
+	/* Pids are mostly sequential, spread them a bit. */
+	return ((uint32_t)pid * 2654435761u) & (t->capacity - 1);
+}
+
+static struct job *
+job_table_find(struct job_table *t, pid_t pid)
+{
+	if (t->count == 0)
+		return NULL;
+	uint32_t mask = t->capacity - 1;
+	for (uint32_t i = job_table_slot(t, pid);; i = (i + 1) & mask) {
+		struct job *j = &t->jobs[i];
+		if (j->pid == pid)
+			return j;
+		if (j->pid == 0)
+			return NULL;
+	}
+}
+
+static void
+job_table_insert(struct job_table *t, const struct job *job)
+{
+	uint32_t i = job_table_slot(t, job->pid);
+	while (t->jobs[i].pid != 0)
+		i = (i + 1) & (t->capacity - 1);
+	t->jobs[i] = *job;
+}
+
+static void
+job_table_add(struct job_table *t, pid_t pid, bool is_background)
+{
+	/* Keep the load factor under 1/2 so as the probes are short. */
+	if ((t->count + 1) * 2 > t->capacity) {
+		struct job *old = t->jobs;
+		uint32_t old_capacity = t->capacity;
+		t->capacity = old_capacity == 0 ? 16 : old_capacity * 2;
+		t->jobs = calloc(t->capacity, sizeof(*t->jobs));
+		for (uint32_t i = 0; i < old_capacity; ++i) {
+			if (old[i].pid != 0)
+				job_table_insert(t, &old[i]);
+		}
+		free(old);
+	}
+	struct job job;
+	job.pid = pid;
+	job.is_background = is_background;
+	job.is_done = false;
+	job.status = 0;
+	job_table_insert(t, &job);
+	++t->count;
+	if (is_background)
+		++t->bg_count;
+}
+
+static void
+job_table_remove(struct job_table *t, struct job *job)
+{
+	if (job->is_background)
+		--t->bg_count;
+	--t->count;
+	/*
+	 * Backward shift deletion: move the following entries of the same
+	 * probe chain into the hole, so as lookups need no tombstones.
+	 */
+	uint32_t mask = t->capacity - 1;
+	uint32_t hole = job - t->jobs;
+	for (uint32_t i = (hole + 1) & mask; t->jobs[i].pid != 0;
+	     i = (i + 1) & mask) {
+		uint32_t home = job_table_slot(t, t->jobs[i].pid);
+		/* Can move only if its home is not in (hole, i]. */
+		if (((i - home) & mask) >= ((i - hole) & mask)) {
+			t->jobs[hole] = t->jobs[i];
+			hole = i;
+		}
+	}
+	t->jobs[hole].pid = 0;
+}
+
+static int
+wait_status_to_code(int status)
+{
+	if (WIFEXITED(status))
+		return WEXITSTATUS(status);
+	if (WIFSIGNALED(status))
+		return 128 + WTERMSIG(status);
+	return 1;
+}
+
+/** Reap all the exited children. Never blocks. */
+static void
+job_table_reap(struct job_table *t)
+{
+	struct signalfd_siginfo info;
+	while (read(t->sigfd, &info, sizeof(info)) > 0)
+		;
+	pid_t pid;
+	int status;
+	while ((pid = waitpid(-1, &status, WNOHANG)) > 0) {
+		struct job *j = job_table_find(t, pid);
+		if (j == NULL)
+			continue;
+		if (j->is_background) {
+			job_table_remove(t, j);
+			continue;
+		}
+		j->is_done = true;
+		j->status = wait_status_to_code(status);
+	}
+}
+
+/** Block until a child exits, then reap. */
+static void
+job_table_wait_event(struct job_table *t)
+{
+	struct pollfd pfd;
+	pfd.fd = t->sigfd;
+	pfd.events = POLLIN;
+	/* On EINTR reaping just finds nothing. */
+	poll(&pfd, 1, -1);
+	job_table_reap(t);
+}
+
+/**
+ * Wait for a foreground child and forget it.
+ * @retval Exit code of the child.
+ */
+static int
+job_table_wait(struct job_table *t, pid_t pid)
+{
+	struct job *j;
+	while ((j = job_table_find(t, pid)) != NULL && !j->is_done)
+		job_table_wait_event(t);
+	assert(j != NULL);
+	int status = j->status;
+	job_table_remove(t, j);
+	return status;
+}
+
+/** Resolved location of an executable. */
+struct path_entry {
+	/** Command name as typed. NULL means the slot is free. */
+	char *name;
+	/** Absolute path of the executable. */
+	char *path;
+	/** How many times the entry was used, like in bash 'hash'. */
+	uint32_t hits;
+};
+
+/**
+ * Cache of the executables found in $PATH, the same as the bash one. Without
+ * it each external command, in each stage of each pipeline, makes execvp()
+ * try execve() on every directory of $PATH until it succeeds. With the cache
+ * the path is found once, and then the command is exec'ed directly.
+ *
+ * The cache is dropped when $PATH changes. An entry is dropped when its file
+ * is not accessible anymore. If the file disappears between the check and
+ * exec, the child gets ENOENT and falls back to execvp().
+ */
+struct path_cache {
+	/** Open addressing hash table with linear probing. */
+	struct path_entry *entries;
+	uint32_t capacity;
+	uint32_t count;
+	/** $PATH the entries were found in. NULL when empty. */
+	char *env_path;
+};
+
+static inline uint32_t
+path_cache_slot(const struct path_cache *c, const char *name)
+{
+	/* FNV-1a. */
+	uint32_t h = 2166136261u;
+	for (; *name != 0; ++name)
+		h = (h ^ (unsigned char)*name) * 16777619u;
+	return h & (c->capacity - 1);
+}
+
+static struct path_entry *
+path_cache_find(struct path_cache *c, const char *name)
+{
+	if (c->count == 0)
+		return NULL;
+	uint32_t mask = c->capacity - 1;
+	for (uint32_t i = path_cache_slot(c, name);; i = (i + 1) & mask) {
+		struct path_entry *e = &c->entries[i];
+		if (e->name == NULL)
+			return NULL;
+		if (strcmp(e->name, name) == 0)
+			return e;
+	}
+}
+
+static void
+path_cache_insert(struct path_cache *c, const struct path_entry *entry)
+{
+	uint32_t i = path_cache_slot(c, entry->name);
+	while (c->entries[i].name != NULL)
+		i = (i + 1) & (c->capacity - 1);
+	c->entries[i] = *entry;
+}
+
+static struct path_entry *
+path_cache_add(struct path_cache *c, const char *name, const char *path)
+{
+	/* Keep the load factor under 1/2 so as the probes are short. */
+	if ((c->count + 1) * 2 > c->capacity) {
+		struct path_entry *old = c->entries;
+		uint32_t old_capacity = c->capacity;
+		c->capacity = old_capacity == 0 ? 32 : old_capacity * 2;
+		c->entries = calloc(c->capacity, sizeof(*c->entries));
+		for (uint32_t i = 0; i < old_capacity; ++i) {
+			if (old[i].name != NULL)
+				path_cache_insert(c, &old[i]);
+		}
+		free(old);
+	}
+	struct path_entry entry;
+	entry.name = strdup(name);
+	entry.path = strdup(path);
+	entry.hits = 0;
+	path_cache_insert(c, &entry);
+	++c->count;
+	return path_cache_find(c, name);
+}
+
+static void
+path_cache_remove(struct path_cache *c, struct path_entry *entry)
+{
+	free(entry->name);
+	free(entry->path);
+	--c->count;
+	/* Backward shift deletion, the same as in the job table. */
+	uint32_t mask = c->capacity - 1;
+	uint32_t hole = entry - c->entries;
+	for (uint32_t i = (hole + 1) & mask; c->entries[i].name != NULL;
+	     i = (i + 1) & mask) {
+		uint32_t home = path_cache_slot(c, c->entries[i].name);
+		if (((i - home) & mask) >= ((i - hole) & mask)) {
+			c->entries[hole] = c->entries[i];
+			hole = i;
+		}
+	}
+	c->entries[hole].name = NULL;
+	c->entries[hole].path = NULL;
+}
+
+static void
+path_cache_clear(struct path_cache *c)
+{
+	for (uint32_t i = 0; i < c->capacity; ++i) {
+		free(c->entries[i].name);
+		free(c->entries[i].path);
+	}
+	free(c->entries);
+	free(c->env_path);
+	memset(c, 0, sizeof(*c));
+}
+
+/**
+ * Find an executable in $PATH the way execvp() does. Relative directories
+ * depend on the current directory, so what is found in them is returned but
+ * is not cached.
+ * @param[out] path Buffer for the result, PATH_MAX bytes.
+ * @retval Whether the result can be cached. False also when not found, then
+ *         @a path is empty.
+ */
+static bool
+path_search(const char *name, const char *env_path, char *path)
+{
+	path[0] = 0;
+	size_t name_len = strlen(name);
+	const char *dir = env_path;
+	while (true) {
+		const char *end = strchrnul(dir, ':');
+		size_t dir_len = end - dir;
+		/* An empty entry means the current directory. */
+		const char *d = dir_len == 0 ? "." : dir;
+		if (dir_len == 0)
+			dir_len = 1;
+		if (dir_len + name_len + 2 <= PATH_MAX) {
+			memcpy(path, d, dir_len);
+			path[dir_len] = '/';
+			memcpy(path + dir_len + 1, name, name_len + 1);
+			struct stat st;
+			if (stat(path, &st) == 0 && S_ISREG(st.st_mode) &&
+			    access(path, X_OK) == 0)
+				return path[0] == '/';
+		}
+		if (*end == 0)
+			break;
+		dir = end + 1;
+	}
+	path[0] = 0;
+	return false;
+}
+
+/**
+ * Resolve a command name into a path to exec.
+ * @param[out] path Buffer for the result, PATH_MAX bytes.
+ * @retval Cache entry the path was taken from or NULL, when it is not cached.
+ *         @a path is empty when the command is not found, then the child has
+ *         to report the error.
+ */
+static struct path_entry *
+path_cache_resolve(struct path_cache *c, const char *name, char *path)
+{
+	if (strchr(name, '/') != NULL) {
+		strcpy(path, name);
+		return NULL;
+	}
+	const char *env_path = getenv("PATH");
+	if (env_path == NULL)
+		env_path = "/bin:/usr/bin";
+	if (c->env_path == NULL || strcmp(c->env_path, env_path) != 0) {
+		path_cache_clear(c);
+		c->env_path = strdup(env_path);
+	}
+	struct path_entry *e = path_cache_find(c, name);
+	if (e != NULL) {
+		/*
+		 * One access() instead of a failed execve() per each directory
+		 * before the right one. A file which is gone is searched
+		 * again, it could have moved to another directory.
+		 */
+		if (access(e->path, X_OK) == 0) {
+			++e->hits;
+			strcpy(path, e->path);
+			return e;
+		}
+		path_cache_remove(c, e);
+	}
+	if (!path_search(name, env_path, path))
+		return NULL;
+	e = path_cache_add(c, name, path);
+	++e->hits;
+	return e;
+}
+
+/** State of the shell which survives between command lines. */
+struct shell {
+	/** Exit status of the last executed command. */
+	int status;
+	/** Set by the 'exit' built-in when the shell has to stop. */
+	bool is_exit;
+	struct job_table jobs;
+	struct path_cache paths;
+};
+
+/**
+ * Buffered output of a built-in command. Built-ins write directly into a file
+ * descriptor, without stdio, so as their output never gets mixed with a
+ * not flushed stdio buffer, and so as it is not duplicated on fork().
+ */
+struct out_buf {
+	int fd;
+	uint32_t size;
+	/** Errno of the first failed write, 0 if none. */
+	int error;
+	char data[4096];
+};
+
+static inline void
+out_buf_create(struct out_buf *out, int fd)
+{
+	out->fd = fd;
+	out->size = 0;
+	out->error = 0;
+}
+
+/**
+ * Write all the data, retrying on partial writes.
+ * @retval 0 Success.
+ * @retval -1 Error, errno is set.
+ */
+static int
+fd_write_all(int fd, const char *data, size_t size)
+{
+	while (size > 0) {
+		ssize_t rc = write(fd, data, size);
+		if (rc < 0) {
+			if (errno == EINTR)
+				continue;
+			return -1;
+		}
+		data += rc;
+		size -= rc;
+	}
+	return 0;
+}
+
+/** After a failed write the rest of the output is dropped. */
+static void
+out_buf_flush(struct out_buf *out)
+{
+	if (out->error == 0 &&
+	    fd_write_all(out->fd, out->data, out->size) != 0)
+		out->error = errno;
+	out->size = 0;
+}
+
+/**
+ * Flush the output and report a failed write like the external commands
+ * do. A closed pipe is not reported, it is the reader's choice.
+ * @param name Command name for the message.
+ * @retval Exit status, 1 if the output is lost.
+ */
+static int
+out_buf_finish(struct out_buf *out, const char *name)
+{
+	out_buf_flush(out);
+	if (out->error == 0)
+		return 0;
+	if (out->error != EPIPE) {
+		fprintf(stderr, "%s: write error: %s\n", name,
+			strerror(out->error));
+	}
+	return 1;
+}
+
 static void
-execute_command_line(const struct command_line *line)
+out_buf_write(struct out_buf *out, const char *data, uint32_t size)
 {
-	/* REPLACE THIS CODE WITH ACTUAL COMMAND EXECUTION */
+	while (size > 0) {
+		if (out->size == sizeof(out->data))
+			out_buf_flush(out);
+		uint32_t len = sizeof(out->data) - out->size;
+		if (len > size)
+			len = size;
+		memcpy(out->data + out->size, data, len);
+		out->size += len;
+		data += len;
+		size -= len;
+	}
+}
+
+static inline void
+out_buf_putc(struct out_buf *out, char c)
+{
+	out_buf_write(out, &c, 1);
+}
+
+static inline void
+out_buf_puts(struct out_buf *out, const char *str)
+{
+	out_buf_write(out, str, strlen(str));
+}
 
+static void
+out_buf_printf(struct out_buf *out, const char *format, ...)
+{
+	char small[256];
+	va_list args;
+	va_start(args, format);
+	int len = vsnprintf(small, sizeof(small), format, args);
+	va_end(args);
+	if (len < 0)
+		return;
+	if ((size_t)len < sizeof(small)) {
+		out_buf_write(out, small, len);
+		return;
+	}
+	char *big = malloc(len + 1);
+	va_start(args, format);
+	vsnprintf(big, len + 1, format, args);
+	va_end(args);
+	out_buf_write(out, big, len);
+	free(big);
+}
+
+/**
+ * Decode one backslash escape sequence starting right after the backslash.
+ * The result is written into @a out. @a is_stop is set when the sequence is
+ * '\c', which means 'produce no further output'.
+ * @retval Number of consumed characters after the backslash.
+ */
+static uint32_t
+escape_decode(const char *pos, struct out_buf *out, bool *is_stop)
+{
+	const char *begin = pos;
+	char c = *pos++;
+	switch (c) {
+	case 'a': out_buf_putc(out, '\a'); break;
+	case 'b': out_buf_putc(out, '\b'); break;
+	case 'e': out_buf_putc(out, '\033'); break;
+	case 'f': out_buf_putc(out, '\f'); break;
+	case 'n': out_buf_putc(out, '\n'); break;
+	case 'r': out_buf_putc(out, '\r'); break;
+	case 't': out_buf_putc(out, '\t'); break;
+	case 'v': out_buf_putc(out, '\v'); break;
+	case '\\': out_buf_putc(out, '\\'); break;
+	case 'c':
+		*is_stop = true;
+		break;
+	case '0': case '1': case '2': case '3':
+	case '4': case '5': case '6': case '7': {
+		/* Up to 3 octal digits, plus an optional leading zero. */
+		int value = c - '0';
+		int limit = c == '0' ? 3 : 2;
+		for (int i = 0; i < limit && *pos >= '0' && *pos <= '7'; ++i)
+			value = value * 8 + *pos++ - '0';
+		out_buf_putc(out, (char)value);
+		break;
+	}
+	case 0:
+		/* Trailing backslash is printed as is. */
+		out_buf_putc(out, '\\');
+		return 0;
+	default:
+		out_buf_putc(out, '\\');
+		out_buf_putc(out, c);
+		break;
+	}
+	return pos - begin;
+}
+
+/**
+ * Built-in command. Executed by the shell without exec(), either right in
+ * the shell process or in a forked child.
+ * @param sh Shell state.
+ * @param cmd Command with the arguments.
+ * @param in_fd Descriptor to read the input from.
+ * @param out_fd Descriptor to write the output to.
+ * @retval Exit status of the command.
+ */
+typedef int (*builtin_f)(struct shell *sh, const struct command *cmd,
+			 int in_fd, int out_fd);
+
+struct builtin {
+	const char *name;
+	builtin_f run;
+	/**
+	 * The built-in changes the state of the shell process itself. Such
+	 * built-ins run in the shell only when they are alone in a pipeline,
+	 * like in bash. Otherwise they run in a child and the shell is not
+	 * affected.
+	 */
+	bool is_stateful;
+	/**
+	 * Optional check if the built-in can handle the arguments. If not,
+	 * the command is executed as an external program.
+	 */
+	bool (*is_supported)(const struct command *cmd);
+};
+
+static int
+builtin_cd(struct shell *sh, const struct command *cmd, int in_fd,
+	   int out_fd)
+{
+	(void)in_fd;
+	(void)sh;
+	(void)out_fd;
+	const char *path;
+	if (cmd->arg_count > 0)
+		path = cmd->args[0];
+	else if ((path = getenv("HOME")) == NULL)
+		return 0;
+	if (chdir(path) != 0) {
+		fprintf(stderr, "cd: %s: %s\n", path, strerror(errno));
+		return 1;
+	}
+	return 0;
+}
+
+enum {
+	/** How much to move per one splice() or copy_file_range(). */
+	RELAY_CHUNK_SIZE = 1 << 20,
+	/** Buffer for the read()/write() fallback. */
+	RELAY_BUF_SIZE = 64 * 1024,
+};
+
+/**
+ * Move the data with a zero-copy syscall until EOF. The syscall is
+ * copy_file_range() or splice(), both take the same arguments when the
+ * offsets are NULL.
+ * @retval 0 Success, all the data is moved.
+ * @retval 1 The syscall is not applicable to these descriptors. Some data
+ *         could be moved already, the rest has to be copied another way.
+ * @retval -1 Error, errno is set.
+ */
+static int
+fd_relay_zero_copy(int in_fd, int out_fd, bool is_splice)
+{
+	while (true) {
+		ssize_t rc;
+		if (is_splice) {
+			rc = splice(in_fd, NULL, out_fd, NULL, RELAY_CHUNK_SIZE,
+				    SPLICE_F_MOVE);
+		} else {
+			rc = copy_file_range(in_fd, NULL, out_fd, NULL,
+					     RELAY_CHUNK_SIZE, 0);
+		}
+		if (rc > 0)
+			continue;
+		if (rc == 0)
+			return 0;
+		if (errno == EINTR)
+			continue;
+		/*
+		 * Different file systems, O_APPEND output, special files - the
+		 * kernel refuses but plain read() and write() can work.
+		 */
+		if (errno == EINVAL || errno == EXDEV || errno == ENOSYS ||
+		    errno == EOPNOTSUPP || errno == EBADF)
+			return 1;
+		return -1;
+	}
+}
+
+/**
+ * Move all the data from @a in_fd to @a out_fd until EOF. The shell tries
+ * not to bounce it through a user space buffer: copy_file_range() between
+ * regular files, splice() when either side is a pipe. Only when the kernel
+ * can do neither, the data is read and written.
+ * @retval 0 Success.
+ * @retval -1 Error, errno is set.
+ */
+static int
+fd_relay(int in_fd, int out_fd)
+{
+	struct stat in_st, out_st;
+	if (fstat(in_fd, &in_st) != 0 || fstat(out_fd, &out_st) != 0)
+		return -1;
+	int rc = 1;
+	if (S_ISREG(in_st.st_mode) && S_ISREG(out_st.st_mode))
+		rc = fd_relay_zero_copy(in_fd, out_fd, false);
+	else if (S_ISFIFO(in_st.st_mode) || S_ISFIFO(out_st.st_mode))
+		rc = fd_relay_zero_copy(in_fd, out_fd, true);
+	if (rc <= 0)
+		return rc;
+	char *buf = malloc(RELAY_BUF_SIZE);
+	rc = 0;
+	while (rc == 0) {
+		ssize_t size = read(in_fd, buf, RELAY_BUF_SIZE);
+		if (size == 0)
+			break;
+		if (size < 0) {
+			if (errno != EINTR)
+				rc = -1;
+			continue;
+		}
+		rc = fd_write_all(out_fd, buf, size);
+	}
+	free(buf);
+	return rc;
+}
+
+/** Options of cat are left to the real one. */
+static bool
+builtin_cat_is_supported(const struct command *cmd)
+{
+	for (uint32_t i = 0; i < cmd->arg_count; ++i) {
+		const char *arg = cmd->args[i];
+		if (arg[0] == '-' && arg[1] != 0)
+			return false;
+	}
+	return true;
+}
+
+/**
+ * Check if both descriptors are the same regular file. Cat would copy such
+ * a file onto itself endlessly when the output is appended.
+ */
+static bool
+fd_is_same_file(int in_fd, int out_fd)
+{
+	struct stat in_st, out_st;
+	if (fstat(in_fd, &in_st) != 0 || fstat(out_fd, &out_st) != 0)
+		return false;
+	return S_ISREG(in_st.st_mode) && S_ISREG(out_st.st_mode) &&
+	       in_st.st_dev == out_st.st_dev && in_st.st_ino == out_st.st_ino;
+}
+
+/**
+ * Cat is built in so as the data going through a pipeline or into a file is
+ * moved by the kernel and the shell never touches it.
+ */
+static int
+builtin_cat(struct shell *sh, const struct command *cmd, int in_fd,
+	    int out_fd)
+{
+	(void)sh;
+	if (cmd->arg_count == 0) {
+		if (fd_is_same_file(in_fd, out_fd)) {
+			fprintf(stderr, "cat: -: input file is output file\n");
+			return 1;
+		}
+		if (fd_relay(in_fd, out_fd) == 0)
+			return 0;
+		/* The reader is gone, it is not an error to report. */
+		if (errno != EPIPE)
+			fprintf(stderr, "cat: %s\n", strerror(errno));
+		return 1;
+	}
+	int rc = 0;
+	for (uint32_t i = 0; i < cmd->arg_count; ++i) {
+		const char *path = cmd->args[i];
+		int fd = in_fd;
+		if (strcmp(path, "-") != 0 &&
+		    (fd = open(path, O_RDONLY | O_CLOEXEC)) < 0) {
+			fprintf(stderr, "cat: %s: %s\n", path, strerror(errno));
+			rc = 1;
+			continue;
+		}
+		if (fd_is_same_file(fd, out_fd)) {
+			fprintf(stderr, "cat: %s: input file is output file\n",
+				path);
+			rc = 1;
+		} else if (fd_relay(fd, out_fd) != 0) {
+			bool is_pipe_closed = errno == EPIPE;
+			if (!is_pipe_closed) {
+				fprintf(stderr, "cat: %s: %s\n", path,
+					strerror(errno));
+			}
+			rc = 1;
+			if (fd != in_fd)
+				close(fd);
+			if (is_pipe_closed)
+				break;
+			continue;
+		}
+		if (fd != in_fd)
+			close(fd);
+	}
+	return rc;
+}
+
+static int
+builtin_echo(struct shell *sh, const struct command *cmd, int in_fd,
+	     int out_fd)
+{
+	(void)in_fd;
+	(void)sh;
+	struct out_buf out;
+	out_buf_create(&out, out_fd);
+	bool is_newline = true;
+	bool is_escape = false;
+	uint32_t i = 0;
+	for (; i < cmd->arg_count; ++i) {
+		const char *arg = cmd->args[i];
+		if (arg[0] != '-' || arg[1] == 0 ||
+		    arg[strspn(arg + 1, "neE") + 1] != 0)
+			break;
+		for (++arg; *arg != 0; ++arg) {
+			if (*arg == 'n')
+				is_newline = false;
+			else
+				is_escape = *arg == 'e';
+		}
+	}
+	bool is_stop = false;
+	for (uint32_t first = i; i < cmd->arg_count && !is_stop; ++i) {
+		if (i != first)
+			out_buf_putc(&out, ' ');
+		const char *arg = cmd->args[i];
+		if (!is_escape) {
+			out_buf_puts(&out, arg);
+			continue;
+		}
+		for (; *arg != 0 && !is_stop; ++arg) {
+			if (*arg == '\\')
+				arg += escape_decode(arg + 1, &out, &is_stop);
+			else
+				out_buf_putc(&out, *arg);
+		}
+	}
+	if (is_newline && !is_stop)
+		out_buf_putc(&out, '\n');
+	return out_buf_finish(&out, "echo");
+}
+
+static int
+builtin_exit(struct shell *sh, const struct command *cmd, int in_fd,
+	     int out_fd)
+{
+	(void)in_fd;
+	(void)out_fd;
+	sh->is_exit = true;
+	if (cmd->arg_count == 0)
+		return sh->status;
+	return atoi(cmd->args[0]) & 0xff;
+}
+
+static int
+builtin_false(struct shell *sh, const struct command *cmd, int in_fd,
+	      int out_fd)
+{
+	(void)in_fd;
+	(void)sh;
+	(void)cmd;
+	(void)out_fd;
+	return 1;
+}
+
+static int
+builtin_true(struct shell *sh, const struct command *cmd, int in_fd,
+	     int out_fd)
+{
+	(void)in_fd;
+	(void)sh;
+	(void)cmd;
+	(void)out_fd;
+	return 0;
+}
+
+/**
+ * Numeric argument of printf. Like in bash, a leading quote means the value
+ * is the code of the next character.
+ */
+static bool
+printf_arg_is_char(const char *arg)
+{
+	return arg[0] == '\'' || arg[0] == '"';
+}
+
+static long long
+printf_arg_int(const char *arg)
+{
+	if (printf_arg_is_char(arg))
+		return (unsigned char)arg[1];
+	return strtoll(arg, NULL, 0);
+}
+
+static unsigned long long
+printf_arg_uint(const char *arg)
+{
+	if (printf_arg_is_char(arg))
+		return (unsigned char)arg[1];
+	return strtoull(arg, NULL, 0);
+}
+
+static double
+printf_arg_double(const char *arg)
+{
+	if (printf_arg_is_char(arg))
+		return (unsigned char)arg[1];
+	return strtod(arg, NULL);
+}
+
+static int
+builtin_printf(struct shell *sh, const struct command *cmd, int in_fd,
+	       int out_fd)
+{
+	(void)in_fd;
+	(void)sh;
+	if (cmd->arg_count == 0) {
+		fprintf(stderr, "printf: usage: printf format [arguments]\n");
+		return 2;
+	}
+	struct out_buf out;
+	out_buf_create(&out, out_fd);
+	const char *format = cmd->args[0];
+	uint32_t argi = 1;
+	int rc = 0;
+	bool is_stop = false;
+	/* The format is reused while there are unconsumed arguments. */
+	do {
+		uint32_t pass_start = argi;
+		for (const char *pos = format; *pos != 0 && !is_stop; ++pos) {
+			if (*pos == '\\') {
+				pos += escape_decode(pos + 1, &out, &is_stop);
+				continue;
+			}
+			if (*pos != '%') {
+				out_buf_putc(&out, *pos);
+				continue;
+			}
+			if (pos[1] == '%') {
+				out_buf_putc(&out, '%');
+				++pos;
+				continue;
+			}
+			/* Collect the spec into a format for snprintf. */
+			char spec[64];
+			uint32_t len = 0;
+			spec[len++] = '%';
+			++pos;
+			while (*pos != 0 && strchr("-+ #0", *pos) != NULL &&
+			       len < 8)
+				spec[len++] = *pos++;
+			int star[2];
+			int star_count = 0;
+			for (int part = 0; part < 2; ++part) {
+				if (part == 1) {
+					if (*pos != '.')
+						break;
+					spec[len++] = *pos++;
+				}
+				if (*pos == '*') {
+					const char *a = argi < cmd->arg_count ?
+						cmd->args[argi++] : "0";
+					star[star_count++] = printf_arg_int(a);
+					spec[len++] = *pos++;
+					continue;
+				}
+				while (*pos >= '0' && *pos <= '9' && len < 40)
+					spec[len++] = *pos++;
+			}
+			char conv = *pos;
+			const char *arg = "";
+			if (argi < cmd->arg_count)
+				arg = cmd->args[argi++];
+			else if (conv != 's' && conv != 'b' && conv != 'c')
+				arg = "0";
+			switch (conv) {
+			case 'd':
+			case 'i':
+				spec[len++] = 'l';
+				spec[len++] = 'l';
+				spec[len++] = conv;
+				spec[len] = 0;
+				if (star_count == 2)
+					out_buf_printf(&out, spec, star[0],
+						       star[1],
+						       printf_arg_int(arg));
+				else if (star_count == 1)
+					out_buf_printf(&out, spec, star[0],
+						       printf_arg_int(arg));
+				else
+					out_buf_printf(&out, spec,
+						       printf_arg_int(arg));
+				break;
+			case 'o':
+			case 'u':
+			case 'x':
+			case 'X':
+				spec[len++] = 'l';
+				spec[len++] = 'l';
+				spec[len++] = conv;
+				spec[len] = 0;
+				if (star_count == 2)
+					out_buf_printf(&out, spec, star[0],
+						       star[1],
+						       printf_arg_uint(arg));
+				else if (star_count == 1)
+					out_buf_printf(&out, spec, star[0],
+						       printf_arg_uint(arg));
+				else
+					out_buf_printf(&out, spec,
+						       printf_arg_uint(arg));
+				break;
+			case 'e':
+			case 'E':
+			case 'f':
+			case 'F':
+			case 'g':
+			case 'G':
+			case 'a':
+			case 'A':
+				spec[len++] = conv;
+				spec[len] = 0;
+				if (star_count == 2)
+					out_buf_printf(&out, spec, star[0],
+						       star[1],
+						       printf_arg_double(arg));
+				else if (star_count == 1)
+					out_buf_printf(&out, spec, star[0],
+						       printf_arg_double(arg));
+				else
+					out_buf_printf(&out, spec,
+						       printf_arg_double(arg));
+				break;
+			case 'c':
+			case 's':
+				spec[len++] = 's';
+				spec[len] = 0;
+				char c[2] = {arg[0], 0};
+				if (conv == 'c')
+					arg = c;
+				if (star_count == 2)
+					out_buf_printf(&out, spec, star[0],
+						       star[1], arg);
+				else if (star_count == 1)
+					out_buf_printf(&out, spec, star[0],
+						       arg);
+				else
+					out_buf_printf(&out, spec, arg);
+				break;
+			case 'b':
+				for (; *arg != 0 && !is_stop; ++arg) {
+					if (*arg == '\\') {
+						arg += escape_decode(arg + 1,
+							&out, &is_stop);
+					} else {
+						out_buf_putc(&out, *arg);
+					}
+				}
+				break;
+			default:
+				out_buf_flush(&out);
+				fprintf(stderr, "printf: %%%c: invalid format "
+					"character\n", conv);
+				return 1;
+			}
+		}
+		/* No argument was consumed - repeating won't help. */
+		if (argi == pass_start)
+			break;
+	} while (argi < cmd->arg_count && !is_stop);
+	if (out_buf_finish(&out, "printf") != 0)
+		return 1;
+	return rc;
+}
+
+/** Wait for all the background jobs. */
+static int
+builtin_wait(struct shell *sh, const struct command *cmd, int in_fd,
+	     int out_fd)
+{
+	(void)in_fd;
+	(void)cmd;
+	(void)out_fd;
+	job_table_reap(&sh->jobs);
+	while (sh->jobs.bg_count > 0)
+		job_table_wait_event(&sh->jobs);
+	return 0;
+}
+
+static int
+builtin_hash(struct shell *sh, const struct command *cmd, int in_fd,
+	     int out_fd);
+
+/** Registry of the built-ins. Keep sorted by name. */
+static const struct builtin builtins[] = {
+	{"cat", builtin_cat, false, builtin_cat_is_supported},
+	{"cd", builtin_cd, true, NULL},
+	{"echo", builtin_echo, false, NULL},
+	{"exit", builtin_exit, true, NULL},
+	{"false", builtin_false, false, NULL},
+	{"hash", builtin_hash, true, NULL},
+	{"printf", builtin_printf, false, NULL},
+	{"true", builtin_true, false, NULL},
+	{"wait", builtin_wait, true, NULL},
+};
+
+static const struct builtin *
+builtin_find(const char *name)
+{
+	int left = 0;
+	int right = sizeof(builtins) / sizeof(builtins[0]) - 1;
+	while (left <= right) {
+		int mid = (left + right) / 2;
+		int cmp = strcmp(name, builtins[mid].name);
+		if (cmp == 0)
+			return &builtins[mid];
+		if (cmp < 0)
+			right = mid - 1;
+		else
+			left = mid + 1;
+	}
+	return NULL;
+}
+
+/**
+ * Like in bash: without arguments show the cached paths, with -r forget them,
+ * with names find and remember them.
+ */
+static int
+builtin_hash(struct shell *sh, const struct command *cmd, int in_fd,
+	     int out_fd)
+{
+	(void)in_fd;
+	struct path_cache *c = &sh->paths;
+	if (cmd->arg_count == 0) {
+		if (c->count == 0) {
+			fprintf(stderr, "hash: hash table empty\n");
+			return 0;
+		}
+		struct out_buf out;
+		out_buf_create(&out, out_fd);
+		out_buf_puts(&out, "hits\tcommand\n");
+		for (uint32_t i = 0; i < c->capacity; ++i) {
+			const struct path_entry *e = &c->entries[i];
+			if (e->name != NULL)
+				out_buf_printf(&out, "%4u\t%s\n", e->hits,
+					       e->path);
+		}
+		return out_buf_finish(&out, "hash");
+	}
+	int rc = 0;
+	for (uint32_t i = 0; i < cmd->arg_count; ++i) {
+		const char *name = cmd->args[i];
+		if (strcmp(name, "-r") == 0) {
+			path_cache_clear(c);
+			continue;
+		}
+		if (builtin_find(name) != NULL || strchr(name, '/') != NULL)
+			continue;
+		char path[PATH_MAX];
+		struct path_entry *e = path_cache_resolve(c, name, path);
+		if (e != NULL) {
+			/* Only remembered, not used yet. */
+			--e->hits;
+		} else if (path[0] == 0) {
+			fprintf(stderr, "hash: %s: not found\n", name);
+			rc = 1;
+		}
+	}
+	return rc;
+}
+
+/**
+ * Replace the current process with the command. Never returns.
+ * @param path Resolved path of the executable. When empty or stale, $PATH is
+ *        searched again.
+ */
+static void
+command_exec(const struct command *cmd, const char *path)
+{
+	char **argv = malloc(sizeof(*argv) * (cmd->arg_count + 2));
+	argv[0] = cmd->exe;
+	memcpy(argv + 1, cmd->args, sizeof(*argv) * cmd->arg_count);
+	argv[cmd->arg_count + 1] = NULL;
+	if (path[0] != 0)
+		execv(path, argv);
+	if (path[0] == 0 || errno == ENOENT)
+		execvp(cmd->exe, argv);
+	int err = errno;
+	if (err == ENOENT)
+		fprintf(stderr, "%s: command not found\n", cmd->exe);
+	else
+		fprintf(stderr, "%s: %s\n", cmd->exe, strerror(err));
+	_exit(err == ENOENT ? 127 : 126);
+}
+
+/**
+ * Run a built-in right in the shell process. If the output is a pipe with
+ * no reader, SIGPIPE would kill the shell itself. So it is blocked, the
+ * writes fail with EPIPE, and the status is as if the built-in ran in a
+ * child killed by the signal.
+ */
+static int
+builtin_run_in_shell(struct shell *sh, const struct builtin *b,
+		     const struct command *cmd, int in_fd, int out_fd)
+{
+	sigset_t mask, old_mask, pending;
+	sigemptyset(&mask);
+	sigaddset(&mask, SIGPIPE);
+	sigprocmask(SIG_BLOCK, &mask, &old_mask);
+	int rc = b->run(sh, cmd, in_fd, out_fd);
+	if (sigpending(&pending) == 0 && sigismember(&pending, SIGPIPE)) {
+		struct timespec timeout = {0, 0};
+		sigtimedwait(&mask, NULL, &timeout);
+		rc = 128 + SIGPIPE;
+	}
+	sigprocmask(SIG_SETMASK, &old_mask, NULL);
+	return rc;
+}
+
+/**
+ * Execute one pipeline starting at @a e. It lasts until the end of the line
+ * or until a first '&&' or '||'. Output of the last command goes to
+ * @a out_fd. The status of the last command is saved into the shell.
+ * @retval First expression after the pipeline.
+ */
+static const struct expr *
+execute_pipeline(struct shell *sh, const struct expr *e, int out_fd)
+{
+	uint32_t count = 0;
+	for (const struct expr *it = e; it != NULL; it = it->next) {
+		if (it->type == EXPR_TYPE_COMMAND)
+			++count;
+		else if (it->type != EXPR_TYPE_PIPE)
+			break;
+	}
+	assert(count > 0);
+	pid_t *pids = malloc(sizeof(*pids) * count);
+	uint32_t pid_count = 0;
+	bool is_last_forked = false;
+	int in_fd = -1;
+	for (; e != NULL; e = e->next) {
+		if (e->type == EXPR_TYPE_PIPE)
+			continue;
+		if (e->type != EXPR_TYPE_COMMAND)
+			break;
+		bool is_last = e->next == NULL ||
+			e->next->type != EXPR_TYPE_PIPE;
+		const struct builtin *b = builtin_find(e->cmd.exe);
+		if (b != NULL && b->is_supported != NULL &&
+		    !b->is_supported(&e->cmd))
+			b = NULL;
+		int fds[2] = {-1, -1};
+		int cmd_out_fd = out_fd;
+		if (!is_last) {
+			if (pipe(fds) != 0) {
+				fprintf(stderr, "pipe: %s\n", strerror(errno));
+				sh->status = 1;
+				break;
+			}
+			cmd_out_fd = fds[1];
+		}
+		/*
+		 * Fast path: the last command of a pipeline, if it is a
+		 * built-in, runs right in the shell. No fork, no exec. Its
+		 * stdin is closed afterwards like it would happen when a child
+		 * exits.
+		 */
+		if (is_last && b != NULL && (!b->is_stateful || count == 1)) {
+			int cmd_in_fd = in_fd >= 0 ? in_fd : STDIN_FILENO;
+			sh->status = builtin_run_in_shell(sh, b, &e->cmd,
+							  cmd_in_fd,
+							  cmd_out_fd);
+			if (in_fd >= 0)
+				close(in_fd);
+			is_last_forked = false;
+			in_fd = -1;
+			continue;
+		}
+		/*
+		 * The path is resolved in the shell, not in the child, so as
+		 * the cache survives.
+		 */
+		char path[PATH_MAX];
+		if (b == NULL)
+			path_cache_resolve(&sh->paths, e->cmd.exe, path);
+		pid_t pid = fork();
+		if (pid == 0) {
+			job_table_child_prepare(&sh->jobs);
+			if (in_fd >= 0) {
+				dup2(in_fd, STDIN_FILENO);
+				close(in_fd);
+			}
+			if (cmd_out_fd != STDOUT_FILENO) {
+				dup2(cmd_out_fd, STDOUT_FILENO);
+				close(cmd_out_fd);
+			}
+			if (fds[0] >= 0)
+				close(fds[0]);
+			/*
+			 * Built-ins not suitable for the shell process still
+			 * save an exec() in a child.
+			 */
+			if (b != NULL) {
+				struct shell child = *sh;
+				_exit(b->run(&child, &e->cmd, STDIN_FILENO,
+					     STDOUT_FILENO));
+			}
+			command_exec(&e->cmd, path);
+		}
+		if (in_fd >= 0)
+			close(in_fd);
+		if (fds[1] >= 0)
+			close(fds[1]);
+		in_fd = fds[0];
+		if (pid < 0) {
+			fprintf(stderr, "fork: %s\n", strerror(errno));
+			sh->status = 1;
+			is_last_forked = false;
+			continue;
+		}
+		job_table_add(&sh->jobs, pid, false);
+		pids[pid_count++] = pid;
+		is_last_forked = is_last;
+	}
+	if (in_fd >= 0)
+		close(in_fd);
+	for (uint32_t i = 0; i < pid_count; ++i) {
+		int status = job_table_wait(&sh->jobs, pids[i]);
+		if (i == pid_count - 1 && is_last_forked)
+			sh->status = status;
+	}
+	free(pids);
+	return e;
+}
+
+static int
+output_open(const struct command_line *line)
+{
+	int flags = O_WRONLY | O_CREAT | O_CLOEXEC;
+	if (line->out_type == OUTPUT_TYPE_FILE_APPEND)
+		flags |= O_APPEND;
+	else
+		flags |= O_TRUNC;
+	int fd = open(line->out_file, flags, 0644);
+	if (fd < 0)
+		fprintf(stderr, "%s: %s\n", line->out_file, strerror(errno));
+	return fd;
+}
+
+static void
+execute_command_line_fg(struct shell *sh, const struct command_line *line)
+{
 	assert(line != NULL);
-	printf("================================\n");
-	printf("Command line:\n");
-	printf("Is background: %d\n", (int)line->is_background);
-	printf("Output: ");
-	if (line->out_type == OUTPUT_TYPE_STDOUT) {
-		printf("stdout\n");
-	} else if (line->out_type == OUTPUT_TYPE_FILE_NEW) {
-		printf("new file - \"%s\"\n", line->out_file);
-	} else if (line->out_type == OUTPUT_TYPE_FILE_APPEND) {
-		printf("append file - \"%s\"\n", line->out_file);
-	} else {
-		assert(false);
-	}
-	printf("Expressions:\n");
+	/*
+	 * The output redirect belongs to the last pipeline only, the one after
+	 * the last '&&' or '||'.
+	 */
+	const struct expr *last = line->head;
+	for (const struct expr *e = line->head; e != NULL; e = e->next) {
+		if (e->type == EXPR_TYPE_AND || e->type == EXPR_TYPE_OR)
+			last = e->next;
+	}
 	const struct expr *e = line->head;
-	while (e != NULL) {
-		if (e->type == EXPR_TYPE_COMMAND) {
-			printf("\tCommand: %s", e->cmd.exe);
-			for (uint32_t i = 0; i < e->cmd.arg_count; ++i)
-				printf(" %s", e->cmd.args[i]);
-			printf("\n");
-		} else if (e->type == EXPR_TYPE_PIPE) {
-			printf("\tPIPE\n");
-		} else if (e->type == EXPR_TYPE_AND) {
-			printf("\tAND\n");
-		} else if (e->type == EXPR_TYPE_OR) {
-			printf("\tOR\n");
-		} else {
-			assert(false);
+	while (e != NULL && !sh->is_exit) {
+		int out_fd = STDOUT_FILENO;
+		if (e == last && line->out_type != OUTPUT_TYPE_STDOUT) {
+			out_fd = output_open(line);
+			if (out_fd < 0) {
+				sh->status = 1;
+				return;
+			}
+		}
+		e = execute_pipeline(sh, e, out_fd);
+		if (out_fd != STDOUT_FILENO)
+			close(out_fd);
+		while (e != NULL && !sh->is_exit) {
+			assert(e->type == EXPR_TYPE_AND ||
+			       e->type == EXPR_TYPE_OR);
+			bool is_run = (e->type == EXPR_TYPE_AND) ==
+				(sh->status == 0);
+			e = e->next;
+			if (is_run)
+				break;
+			/* Skip the pipeline. */
+			while (e != NULL && e->type != EXPR_TYPE_AND &&
+			       e->type != EXPR_TYPE_OR)
+				e = e->next;
 		}
-		e = e->next;
 	}
 }
 
-int
-main(void)
+static void
+execute_command_line(struct shell *sh, const struct command_line *line)
+{
+	if (!line->is_background) {
+		execute_command_line_fg(sh, line);
+		return;
+	}
+	pid_t pid = fork();
+	if (pid < 0) {
+		fprintf(stderr, "fork: %s\n", strerror(errno));
+		sh->status = 1;
+		return;
+	}
+	if (pid == 0) {
+		struct shell child = *sh;
+		job_table_child_reset(&child.jobs);
+		execute_command_line_fg(&child, line);
+		_exit(child.status);
+	}
+	job_table_add(&sh->jobs, pid, true);
+	sh->status = 0;
+}
+
+/** One output stream of a line executed in parallel. */
+struct line_stream {
+	/** Read end of the pipe with the output. -1 after EOF. */
+	int fd;
+	/** Output kept until all the earlier lines print theirs. */
+	char *buf;
+	uint32_t size;
+	uint32_t capacity;
+};
+
+/** A command line executed by the parallel mode, see struct parallel. */
+struct line_slot {
+	/**
+	 * Forked shell executing the line. 0 for a slot which is only a text,
+	 * like a syntax error message.
+	 */
+	pid_t pid;
+	/** Stdout and stderr, they go to the descriptors 1 and 2. */
+	struct line_stream streams[2];
+	/** Output file of the line, NULL for stdout. */
+	char *out_file;
+	/** Arguments of the line, one after another with the zeros. */
+	char *words;
+	uint32_t words_size;
+	bool is_done;
+	int status;
+};
+
+/**
+ * Parallel mode, --jobs N. Lines are popped from the parser only while less
+ * than N of them are executed, so the parser holds the rest of the input as
+ * a bounded queue. Each line runs in a forked copy of the shell with stdout
+ * and stderr redirected into pipes. The first unfinished line in the input
+ * order prints right away, the later ones are buffered and printed when
+ * their turn comes. Hence the output looks the same as in the sequential
+ * mode. Except that a buffered line prints all its stdout and then all its
+ * stderr, their relative order is not kept.
+ *
+ * Some lines can't run along with the others. The ones with cd, exit, wait,
+ * hash change the shell, so they wait for all the earlier lines and run in
+ * the shell itself, alone. A line writing to a file or having it in the
+ * arguments waits for the earlier lines writing to the same file, and a
+ * line writing to a file waits for the earlier lines having it in the
+ * arguments. Otherwise the content would be mixed, or read before it is
+ * written or after it is overwritten. Other implicit
+ * dependencies, like 'ls' after 'touch', are not detected - the mode is for
+ * scripts of independent commands.
+ */
+struct parallel {
+	/** Lines in the input order, a ring buffer. */
+	struct line_slot *slots;
+	uint32_t capacity;
+	uint32_t head;
+	uint32_t count;
+	/** How many lines are executed now, and the limit. */
+	uint32_t running;
+	uint32_t max_running;
+};
+
+static void
+parallel_create(struct parallel *par, uint32_t max_running)
+{
+	memset(par, 0, sizeof(*par));
+	par->max_running = max_running;
+}
+
+static void
+parallel_destroy(struct parallel *par)
+{
+	assert(par->count == 0);
+	free(par->slots);
+}
+
+static inline struct line_slot *
+parallel_slot(struct parallel *par, uint32_t i)
+{
+	return &par->slots[(par->head + i) & (par->capacity - 1)];
+}
+
+static struct line_slot *
+parallel_push(struct parallel *par)
+{
+	if (par->count == par->capacity) {
+		uint32_t capacity = par->capacity == 0 ? 16 : par->capacity * 2;
+		struct line_slot *slots = malloc(sizeof(*slots) * capacity);
+		for (uint32_t i = 0; i < par->count; ++i)
+			slots[i] = *parallel_slot(par, i);
+		free(par->slots);
+		par->slots = slots;
+		par->capacity = capacity;
+		par->head = 0;
+	}
+	struct line_slot *slot = parallel_slot(par, par->count++);
+	memset(slot, 0, sizeof(*slot));
+	slot->streams[0].fd = -1;
+	slot->streams[1].fd = -1;
+	return slot;
+}
+
+static void
+line_stream_append(struct line_stream *stream, const char *data,
+		   uint32_t size)
+{
+	if (stream->capacity - stream->size < size) {
+		uint32_t capacity = stream->capacity * 2;
+		if (capacity < stream->size + size)
+			capacity = stream->size + size;
+		stream->buf = realloc(stream->buf, capacity);
+		stream->capacity = capacity;
+	}
+	memcpy(stream->buf + stream->size, data, size);
+	stream->size += size;
+}
+
+/** Print and drop what the line has buffered. */
+static void
+line_slot_flush(struct line_slot *slot)
+{
+	for (int i = 0; i < 2; ++i) {
+		struct line_stream *stream = &slot->streams[i];
+		fd_write_all(STDOUT_FILENO + i, stream->buf, stream->size);
+		stream->size = 0;
+	}
+}
+
+static bool
+line_slot_is_running(const struct line_slot *slot)
+{
+	return !slot->is_done || slot->streams[0].fd >= 0 ||
+	       slot->streams[1].fd >= 0;
+}
+
+/** Remember the arguments of the line to find the files it reads. */
+static void
+line_slot_set_words(struct line_slot *slot, const struct command_line *line)
+{
+	for (const struct expr *e = line->head; e != NULL; e = e->next) {
+		if (e->type != EXPR_TYPE_COMMAND)
+			continue;
+		for (uint32_t i = 0; i < e->cmd.arg_count; ++i) {
+			const char *arg = e->cmd.args[i];
+			uint32_t size = strlen(arg) + 1;
+			slot->words = realloc(slot->words,
+					      slot->words_size + size);
+			memcpy(slot->words + slot->words_size, arg, size);
+			slot->words_size += size;
+		}
+	}
+}
+
+static bool
+line_slot_has_word(const struct line_slot *slot, const char *word)
+{
+	const char *pos = slot->words;
+	const char *end = slot->words + slot->words_size;
+	for (; pos < end; pos += strlen(pos) + 1) {
+		if (strcmp(pos, word) == 0)
+			return true;
+	}
+	return false;
+}
+
+/** Lines with built-ins which change the shell. */
+static bool
+line_is_stateful(const struct command_line *line)
+{
+	for (const struct expr *e = line->head; e != NULL; e = e->next) {
+		if (e->type != EXPR_TYPE_COMMAND)
+			continue;
+		const struct builtin *b = builtin_find(e->cmd.exe);
+		if (b != NULL && b->is_stateful)
+			return true;
+	}
+	return false;
+}
+
+/**
+ * Check if the line writes to the file or mentions it in the arguments,
+ * which most likely means it reads the file.
+ */
+static bool
+line_uses_file(const struct command_line *line, const char *path)
+{
+	if (line->out_file != NULL && strcmp(line->out_file, path) == 0)
+		return true;
+	for (const struct expr *e = line->head; e != NULL; e = e->next) {
+		if (e->type != EXPR_TYPE_COMMAND)
+			continue;
+		for (uint32_t i = 0; i < e->cmd.arg_count; ++i) {
+			if (strcmp(e->cmd.args[i], path) == 0)
+				return true;
+		}
+	}
+	return false;
+}
+
+static void
+parallel_collect(struct shell *sh, struct parallel *par);
+
+/** Check if the line has to wait for the lines being executed. */
+static bool
+parallel_is_blocked(struct shell *sh, struct parallel *par,
+		    const struct command_line *line)
+{
+	/* Only the unfinished lines can block, drop the rest. */
+	parallel_collect(sh, par);
+	/* They run in the shell and print right away. */
+	if (line->is_background || line_is_stateful(line))
+		return par->count > 0;
+	if (par->running == par->max_running)
+		return true;
+	for (uint32_t i = 0; i < par->count; ++i) {
+		const struct line_slot *slot = parallel_slot(par, i);
+		if (slot->is_done)
+			continue;
+		if (slot->out_file != NULL &&
+		    line_uses_file(line, slot->out_file))
+			return true;
+		if (line->out_file != NULL &&
+		    line_slot_has_word(slot, line->out_file))
+			return true;
+	}
+	return false;
+}
+
+static void
+parallel_start(struct shell *sh, struct parallel *par,
+	       const struct command_line *line)
+{
+	int out_fds[2];
+	int err_fds[2];
+	if (pipe2(out_fds, O_CLOEXEC) != 0) {
+		fprintf(stderr, "pipe: %s\n", strerror(errno));
+		sh->status = 1;
+		return;
+	}
+	if (pipe2(err_fds, O_CLOEXEC) != 0) {
+		fprintf(stderr, "pipe: %s\n", strerror(errno));
+		close(out_fds[0]);
+		close(out_fds[1]);
+		sh->status = 1;
+		return;
+	}
+	pid_t pid = fork();
+	if (pid == 0) {
+		dup2(out_fds[1], STDOUT_FILENO);
+		dup2(err_fds[1], STDERR_FILENO);
+		close(out_fds[0]);
+		close(out_fds[1]);
+		close(err_fds[0]);
+		close(err_fds[1]);
+		struct shell child = *sh;
+		job_table_child_reset(&child.jobs);
+		execute_command_line_fg(&child, line);
+		_exit(child.status);
+	}
+	close(out_fds[1]);
+	close(err_fds[1]);
+	if (pid < 0) {
+		fprintf(stderr, "fork: %s\n", strerror(errno));
+		close(out_fds[0]);
+		close(err_fds[0]);
+		sh->status = 1;
+		return;
+	}
+	job_table_add(&sh->jobs, pid, false);
+	struct line_slot *slot = parallel_push(par);
+	slot->pid = pid;
+	slot->streams[0].fd = out_fds[0];
+	slot->streams[1].fd = err_fds[0];
+	if (line->out_file != NULL)
+		slot->out_file = strdup(line->out_file);
+	line_slot_set_words(slot, line);
+	++par->running;
+}
+
+/** Queue a text to print in order with the output of the lines. */
+static void
+parallel_push_text(struct parallel *par, const char *text)
+{
+	/* The first in the order prints right away, like a running line. */
+	if (par->count == 0) {
+		fd_write_all(STDOUT_FILENO, text, strlen(text));
+		return;
+	}
+	struct line_slot *slot = parallel_push(par);
+	line_stream_append(&slot->streams[0], text, strlen(text));
+	slot->is_done = true;
+}
+
+/**
+ * Read an output stream of a line, @a i is its index in the slot. The first
+ * line in the order prints it.
+ */
+static void
+parallel_read(struct parallel *par, struct line_slot *slot, int i)
+{
+	struct line_stream *stream = &slot->streams[i];
+	char buf[4096];
+	ssize_t rc = read(stream->fd, buf, sizeof(buf));
+	if (rc < 0 && errno == EINTR)
+		return;
+	if (rc <= 0) {
+		close(stream->fd);
+		stream->fd = -1;
+		return;
+	}
+	if (slot == parallel_slot(par, 0))
+		fd_write_all(STDOUT_FILENO + i, buf, rc);
+	else
+		line_stream_append(stream, buf, rc);
+}
+
+/**
+ * Collect the finished lines. The ones at the head of the order are printed
+ * and dropped, their status becomes the shell's status.
+ */
+static void
+parallel_collect(struct shell *sh, struct parallel *par)
+{
+	for (uint32_t i = 0; i < par->count; ++i) {
+		struct line_slot *slot = parallel_slot(par, i);
+		if (slot->pid == 0 || slot->is_done)
+			continue;
+		struct job *j = job_table_find(&sh->jobs, slot->pid);
+		if (j == NULL || !j->is_done)
+			continue;
+		slot->status = j->status;
+		slot->is_done = true;
+		job_table_remove(&sh->jobs, j);
+		--par->running;
+	}
+	while (par->count > 0) {
+		struct line_slot *slot = parallel_slot(par, 0);
+		if (line_slot_is_running(slot))
+			break;
+		if (slot->pid != 0)
+			sh->status = slot->status;
+		free(slot->streams[0].buf);
+		free(slot->streams[1].buf);
+		free(slot->out_file);
+		free(slot->words);
+		par->head = (par->head + 1) & (par->capacity - 1);
+		--par->count;
+		/* The next line is the first now and prints what it has. */
+		if (par->count > 0)
+			line_slot_flush(parallel_slot(par, 0));
+	}
+}
+
+/**
+ * Wait for anything from the executed lines, and also for the input if
+ * @a in_fd is not negative.
+ * @retval Whether the input is ready.
+ */
+static bool
+parallel_wait(struct shell *sh, struct parallel *par, int in_fd)
+{
+	bool is_output = false;
+	for (uint32_t i = 0; i < par->count && !is_output; ++i)
+		is_output = line_slot_is_running(parallel_slot(par, i));
+	/* Nothing can wake the poll up then. */
+	if (in_fd < 0 && par->running == 0 && !is_output) {
+		parallel_collect(sh, par);
+		return false;
+	}
+	struct pollfd *pfds = malloc(sizeof(*pfds) * (par->count * 2 + 2));
+	uint32_t count = 0;
+	pfds[count].fd = in_fd;
+	pfds[count++].events = POLLIN;
+	pfds[count].fd = sh->jobs.sigfd;
+	pfds[count++].events = POLLIN;
+	for (uint32_t i = 0; i < par->count; ++i) {
+		struct line_slot *slot = parallel_slot(par, i);
+		for (int j = 0; j < 2; ++j) {
+			pfds[count].fd = slot->streams[j].fd;
+			pfds[count++].events = POLLIN;
+		}
+	}
+	bool is_input = false;
+	if (poll(pfds, count, -1) > 0) {
+		is_input = pfds[0].revents != 0;
+		for (uint32_t i = 0; i < par->count; ++i) {
+			struct line_slot *slot = parallel_slot(par, i);
+			for (int j = 0; j < 2; ++j) {
+				if (pfds[i * 2 + j + 2].revents != 0)
+					parallel_read(par, slot, j);
+			}
+		}
+		if (pfds[1].revents != 0)
+			job_table_reap(&sh->jobs);
+	}
+	free(pfds);
+	parallel_collect(sh, par);
+	return is_input;
+}
+
+/** Pop the next line. Syntax errors are queued as text on the way. */
+static struct command_line *
+parallel_pop(struct parallel *par, struct parser *p)
+{
+	while (true) {
+		struct command_line *line = NULL;
+		enum parser_error err = parser_pop_next(p, &line);
+		if (err == PARSER_ERR_NONE)
+			return line;
+		char text[64];
+		snprintf(text, sizeof(text), "Error: %d\n", (int)err);
+		parallel_push_text(par, text);
+	}
+}
+
+/** Main loop of the parallel mode. */
+static void
+parallel_run(struct shell *sh, struct parser *p, uint32_t max_running)
 {
 	const size_t buf_size = 1024;
 	char buf[buf_size];
-	int rc;
-	struct parser *p = parser_new();
-	while ((rc = read(STDIN_FILENO, buf, buf_size)) > 0) {
+	struct parallel par;
+	parallel_create(&par, max_running);
+	struct command_line *line = NULL;
+	bool is_eof = false;
+	while (!sh->is_exit) {
+		/* Start all the lines which can be started. */
+		while (!sh->is_exit) {
+			if (line == NULL)
+				line = parallel_pop(&par, p);
+			if (line == NULL)
+				break;
+			if (parallel_is_blocked(sh, &par, line))
+				break;
+			if (line->is_background || line_is_stateful(line))
+				execute_command_line(sh, line);
+			else
+				parallel_start(sh, &par, line);
+			command_line_delete(line);
+			line = NULL;
+		}
+		if (sh->is_exit || (is_eof && line == NULL && par.count == 0))
+			break;
+		/* Read more only when the queue in the parser is empty. */
+		int in_fd = is_eof || line != NULL ? -1 : STDIN_FILENO;
+		if (!parallel_wait(sh, &par, in_fd))
+			continue;
+		ssize_t rc = read(STDIN_FILENO, buf, buf_size);
+		if (rc <= 0)
+			is_eof = true;
+		else
+			parser_feed(p, buf, rc);
+	}
+	if (line != NULL)
+		command_line_delete(line);
+	/* After exit the lines started before still finish and print. */
+	while (par.count > 0)
+		parallel_wait(sh, &par, -1);
+	parallel_destroy(&par);
+}
+
+/** Main loop: execute the lines one by one. */
+static void
+sequential_run(struct shell *sh, struct parser *p)
+{
+	const size_t buf_size = 1024;
+	char buf[buf_size];
+	struct pollfd pfds[2];
+	pfds[0].fd = STDIN_FILENO;
+	pfds[0].events = POLLIN;
+	pfds[1].fd = sh->jobs.sigfd;
+	pfds[1].events = POLLIN;
+	while (!sh->is_exit) {
+		/*
+		 * Background jobs are reaped as soon as they end, even when
+		 * the shell waits for input.
+		 */
+		if (poll(pfds, 2, -1) < 0) {
+			if (errno == EINTR)
+				continue;
+			break;
+		}
+		if (pfds[1].revents != 0)
+			job_table_reap(&sh->jobs);
+		if (pfds[0].revents == 0)
+			continue;
+		ssize_t rc = read(STDIN_FILENO, buf, buf_size);
+		if (rc <= 0)
+			break;
 		parser_feed(p, buf, rc);
 		struct command_line *line = NULL;
-		while (true) {
+		while (!sh->is_exit) {
 			enum parser_error err = parser_pop_next(p, &line);
 			if (err == PARSER_ERR_NONE && line == NULL)
 				break;
 			if (err != PARSER_ERR_NONE) {
 				printf("Error: %d\n", (int)err);
+				/* Commands write to the fd bypassing stdio. */
+				fflush(stdout);
 				continue;
 			}
-			execute_command_line(line);
+			execute_command_line(sh, line);
 			command_line_delete(line);
 		}
 	}
+}
+
+static void
+usage(const char *name)
+{
+	fprintf(stderr, "Usage: %s [--jobs N]\n"
+		"  -j, --jobs N  execute up to N lines at once. The output\n"
+		"                is in the input order, but stdout and\n"
+		"                stderr of one line are not interleaved.\n"
+		"                Lines depend on each other only through\n"
+		"                the file names, like '> f' and 'cat f'.\n",
+		name);
+}
+
+int
+main(int argc, char **argv)
+{
+	uint32_t jobs = 1;
+	for (int i = 1; i < argc; ++i) {
+		const char *value = NULL;
+		if (strcmp(argv[i], "--jobs") == 0 ||
+		    strcmp(argv[i], "-j") == 0)
+			value = i + 1 < argc ? argv[++i] : NULL;
+		else if (strncmp(argv[i], "--jobs=", 7) == 0)
+			value = argv[i] + 7;
+		if (value == NULL || (jobs = strtoul(value, NULL, 10)) == 0) {
+			usage(argv[0]);
+			return 2;
+		}
+	}
+	struct shell sh;
+	sh.status = 0;
+	sh.is_exit = false;
+	memset(&sh.paths, 0, sizeof(sh.paths));
+	if (job_table_create(&sh.jobs) != 0) {
+		fprintf(stderr, "signalfd: %s\n", strerror(errno));
+		return 1;
+	}
+	struct parser *p = parser_new();
+	if (jobs > 1)
+		parallel_run(&sh, p, jobs);
+	else
+		sequential_run(&sh, p);
 	parser_delete(p);
-	return 0;
+	job_table_destroy(&sh.jobs);
+	path_cache_clear(&sh.paths);
+	return sh.status;
 }
@@ -0,0 +1,69 @@
+#!/bin/bash
+# Tests of the built-in commands for the cases the checker does not cover.
+# Each script must print exactly the expected output, stderr included, and
+# must not hang.
+#
+# Usage: ./test_builtins.sh [shell]
+
+shell=$(realpath "${1:-./a.out}")
+dir=$(mktemp -d)
+trap 'rm -rf "$dir"' EXIT
+failed=0
+
+check() {
+	local name=$1 script=$2 expected=$3 actual
+	# A runaway copy of a file onto itself stops at the size limit.
+	actual=$(cd "$dir" && ulimit -f 1024 &&
+		 printf "$script" | timeout 5 "$shell" 2>&1)
+	if [ $? -eq 124 ]; then
+		echo "not ok - $name: timeout"
+		failed=1
+	elif [ "$expected" != "$actual" ]; then
+		echo "not ok - $name"
+		echo "expected:"; echo "$expected"
+		echo "actual:"; echo "$actual"
+		failed=1
+	else
+		echo "ok - $name"
+	fi
+	rm -rf "${dir:?}"/*
+}
+
+check "cat appends a file to itself" \
+	'echo abc > f\ncat f >> f\ncat f\n' \
+	'cat: f: input file is output file
+abc'
+check "cat of the same file among others" \
+	'echo abc > f\necho def > g\ncat g f g >> f\ncat f\n' \
+	'cat: f: input file is output file
+abc
+def
+def'
+check "echo to a full device" 'echo hi > /dev/full\n' \
+	'echo: write error: No space left on device'
+check "printf to a full device" 'printf x > /dev/full\n' \
+	'printf: write error: No space left on device'
+
+# The shell exits with the status of the last line.
+printf 'echo hi > /dev/full\n' | "$shell" 2> /dev/null
+if [ $? -eq 1 ]; then
+	echo "ok - echo write error status"
+else
+	echo "not ok - echo write error status"
+	failed=1
+fi
+
+# The shell's stdout is closed after one byte. The built-ins running in the
+# shell process must not kill it with SIGPIPE, and must fail.
+(cd "$dir" && yes | head -c 10000000 > big &&
+ printf 'cat big || touch failed\necho x | echo y\n'\
+'echo ok > done\n' | timeout 5 "$shell" | head -c 1 > /dev/null)
+if [ -f "$dir/done" ] && [ -f "$dir/failed" ]; then
+	echo "ok - built-ins with a closed stdout"
+else
+	echo "not ok - built-ins with a closed stdout"
+	failed=1
+fi
+rm -rf "${dir:?}"/*
+
+exit $failed
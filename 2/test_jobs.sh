@@ -0,0 +1,43 @@
+#!/bin/bash
+# Tests of the --jobs mode: each script must print the same in the parallel
+# mode as in the sequential one, and must not hang.
+#
+# Usage: ./test_jobs.sh [shell]
+
+shell=$(realpath "${1:-./a.out}")
+dir=$(mktemp -d)
+trap 'rm -rf "$dir"' EXIT
+failed=0
+
+check() {
+	local name=$1 script=$2 expected actual
+	expected=$(cd "$dir" && printf "$script" | timeout 5 "$shell" 2>&1)
+	actual=$(cd "$dir" && printf "$script" |
+		 timeout 5 "$shell" --jobs 4 2>&1)
+	local rc=$?
+	if [ $rc -eq 124 ]; then
+		echo "not ok - $name: timeout"
+		failed=1
+	elif [ "$expected" != "$actual" ]; then
+		echo "not ok - $name"
+		echo "expected:"; echo "$expected"
+		echo "actual:"; echo "$actual"
+		failed=1
+	else
+		echo "ok - $name"
+	fi
+	rm -rf "${dir:?}"/*
+}
+
+check "order" 'sleep 0.2 && echo 1\necho 2\nsleep 0.1 && echo 3\necho 4\n'
+check "file dependency" 'echo a > f\necho b >> f\ncat f\n'
+check "syntax error" 'echo 1\n| echo a\necho 2\n'
+check "syntax error then cd" '| echo a\ncd /\necho done\n'
+check "syntax error then exit" '| echo a\nexit 3\necho never\n'
+check "syntax error then wait" '| echo a\nwait\necho done\n'
+check "syntax error then background" '| echo a\necho x &\nwait\necho done\n'
+check "stateful after running" 'sleep 0.1 && echo a\ncd /\necho done\n'
+check "stderr order" 'sleep 0.2 && cat none1\necho a\ncat none2\necho b\n'
+check "write after read" 'echo old > f\nsleep 0.2 && cat f\necho new > f\ncat f\n'
+
+exit $failed
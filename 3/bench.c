@@ -0,0 +1,667 @@
+/**
+ * Benchmark of userfs. Prints one JSON object per workload and parameter set
+ * with the throughput, the allocation count and the memory usage, so the
+ * numbers can be compared across changes of the internal structures.
+ *
+ * Single-threaded workloads:
+ * - seq_write - create a file, write it whole by buffers of the given size,
+ *   delete it;
+ * - seq_read - read a whole file by buffers of the given size;
+ * - rand_write, rand_read - random buffer-aligned positions of one file;
+ * - create_delete - create a file, write a few bytes, close and delete it;
+ * - namespace - create the given number of files in one directory, open
+ *   random ones, delete them all. Each phase is reported separately.
+ *
+ * Concurrent workloads, run by 1, 2, 4, ... threads up to the given count,
+ * each thread doing the same number of operations:
+ * - pread_shared - all the threads read random blocks of one file via one
+ *   descriptor;
+ * - pread_own_fd - the same, but each thread has an own descriptor;
+ * - pwrite_own - each thread writes random blocks of an own file;
+ * - open_close - each thread opens and closes an own file;
+ * - mixed_shared - 1 of 8 operations is a write, into one shared file;
+ * - queue_pwrite - one thread submits small random writes into a few files
+ *   in batches via ufs_queue_submit(), that many queue workers run them.
+ *
+ * The allocations are counted only when linked with utils/heap_help. Run it
+ * with HHREPORT=q then, the numbers are useless with the leak reports. The
+ * peak RSS is of the workload: the high water mark is reset to the current
+ * RSS before it, so what was resident at the start counts too. It is -1 when
+ * the kernel can't reset it. pool_reserved is how much memory the userfs
+ * pools took from the system during the workload.
+ */
+#include "userfs.h"
+
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+uint64_t heaph_get_alloc_count_total(void) __attribute__((weak));
+
+enum {
+	BENCH_BLOCK_SIZE = 4096,
+	BENCH_FILE_SIZE = 16 * 1024 * 1024,
+	/** Sequential workloads go through the file that many times. */
+	BENCH_SEQ_ROUNDS = 8,
+	/** Random workloads stop earlier on big buffers. */
+	BENCH_RAND_MAX_BYTES = 256 * 1024 * 1024,
+	BENCH_MAX_THREADS = 64,
+	BENCH_MAX_POOLS = 32,
+	BENCH_QUEUE_FILES = 4,
+	BENCH_QUEUE_BATCH = 64,
+	BENCH_QUEUE_BLOCK_SIZE = 512,
+};
+
+static const size_t bench_buffer_sizes[] = {
+	512, 4096, 64 * 1024, 1024 * 1024,
+};
+
+static const uint32_t bench_namespace_sizes[] = {
+	1000, 10000, 100000,
+};
+
+enum bench_workload {
+	BENCH_PREAD_SHARED,
+	BENCH_PREAD_OWN_FD,
+	BENCH_PWRITE_OWN,
+	BENCH_OPEN_CLOSE,
+	BENCH_MIXED_SHARED,
+	BENCH_WORKLOAD_COUNT,
+};
+
+static const char *const bench_workload_names[] = {
+	"pread_shared", "pread_own_fd", "pwrite_own", "open_close",
+	"mixed_shared",
+};
+
+struct bench_thread {
+	pthread_t thread;
+	enum bench_workload workload;
+	int id;
+	int fd;
+	uint64_t ops;
+	uint64_t bytes;
+	int errors;
+};
+
+/** Measurements of one workload run. */
+struct bench_result {
+	uint64_t ops;
+	uint64_t bytes;
+	double start;
+	double seconds;
+	uint64_t allocs;
+	/** -1 when unknown. */
+	long peak_rss_kb;
+	int errors;
+};
+
+static pthread_barrier_t bench_barrier;
+static const char *bench_filter;
+static const char *bench_tag = "";
+static FILE *bench_history;
+
+static double
+bench_now(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1000000000.0;
+}
+
+static uint64_t
+bench_alloc_count(void)
+{
+	if (heaph_get_alloc_count_total == NULL)
+		return 0;
+	return heaph_get_alloc_count_total();
+}
+
+static inline uint64_t
+bench_rand(uint64_t *state)
+{
+	/* xorshift64. */
+	uint64_t x = *state;
+	x ^= x << 13;
+	x ^= x >> 7;
+	x ^= x << 17;
+	return *state = x;
+}
+
+static bool
+bench_is_selected(const char *workload)
+{
+	return bench_filter == NULL || strcmp(bench_filter, workload) == 0;
+}
+
+/** Reset the peak RSS of the process to the current RSS. */
+static bool
+bench_rss_reset(void)
+{
+	FILE *f = fopen("/proc/self/clear_refs", "w");
+	if (f == NULL)
+		return false;
+	bool ok = fputs("5", f) >= 0;
+	return fclose(f) == 0 && ok;
+}
+
+/** Peak RSS since the last reset, -1 if unknown. */
+static long
+bench_rss_peak_kb(void)
+{
+	FILE *f = fopen("/proc/self/status", "r");
+	if (f == NULL)
+		return -1;
+	char line[256];
+	long kb = -1;
+	while (kb < 0 && fgets(line, sizeof(line), f) != NULL) {
+		if (sscanf(line, "VmHWM: %ld kB", &kb) != 1)
+			kb = -1;
+	}
+	fclose(f);
+	return kb;
+}
+
+static void
+bench_begin(struct bench_result *res)
+{
+	memset(res, 0, sizeof(*res));
+	res->peak_rss_kb = bench_rss_reset() ? 0 : -1;
+	res->allocs = bench_alloc_count();
+	res->start = bench_now();
+}
+
+static void
+bench_end(struct bench_result *res)
+{
+	res->seconds = bench_now() - res->start;
+	res->allocs = bench_alloc_count() - res->allocs;
+	if (res->peak_rss_kb == 0)
+		res->peak_rss_kb = bench_rss_peak_kb();
+}
+
+/**
+ * Print the result and append it to the history file if there is one.
+ * @param block Buffer size, 0 when not applicable.
+ * @param files File count, 0 when not applicable.
+ */
+static void
+bench_report(const char *workload, int threads, size_t block, uint32_t files,
+	     const struct bench_result *res)
+{
+	struct ufs_pool_stats pools[BENCH_MAX_POOLS];
+	int pool_count = ufs_pool_stats(pools, BENCH_MAX_POOLS);
+	if (pool_count > BENCH_MAX_POOLS)
+		pool_count = BENCH_MAX_POOLS;
+	size_t reserved = 0;
+	for (int i = 0; i < pool_count; ++i)
+		reserved += pools[i].reserved;
+	double seconds = res->seconds > 0 ? res->seconds : 1e-9;
+	char json[512];
+	snprintf(json, sizeof(json), "{\"tag\": \"%s\", \"workload\": \"%s\", "
+		 "\"threads\": %d, \"block\": %zu, \"files\": %u, "
+		 "\"ops\": %llu, \"seconds\": %.6f, \"ops_per_sec\": %.0f, "
+		 "\"mb_per_sec\": %.2f, \"allocs\": %llu, "
+		 "\"allocs_per_op\": %.3f, \"peak_rss_kb\": %ld, "
+		 "\"pool_reserved\": %zu, \"errors\": %d}",
+		 bench_tag, workload, threads, block, files,
+		 (unsigned long long)res->ops, res->seconds,
+		 res->ops / seconds, res->bytes / seconds / (1024 * 1024),
+		 (unsigned long long)res->allocs,
+		 res->ops == 0 ? 0 : (double)res->allocs / res->ops,
+		 res->peak_rss_kb, reserved, res->errors);
+	printf("%s\n", json);
+	fflush(stdout);
+	if (bench_history != NULL)
+		fprintf(bench_history, "%s\n", json);
+}
+
+static void
+bench_file_name(char *name, size_t size, int id)
+{
+	snprintf(name, size, "bench_%d", id);
+}
+
+/** Create the file and fill it to the full benchmark size. */
+static int
+bench_file_create(const char *name)
+{
+	int fd = ufs_open(name, UFS_CREATE);
+	if (fd == -1)
+		return -1;
+	char block[BENCH_BLOCK_SIZE];
+	memset(block, 'x', sizeof(block));
+	for (size_t pos = 0; pos < BENCH_FILE_SIZE; pos += sizeof(block)) {
+		if (ufs_write(fd, block, sizeof(block)) != sizeof(block)) {
+			ufs_close(fd);
+			return -1;
+		}
+	}
+	return fd;
+}
+
+static int
+bench_seq(bool is_write, size_t block)
+{
+	char *buf = malloc(block);
+	if (buf == NULL)
+		return -1;
+	memset(buf, 'x', block);
+	int fd = -1;
+	if (!is_write && (fd = bench_file_create("seq")) == -1) {
+		free(buf);
+		return -1;
+	}
+	struct bench_result res;
+	bench_begin(&res);
+	for (int r = 0; r < BENCH_SEQ_ROUNDS; ++r) {
+		if (is_write) {
+			fd = ufs_open("seq", UFS_CREATE);
+			if (fd == -1) {
+				++res.errors;
+				break;
+			}
+		} else {
+			ufs_seek(fd, 0, SEEK_SET);
+		}
+		for (size_t pos = 0; pos < BENCH_FILE_SIZE; pos += block) {
+			ssize_t rc = is_write ? ufs_write(fd, buf, block) :
+				     ufs_read(fd, buf, block);
+			if (rc != (ssize_t)block)
+				++res.errors;
+			++res.ops;
+		}
+		if (is_write) {
+			ufs_close(fd);
+			ufs_delete("seq");
+		}
+	}
+	res.bytes = res.ops * block;
+	bench_end(&res);
+	if (!is_write) {
+		ufs_close(fd);
+		ufs_delete("seq");
+	}
+	bench_report(is_write ? "seq_write" : "seq_read", 1, block, 0, &res);
+	free(buf);
+	return res.errors == 0 ? 0 : -1;
+}
+
+static int
+bench_rand_io(bool is_write, size_t block, uint64_t ops)
+{
+	char *buf = malloc(block);
+	if (buf == NULL)
+		return -1;
+	memset(buf, 'y', block);
+	int fd = bench_file_create("rand");
+	if (fd == -1) {
+		free(buf);
+		return -1;
+	}
+	if (ops > BENCH_RAND_MAX_BYTES / block)
+		ops = BENCH_RAND_MAX_BYTES / block;
+	uint64_t blocks = BENCH_FILE_SIZE / block;
+	uint64_t rand = 88172645463325252ull;
+	struct bench_result res;
+	bench_begin(&res);
+	for (uint64_t i = 0; i < ops; ++i) {
+		size_t pos = bench_rand(&rand) % blocks * block;
+		ssize_t rc = is_write ? ufs_pwrite(fd, buf, block, pos) :
+			     ufs_pread(fd, buf, block, pos);
+		if (rc != (ssize_t)block)
+			++res.errors;
+	}
+	res.ops = ops;
+	res.bytes = ops * block;
+	bench_end(&res);
+	ufs_close(fd);
+	ufs_delete("rand");
+	bench_report(is_write ? "rand_write" : "rand_read", 1, block, 0, &res);
+	free(buf);
+	return res.errors == 0 ? 0 : -1;
+}
+
+static int
+bench_create_delete(uint64_t ops)
+{
+	const char data[] = "some file content";
+	struct bench_result res;
+	bench_begin(&res);
+	for (uint64_t i = 0; i < ops; ++i) {
+		int fd = ufs_open("churn", UFS_CREATE);
+		if (fd == -1) {
+			++res.errors;
+			continue;
+		}
+		if (ufs_write(fd, data, sizeof(data)) != sizeof(data))
+			++res.errors;
+		if (ufs_close(fd) != 0 || ufs_delete("churn") != 0)
+			++res.errors;
+	}
+	res.ops = ops;
+	res.bytes = ops * sizeof(data);
+	bench_end(&res);
+	bench_report("create_delete", 1, 0, 0, &res);
+	return res.errors == 0 ? 0 : -1;
+}
+
+static int
+bench_namespace(uint32_t files, uint64_t ops)
+{
+	if (ufs_mkdir("ns") != 0)
+		return -1;
+	char name[32];
+	struct bench_result res;
+	int errors = 0;
+
+	bench_begin(&res);
+	for (uint32_t i = 0; i < files; ++i) {
+		snprintf(name, sizeof(name), "ns/file_%u", i);
+		int fd = ufs_open(name, UFS_CREATE);
+		if (fd == -1 || ufs_close(fd) != 0)
+			++res.errors;
+	}
+	res.ops = files;
+	bench_end(&res);
+	bench_report("namespace_create", 1, 0, files, &res);
+	errors += res.errors;
+
+	uint64_t rand = files * 2654435761u + 1;
+	bench_begin(&res);
+	for (uint64_t i = 0; i < ops; ++i) {
+		snprintf(name, sizeof(name), "ns/file_%u",
+			 (uint32_t)(bench_rand(&rand) % files));
+		int fd = ufs_open(name, 0);
+		if (fd == -1 || ufs_close(fd) != 0)
+			++res.errors;
+	}
+	res.ops = ops;
+	bench_end(&res);
+	bench_report("namespace_open", 1, 0, files, &res);
+	errors += res.errors;
+
+	bench_begin(&res);
+	for (uint32_t i = 0; i < files; ++i) {
+		snprintf(name, sizeof(name), "ns/file_%u", i);
+		if (ufs_delete(name) != 0)
+			++res.errors;
+	}
+	res.ops = files;
+	bench_end(&res);
+	bench_report("namespace_delete", 1, 0, files, &res);
+	errors += res.errors;
+
+	if (ufs_rmdir("ns") != 0)
+		++errors;
+	return errors == 0 ? 0 : -1;
+}
+
+static void *
+bench_thread_f(void *arg)
+{
+	struct bench_thread *t = arg;
+	char name[32];
+	bench_file_name(name, sizeof(name), t->id);
+	char block[BENCH_BLOCK_SIZE];
+	memset(block, 'a' + t->id % 26, sizeof(block));
+	uint64_t rand = t->id * 2654435761u + 1;
+	uint64_t blocks = BENCH_FILE_SIZE / BENCH_BLOCK_SIZE;
+	pthread_barrier_wait(&bench_barrier);
+	for (uint64_t i = 0; i < t->ops; ++i) {
+		size_t pos = bench_rand(&rand) % blocks * BENCH_BLOCK_SIZE;
+		ssize_t rc = BENCH_BLOCK_SIZE;
+		switch (t->workload) {
+		case BENCH_PREAD_SHARED:
+		case BENCH_PREAD_OWN_FD:
+			rc = ufs_pread(t->fd, block, sizeof(block), pos);
+			break;
+		case BENCH_PWRITE_OWN:
+			rc = ufs_pwrite(t->fd, block, sizeof(block), pos);
+			break;
+		case BENCH_OPEN_CLOSE: {
+			int fd = ufs_open(name, 0);
+			if (fd == -1 || ufs_close(fd) != 0)
+				rc = -1;
+			break;
+		}
+		case BENCH_MIXED_SHARED:
+			if (i % 8 == 0)
+				rc = ufs_pwrite(t->fd, block, BENCH_BLOCK_SIZE,
+						pos);
+			else
+				rc = ufs_pread(t->fd, block, BENCH_BLOCK_SIZE,
+					       pos);
+			break;
+		default:
+			abort();
+		}
+		if (rc != BENCH_BLOCK_SIZE)
+			++t->errors;
+	}
+	if (t->workload != BENCH_OPEN_CLOSE)
+		t->bytes = t->ops * BENCH_BLOCK_SIZE;
+	return NULL;
+}
+
+static int
+bench_run(enum bench_workload workload, int thread_count, uint64_t ops)
+{
+	struct bench_thread threads[BENCH_MAX_THREADS];
+	bool is_shared = workload == BENCH_PREAD_SHARED ||
+			 workload == BENCH_PREAD_OWN_FD ||
+			 workload == BENCH_MIXED_SHARED;
+	int shared_fd = -1;
+	if (is_shared && (shared_fd = bench_file_create("shared")) == -1)
+		return -1;
+	for (int i = 0; i < thread_count; ++i) {
+		struct bench_thread *t = &threads[i];
+		memset(t, 0, sizeof(*t));
+		t->workload = workload;
+		t->id = i;
+		t->ops = ops;
+		t->fd = shared_fd;
+		if (workload == BENCH_PREAD_OWN_FD)
+			t->fd = ufs_open("shared", 0);
+		if (is_shared)
+			continue;
+		char name[32];
+		bench_file_name(name, sizeof(name), i);
+		t->fd = bench_file_create(name);
+		if (t->fd == -1)
+			return -1;
+	}
+	pthread_barrier_init(&bench_barrier, NULL, thread_count + 1);
+	for (int i = 0; i < thread_count; ++i)
+		pthread_create(&threads[i].thread, NULL, bench_thread_f,
+			       &threads[i]);
+	/*
+	 * Start before the release, on few cores the threads can be done
+	 * before the main one is scheduled again.
+	 */
+	struct bench_result res;
+	bench_begin(&res);
+	pthread_barrier_wait(&bench_barrier);
+	for (int i = 0; i < thread_count; ++i) {
+		pthread_join(threads[i].thread, NULL);
+		res.bytes += threads[i].bytes;
+		res.errors += threads[i].errors;
+	}
+	res.ops = ops * thread_count;
+	bench_end(&res);
+	pthread_barrier_destroy(&bench_barrier);
+	size_t block = workload == BENCH_OPEN_CLOSE ? 0 : BENCH_BLOCK_SIZE;
+	bench_report(bench_workload_names[workload], thread_count, block, 0,
+		     &res);
+	if (workload == BENCH_PREAD_OWN_FD) {
+		for (int i = 0; i < thread_count; ++i)
+			ufs_close(threads[i].fd);
+	}
+	if (is_shared) {
+		ufs_close(shared_fd);
+		ufs_delete("shared");
+	}
+	for (int i = 0; i < thread_count && !is_shared; ++i) {
+		char name[32];
+		bench_file_name(name, sizeof(name), i);
+		ufs_close(threads[i].fd);
+		ufs_delete(name);
+	}
+	return res.errors == 0 ? 0 : -1;
+}
+
+static int
+bench_queue(int worker_count, uint64_t ops)
+{
+	struct ufs_queue *q = ufs_queue_new(worker_count);
+	if (q == NULL)
+		return -1;
+	int fds[BENCH_QUEUE_FILES];
+	for (int i = 0; i < BENCH_QUEUE_FILES; ++i) {
+		char name[32];
+		bench_file_name(name, sizeof(name), i);
+		fds[i] = bench_file_create(name);
+	}
+	char block[BENCH_QUEUE_BLOCK_SIZE];
+	memset(block, 'q', sizeof(block));
+	struct ufs_op batch[BENCH_QUEUE_BATCH];
+	struct ufs_op *done[BENCH_QUEUE_BATCH];
+	memset(batch, 0, sizeof(batch));
+	uint64_t blocks = BENCH_FILE_SIZE / sizeof(block);
+	uint64_t rand = 2463534242ull;
+	struct bench_result res;
+	bench_begin(&res);
+	while (res.ops < ops) {
+		for (int i = 0; i < BENCH_QUEUE_BATCH; ++i) {
+			struct ufs_op *op = &batch[i];
+			op->code = UFS_OP_PWRITE;
+			op->fd = fds[i % BENCH_QUEUE_FILES];
+			op->buf = block;
+			op->size = sizeof(block);
+			op->offset = bench_rand(&rand) % blocks * sizeof(block);
+		}
+		ufs_queue_submit(q, batch, BENCH_QUEUE_BATCH);
+		int count = 0;
+		while (count < BENCH_QUEUE_BATCH) {
+			count += ufs_queue_reap(q, done, BENCH_QUEUE_BATCH,
+						BENCH_QUEUE_BATCH - count);
+		}
+		for (int i = 0; i < BENCH_QUEUE_BATCH; ++i) {
+			if (batch[i].result != (ssize_t)sizeof(block))
+				++res.errors;
+		}
+		res.ops += BENCH_QUEUE_BATCH;
+	}
+	res.bytes = res.ops * sizeof(block);
+	bench_end(&res);
+	ufs_queue_delete(q);
+	bench_report("queue_pwrite", worker_count, sizeof(block), 0, &res);
+	for (int i = 0; i < BENCH_QUEUE_FILES; ++i) {
+		char name[32];
+		bench_file_name(name, sizeof(name), i);
+		ufs_close(fds[i]);
+		ufs_delete(name);
+	}
+	return res.errors == 0 ? 0 : -1;
+}
+
+static void
+usage(const char *name)
+{
+	fprintf(stderr, "Usage: %s [-t max_threads] [-n ops] [-w workload] "
+		"[-T tag] [-o history_file]\n", name);
+}
+
+int
+main(int argc, char **argv)
+{
+	/* Even on few cores, the lock overhead is visible with 4 threads. */
+	int max_threads = sysconf(_SC_NPROCESSORS_ONLN);
+	if (max_threads < 4)
+		max_threads = 4;
+	uint64_t ops = 200000;
+	const char *history = NULL;
+	int opt;
+	while ((opt = getopt(argc, argv, "t:n:w:T:o:h")) != -1) {
+		switch (opt) {
+		case 't': max_threads = atoi(optarg); break;
+		case 'n': ops = strtoull(optarg, NULL, 10); break;
+		case 'w': bench_filter = optarg; break;
+		case 'T': bench_tag = optarg; break;
+		case 'o': history = optarg; break;
+		default:
+			usage(argv[0]);
+			return opt == 'h' ? 0 : 1;
+		}
+	}
+	if (max_threads < 1)
+		max_threads = 1;
+	if (max_threads > BENCH_MAX_THREADS)
+		max_threads = BENCH_MAX_THREADS;
+	if (history != NULL && (bench_history = fopen(history, "a")) == NULL) {
+		perror(history);
+		return 1;
+	}
+	int rc = 0;
+	int size_count = sizeof(bench_buffer_sizes) /
+			 sizeof(bench_buffer_sizes[0]);
+	/*
+	 * Everything is destroyed after each run, so the pool usage and the
+	 * allocations of one workload do not leak into the next one.
+	 */
+	for (int i = 0; i < size_count; ++i) {
+		size_t size = bench_buffer_sizes[i];
+		if (bench_is_selected("seq_write") &&
+		    bench_seq(true, size) != 0)
+			rc = 1;
+		ufs_destroy();
+		if (bench_is_selected("seq_read") &&
+		    bench_seq(false, size) != 0)
+			rc = 1;
+		ufs_destroy();
+	}
+	for (int i = 0; i < size_count; ++i) {
+		size_t size = bench_buffer_sizes[i];
+		if (bench_is_selected("rand_write") &&
+		    bench_rand_io(true, size, ops) != 0)
+			rc = 1;
+		ufs_destroy();
+		if (bench_is_selected("rand_read") &&
+		    bench_rand_io(false, size, ops) != 0)
+			rc = 1;
+		ufs_destroy();
+	}
+	if (bench_is_selected("create_delete") && bench_create_delete(ops) != 0)
+		rc = 1;
+	ufs_destroy();
+	int ns_count = sizeof(bench_namespace_sizes) /
+		       sizeof(bench_namespace_sizes[0]);
+	for (int i = 0; i < ns_count && bench_is_selected("namespace"); ++i) {
+		if (bench_namespace(bench_namespace_sizes[i], ops) != 0)
+			rc = 1;
+		ufs_destroy();
+	}
+	for (int w = 0; w < BENCH_WORKLOAD_COUNT; ++w) {
+		if (!bench_is_selected(bench_workload_names[w]))
+			continue;
+		for (int n = 1; n <= max_threads; n *= 2) {
+			if (bench_run(w, n, ops) != 0)
+				rc = 1;
+			ufs_destroy();
+		}
+	}
+	for (int n = 1; n <= max_threads && bench_is_selected("queue_pwrite");
+	     n *= 2) {
+		if (bench_queue(n, ops) != 0)
+			rc = 1;
+		ufs_destroy();
+	}
+	if (bench_history != NULL)
+		fclose(bench_history);
+	return rc;
+}
@@ -0,0 +1,61 @@
+#!/bin/bash
+# FUSE benchmark: runs the same fio jobs against userfs mounted with
+# userfs_fuse and against a tmpfs directory, then copies a big file in and out
+# of the mount. tmpfs is the upper bound: both keep the data in memory, so the
+# difference is the cost of the FUSE round trips and of userfs itself.
+#
+# Usage: ./bench_fuse.sh [size_mb] [tmpfs_dir]
+
+size_mb=${1:-256}
+tmpfs=${2:-/dev/shm}
+dir=$(mktemp -d)
+ref=$(mktemp -d -p "$tmpfs")
+mnt="$dir/mnt"
+mkdir "$mnt"
+trap 'fusermount3 -u "$mnt" 2>/dev/null; rm -rf "$dir" "$ref"' EXIT
+
+if ! ./userfs_fuse "$mnt"; then
+	echo "could not mount userfs on $mnt"
+	exit 1
+fi
+
+# Terse version 3: read bandwidth in KiB/s and IOPS are the fields 7 and 8,
+# write ones are 48 and 49.
+job() {
+	local target=$1 name=$2
+	shift 2
+	fio --name="$name" --directory="$target" --size="${size_mb}M" \
+	    --ioengine=psync --output-format=terse --terse-version=3 "$@" |
+		awk -F';' -v name="$name" -v target="$target" '{
+			bw = ($7 + $48) / 1024
+			iops = $8 + $49
+			printf("%-12s %-40s %10.1f MB/s %10.0f IOPS\n",
+			       name, target, bw, iops)
+		}'
+}
+
+for target in "$mnt" "$ref"; do
+	job "$target" seq_write --rw=write --bs=1M
+	job "$target" seq_read --rw=read --bs=1M
+	job "$target" rand_write --rw=randwrite --bs=4k
+	job "$target" rand_read --rw=randread --bs=4k
+	rm -f "$target"/*
+done
+
+head -c $((size_mb * 1024 * 1024)) /dev/urandom > "$ref/in"
+copy() {
+	local start end
+	start=$(date +%s%N)
+	cp "$1" "$2"
+	end=$(date +%s%N)
+	if ! cmp -s "$ref/in" "$2"; then
+		echo "$3: the copy differs from the input"
+		exit 1
+	fi
+	awk -v name="$3" -v ns=$((end - start)) -v mb="$size_mb" 'BEGIN {
+		printf("%-12s %8.3f s %10.1f MB/s\n", name, ns / 1e9,
+		       mb / (ns / 1e9))
+	}'
+}
+copy "$ref/in" "$mnt/in" "cp in"
+copy "$mnt/in" "$ref/out" "cp out"
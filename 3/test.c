@@ -2,7 +2,10 @@
 #include "unit.h"
 #include <assert.h>
 #include <limits.h>
+#include <pthread.h>
+#include <stdint.h>
 #include <string.h>
+#include <unistd.h>
 
 static void
 test_open(void)
@@ -70,6 +73,39 @@ test_stress_open(void)
 	unit_test_finish();
 }
 
+static void
+test_stress_names(void)
+{
+	unit_test_start();
+
+	const int count = 1000 * 1000;
+	char name[16];
+	unit_msg("create %d files", count);
+	for (int i = 0; i < count; ++i) {
+		sprintf(name, "file%d", i);
+		int fd = ufs_open(name, UFS_CREATE);
+		unit_fail_if(fd == -1);
+		unit_fail_if(ufs_close(fd) != 0);
+	}
+	unit_msg("open them in another order");
+	for (int i = 0; i < count; ++i) {
+		sprintf(name, "file%d", (int)((i * 7919LL) % count));
+		int fd = ufs_open(name, 0);
+		unit_fail_if(fd == -1);
+		unit_fail_if(ufs_close(fd) != 0);
+	}
+	unit_check(ufs_open("file-1", 0) == -1, "a missing one is not found");
+	unit_msg("delete them");
+	for (int i = 0; i < count; ++i) {
+		sprintf(name, "file%d", i);
+		unit_fail_if(ufs_delete(name) != 0);
+	}
+	sprintf(name, "file%d", count / 2);
+	unit_check(ufs_open(name, 0) == -1, "all are gone");
+
+	unit_test_finish();
+}
+
 static void
 test_close(void)
 {
@@ -93,6 +129,42 @@ test_close(void)
 	unit_test_finish();
 }
 
+static void
+test_fd_reuse(void)
+{
+	unit_test_start();
+
+	const int count = 2000;
+	int *fds = malloc(count * sizeof(*fds));
+	for (int i = 0; i < count; ++i) {
+		fds[i] = ufs_open("file", UFS_CREATE);
+		unit_fail_if(fds[i] == -1);
+	}
+	unit_check(ufs_close(fds[1500]) == 0 && ufs_close(fds[100]) == 0,
+		   "close two descriptors");
+	int fd = ufs_open("file", 0);
+	unit_check(fd == fds[100], "the lowest free one is reused");
+	unit_fail_if(ufs_close(fd) != 0);
+
+	unit_msg("close all but the last one");
+	for (int i = 0; i < count - 1; ++i) {
+		if (i != 1500 && i != 100)
+			unit_fail_if(ufs_close(fds[i]) != 0);
+	}
+	fd = ufs_open("file", 0);
+	unit_check(fd == 0, "descriptors start from zero again");
+	char c;
+	unit_check(ufs_read(fds[count - 1], &c, 1) == 0,
+		   "the last descriptor still works");
+	unit_fail_if(ufs_close(fd) != 0);
+	unit_fail_if(ufs_close(fds[count - 1]) != 0);
+	unit_check(ufs_close(fds[count - 1]) == -1, "and is closed");
+	free(fds);
+	unit_fail_if(ufs_delete("file") != 0);
+
+	unit_test_finish();
+}
+
 static void
 test_io(void)
 {
@@ -334,6 +406,572 @@ test_max_file_size(void)
 	unit_test_finish();
 }
 
+static void
+test_seek(void)
+{
+	unit_test_start();
+
+	unit_check(ufs_seek(-1, 0, UFS_SEEK_SET) == -1, "seek invalid fd");
+	unit_check(ufs_errno() == UFS_ERR_NO_FILE, "errno is set");
+
+	int fd = ufs_open("file", UFS_CREATE);
+	unit_fail_if(fd == -1);
+	const int size = 1024 * 1024 * 3;
+	char *buf = malloc(size);
+	for (int i = 0; i < size; ++i)
+		buf[i] = 'a' + i % 26;
+	unit_fail_if(ufs_write(fd, buf, size) != size);
+
+	char tmp[128];
+	int offset = size - 1000;
+	unit_check(ufs_seek(fd, offset, UFS_SEEK_SET) == offset, "seek set");
+	unit_check(ufs_read(fd, tmp, 10) == 10, "read after seek");
+	unit_check(memcmp(tmp, buf + offset, 10) == 0, "data is correct");
+	unit_check(ufs_seek(fd, -20, UFS_SEEK_CUR) == offset - 10,
+		   "seek back from current");
+	unit_check(ufs_seek(fd, -5, UFS_SEEK_END) == size - 5,
+		   "seek from end");
+	unit_check(ufs_read(fd, tmp, sizeof(tmp)) == 5, "read the tail");
+	unit_check(ufs_seek(fd, -1, UFS_SEEK_SET) == -1, "negative position");
+	unit_check(ufs_errno() == UFS_ERR_INVALID_ARG, "errno is set");
+	unit_check(ufs_seek(fd, 0, 100) == -1, "invalid whence");
+	unit_check(ufs_errno() == UFS_ERR_INVALID_ARG, "errno is set");
+
+	unit_msg("pread and pwrite do not move the position");
+	unit_fail_if(ufs_seek(fd, 10, UFS_SEEK_SET) != 10);
+	unit_check(ufs_pread(fd, tmp, 10, 1000000) == 10, "pread");
+	unit_check(memcmp(tmp, buf + 1000000, 10) == 0, "data is correct");
+	unit_check(ufs_pread(fd, tmp, 10, size) == 0, "pread at the end");
+	unit_check(ufs_pwrite(fd, "0123456789", 10, 2000000) == 10, "pwrite");
+	unit_check(ufs_pread(fd, tmp, 10, 2000000) == 10 &&
+		   memcmp(tmp, "0123456789", 10) == 0, "pwrite is visible");
+	unit_check(ufs_read(fd, tmp, 10) == 10 &&
+		   memcmp(tmp, buf + 10, 10) == 0, "position is the same");
+
+	unit_msg("write beyond the end fills the gap with zeros");
+	unit_check(ufs_seek(fd, size + 100, UFS_SEEK_SET) == size + 100,
+		   "seek beyond the end");
+	unit_check(ufs_read(fd, tmp, 10) == 0, "nothing to read there");
+	unit_check(ufs_write(fd, "x", 1) == 1, "write there");
+	unit_check(ufs_pread(fd, tmp, sizeof(tmp), size) == 101,
+		   "file is extended");
+	bool ok = tmp[100] == 'x';
+	for (int i = 0; i < 100 && ok; ++i)
+		ok = tmp[i] == 0;
+	unit_check(ok, "gap is zeros");
+
+	free(buf);
+	unit_fail_if(ufs_close(fd) != 0);
+	unit_fail_if(ufs_delete("file") != 0);
+
+	unit_test_finish();
+}
+
+static void
+test_pool_stats(void)
+{
+	unit_test_start();
+
+	struct ufs_pool_stats stats[32];
+	int count = ufs_pool_stats(stats, 32);
+	unit_check(count > 0 && count <= 32, "pools are reported");
+	size_t used = 0;
+	size_t chunks = 0;
+	for (int i = 0; i < count; ++i) {
+		used += stats[i].used;
+		chunks += stats[i].chunk_count;
+	}
+	unit_check(used == 0, "nothing is used");
+
+	int fd = ufs_open("file", UFS_CREATE);
+	unit_fail_if(fd == -1);
+	char buf[4096] = {0};
+	for (int i = 0; i < 1024; ++i)
+		unit_fail_if(ufs_write(fd, buf, sizeof(buf)) != sizeof(buf));
+	unit_fail_if(ufs_pool_stats(stats, 32) != count);
+	size_t new_chunks = 0;
+	size_t bytes = 0;
+	for (int i = 0; i < count; ++i) {
+		new_chunks += stats[i].chunk_count;
+		bytes += stats[i].used * stats[i].object_size;
+	}
+	unit_check(bytes >= 4 * 1024 * 1024, "the data is in the pools");
+	unit_check(new_chunks - chunks < 16, "and it took a few chunks");
+
+	unit_fail_if(ufs_close(fd) != 0);
+	unit_fail_if(ufs_delete("file") != 0);
+	ufs_pool_stats(stats, 32);
+	used = 0;
+	for (int i = 0; i < count; ++i)
+		used += stats[i].used;
+	unit_check(used == 0, "all is returned to the pools");
+
+	unit_test_finish();
+}
+
+static size_t
+pool_used_bytes(void)
+{
+	struct ufs_pool_stats stats[32];
+	int count = ufs_pool_stats(stats, 32);
+	size_t bytes = 0;
+	for (int i = 0; i < count; ++i) {
+		if (strncmp(stats[i].name, "extent_", 7) == 0)
+			bytes += stats[i].used * stats[i].object_size;
+	}
+	return bytes;
+}
+
+static void
+test_clone(void)
+{
+	unit_test_start();
+
+	unit_check(ufs_clone("nothing", "copy") == -1 &&
+		   ufs_errno() == UFS_ERR_NO_FILE, "clone of no file");
+
+	int fd = ufs_open("file", UFS_CREATE);
+	unit_fail_if(fd == -1);
+	char data[1024 * 1024];
+	for (size_t i = 0; i < sizeof(data); ++i)
+		data[i] = 'a' + i % 26;
+	for (int i = 0; i < 4; ++i)
+		unit_fail_if(ufs_write(fd, data, sizeof(data)) != sizeof(data));
+	size_t used = pool_used_bytes();
+	unit_check(ufs_clone("file", "copy") == 0, "clone");
+	unit_check(pool_used_bytes() == used, "the clone takes no data memory");
+
+	int copy = ufs_open("copy", 0);
+	unit_fail_if(copy == -1);
+	char buf[sizeof(data)];
+	unit_fail_if(ufs_pread(copy, buf, sizeof(buf), 3 * sizeof(data)) !=
+		     sizeof(buf));
+	unit_check(memcmp(buf, data, sizeof(buf)) == 0, "clone has the data");
+
+	unit_fail_if(ufs_pwrite(copy, "XYZ", 3, 100) != 3);
+	unit_check(pool_used_bytes() - used <= 1024 * 1024,
+		   "a write copies only one extent");
+	unit_fail_if(ufs_pread(fd, buf, 3, 100) != 3);
+	unit_check(memcmp(buf, data + 100, 3) == 0, "the origin is intact");
+	unit_fail_if(ufs_pread(copy, buf, 3, 100) != 3);
+	unit_check(memcmp(buf, "XYZ", 3) == 0, "the clone is changed");
+
+	/* The origin writes into the block the clone doesn't share anymore. */
+	unit_fail_if(ufs_pwrite(fd, "abc", 3, 0) != 3);
+	unit_fail_if(ufs_pread(copy, buf, 3, 0) != 3);
+	unit_check(memcmp(buf, data, 3) == 0, "origin writes are not seen");
+
+	unit_check(ufs_clone("copy", "file") == 0, "clone onto existing file");
+	unit_fail_if(ufs_pread(fd, buf, 3, 100) != 3);
+	unit_check(memcmp(buf, "XYZ", 3) == 0, "its descriptors see new data");
+
+	unit_fail_if(ufs_close(fd) != 0);
+	unit_fail_if(ufs_delete("file") != 0);
+	unit_fail_if(ufs_pread(copy, buf, sizeof(buf), sizeof(data)) !=
+		     sizeof(buf));
+	unit_check(memcmp(buf, data, sizeof(buf)) == 0,
+		   "clone survives the origin deletion");
+	unit_fail_if(ufs_close(copy) != 0);
+	unit_fail_if(ufs_delete("copy") != 0);
+	unit_check(pool_used_bytes() == 0, "all the extents are freed");
+
+	unit_test_finish();
+}
+
+static void
+test_snapshot(void)
+{
+	unit_test_start();
+
+	int fd = ufs_open("file1", UFS_CREATE);
+	unit_fail_if(fd == -1);
+	unit_fail_if(ufs_write(fd, "111", 3) != 3);
+	unit_fail_if(ufs_close(fd) != 0);
+	fd = ufs_open("file2", UFS_CREATE);
+	unit_fail_if(fd == -1);
+	unit_fail_if(ufs_write(fd, "222", 3) != 3);
+
+	struct ufs_snapshot *snap = ufs_snapshot();
+	unit_check(snap != NULL, "snapshot");
+
+	unit_fail_if(ufs_pwrite(fd, "xxx", 3, 0) != 3);
+	unit_fail_if(ufs_delete("file1") != 0);
+	int fd3 = ufs_open("file3", UFS_CREATE);
+	unit_fail_if(fd3 == -1);
+	unit_fail_if(ufs_close(fd3) != 0);
+
+	unit_check(ufs_snapshot_restore(snap) == 0, "restore");
+	char buf[8];
+	unit_check(ufs_open("file3", 0) == -1, "new file is gone");
+	int fd1 = ufs_open("file1", 0);
+	unit_fail_if(fd1 == -1);
+	unit_check(ufs_read(fd1, buf, sizeof(buf)) == 3 &&
+		   memcmp(buf, "111", 3) == 0, "deleted file is back");
+	unit_fail_if(ufs_close(fd1) != 0);
+	int fd2 = ufs_open("file2", 0);
+	unit_fail_if(fd2 == -1);
+	unit_check(ufs_read(fd2, buf, sizeof(buf)) == 3 &&
+		   memcmp(buf, "222", 3) == 0, "changed file is restored");
+	unit_check(ufs_pread(fd, buf, sizeof(buf), 0) == 3 &&
+		   memcmp(buf, "xxx", 3) == 0,
+		   "old descriptor works with the replaced file");
+	unit_fail_if(ufs_close(fd) != 0);
+
+	/* Restore again, the snapshot is not spent. */
+	unit_fail_if(ufs_pwrite(fd2, "yyy", 3, 0) != 3);
+	unit_fail_if(ufs_close(fd2) != 0);
+	unit_fail_if(ufs_snapshot_restore(snap) != 0);
+	fd2 = ufs_open("file2", 0);
+	unit_check(ufs_read(fd2, buf, sizeof(buf)) == 3 &&
+		   memcmp(buf, "222", 3) == 0, "second restore");
+	unit_fail_if(ufs_close(fd2) != 0);
+
+	ufs_snapshot_delete(snap);
+	unit_fail_if(ufs_delete("file1") != 0);
+	unit_fail_if(ufs_delete("file2") != 0);
+	unit_check(pool_used_bytes() == 0, "all the extents are freed");
+
+	unit_test_finish();
+}
+
+static void
+test_vectored(void)
+{
+	unit_test_start();
+
+	int fd = ufs_open("file", UFS_CREATE);
+	unit_fail_if(fd == -1);
+	char a[] = "first ";
+	char b[] = "second ";
+	char c[] = "third";
+	struct iovec in[] = {
+		{a, strlen(a)}, {b, strlen(b)}, {NULL, 0}, {c, strlen(c)},
+	};
+	unit_check(ufs_writev(fd, in, 4) == 18, "writev");
+	unit_check(ufs_writev(fd, in, -1) == -1 &&
+		   ufs_errno() == UFS_ERR_INVALID_ARG, "writev invalid count");
+	unit_fail_if(ufs_seek(fd, 0, UFS_SEEK_SET) != 0);
+	char x[10];
+	char y[20];
+	struct iovec out[] = {{x, sizeof(x)}, {y, sizeof(y)}};
+	unit_check(ufs_readv(fd, out, 2) == 18, "readv");
+	unit_check(memcmp(x, "first seco", 10) == 0 &&
+		   memcmp(y, "nd third", 8) == 0, "readv data");
+	unit_check(ufs_readv(fd, out, 2) == 0, "readv at the end");
+	unit_fail_if(ufs_close(fd) != 0);
+	unit_fail_if(ufs_delete("file") != 0);
+
+	unit_test_finish();
+}
+
+static void
+test_read_view(void)
+{
+	unit_test_start();
+
+	int fd = ufs_open("file", UFS_CREATE);
+	unit_fail_if(fd == -1);
+	static char data[3 * 1024 * 1024];
+	for (size_t i = 0; i < sizeof(data); ++i)
+		data[i] = 'a' + i % 26;
+	unit_fail_if(ufs_write(fd, data, sizeof(data)) != sizeof(data));
+
+	struct ufs_view view;
+	unit_check(ufs_read_view(fd, 100, sizeof(data), &view) == 0, "view");
+	unit_check(view.size == sizeof(data) - 100, "it stops at the file end");
+	size_t pos = 100;
+	bool is_equal = true;
+	for (int i = 0; i < view.iovcnt; ++i) {
+		is_equal = is_equal && memcmp(view.iov[i].iov_base, data + pos,
+					      view.iov[i].iov_len) == 0;
+		pos += view.iov[i].iov_len;
+	}
+	unit_check(is_equal && pos == sizeof(data), "view has the data");
+	unit_check(view.iovcnt > 1, "it is split by blocks");
+
+	size_t used = pool_used_bytes();
+	unit_fail_if(ufs_pwrite(fd, "XYZ", 3, 100) != 3);
+	unit_check(memcmp(view.iov[0].iov_base, data + 100, 3) == 0,
+		   "a write does not change the view");
+	unit_check(pool_used_bytes() > used, "it goes into a copy");
+	char buf[3];
+	unit_fail_if(ufs_pread(fd, buf, 3, 100) != 3);
+	unit_check(memcmp(buf, "XYZ", 3) == 0, "the file is changed");
+
+	/* The view outlives the file. */
+	unit_fail_if(ufs_close(fd) != 0);
+	unit_fail_if(ufs_delete("file") != 0);
+	const struct iovec *last = &view.iov[view.iovcnt - 1];
+	unit_check(memcmp(last->iov_base, data + sizeof(data) - last->iov_len,
+			  last->iov_len) == 0, "view of a deleted file");
+	ufs_view_release(&view);
+	unit_check(pool_used_bytes() == 0, "release frees the blocks");
+
+	fd = ufs_open("file", UFS_CREATE);
+	unit_check(ufs_read_view(fd, 0, 10, &view) == 0 && view.size == 0 &&
+		   view.iovcnt == 0, "view of an empty file");
+	ufs_view_release(&view);
+	unit_check(ufs_read_view(fd + 1, 0, 10, &view) == -1 &&
+		   ufs_errno() == UFS_ERR_NO_FILE, "view of a bad descriptor");
+	unit_fail_if(ufs_close(fd) != 0);
+	unit_fail_if(ufs_delete("file") != 0);
+
+	unit_test_finish();
+}
+
+enum {
+	QUEUE_FILE_COUNT = 4,
+	QUEUE_OPS_PER_FILE = 4,
+	QUEUE_OP_COUNT = QUEUE_FILE_COUNT * QUEUE_OPS_PER_FILE,
+};
+
+static void
+test_queue(void)
+{
+	unit_test_start();
+
+	unit_check(ufs_queue_new(0) == NULL &&
+		   ufs_errno() == UFS_ERR_INVALID_ARG, "no workers");
+	struct ufs_queue *q = ufs_queue_new(3);
+	unit_fail_if(q == NULL);
+	struct ufs_op ops[QUEUE_OP_COUNT];
+	struct ufs_op *done[QUEUE_OP_COUNT];
+	char names[QUEUE_FILE_COUNT][16];
+	int fds[QUEUE_FILE_COUNT];
+	memset(ops, 0, sizeof(ops));
+	for (int i = 0; i < QUEUE_FILE_COUNT; ++i) {
+		sprintf(names[i], "file_%d", i);
+		ops[i].code = UFS_OP_OPEN;
+		ops[i].filename = names[i];
+		ops[i].flags = UFS_CREATE;
+		ops[i].user_data = &fds[i];
+	}
+	unit_check(ufs_queue_submit(q, ops, QUEUE_FILE_COUNT) ==
+		   QUEUE_FILE_COUNT, "submit opens");
+	unit_check(ufs_queue_reap(q, done, QUEUE_OP_COUNT, QUEUE_FILE_COUNT) ==
+		   QUEUE_FILE_COUNT, "reap opens");
+	bool is_ok = true;
+	for (int i = 0; i < QUEUE_FILE_COUNT; ++i) {
+		is_ok = is_ok && done[i]->result >= 0;
+		*(int *)done[i]->user_data = done[i]->result;
+	}
+	unit_check(is_ok, "files are opened");
+
+	/*
+	 * The files are interleaved, but the operations on each descriptor
+	 * have to run in order.
+	 */
+	char bufs[QUEUE_FILE_COUNT][16];
+	memset(ops, 0, sizeof(ops));
+	for (int i = 0; i < QUEUE_FILE_COUNT; ++i) {
+		struct ufs_op *op = &ops[i];
+		op->code = UFS_OP_WRITE;
+		op->buf = "hello ";
+		op->size = 6;
+		op = &ops[i + QUEUE_FILE_COUNT];
+		op->code = UFS_OP_WRITE;
+		op->buf = "world";
+		op->size = 5;
+		op = &ops[i + 2 * QUEUE_FILE_COUNT];
+		op->code = UFS_OP_PWRITE;
+		op->buf = "!";
+		op->size = 1;
+		op->offset = 11;
+		op = &ops[i + 3 * QUEUE_FILE_COUNT];
+		op->code = UFS_OP_PREAD;
+		op->buf = bufs[i];
+		op->size = sizeof(bufs[i]);
+		for (int j = 0; j < QUEUE_OPS_PER_FILE; ++j)
+			ops[i + j * QUEUE_FILE_COUNT].fd = fds[i];
+	}
+	unit_check(ufs_queue_submit(q, ops, QUEUE_OP_COUNT) == QUEUE_OP_COUNT,
+		   "submit reads and writes");
+	int count = 0;
+	while (count < QUEUE_OP_COUNT)
+		count += ufs_queue_reap(q, done + count, QUEUE_OP_COUNT, 1);
+	unit_check(ufs_queue_reap(q, done, QUEUE_OP_COUNT, 1) == 0,
+		   "nothing more to reap");
+	is_ok = true;
+	for (int i = 0; i < 3 * QUEUE_FILE_COUNT; ++i) {
+		is_ok = is_ok && ops[i].result == (ssize_t)ops[i].size &&
+			ops[i].error == UFS_ERR_NO_ERR;
+	}
+	for (int i = 0; i < QUEUE_FILE_COUNT; ++i) {
+		is_ok = is_ok && ops[i + 3 * QUEUE_FILE_COUNT].result == 12 &&
+			memcmp(bufs[i], "hello world!", 12) == 0;
+	}
+	unit_check(is_ok, "operations on a descriptor are ordered");
+
+	memset(ops, 0, sizeof(ops));
+	ops[0].code = UFS_OP_PREAD;
+	ops[0].fd = fds[QUEUE_FILE_COUNT - 1] + 100;
+	ops[0].buf = bufs[0];
+	ops[0].size = 1;
+	ops[1].code = 100;
+	unit_check(ufs_queue_submit(q, ops, 2) == -1 &&
+		   ufs_errno() == UFS_ERR_INVALID_ARG, "bad operation code");
+	unit_check(ufs_queue_submit(q, ops, 1) == 1, "submit a bad read");
+	unit_check(ufs_queue_reap(q, done, QUEUE_OP_COUNT, 1) == 1 &&
+		   done[0]->result == -1 && done[0]->error == UFS_ERR_NO_FILE,
+		   "error is in the operation");
+
+	for (int i = 0; i < QUEUE_FILE_COUNT; ++i) {
+		ops[i].code = UFS_OP_CLOSE;
+		ops[i].fd = fds[i];
+	}
+	unit_fail_if(ufs_queue_submit(q, ops, QUEUE_FILE_COUNT) !=
+		     QUEUE_FILE_COUNT);
+	/* The deletion waits for the closes. */
+	ufs_queue_delete(q);
+	is_ok = true;
+	for (int i = 0; i < QUEUE_FILE_COUNT; ++i) {
+		is_ok = is_ok && ops[i].result == 0;
+		unit_fail_if(ufs_delete(names[i]) != 0);
+	}
+	unit_check(is_ok, "files are closed");
+
+	unit_test_finish();
+}
+
+enum {
+	THREAD_COUNT = 4,
+	THREAD_ITERATIONS = 300,
+	THREAD_SHARED_SIZE = 8192,
+};
+
+static char
+thread_shared_byte(size_t pos)
+{
+	return 'a' + pos % 23;
+}
+
+static void *
+test_threads_worker(void *arg)
+{
+	int id = (int)(intptr_t)arg;
+	int errors = 0;
+	char name[32];
+	snprintf(name, sizeof(name), "thread_file_%d", id);
+	int shared = ufs_open("shared", 0);
+	errors += shared == -1;
+	char buf[512];
+	char data[512];
+	memset(data, 'A' + id, sizeof(data));
+	for (int i = 0; i < THREAD_ITERATIONS; ++i) {
+		/* Own file: open, append, reopen and read back. */
+		int fd = ufs_open(name, UFS_CREATE);
+		if (fd == -1) {
+			++errors;
+			continue;
+		}
+		errors += ufs_seek(fd, 0, UFS_SEEK_END) !=
+			  (off_t)(i * sizeof(data));
+		errors += ufs_write(fd, data, sizeof(data)) != sizeof(data);
+		errors += ufs_close(fd) != 0;
+		fd = ufs_open(name, 0);
+		errors += ufs_pread(fd, buf, sizeof(buf), i * sizeof(buf)) !=
+			  sizeof(buf);
+		errors += memcmp(buf, data, sizeof(buf)) != 0;
+		errors += ufs_close(fd) != 0;
+		/* Shared file: read in parallel with the others. */
+		size_t pos = (i * 97 + id * 1031) % (THREAD_SHARED_SIZE - 100);
+		errors += ufs_pread(shared, buf, 100, pos) != 100;
+		for (size_t j = 0; j < 100; ++j)
+			errors += buf[j] != thread_shared_byte(pos + j);
+		/* Errors are per thread. */
+		errors += ufs_close(-1) != -1 || ufs_errno() != UFS_ERR_NO_FILE;
+	}
+	errors += ufs_close(shared) != 0;
+	errors += ufs_delete(name) != 0;
+	return (void *)(intptr_t)errors;
+}
+
+static size_t
+test_pool_reserved(void)
+{
+	struct ufs_pool_stats stats[32];
+	int count = ufs_pool_stats(stats, 32);
+	unit_fail_if(count > 32);
+	size_t reserved = 0;
+	for (int i = 0; i < count; ++i)
+		reserved += stats[i].reserved;
+	return reserved;
+}
+
+static void
+test_delete_frees(void)
+{
+	unit_test_start();
+
+	const size_t file_size = 8 * 1024 * 1024;
+	const int rounds = 16;
+	char *buf = malloc(1024 * 1024);
+	memset(buf, 'a', 1024 * 1024);
+	size_t first_reserved = 0;
+	unit_msg("write and delete a big file %d times", rounds);
+	for (int i = 0; i < rounds; ++i) {
+		int fd = ufs_open("big", UFS_CREATE);
+		unit_fail_if(fd == -1);
+		for (size_t done = 0; done < file_size; done += 1024 * 1024)
+			unit_fail_if(ufs_write(fd, buf, 1024 * 1024) < 0);
+		/* Both ways: the delete or the last close frees. */
+		if (i % 2 == 0) {
+			unit_fail_if(ufs_close(fd) != 0);
+			unit_fail_if(ufs_delete("big") != 0);
+		} else {
+			unit_fail_if(ufs_delete("big") != 0);
+			unit_fail_if(ufs_close(fd) != 0);
+		}
+		if (i == 0)
+			first_reserved = test_pool_reserved();
+	}
+	unit_check(test_pool_reserved() < first_reserved + file_size / 2,
+		   "the memory of the deleted files is reused");
+	free(buf);
+
+	unit_test_finish();
+}
+
+static void
+test_threads(void)
+{
+	unit_test_start();
+
+	int fd = ufs_open("shared", UFS_CREATE);
+	unit_fail_if(fd == -1);
+	char data[THREAD_SHARED_SIZE];
+	for (size_t i = 0; i < sizeof(data); ++i)
+		data[i] = thread_shared_byte(i);
+	unit_fail_if(ufs_write(fd, data, sizeof(data)) != sizeof(data));
+
+	pthread_t threads[THREAD_COUNT];
+	for (int i = 0; i < THREAD_COUNT; ++i) {
+		unit_fail_if(pthread_create(&threads[i], NULL,
+					    test_threads_worker,
+					    (void *)(intptr_t)i) != 0);
+	}
+	/* Read it here too, while the others are working. */
+	int errors = 0;
+	char buf[sizeof(data)];
+	for (int i = 0; i < THREAD_ITERATIONS; ++i) {
+		errors += ufs_pread(fd, buf, sizeof(buf), 0) != sizeof(buf);
+		errors += memcmp(buf, data, sizeof(buf)) != 0;
+	}
+	for (int i = 0; i < THREAD_COUNT; ++i) {
+		void *rc;
+		pthread_join(threads[i], &rc);
+		errors += (int)(intptr_t)rc;
+	}
+	unit_check(errors == 0, "parallel operations on own and shared files");
+	unit_check(ufs_open("thread_file_0", 0) == -1 &&
+		   ufs_errno() == UFS_ERR_NO_FILE, "own files are deleted");
+
+	unit_fail_if(ufs_close(fd) != 0);
+	unit_fail_if(ufs_delete("shared") != 0);
+
+	unit_test_finish();
+}
+
 static void
 test_rights(void)
 {
@@ -469,6 +1107,405 @@ test_resize(void)
 #endif
 }
 
+static void
+test_sparse(void)
+{
+#ifdef NEED_RESIZE
+	unit_test_start();
+
+	int fd = ufs_open("file", UFS_CREATE);
+	unit_fail_if(fd == -1);
+	unit_fail_if(ufs_write(fd, "head", 4) != 4);
+	size_t used = pool_used_bytes();
+	size_t max_size = 100 * 1024 * 1024;
+	unit_check(ufs_resize(fd, max_size) == 0, "grow to the max size");
+	unit_check(pool_used_bytes() == used, "growth makes a hole");
+
+	char buf[4096];
+	char zeros[sizeof(buf)];
+	memset(zeros, 0, sizeof(zeros));
+	unit_check(ufs_pread(fd, buf, 8, 0) == 8 &&
+		   memcmp(buf, "head\0\0\0\0", 8) == 0,
+		   "the old tail is zeroed");
+	unit_check(ufs_pread(fd, buf, sizeof(buf), max_size / 2) ==
+		   sizeof(buf) && memcmp(buf, zeros, sizeof(buf)) == 0,
+		   "the hole reads as zeros");
+
+	unit_fail_if(ufs_pwrite(fd, "middle", 6, max_size / 2) != 6);
+	size_t one_extent = pool_used_bytes() - used;
+	unit_check(one_extent > 0 && one_extent <= 1024 * 1024,
+		   "write into the hole allocates one extent");
+	unit_check(ufs_pread(fd, buf, 6, max_size / 2) == 6 &&
+		   memcmp(buf, "middle", 6) == 0, "the write is visible");
+	unit_check(ufs_pread(fd, buf, 6, max_size / 2 - 6) == 6 &&
+		   memcmp(buf, zeros, 6) == 0, "and the hole around it");
+
+	unit_check(ufs_resize(fd, 4) == 0, "shrink back");
+	unit_check(pool_used_bytes() == used, "the extents are freed");
+	unit_check(ufs_resize(fd, max_size) == 0 &&
+		   ufs_pread(fd, buf, 6, max_size / 2) == 6 &&
+		   memcmp(buf, zeros, 6) == 0, "regrown file has no old data");
+
+	unit_fail_if(ufs_close(fd) != 0);
+	unit_fail_if(ufs_delete("file") != 0);
+
+	unit_test_finish();
+#endif
+}
+
+/** Count files and directories of a listing. */
+static int
+test_dirs_count(const struct ufs_dirent *entry, void *arg)
+{
+	int *counts = arg;
+	++counts[entry->is_dir];
+	return 0;
+}
+
+static void
+test_dirs(void)
+{
+	unit_test_start();
+
+	unit_check(ufs_mkdir("dir") == 0, "mkdir");
+	unit_check(ufs_mkdir("dir") == -1 && ufs_errno() == UFS_ERR_EXISTS,
+		   "mkdir of existing path");
+	unit_check(ufs_mkdir("no/dir") == -1 &&
+		   ufs_errno() == UFS_ERR_NO_FILE, "mkdir without parent");
+	unit_check(ufs_open("dir", UFS_CREATE) == -1 &&
+		   ufs_errno() == UFS_ERR_IS_DIR, "directory is not opened");
+	unit_check(ufs_open("dir/", UFS_CREATE) == -1 &&
+		   ufs_errno() == UFS_ERR_INVALID_ARG, "empty file name");
+	unit_check(ufs_open("dir//file", UFS_CREATE) == -1 &&
+		   ufs_errno() == UFS_ERR_INVALID_ARG, "empty directory name");
+	int fd = ufs_open("dir/file", UFS_CREATE);
+	unit_check(fd != -1, "file in directory");
+	unit_fail_if(ufs_write(fd, "abc", 3) != 3);
+	unit_check(ufs_open("dir/file/x", UFS_CREATE) == -1 &&
+		   ufs_errno() == UFS_ERR_NOT_DIR, "file is not a directory");
+	int fd2 = ufs_open("/dir/file", 0);
+	char buf[8];
+	unit_check(ufs_read(fd2, buf, sizeof(buf)) == 3 &&
+		   memcmp(buf, "abc", 3) == 0, "leading slash is optional");
+	unit_fail_if(ufs_close(fd2) != 0);
+
+	unit_fail_if(ufs_mkdir("dir/sub") != 0);
+	char name[32];
+	for (int i = 0; i < 100; ++i) {
+		sprintf(name, "dir/sub/f%d", i);
+		fd2 = ufs_open(name, UFS_CREATE);
+		unit_fail_if(fd2 == -1);
+		unit_fail_if(ufs_close(fd2) != 0);
+	}
+	int counts[2] = {0, 0};
+	unit_check(ufs_readdir("dir/sub", test_dirs_count, counts) == 0 &&
+		   counts[0] == 100 && counts[1] == 0, "readdir");
+	counts[0] = counts[1] = 0;
+	unit_check(ufs_readdir("dir", test_dirs_count, counts) == 0 &&
+		   counts[0] == 1 && counts[1] == 1, "readdir of parent");
+	counts[0] = counts[1] = 0;
+	unit_check(ufs_readdir("", test_dirs_count, counts) == 0 &&
+		   counts[1] == 1, "readdir of root");
+	unit_check(ufs_readdir("dir/file", test_dirs_count, counts) == -1 &&
+		   ufs_errno() == UFS_ERR_NOT_DIR, "readdir of file");
+
+	unit_check(ufs_rmdir("dir/sub") == -1 &&
+		   ufs_errno() == UFS_ERR_NOT_EMPTY, "rmdir of non-empty");
+	unit_check(ufs_rmdir("") == -1 && ufs_errno() == UFS_ERR_INVALID_ARG,
+		   "rmdir of root");
+	unit_check(ufs_delete("dir") == -1 && ufs_errno() == UFS_ERR_IS_DIR,
+		   "delete of directory");
+
+	/* Gets the path into the cache. */
+	fd2 = ufs_open("dir/sub/f1", 0);
+	unit_fail_if(fd2 == -1);
+	unit_fail_if(ufs_close(fd2) != 0);
+	unit_check(ufs_rename("dir/sub", "moved") == 0, "rename directory");
+	unit_check(ufs_open("dir/sub/f1", 0) == -1 &&
+		   ufs_errno() == UFS_ERR_NO_FILE, "old path is gone");
+	fd2 = ufs_open("moved/f1", 0);
+	unit_check(fd2 != -1, "new path works");
+	unit_fail_if(ufs_close(fd2) != 0);
+	unit_check(ufs_rename("moved", "moved/x") == -1 &&
+		   ufs_errno() == UFS_ERR_INVALID_ARG, "move into itself");
+	unit_check(ufs_rename("dir", "moved/f3") == -1 &&
+		   ufs_errno() == UFS_ERR_EXISTS, "directory over file");
+
+	unit_check(ufs_rename("dir/file", "moved/f2") == 0,
+		   "rename file over another");
+	unit_check(ufs_open("dir/file", 0) == -1, "file left old directory");
+	fd2 = ufs_open("moved/f2", 0);
+	unit_check(ufs_read(fd2, buf, sizeof(buf)) == 3 &&
+		   memcmp(buf, "abc", 3) == 0, "file is at new path");
+	unit_fail_if(ufs_close(fd2) != 0);
+	unit_check(ufs_pread(fd, buf, sizeof(buf), 0) == 3 &&
+		   memcmp(buf, "abc", 3) == 0, "descriptor is still valid");
+	unit_fail_if(ufs_close(fd) != 0);
+	counts[0] = counts[1] = 0;
+	unit_check(ufs_readdir("moved", test_dirs_count, counts) == 0 &&
+		   counts[0] == 100, "replaced file is gone");
+
+	for (int i = 0; i < 100; ++i) {
+		sprintf(name, "moved/f%d", i);
+		unit_fail_if(ufs_delete(name) != 0);
+	}
+	unit_check(ufs_rmdir("moved") == 0 && ufs_rmdir("dir") == 0, "rmdir");
+	unit_check(ufs_readdir("dir", test_dirs_count, counts) == -1 &&
+		   ufs_errno() == UFS_ERR_NO_FILE, "directory is gone");
+	unit_check(pool_used_bytes() == 0, "all the extents are freed");
+
+	unit_test_finish();
+}
+
+static void
+test_compact(void)
+{
+	unit_test_start();
+
+	static char log[2 * 1024 * 1024 + 100];
+	size_t pos = 0;
+	for (int i = 0; pos < sizeof(log) - 100; ++i) {
+		pos += sprintf(log + pos, "12:%02d:%02d INFO request %d done "
+			       "in %d ms\n", i / 60 % 60, i % 60, i, i % 97);
+	}
+	size_t log_size = pos;
+	static char noise[256 * 1024];
+	uint64_t x = 88172645463325252ull;
+	for (size_t i = 0; i < sizeof(noise); ++i) {
+		x ^= x << 13;
+		x ^= x >> 7;
+		x ^= x << 17;
+		noise[i] = x;
+	}
+	const char *names[] = {"log1", "log2", "noise"};
+	const char *datas[] = {log, log, noise};
+	size_t sizes[] = {log_size, log_size, sizeof(noise)};
+	for (int i = 0; i < 3; ++i) {
+		int fd = ufs_open(names[i], UFS_CREATE);
+		unit_fail_if(fd == -1);
+		unit_fail_if(ufs_write(fd, datas[i], sizes[i]) !=
+			     (ssize_t)sizes[i]);
+		unit_fail_if(ufs_close(fd) != 0);
+	}
+
+	struct ufs_space_stats stats;
+	unit_check(ufs_compact() == 0, "compact");
+	ufs_space_stats(&stats);
+	unit_check(stats.logical == 2 * log_size + sizeof(noise) &&
+		   stats.physical >= stats.logical, "all is plain");
+	unit_check(stats.packed_count == 0 && stats.deduplicated == 0,
+		   "just written files are hot");
+	unit_check(ufs_compact() == 0, "compact cold files");
+	ufs_space_stats(&stats);
+	unit_check(stats.packed_count > 0 && stats.deduplicated > 0,
+		   "extents are compressed and deduplicated");
+	unit_check(stats.physical * 4 < stats.logical,
+		   "the memory drops several times");
+
+	unit_fail_if(ufs_clone("log1", "log3") != 0);
+	static char buf[sizeof(log)];
+	bool is_equal = true;
+	for (int i = 0; i < 4; ++i) {
+		const char *name = i == 3 ? "log3" : names[i];
+		const char *data = i == 3 ? log : datas[i];
+		size_t size = i == 3 ? log_size : sizes[i];
+		int fd = ufs_open(name, 0);
+		unit_fail_if(fd == -1);
+		is_equal = is_equal &&
+			   ufs_pread(fd, buf + 1, 1000, 777) == 1000 &&
+			   memcmp(buf + 1, data + 777, 1000) == 0 &&
+			   ufs_read(fd, buf, sizeof(buf)) == (ssize_t)size &&
+			   memcmp(buf, data, size) == 0;
+		unit_fail_if(ufs_close(fd) != 0);
+	}
+	unit_check(is_equal, "compacted files are read back");
+	ufs_space_stats(&stats);
+	unit_check(stats.packed_count == 0, "read extents are decompressed");
+
+	unit_check(ufs_compact() == 0 && ufs_compact() == 0,
+		   "compact again");
+	int fd = ufs_open("log1", 0);
+	unit_fail_if(fd == -1);
+	unit_fail_if(ufs_pwrite(fd, "XYZ", 3, 100000) != 3);
+	unit_fail_if(ufs_resize(fd, 1000) != 0);
+	unit_fail_if(ufs_resize(fd, 5000) != 0);
+	static const char zeros[4000];
+	unit_check(ufs_pread(fd, buf, 5000, 0) == 5000 &&
+		   memcmp(buf, log, 1000) == 0 &&
+		   memcmp(buf + 1000, zeros, 4000) == 0,
+		   "compressed file is truncated and extended");
+	unit_fail_if(ufs_close(fd) != 0);
+	fd = ufs_open("log2", 0);
+	unit_check(ufs_read(fd, buf, sizeof(buf)) == (ssize_t)log_size &&
+		   memcmp(buf, log, log_size) == 0,
+		   "deduplicated copy is not changed");
+	unit_fail_if(ufs_close(fd) != 0);
+
+	for (int i = 0; i < 3; ++i)
+		unit_fail_if(ufs_delete(names[i]) != 0);
+	unit_fail_if(ufs_delete("log3") != 0);
+	ufs_space_stats(&stats);
+	unit_check(stats.logical == 0 && stats.physical == 0 &&
+		   stats.packed_count == 0, "nothing is left");
+
+	unit_test_finish();
+}
+
+static void
+test_image(void)
+{
+	unit_test_start();
+
+	const char *path = "userfs_test.img";
+	unlink(path);
+	unit_check(ufs_mount(path, 64 * 1024 * 1024) == 0, "new image");
+	unit_check(ufs_mount(path, 0) == -1 &&
+		   ufs_errno() == UFS_ERR_INVALID_ARG, "mount is done once");
+
+	static char data[3 * 1024 * 1024];
+	for (size_t i = 0; i < sizeof(data); ++i)
+		data[i] = 'a' + i % 26;
+	int fd = ufs_open("big", UFS_CREATE);
+	unit_fail_if(fd == -1);
+	unit_fail_if(ufs_write(fd, data, sizeof(data)) != sizeof(data));
+	unit_fail_if(ufs_close(fd) != 0);
+	fd = ufs_open("small", UFS_CREATE);
+	unit_fail_if(fd == -1);
+	unit_fail_if(ufs_write(fd, "small", 5) != 5);
+	unit_fail_if(ufs_close(fd) != 0);
+	unit_fail_if(ufs_clone("big", "clone") != 0);
+	fd = ufs_open("clone", 0);
+	unit_fail_if(ufs_pwrite(fd, "XYZ", 3, 1000) != 3);
+	unit_fail_if(ufs_close(fd) != 0);
+	fd = ufs_open("deleted", UFS_CREATE);
+	unit_fail_if(fd == -1);
+	unit_fail_if(ufs_close(fd) != 0);
+	unit_fail_if(ufs_delete("deleted") != 0);
+	unit_fail_if(ufs_mkdir("dir") != 0);
+	unit_fail_if(ufs_mkdir("dir/empty") != 0);
+	unit_fail_if(ufs_clone("small", "dir/small") != 0);
+	unit_check(ufs_sync() == 0, "sync");
+	/* Unmaps the image, the files stay there. */
+	ufs_destroy();
+
+	unit_check(ufs_mount(path, 0) == 0, "mount existing image");
+	static char buf[sizeof(data)];
+	fd = ufs_open("big", 0);
+	unit_fail_if(fd == -1);
+	unit_check(ufs_read(fd, buf, sizeof(buf)) == sizeof(data) &&
+		   memcmp(buf, data, sizeof(data)) == 0, "big file is loaded");
+	int clone = ufs_open("clone", 0);
+	unit_fail_if(clone == -1);
+	unit_check(ufs_pread(clone, buf, sizeof(buf), 0) == sizeof(data) &&
+		   memcmp(buf + 1000, "XYZ", 3) == 0 &&
+		   memcmp(buf + 2000, data + 2000, sizeof(data) - 2000) == 0,
+		   "clone is loaded");
+	/* The clone still shares the untouched extents. */
+	unit_fail_if(ufs_pwrite(fd, "123", 3, sizeof(data) - 3) != 3);
+	unit_fail_if(ufs_pread(clone, buf, 3, sizeof(data) - 3) != 3);
+	unit_check(memcmp(buf, data + sizeof(data) - 3, 3) == 0,
+		   "shared extents are copied on write after load");
+	unit_fail_if(ufs_close(fd) != 0);
+	unit_fail_if(ufs_close(clone) != 0);
+	fd = ufs_open("small", 0);
+	unit_check(ufs_read(fd, buf, sizeof(buf)) == 5 &&
+		   memcmp(buf, "small", 5) == 0, "small file is loaded");
+	unit_fail_if(ufs_close(fd) != 0);
+	unit_check(ufs_open("deleted", 0) == -1, "deleted file is not loaded");
+	fd = ufs_open("dir/small", 0);
+	unit_check(ufs_read(fd, buf, sizeof(buf)) == 5 &&
+		   memcmp(buf, "small", 5) == 0, "file in directory is loaded");
+	unit_fail_if(ufs_close(fd) != 0);
+	unit_check(ufs_rmdir("dir/empty") == 0, "empty directory is loaded");
+	unit_fail_if(ufs_delete("dir/small") != 0);
+	unit_fail_if(ufs_rmdir("dir") != 0);
+	unit_fail_if(ufs_delete("big") != 0);
+	unit_fail_if(ufs_delete("small") != 0);
+	unit_fail_if(ufs_delete("clone") != 0);
+	ufs_destroy();
+
+	unit_check(ufs_mount(path, 0) == 0, "mount after deletion");
+	unit_check(ufs_open("big", 0) == -1, "the files are gone");
+	ufs_destroy();
+
+	FILE *f = fopen(path, "r+");
+	unit_fail_if(f == NULL);
+	fputs("garbage", f);
+	fclose(f);
+	unit_check(ufs_mount(path, 0) == -1 && ufs_errno() == UFS_ERR_BAD_IMAGE,
+		   "corrupted image is not mounted");
+	unlink(path);
+
+	unit_test_finish();
+}
+
+static void
+test_cache(void)
+{
+	unit_test_start();
+
+	const char *path = "userfs_test.img";
+	unlink(path);
+	struct ufs_cache_stats stats;
+	ufs_cache_stats(&stats);
+	unit_check(stats.resident == 0 && stats.readahead == 0,
+		   "no stats without an image");
+	ufs_cache_limit(2 * 1024 * 1024);
+	unit_fail_if(ufs_mount(path, 64 * 1024 * 1024) != 0);
+
+	static char data[8 * 1024 * 1024];
+	for (size_t i = 0; i < sizeof(data); ++i)
+		data[i] = 'a' + i % 23;
+	int fd = ufs_open("file", UFS_CREATE);
+	unit_fail_if(fd == -1);
+	for (size_t pos = 0; pos < sizeof(data); pos += 64 * 1024)
+		unit_fail_if(ufs_write(fd, data + pos, 64 * 1024) != 64 * 1024);
+	ufs_cache_stats(&stats);
+	unit_check(stats.dirty + stats.flushed > 0, "written data is dirty");
+	unit_check(ufs_sync() == 0, "sync");
+	ufs_cache_stats(&stats);
+	unit_check(stats.dirty == 0, "sync writes back everything");
+	unit_check(stats.resident <= 2 * 1024 * 1024 && stats.evicted > 0,
+		   "sync drops the chunks above the limit");
+
+	static char buf[64 * 1024];
+	bool is_equal = true;
+	unit_fail_if(ufs_seek(fd, 0, UFS_SEEK_SET) != 0);
+	for (size_t pos = 0; pos < sizeof(data); pos += sizeof(buf)) {
+		unit_fail_if(ufs_read(fd, buf, sizeof(buf)) != sizeof(buf));
+		is_equal = is_equal &&
+			   memcmp(buf, data + pos, sizeof(buf)) == 0;
+	}
+	unit_check(is_equal, "dropped data is read back");
+	ufs_cache_stats(&stats);
+	unit_check(stats.readahead >= sizeof(data) / 2,
+		   "sequential reads prefetch");
+	uint64_t readahead = stats.readahead;
+	for (size_t i = 0; i < 16; ++i) {
+		size_t pos = (i * 7919 % 128) * sizeof(buf);
+		unit_fail_if(ufs_pread(fd, buf, sizeof(buf), pos) !=
+			     sizeof(buf));
+	}
+	ufs_cache_stats(&stats);
+	unit_check(stats.readahead == readahead,
+		   "random reads don't prefetch");
+	unit_fail_if(ufs_close(fd) != 0);
+	ufs_cache_limit(0);
+	ufs_destroy();
+
+	unit_check(ufs_mount(path, 0) == 0, "mount after eviction");
+	fd = ufs_open("file", 0);
+	unit_fail_if(fd == -1);
+	static char all[sizeof(data)];
+	unit_check(ufs_read(fd, all, sizeof(all)) == sizeof(all) &&
+		   memcmp(all, data, sizeof(data)) == 0, "data is saved");
+	unit_fail_if(ufs_close(fd) != 0);
+	ufs_destroy();
+	unlink(path);
+
+	unit_test_finish();
+}
+
 int
 main(void)
 {
@@ -476,12 +1513,28 @@ main(void)
 
 	test_open();
 	test_close();
+	test_fd_reuse();
 	test_io();
 	test_delete();
 	test_stress_open();
+	test_stress_names();
 	test_max_file_size();
+	test_seek();
+	test_pool_stats();
+	test_delete_frees();
+	test_threads();
+	test_clone();
+	test_snapshot();
+	test_vectored();
+	test_read_view();
+	test_queue();
 	test_rights();
 	test_resize();
+	test_sparse();
+	test_dirs();
+	test_compact();
+	test_image();
+	test_cache();
 
 	/* Free the memory to make the memory leak detector happy. */
 	ufs_destroy();
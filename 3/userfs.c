@@ -1,68 +1,1163 @@
+#define _GNU_SOURCE
 #include "userfs.h"
+#include <assert.h>
+#include <pthread.h>
+#include <stdbool.h>
 #include <stddef.h>
+#include <stdint.h>
 #include <stdlib.h>
 #include <string.h>
-
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
 
 enum {
 	BLOCK_SIZE = 512,
 	MAX_FILE_SIZE = 1024 * 1024 * 100,
+	/**
+	 * Extents double in size starting from BLOCK_SIZE. After that many
+	 * doublings they stop growing.
+	 */
+	EXTENT_MAX_SHIFT = 11,
+	EXTENT_MAX_SIZE = BLOCK_SIZE << EXTENT_MAX_SHIFT,
+	/** Offset in a file where the extents of the max size begin. */
+	EXTENT_MAX_START = EXTENT_MAX_SIZE - BLOCK_SIZE,
+};
+
+/**
+ * Error code of the last failed call in this thread. Set from any function on
+ * any error.
+ */
+static __thread enum ufs_error_code ufs_error_code = UFS_ERR_NO_ERR;
+
+/**
+ * A file is an array of extents - contiguous chunks of memory. Extent i has
+ * size BLOCK_SIZE * 2^i until the size reaches EXTENT_MAX_SIZE. Small files
+ * waste little memory, big ones consist of few big chunks. The sizes do not
+ * depend on the content, so any offset is mapped to its extent with
+ * arithmetic, without walking anything.
+ */
+static inline size_t
+extent_size(uint32_t i)
+{
+	return (size_t)BLOCK_SIZE << (i < EXTENT_MAX_SHIFT ?
+				      i : EXTENT_MAX_SHIFT);
+}
+
+/** Offset in the file of the first byte of extent i. */
+static inline size_t
+extent_start(uint32_t i)
+{
+	if (i < EXTENT_MAX_SHIFT)
+		return (size_t)BLOCK_SIZE * ((1 << i) - 1);
+	return EXTENT_MAX_START + (size_t)(i - EXTENT_MAX_SHIFT) *
+	       EXTENT_MAX_SIZE;
+}
+
+/** Index of the extent containing the byte at @a pos. */
+static inline uint32_t
+extent_index(size_t pos)
+{
+	if (pos < EXTENT_MAX_START) {
+		/* Extent i covers [2^i - 1, 2^(i + 1) - 1) blocks. */
+		size_t block = pos / BLOCK_SIZE + 1;
+		return 63 - __builtin_clzll(block);
+	}
+	return EXTENT_MAX_SHIFT + (pos - EXTENT_MAX_START) / EXTENT_MAX_SIZE;
+}
+
+enum {
+	/** Chunk size of the pools of the structures. */
+	POOL_CHUNK_SIZE = 64 * 1024,
+	/** Names up to this size, with the terminating zero, use a pool. */
+	NAME_POOL_SIZE = 64,
+	EXTENT_CLASS_COUNT = EXTENT_MAX_SHIFT + 1,
+};
+
+/**
+ * Pool of objects of the same size. Objects are carved from big chunks one
+ * after another, and the freed ones are linked into a free list to be reused
+ * first. The chunks are never given back one by one, all of them are freed
+ * in ufs_destroy(). Hence the files and blocks being created and deleted all
+ * the time cost no malloc() at all.
+ */
+struct pool {
+	const char *name;
+	uint32_t obj_size;
+	uint32_t chunk_size;
+	/**
+	 * Take the chunks right from the system with mmap(). They are page
+	 * aligned, and big chunks don't fragment the heap.
+	 */
+	bool is_mmap;
+	/** Protects everything below. Taken for a few instructions only. */
+	pthread_mutex_t mutex;
+	/** Freed objects, linked via their first bytes. */
+	void *free_list;
+	/** Not used yet part of the last chunk. */
+	char *pos;
+	char *end;
+	/** All the chunks, to free them at once. */
+	void **chunks;
+	uint32_t chunk_count;
+	uint32_t chunk_capacity;
+	/** How many objects are in use. */
+	size_t used;
+};
+
+#define POOL_INITIALIZER(pool_name, size, chunk, mmap) {		\
+	.name = (pool_name),						\
+	.obj_size = (size),						\
+	.chunk_size = (chunk),						\
+	.is_mmap = (mmap),						\
+	.mutex = PTHREAD_MUTEX_INITIALIZER,				\
+}
+
+/**
+ * Image file the data lives in when it is persistent, see ufs_mount(). It
+ * consists of
+ * - the superblock, struct image_super;
+ * - the chunk map, a byte per chunk: 0 if the chunk is free, otherwise
+ *   1 + the extent class the chunk is split into;
+ * - two metadata areas, the active one has the saved file list, the other
+ *   one is for the next ufs_sync();
+ * - the chunks, EXTENT_MAX_SIZE each. The extent pools take their chunks
+ *   here instead of mmap().
+ *
+ * The kernel caches the pages of the image. Userfs tells it what to do with
+ * them by the chunks: the changed ones are written back in background in
+ * batches, the ones ahead of sequential reads are prefetched, and above the
+ * memory limit the least recently used ones are dropped, by CLOCK.
+ */
+struct image {
+	int fd;
+	char *base;
+	size_t size;
+	struct image_super *super;
+	uint8_t *chunk_map;
+	char *chunks;
+	uint64_t chunk_count;
+	/** Where to start looking for a free chunk. */
+	uint64_t chunk_hint;
+	/** Protects the chunk map. */
+	pthread_mutex_t mutex;
+	/** CHUNK_* bits of each chunk, changed atomically. */
+	uint8_t *chunk_state;
+	uint64_t dirty_count;
+	uint64_t resident_count;
+	/** Max resident chunks, 0 if no limit. */
+	uint64_t resident_limit;
+	/** Next chunk for the CLOCK eviction to look at. */
+	uint64_t clock_hand;
+	/** Serializes the write backs and the evictions. */
+	pthread_mutex_t cache_mutex;
+	/** Background writer, see image_flusher_f(). */
+	pthread_t flusher;
+	bool is_flusher_started;
+	/** Protects the flags below, the flusher sleeps on the cond. */
+	pthread_mutex_t flush_mutex;
+	pthread_cond_t flush_cond;
+	bool is_flush_wanted;
+	bool is_stopping;
+	/** Bytes for struct ufs_cache_stats. */
+	uint64_t flushed;
+	uint64_t flush_count;
+	uint64_t readahead;
+	uint64_t evicted;
+};
+
+enum {
+	IMAGE_PAGE_SIZE = 4096,
+	/** Changed since the last write back. */
+	CHUNK_DIRTY = 1 << 0,
+	/** Changed since the last ufs_sync(). */
+	CHUNK_UNSYNCED = 1 << 1,
+	/** Accessed since the CLOCK hand passed it. */
+	CHUNK_REFERENCED = 1 << 2,
+	/** Accessed since it was dropped, so it is in the memory likely. */
+	CHUNK_RESIDENT = 1 << 3,
+	/** That many dirty chunks wake the flusher before its timeout. */
+	IMAGE_FLUSH_BATCH = 16,
+	/** Seconds the flusher sleeps when there is nothing to do. */
+	IMAGE_FLUSH_INTERVAL = 1,
+	/** Readahead window of sequential reads grows between these. */
+	READAHEAD_MIN = 64 * 1024,
+	READAHEAD_MAX = 4 * EXTENT_MAX_SIZE,
+};
+
+static struct image image = {
+	.fd = -1,
+	.mutex = PTHREAD_MUTEX_INITIALIZER,
+	.cache_mutex = PTHREAD_MUTEX_INITIALIZER,
+	.flush_mutex = PTHREAD_MUTEX_INITIALIZER,
+	.flush_cond = PTHREAD_COND_INITIALIZER,
+};
+
+/** Take a free chunk of the image for the extent pool of class @a cls. */
+static char *
+image_chunk_alloc(uint32_t cls)
+{
+	pthread_mutex_lock(&image.mutex);
+	char *chunk = NULL;
+	for (uint64_t n = 0; n < image.chunk_count; ++n) {
+		uint64_t i = (image.chunk_hint + n) % image.chunk_count;
+		if (image.chunk_map[i] != 0)
+			continue;
+		image.chunk_map[i] = cls + 1;
+		image.chunk_hint = i + 1;
+		chunk = image.chunks + i * EXTENT_MAX_SIZE;
+		break;
+	}
+	pthread_mutex_unlock(&image.mutex);
+	return chunk;
+}
+
+static inline bool
+image_contains(const char *ptr)
+{
+	return image.base != NULL && ptr >= image.base &&
+	       ptr < image.base + image.size;
+}
+
+static void
+image_flusher_wake(void)
+{
+	pthread_mutex_lock(&image.flush_mutex);
+	image.is_flush_wanted = true;
+	pthread_cond_signal(&image.flush_cond);
+	pthread_mutex_unlock(&image.flush_mutex);
+}
+
+/**
+ * Mark the chunk of the extent data as used, and as changed for a write. Does
+ * nothing for the data out of the image. Must be called after the access, so
+ * as a write back which clears the marks sees the data.
+ */
+static inline void
+image_touch(const char *data, bool is_write)
+{
+	if (image.chunk_state == NULL || data < image.chunks ||
+	    data >= image.chunks + image.chunk_count * EXTENT_MAX_SIZE)
+		return;
+	uint8_t *state =
+		&image.chunk_state[(data - image.chunks) / EXTENT_MAX_SIZE];
+	uint8_t bits = CHUNK_REFERENCED | CHUNK_RESIDENT;
+	if (is_write)
+		bits |= CHUNK_DIRTY | CHUNK_UNSYNCED;
+	/* Mostly they are set already, the cache line stays shared then. */
+	if ((__atomic_load_n(state, __ATOMIC_RELAXED) & bits) == bits)
+		return;
+	uint8_t old = __atomic_fetch_or(state, bits, __ATOMIC_RELAXED);
+	bool is_wanted = false;
+	if ((old & CHUNK_RESIDENT) == 0) {
+		uint64_t limit = __atomic_load_n(&image.resident_limit,
+						 __ATOMIC_RELAXED);
+		uint64_t count = __atomic_add_fetch(&image.resident_count, 1,
+						    __ATOMIC_RELAXED);
+		is_wanted = limit != 0 && count > limit;
+	}
+	if ((bits & ~old & CHUNK_DIRTY) != 0) {
+		uint64_t count = __atomic_add_fetch(&image.dirty_count, 1,
+						    __ATOMIC_RELAXED);
+		is_wanted = is_wanted || count == IMAGE_FLUSH_BATCH;
+	}
+	if (is_wanted)
+		image_flusher_wake();
+}
+
+/**
+ * Add a chunk which is already split into objects. They are all used, the
+ * free ones have to be put with pool_free().
+ */
+static int
+pool_adopt_chunk(struct pool *p, char *chunk, size_t used)
+{
+	if (p->chunk_count == p->chunk_capacity) {
+		uint32_t capacity = p->chunk_capacity == 0 ?
+				    16 : p->chunk_capacity * 2;
+		void **chunks = realloc(p->chunks, capacity * sizeof(*chunks));
+		if (chunks == NULL)
+			return -1;
+		p->chunks = chunks;
+		p->chunk_capacity = capacity;
+	}
+	p->chunks[p->chunk_count++] = chunk;
+	p->used += used;
+	return 0;
+}
+
+static void *
+pool_alloc_locked(struct pool *p)
+{
+	void *obj = p->free_list;
+	if (obj != NULL) {
+		p->free_list = *(void **)obj;
+		++p->used;
+		return obj;
+	}
+	if (p->pos == p->end) {
+		char *chunk;
+		if (p->is_mmap && image.base != NULL) {
+			chunk = image_chunk_alloc(__builtin_ctz(p->obj_size /
+								BLOCK_SIZE));
+			if (chunk == NULL)
+				return NULL;
+		} else if (p->is_mmap) {
+			chunk = mmap(NULL, p->chunk_size,
+				     PROT_READ | PROT_WRITE,
+				     MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+			if (chunk == MAP_FAILED)
+				return NULL;
+		} else if ((chunk = malloc(p->chunk_size)) == NULL) {
+			return NULL;
+		}
+		if (pool_adopt_chunk(p, chunk, 0) != 0) {
+			if (!p->is_mmap)
+				free(chunk);
+			else if (!image_contains(chunk))
+				munmap(chunk, p->chunk_size);
+			return NULL;
+		}
+		p->pos = chunk;
+		p->end = chunk + p->chunk_size / p->obj_size * p->obj_size;
+	}
+	obj = p->pos;
+	p->pos += p->obj_size;
+	++p->used;
+	return obj;
+}
+
+static void *
+pool_alloc(struct pool *p)
+{
+	pthread_mutex_lock(&p->mutex);
+	void *obj = pool_alloc_locked(p);
+	pthread_mutex_unlock(&p->mutex);
+	return obj;
+}
+
+static void
+pool_free(struct pool *p, void *obj)
+{
+	pthread_mutex_lock(&p->mutex);
+	*(void **)obj = p->free_list;
+	p->free_list = obj;
+	--p->used;
+	pthread_mutex_unlock(&p->mutex);
+}
+
+/** Free all the chunks. The pool can be used again afterwards. */
+static void
+pool_destroy(struct pool *p)
+{
+	for (uint32_t i = 0; i < p->chunk_count; ++i) {
+		if (!p->is_mmap)
+			free(p->chunks[i]);
+		else if (!image_contains(p->chunks[i]))
+			munmap(p->chunks[i], p->chunk_size);
+	}
+	free(p->chunks);
+	p->chunks = NULL;
+	p->chunk_count = 0;
+	p->chunk_capacity = 0;
+	p->free_list = NULL;
+	p->pos = NULL;
+	p->end = NULL;
+	p->used = 0;
+}
+
+static void
+pool_stats(struct pool *p, struct ufs_pool_stats *stats)
+{
+	pthread_mutex_lock(&p->mutex);
+	stats->name = p->name;
+	stats->object_size = p->obj_size;
+	stats->used = p->used;
+	stats->chunk_count = p->chunk_count;
+	stats->reserved = (size_t)p->chunk_count * p->chunk_size;
+	pthread_mutex_unlock(&p->mutex);
+}
+
+#define EXTENT_POOL(i, pool_name)					\
+	POOL_INITIALIZER(pool_name, BLOCK_SIZE << (i), EXTENT_MAX_SIZE, true)
+
+/**
+ * Extents of each size have an own pool. Their chunks are EXTENT_MAX_SIZE,
+ * so the biggest extents are the chunks themselves.
+ */
+static struct pool extent_pools[EXTENT_CLASS_COUNT] = {
+	EXTENT_POOL(0, "extent_512"),
+	EXTENT_POOL(1, "extent_1K"),
+	EXTENT_POOL(2, "extent_2K"),
+	EXTENT_POOL(3, "extent_4K"),
+	EXTENT_POOL(4, "extent_8K"),
+	EXTENT_POOL(5, "extent_16K"),
+	EXTENT_POOL(6, "extent_32K"),
+	EXTENT_POOL(7, "extent_64K"),
+	EXTENT_POOL(8, "extent_128K"),
+	EXTENT_POOL(9, "extent_256K"),
+	EXTENT_POOL(10, "extent_512K"),
+	EXTENT_POOL(11, "extent_1M"),
+};
+
+static inline char *
+extent_alloc(uint32_t i)
+{
+	return pool_alloc(&extent_pools[i < EXTENT_MAX_SHIFT ?
+					i : EXTENT_MAX_SHIFT]);
+}
+
+static inline void
+extent_free(uint32_t i, char *extent)
+{
+	pool_free(&extent_pools[i < EXTENT_MAX_SHIFT ? i : EXTENT_MAX_SHIFT],
+		  extent);
+}
+
+/**
+ * Extents can be shared by several files after ufs_clone() and
+ * ufs_snapshot(). A file marks its shared extents with the lowest bit of the
+ * pointer - the extents are at least BLOCK_SIZE aligned. The count of the
+ * owners is kept aside, in a hash table with an entry per extent with 2 or
+ * more owners. When a write comes into a marked extent, the file checks the
+ * owners: if others are still there, the extent is copied first, otherwise
+ * the file got it back for itself and just drops the mark.
+ */
+enum {
+	EXTENT_SHARED = 1,
+	/**
+	 * The pointer is a struct packed_extent, the extent is compressed.
+	 * They are shared the same way as the plain ones.
+	 */
+	EXTENT_PACKED = 2,
+	EXTENT_FLAGS = EXTENT_SHARED | EXTENT_PACKED,
+};
+
+static inline bool
+extent_is_shared(const char *extent)
+{
+	return ((uintptr_t)extent & EXTENT_SHARED) != 0;
+}
+
+static inline bool
+extent_is_packed(const char *extent)
+{
+	return ((uintptr_t)extent & EXTENT_PACKED) != 0;
+}
+
+static inline char *
+extent_data(char *extent)
+{
+	return (char *)((uintptr_t)extent & ~(uintptr_t)EXTENT_FLAGS);
+}
+
+/** A compressed extent, see ufs_compact(). */
+struct packed_extent {
+	/**
+	 * Bytes of the extent it keeps. The rest of the extent was past the
+	 * file end, it is garbage.
+	 */
+	uint32_t len;
+	/** Size of the compressed data. */
+	uint32_t size;
+	char data[];
+};
+
+/** Totals of the packed extents, for ufs_space_stats(). */
+static uint64_t packed_count = 0;
+static uint64_t packed_bytes = 0;
+/** Extents merged with equal ones by the compactions. */
+static uint64_t dedup_count = 0;
+
+static void
+packed_delete(struct packed_extent *p)
+{
+	__atomic_sub_fetch(&packed_count, 1, __ATOMIC_RELAXED);
+	__atomic_sub_fetch(&packed_bytes, sizeof(*p) + p->size,
+			   __ATOMIC_RELAXED);
+	free(p);
+}
+
+/** Free the extent @a i, plain or packed, regardless of the owners. */
+static void
+extent_destroy(uint32_t i, char *extent)
+{
+	if (extent_is_packed(extent))
+		packed_delete((struct packed_extent *)extent_data(extent));
+	else
+		extent_free(i, extent_data(extent));
+}
+
+struct extent_ref {
+	char *data;
+	uint32_t refs;
+};
+
+/** Open addressing with linear probing, the capacity is a power of 2. */
+static struct extent_ref *extent_refs = NULL;
+static uint32_t extent_ref_count = 0;
+static uint32_t extent_ref_capacity = 0;
+static pthread_mutex_t extent_refs_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+static inline uint32_t
+extent_ref_home(const char *data)
+{
+	/* Fibonacci hashing, the low bits of the address are zeros. */
+	uint64_t h = (uintptr_t)data / BLOCK_SIZE * 0x9E3779B97F4A7C15ull;
+	return (h >> 32) & (extent_ref_capacity - 1);
+}
+
+static inline uint32_t
+extent_ref_slot(const char *data)
+{
+	uint32_t mask = extent_ref_capacity - 1;
+	uint32_t i = extent_ref_home(data);
+	while (extent_refs[i].data != NULL && extent_refs[i].data != data)
+		i = (i + 1) & mask;
+	return i;
+}
+
+/**
+ * Make room for @a count more shared extents, so as the following
+ * extent_ref_inc() calls can't fail. The mutex must be locked.
+ */
+static int
+extent_refs_reserve(uint32_t count)
+{
+	uint32_t capacity = extent_ref_capacity == 0 ? 64 : extent_ref_capacity;
+	while ((extent_ref_count + count) * 2 > capacity)
+		capacity *= 2;
+	if (capacity == extent_ref_capacity)
+		return 0;
+	struct extent_ref *refs = calloc(capacity, sizeof(*refs));
+	if (refs == NULL)
+		return -1;
+	struct extent_ref *old = extent_refs;
+	uint32_t old_capacity = extent_ref_capacity;
+	extent_refs = refs;
+	extent_ref_capacity = capacity;
+	for (uint32_t i = 0; i < old_capacity; ++i) {
+		if (old[i].data != NULL)
+			extent_refs[extent_ref_slot(old[i].data)] = old[i];
+	}
+	free(old);
+	return 0;
+}
+
+/** Add an owner to the extent. The room must be reserved. */
+static void
+extent_ref_inc(char *data)
+{
+	struct extent_ref *ref = &extent_refs[extent_ref_slot(data)];
+	if (ref->data == NULL) {
+		ref->data = data;
+		/* The first owner had no entry. */
+		ref->refs = 1;
+		++extent_ref_count;
+	}
+	++ref->refs;
+}
+
+/**
+ * Remove an owner of the extent.
+ * @retval true It was the last owner, the extent can be freed.
+ */
+static bool
+extent_ref_dec(char *data)
+{
+	pthread_mutex_lock(&extent_refs_mutex);
+	if (extent_ref_count == 0) {
+		pthread_mutex_unlock(&extent_refs_mutex);
+		return true;
+	}
+	uint32_t hole = extent_ref_slot(data);
+	struct extent_ref *ref = &extent_refs[hole];
+	if (ref->data == NULL) {
+		pthread_mutex_unlock(&extent_refs_mutex);
+		return true;
+	}
+	if (--ref->refs > 1) {
+		pthread_mutex_unlock(&extent_refs_mutex);
+		return false;
+	}
+	/* One owner left, it doesn't need an entry. Backward shift delete. */
+	uint32_t mask = extent_ref_capacity - 1;
+	for (uint32_t i = (hole + 1) & mask; extent_refs[i].data != NULL;
+	     i = (i + 1) & mask) {
+		uint32_t home = extent_ref_home(extent_refs[i].data);
+		if (((i - home) & mask) >= ((i - hole) & mask)) {
+			extent_refs[hole] = extent_refs[i];
+			hole = i;
+		}
+	}
+	extent_refs[hole].data = NULL;
+	--extent_ref_count;
+	pthread_mutex_unlock(&extent_refs_mutex);
+	return false;
+}
+
+/** Whether anybody else owns the extent too. */
+static bool
+extent_ref_is_shared(char *data)
+{
+	pthread_mutex_lock(&extent_refs_mutex);
+	bool rc = extent_ref_count != 0 &&
+		  extent_refs[extent_ref_slot(data)].data != NULL;
+	pthread_mutex_unlock(&extent_refs_mutex);
+	return rc;
+}
+
+/** Drop the file's ownership of extent @a i. */
+static void
+extent_release(uint32_t i, char *extent)
+{
+	if (extent_is_shared(extent) && !extent_ref_dec(extent_data(extent)))
+		return;
+	extent_destroy(i, extent);
+}
+
+enum {
+	/** Shorter matches are not worth their offset. */
+	LZ_MIN_MATCH = 4,
+	LZ_MAX_OFFSET = 65535,
+	LZ_HASH_BITS = 12,
+	/** A run of the length bytes continues after that value. */
+	LZ_LENGTH_MORE = 255,
+	/** Token nibble value which means the length continues. */
+	LZ_NIBBLE_MORE = 15,
+};
+
+static inline uint32_t
+lz_hash(const unsigned char *pos)
+{
+	uint32_t v;
+	memcpy(&v, pos, sizeof(v));
+	return (v * 2654435761u) >> (32 - LZ_HASH_BITS);
+}
+
+static unsigned char *
+lz_put_length(unsigned char *out, const unsigned char *end, size_t len)
+{
+	for (; len >= LZ_LENGTH_MORE; len -= LZ_LENGTH_MORE) {
+		if (out == end)
+			return NULL;
+		*out++ = LZ_LENGTH_MORE;
+	}
+	if (out == end)
+		return NULL;
+	*out++ = len;
+	return out;
+}
+
+/**
+ * Append a sequence: the literals and then a match of @a match_len bytes
+ * @a offset bytes back. The last sequence has no match.
+ * @retval NULL No room.
+ */
+static unsigned char *
+lz_put_sequence(unsigned char *out, const unsigned char *end,
+		const unsigned char *lit, size_t lit_len, size_t offset,
+		size_t match_len)
+{
+	size_t len = match_len == 0 ? 0 : match_len - LZ_MIN_MATCH;
+	if (out == end)
+		return NULL;
+	unsigned char *token = out++;
+	*token = (lit_len < LZ_NIBBLE_MORE ? lit_len : LZ_NIBBLE_MORE) << 4 |
+		 (len < LZ_NIBBLE_MORE ? len : LZ_NIBBLE_MORE);
+	if (lit_len >= LZ_NIBBLE_MORE &&
+	    (out = lz_put_length(out, end, lit_len - LZ_NIBBLE_MORE)) == NULL)
+		return NULL;
+	if ((size_t)(end - out) < lit_len)
+		return NULL;
+	memcpy(out, lit, lit_len);
+	out += lit_len;
+	if (match_len == 0)
+		return out;
+	if (end - out < 2)
+		return NULL;
+	*out++ = offset & 0xff;
+	*out++ = offset >> 8;
+	if (len >= LZ_NIBBLE_MORE)
+		out = lz_put_length(out, end, len - LZ_NIBBLE_MORE);
+	return out;
+}
+
+/**
+ * Compress with LZ77, in the format of LZ4 blocks: sequences of a token with
+ * the literal and match lengths, the literals, and a 2 byte offset of the
+ * match. The matches are found greedily via a hash table of 4 byte prefixes.
+ * Long runs without matches are skipped faster and faster.
+ * @retval > 0 Compressed size.
+ * @retval 0 It does not fit into @a cap bytes.
+ */
+static size_t
+lz_compress(const char *src, size_t size, char *dst, size_t cap)
+{
+	uint32_t table[1 << LZ_HASH_BITS];
+	memset(table, 0, sizeof(table));
+	const unsigned char *in = (const unsigned char *)src;
+	unsigned char *out = (unsigned char *)dst;
+	const unsigned char *end = out + cap;
+	size_t anchor = 0;
+	size_t pos = 0;
+	while (pos + LZ_MIN_MATCH <= size) {
+		uint32_t h = lz_hash(in + pos);
+		/* Positions are stored + 1, 0 is empty. */
+		size_t match = table[h];
+		table[h] = pos + 1;
+		if (match == 0 || pos - (match - 1) > LZ_MAX_OFFSET ||
+		    memcmp(in + match - 1, in + pos, LZ_MIN_MATCH) != 0) {
+			pos += 1 + ((pos - anchor) >> 6);
+			continue;
+		}
+		--match;
+		size_t len = LZ_MIN_MATCH;
+		while (pos + len < size && in[match + len] == in[pos + len])
+			++len;
+		out = lz_put_sequence(out, end, in + anchor, pos - anchor,
+				      pos - match, len);
+		if (out == NULL)
+			return 0;
+		pos += len;
+		anchor = pos;
+	}
+	out = lz_put_sequence(out, end, in + anchor, size - anchor, 0, 0);
+	return out == NULL ? 0 : out - (unsigned char *)dst;
+}
+
+static bool
+lz_get_length(const unsigned char **in, const unsigned char *end,
+	      size_t *len)
+{
+	unsigned char byte;
+	do {
+		if (*in == end)
+			return false;
+		byte = *(*in)++;
+		*len += byte;
+	} while (byte == LZ_LENGTH_MORE);
+	return true;
+}
+
+/**
+ * Decompress the output of lz_compress().
+ * @retval Decompressed size, 0 if the data is broken or too big.
+ */
+static size_t
+lz_decompress(const char *src, size_t size, char *dst, size_t cap)
+{
+	const unsigned char *in = (const unsigned char *)src;
+	const unsigned char *in_end = in + size;
+	unsigned char *out = (unsigned char *)dst;
+	unsigned char *out_end = out + cap;
+	while (in < in_end) {
+		unsigned token = *in++;
+		size_t lit = token >> 4;
+		if (lit == LZ_NIBBLE_MORE && !lz_get_length(&in, in_end, &lit))
+			return 0;
+		if (lit > (size_t)(in_end - in) ||
+		    lit > (size_t)(out_end - out))
+			return 0;
+		memcpy(out, in, lit);
+		in += lit;
+		out += lit;
+		if (in == in_end)
+			break;
+		if (in_end - in < 2)
+			return 0;
+		size_t offset = in[0] | in[1] << 8;
+		in += 2;
+		size_t len = token & 0xf;
+		if (len == LZ_NIBBLE_MORE && !lz_get_length(&in, in_end, &len))
+			return 0;
+		len += LZ_MIN_MATCH;
+		if (offset == 0 || len > (size_t)(out_end - out) ||
+		    offset > (size_t)(out - (unsigned char *)dst))
+			return 0;
+		const unsigned char *from = out - offset;
+		if (offset >= len) {
+			memcpy(out, from, len);
+			out += len;
+			continue;
+		}
+		/* Overlapped, it repeats the last offset bytes. */
+		while (len-- > 0)
+			*out++ = *from++;
+	}
+	return out - (unsigned char *)dst;
+}
+
+/**
+ * Make a packed extent of the compressed data.
+ * @retval Tagged extent pointer, NULL on no memory.
+ */
+static char *
+packed_new(const char *data, uint32_t size, uint32_t len)
+{
+	struct packed_extent *p = malloc(sizeof(*p) + size);
+	if (p == NULL)
+		return NULL;
+	p->len = len;
+	p->size = size;
+	memcpy(p->data, data, size);
+	__atomic_add_fetch(&packed_count, 1, __ATOMIC_RELAXED);
+	__atomic_add_fetch(&packed_bytes, sizeof(*p) + size, __ATOMIC_RELAXED);
+	return (char *)((uintptr_t)p | EXTENT_PACKED);
+}
+
+/** Decompress the packed extent into @a buf of the extent size. */
+static void
+packed_read(const char *extent, char *buf, size_t size)
+{
+	const struct packed_extent *p =
+		(const struct packed_extent *)extent_data((char *)extent);
+	size_t len = lz_decompress(p->data, p->size, buf, size);
+	assert(len == p->len);
+	(void)len;
+}
+
+/**
+ * Epoch based reclamation. The descriptor table, the descriptors and the
+ * files are used by the threads without locks on the paths from a descriptor
+ * number to the file. When one of them is unlinked from everywhere, it is
+ * not freed right away but retired: stamped with a new global epoch and put
+ * into a list. Each thread publishes the global epoch it has seen when it
+ * starts an operation. A retired object is freed when all the threads being
+ * inside of operations have started after it was retired - nobody can see it
+ * anymore.
+ */
+struct retired {
+	struct retired *next;
+	/** Global epoch when the object was retired. */
+	uint64_t epoch;
+	void (*destroy)(struct retired *r);
+};
+
+/**
+ * A thread using userfs. It is written on each call, so it is padded to a
+ * cache line not to share one with the other threads.
+ */
+struct epoch_reader {
+	/** Epoch seen at the operation start, 0 outside of operations. */
+	uint64_t epoch;
+	struct epoch_reader *next;
+	/** The thread is gone, another one can take the reader. */
+	bool is_free;
+	char padding[64 - sizeof(uint64_t) - sizeof(void *) - sizeof(bool)];
+};
+
+enum {
+	/** Retired objects are reclaimed in batches of that many. */
+	EPOCH_RECLAIM_BATCH = 64,
 };
 
-/** Global error code. Set from any function on any error. */
-static enum ufs_error_code ufs_error_code = UFS_ERR_NO_ERR;
+static uint64_t epoch_global = 1;
+/** Protects the lists below. Readers are only added, until ufs_destroy(). */
+static pthread_mutex_t epoch_mutex = PTHREAD_MUTEX_INITIALIZER;
+static struct epoch_reader *epoch_readers = NULL;
+static struct retired *epoch_retired = NULL;
+static uint32_t epoch_retired_count = 0;
+/** Operations in the threads which failed to get a reader. */
+static uint32_t epoch_anonymous_count = 0;
+/** Incremented by ufs_destroy() to invalidate the readers of the threads. */
+static uint32_t epoch_generation = 0;
+static pthread_key_t epoch_key;
+static pthread_once_t epoch_key_once = PTHREAD_ONCE_INIT;
+static __thread struct epoch_reader *epoch_self = NULL;
+static __thread uint32_t epoch_self_generation = 0;
+
+static void
+epoch_thread_exit(void *arg)
+{
+	(void)arg;
+	pthread_mutex_lock(&epoch_mutex);
+	if (epoch_self != NULL && epoch_self_generation == epoch_generation)
+		epoch_self->is_free = true;
+	pthread_mutex_unlock(&epoch_mutex);
+	epoch_self = NULL;
+}
+
+static void
+epoch_key_create(void)
+{
+	pthread_key_create(&epoch_key, epoch_thread_exit);
+}
+
+/**
+ * Get a reader for the current thread. On no memory the thread goes without
+ * one, and nothing is reclaimed during its operations.
+ */
+static struct epoch_reader *
+epoch_register(void)
+{
+	pthread_once(&epoch_key_once, epoch_key_create);
+	pthread_mutex_lock(&epoch_mutex);
+	struct epoch_reader *r = epoch_readers;
+	while (r != NULL && !r->is_free)
+		r = r->next;
+	if (r == NULL) {
+		r = malloc(sizeof(*r));
+		if (r != NULL) {
+			r->next = epoch_readers;
+			epoch_readers = r;
+		}
+	}
+	if (r != NULL) {
+		r->epoch = 0;
+		r->is_free = false;
+	}
+	epoch_self = r;
+	epoch_self_generation = epoch_generation;
+	pthread_mutex_unlock(&epoch_mutex);
+	pthread_setspecific(epoch_key, r);
+	return r;
+}
+
+/** Start an operation. Retired objects seen after it live until its end. */
+static inline void
+epoch_enter(void)
+{
+	struct epoch_reader *r = epoch_self;
+	if (r == NULL || epoch_self_generation !=
+	    __atomic_load_n(&epoch_generation, __ATOMIC_RELAXED))
+		r = epoch_register();
+	if (r == NULL) {
+		__atomic_add_fetch(&epoch_anonymous_count, 1, __ATOMIC_SEQ_CST);
+		return;
+	}
+	__atomic_store_n(&r->epoch, __atomic_load_n(&epoch_global,
+						    __ATOMIC_RELAXED),
+			 __ATOMIC_RELAXED);
+	/* The epoch must be visible before anything is read. */
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+}
+
+static inline void
+epoch_exit(void)
+{
+	if (epoch_self == NULL) {
+		__atomic_sub_fetch(&epoch_anonymous_count, 1, __ATOMIC_RELEASE);
+		return;
+	}
+	__atomic_store_n(&epoch_self->epoch, 0, __ATOMIC_RELEASE);
+}
+
+/** Free the retired objects which nobody can see anymore. */
+static void
+epoch_reclaim_locked(void)
+{
+	if (__atomic_load_n(&epoch_anonymous_count, __ATOMIC_SEQ_CST) != 0)
+		return;
+	uint64_t min = UINT64_MAX;
+	for (struct epoch_reader *r = epoch_readers; r != NULL; r = r->next) {
+		uint64_t epoch = __atomic_load_n(&r->epoch, __ATOMIC_SEQ_CST);
+		if (epoch != 0 && epoch < min)
+			min = epoch;
+	}
+	struct retired **prev = &epoch_retired;
+	for (struct retired *r = *prev; r != NULL; r = *prev) {
+		if (r->epoch <= min) {
+			*prev = r->next;
+			--epoch_retired_count;
+			r->destroy(r);
+		} else {
+			prev = &r->next;
+		}
+	}
+}
+
+/**
+ * Free the object when nobody can see it. It must be unlinked from all the
+ * shared structures already.
+ */
+static void
+epoch_retire(struct retired *r, void (*destroy)(struct retired *r))
+{
+	r->destroy = destroy;
+	pthread_mutex_lock(&epoch_mutex);
+	r->epoch = __atomic_add_fetch(&epoch_global, 1, __ATOMIC_SEQ_CST);
+	r->next = epoch_retired;
+	epoch_retired = r;
+	if (++epoch_retired_count >= EPOCH_RECLAIM_BATCH)
+		epoch_reclaim_locked();
+	pthread_mutex_unlock(&epoch_mutex);
+}
+
+struct dir;
 
-struct block {
-	/** Block memory. */
-	char *memory;
-	/** How many bytes are occupied. */
-	int occupied;
-	/** Next block in the file. */
-	struct block *next;
-	/** Previous block in the file. */
-	struct block *prev;
+/**
+ * An entry of a directory: a file or a subdirectory. The namespace is a tree
+ * of them.
+ */
+struct dentry {
+	/** Name in the parent directory, without slashes. */
+	char *name;
+	uint32_t name_len;
+	/** Hash of the name, saved for rehashing and quick comparisons. */
+	uint32_t hash;
+	/** NULL for the root and for the entries not linked anywhere. */
+	struct dir *parent;
+	bool is_dir;
+	/** Slot of the path cache which can have the entry. */
+	uint32_t cache_slot;
+};
 
-	/* PUT HERE OTHER MEMBERS */
+/**
+ * A directory. The entries are in an open addressing hash table with linear
+ * probing, its capacity is a power of 2. So a lookup or a listing touches
+ * only the directory itself, whatever is in the others.
+ */
+struct dir {
+	struct dentry dentry;
+	struct dentry **entries;
+	uint32_t entry_count;
+	uint32_t entry_capacity;
 };
 
 struct file {
-	/** Double-linked list of file blocks. */
-	struct block *block_list;
+	/** Extents of the file, see extent_size(). */
+	char **extents;
+	/** How many extents are allocated. */
+	uint32_t extent_count;
+	uint32_t extent_capacity;
+	/** How many of them are packed, see ufs_compact(). */
+	uint32_t packed_count;
+	/** Read or written since the last compaction. */
+	bool is_hot;
+	/** File size in bytes. */
+	size_t size;
+	/**
+	 * Incremented on each shrink. Descriptors which haven't seen the
+	 * latest one can be beyond the end and have to move to it.
+	 */
+	uint32_t shrink_count;
 	/**
-	 * Last block in the list above for fast access to the end
-	 * of file.
+	 * How many file descriptors are opened on the file. Incremented
+	 * atomically under the read lock of the namespace, decremented under
+	 * the file lock.
 	 */
-	struct block *last_block;
-	/** How many file descriptors are opened on the file. */
 	int refs;
-	/** File name. */
-	char *name;
-	/** Files are stored in a double-linked list. */
-	struct file *next;
-	struct file *prev;
+	struct dentry dentry;
+	/**
+	 * The file is deleted but still has opened descriptors. It is not in
+	 * any directory anymore, and is freed on the last close.
+	 */
+	bool is_deleted;
+	/**
+	 * Protects the content, the size and the deletion flag. Reads of the
+	 * file go in parallel, writes and resizes are exclusive.
+	 */
+	pthread_rwlock_t lock;
+	struct retired retired;
+};
+
+static struct pool file_pool =
+	POOL_INITIALIZER("file", sizeof(struct file), POOL_CHUNK_SIZE, false);
+
+static struct pool name_pool =
+	POOL_INITIALIZER("name", NAME_POOL_SIZE, POOL_CHUNK_SIZE, false);
 
-	/* PUT HERE OTHER MEMBERS */
+/**
+ * The whole tree is protected by one lock. Lookups take it as readers,
+ * creation, deletion and renames - as writers.
+ */
+static struct dir root_dir = {.dentry = {.is_dir = true}};
+static pthread_rwlock_t namespace_lock = PTHREAD_RWLOCK_INITIALIZER;
+
+enum {
+	/** Slots of the path cache, a power of 2. */
+	PATH_CACHE_SIZE = 4096,
 };
 
-/** List of all files. */
-static struct file *file_list = NULL;
+/**
+ * Cache of the resolved nested paths, like the dentry cache of the kernels:
+ * a path is hashed as a whole and found in one step instead of a lookup per
+ * directory. It is direct-mapped, a new entry evicts the old one from its
+ * slot. A hit is checked against the tree, so a collision is harmless, but a
+ * cached entry must stay valid memory: it is evicted when unlinked, and the
+ * whole cache is cleared when a directory moves and so all the paths under it
+ * change. The readers of the namespace fill it, hence the atomics.
+ */
+static struct dentry *path_cache[PATH_CACHE_SIZE];
 
 struct filedesc {
 	struct file *file;
+	/** Protects the position. */
+	pthread_mutex_t mutex;
+	/**
+	 * Position in the file. The extent is found from it in O(1), see
+	 * extent_index(), so it is all a descriptor needs to keep.
+	 */
 	size_t pos;
+	/** File's shrink_count when the position was valid last time. */
+	uint32_t shrink_count;
+	/**
+	 * Readahead of an image: where the next sequential read starts, where
+	 * the prefetched data ends, and how much was prefetched last time.
+	 * Accessed atomically, the reads at offsets don't lock the
+	 * descriptor.
+	 */
+	size_t ra_next;
+	size_t ra_end;
+	size_t ra_window;
+	struct retired retired;
+};
 
-	/* PUT HERE OTHER MEMBERS */
+enum {
+	/** Descriptors per bitmap word. */
+	FD_WORD_BITS = 64,
+	/** Descriptors per summary word, each bit is a full bitmap word. */
+	FD_SUMMARY_BITS = FD_WORD_BITS * FD_WORD_BITS,
+	FD_MIN_CAPACITY = FD_WORD_BITS,
 };
 
+static struct pool filedesc_pool =
+	POOL_INITIALIZER("filedesc", sizeof(struct filedesc), POOL_CHUNK_SIZE,
+			 false);
+
 /**
  * An array of file descriptors. When a file descriptor is
  * created, its pointer drops here. When a file descriptor is
  * closed, its place in this array is set to NULL and can be
  * taken by next ufs_open() call.
+ *
+ * The lowest free descriptor is found via two levels of bitmaps:
+ * a bit per descriptor which is busy, and a bit per each full word of
+ * the first level. So the search checks only one bit per 4096
+ * descriptors. The capacity is a power of 2, at least
+ * FD_MIN_CAPACITY. When most of the descriptors are closed, the table
+ * shrinks.
+ *
+ * The operations on descriptors find them in the table without locks. The
+ * table is replaced on resize as a whole, and the old one is retired, see
+ * struct retired. Opening, closing and resizing are serialized by fd_mutex.
  */
-static struct filedesc **file_descriptors = NULL;
+struct fd_table {
+	int capacity;
+	struct retired retired;
+	struct filedesc *descs[];
+};
+
+static struct fd_table *fd_table = NULL;
+static pthread_mutex_t fd_mutex = PTHREAD_MUTEX_INITIALIZER;
 static int file_descriptor_count = 0;
-static int file_descriptor_capacity = 0;
+/** Busy descriptors. */
+static uint64_t *fd_busy = NULL;
+/** Full words of fd_busy. */
+static uint64_t *fd_full = NULL;
+/**
+ * The table is checked for shrinking when the count of descriptors drops
+ * to this. A failed check lowers it, so as the check is not repeated on
+ * each close.
+ */
+static int fd_shrink_count = 0;
+
+#define container_of(ptr, type, member)					\
+	((type *)((char *)(ptr) - offsetof(type, member)))
 
 enum ufs_error_code
 ufs_errno()
@@ -70,310 +1165,3162 @@ ufs_errno()
 	return ufs_error_code;
 }
 
-int ufs_open(const char *filename, int flags) {
-    struct file *current_file = file_list;
-
-    while (current_file != NULL) {
-        if (strcmp(current_file->name, filename) == 0) {
-            break;
-        }
-        current_file = current_file->next;
-    }
-
-    if (current_file == NULL && !(flags & UFS_CREATE)) {
-        ufs_error_code = UFS_ERR_NO_FILE;
-        return -1;
-    }
-
-    if (current_file == NULL) {
-        current_file = (struct file *)malloc(sizeof(struct file));
-        if (current_file == NULL) {
-            ufs_error_code = UFS_ERR_NO_MEM;
-            return -1;
-        }
-        current_file->name = strdup(filename);
-
-        if (current_file->name == NULL) {
-            free(current_file);
-            ufs_error_code = UFS_ERR_NO_MEM;
-            return -1;
-        }
-
-        current_file->block_list = NULL;
-        current_file->last_block = NULL;
-        current_file->refs = 0;
-        current_file->next = file_list;
-        current_file->prev = NULL;
-
-        if (file_list != NULL) {
-            file_list->prev = current_file;
-        }
-
-        file_list = current_file;
-    }
-
-    current_file->refs++;
-
-    struct filedesc *fdesc = (struct filedesc *)malloc(sizeof(struct filedesc));
-    if (fdesc == NULL) {
-        ufs_error_code = UFS_ERR_NO_MEM;
-        return -1;
-    }
-    fdesc->file = current_file;
-
-    if (file_descriptor_count == file_descriptor_capacity) {
-        int new_capacity = file_descriptor_capacity == 0 ? 1 : file_descriptor_capacity * 2;
-        struct filedesc **new_fds = (struct filedesc **)realloc(file_descriptors, new_capacity * sizeof(struct filedesc *));
-        if (new_fds == NULL) {
-            free(fdesc);
-            ufs_error_code = UFS_ERR_NO_MEM;
-            return -1;
-        }
-        file_descriptors = new_fds;
-        file_descriptor_capacity = new_capacity;
-    }
-
-    int fd;
-    for (fd = 0; fd < file_descriptor_capacity; fd++) {
-        if (file_descriptors[fd] == NULL) {
-            file_descriptors[fd] = fdesc;
-            break;
-        }
-    }
-
-    if (fd == file_descriptor_capacity) {
-        free(fdesc);
-        ufs_error_code = UFS_ERR_NO_MEM;
-        return -1;
-    }
-
-    file_descriptor_count++;
-    return fd;
-}
-
-ssize_t ufs_write(int fd, const char *buf, size_t size) {
-   if (fd < 0 || fd >= file_descriptor_capacity || file_descriptors[fd] == NULL) {
-        ufs_error_code = UFS_ERR_NO_FILE;
-        return -1;
-    }
-
-    struct filedesc *fdesc = file_descriptors[fd];
-    struct file *file = fdesc->file;
-
-    size_t written = 0;
-    while (size > 0) {
-        if (file->last_block == NULL || file->last_block->occupied == BLOCK_SIZE) {
-            if (file->last_block != NULL && file->last_block->occupied == BLOCK_SIZE) {
-                if (MAX_FILE_SIZE - written < BLOCK_SIZE) {
-                    break;
-                }
-            }
-
-            struct block *new_block = (struct block *)malloc(sizeof(struct block));
-            if (new_block == NULL) {
-                ufs_error_code = UFS_ERR_NO_MEM;
-                return -1;
-            }
-            new_block->memory = (char *)malloc(BLOCK_SIZE);
-            if (new_block->memory == NULL) {
-                free(new_block);
-                ufs_error_code = UFS_ERR_NO_MEM;
-                return -1;
-            }
-            new_block->occupied = 0;
-            new_block->next = NULL;
-            new_block->prev = file->last_block;
-
-            if (file->last_block != NULL) {
-                file->last_block->next = new_block;
-            } else {
-                file->block_list = new_block;
-            }
-
-            file->last_block = new_block;
-        }
-
-        size_t space_in_block = BLOCK_SIZE - file->last_block->occupied;
-        size_t to_write = size < space_in_block ? size : space_in_block;
-        memcpy(file->last_block->memory + file->last_block->occupied, buf, to_write);
-
-        file->last_block->occupied += to_write;
-        buf += to_write;
-        size -= to_write;
-        written += to_write;
-    }
-
-    return written;
-}
-
-ssize_t ufs_read(int fd, char *buf, size_t size) {
-		if (fd < 0 || fd >= file_descriptor_capacity || file_descriptors[fd] == NULL) {
-		    ufs_error_code = UFS_ERR_NO_FILE;
-		    return -1;
-		}
-
-    struct filedesc *fdesc = file_descriptors[fd];
-    struct file *file = fdesc->file;
-
-    if (file == NULL) {
-        ufs_error_code = UFS_ERR_NO_FILE;
-        return -1;
-    }
-
-    size_t read_bytes = 0;
-    struct block *current_block = file->block_list;
-
-    while (size > 0 && current_block != NULL) {
-        size_t block_data_left = current_block->occupied - fdesc->pos % BLOCK_SIZE;
-        size_t to_read = size < block_data_left ? size : block_data_left;
-        memcpy(buf, current_block->memory + (fdesc->pos % BLOCK_SIZE), to_read);
-
-        buf += to_read;
-        size -= to_read;
-        read_bytes += to_read;
-        fdesc->pos += to_read;
-
-        if (to_read == block_data_left) {
-            current_block = current_block->next;
-            fdesc->pos = 0;
-        }
-
-        if (current_block == NULL || to_read == 0) {
-            break;
-        }
-    }
-
-    return read_bytes;
-}
-
-int ufs_close(int fd) {
-    if (fd < 0 || fd >= file_descriptor_capacity || file_descriptors[fd] == NULL) {
-        ufs_error_code = UFS_ERR_NO_FILE;
-        return -1;
-    }
-
-    struct filedesc *fdesc = file_descriptors[fd];
-
-    free(fdesc);
-    file_descriptors[fd] = NULL;
-
-    return 0;
-}
-
-int ufs_delete(const char *filename) {
-		struct file **pp = &file_list;
-    while (*pp && strcmp((*pp)->name, filename) != 0) {
-        pp = &(*pp)->next;
-    }
-
-    if (*pp == NULL) {
-        ufs_error_code = UFS_ERR_NO_FILE;
-        return -1;
-    }
-
-    struct file *to_delete = *pp;
-    if (to_delete->refs == 0) {
-        *pp = to_delete->next;
-
-        free(to_delete->name);
-        free(to_delete);
-    }
-
-    return 0;
-}
-
-void ufs_destroy(void) {
-    while (file_list) {
-        struct file *current = file_list;
-        file_list = file_list->next;
-
-        free(current->name);
-        free(current);
-    }
-
-    for (int i = 0; i < file_descriptor_capacity; ++i) {
-        if (file_descriptors[i]) {
-            free(file_descriptors[i]);
-        }
-    }
-    free(file_descriptors);
-    file_descriptors = NULL;
-    file_descriptor_capacity = 0;
-    file_descriptor_count = 0;
-}
-
-
-int ufs_resize(int fd, size_t new_size) {
-    if (fd < 0 || fd >= file_descriptor_capacity || file_descriptors[fd] == NULL) {
-        ufs_error_code = UFS_ERR_NO_FILE;
-        return -1;
-    }
-
-    struct filedesc *fdesc = file_descriptors[fd];
-    struct file *file = fdesc->file;
-    size_t current_size = 0;
-    struct block *block = file->block_list;
-    struct block *last_block = NULL;
-
-    while (block != NULL) {
-        current_size += block->occupied;
-        last_block = block;
-        block = block->next;
-    }
-
-    if (new_size > current_size) {
-        size_t additional_size = new_size - current_size;
-        while (additional_size > 0) {
-            struct block *new_block = (struct block *)malloc(sizeof(struct block));
-            if (new_block == NULL) {
-                ufs_error_code = UFS_ERR_NO_MEM;
-                return -1;
-            }
-
-            new_block->memory = (char *)malloc(BLOCK_SIZE);
-            if (new_block->memory == NULL) {
-                free(new_block);
-                ufs_error_code = UFS_ERR_NO_MEM;
-                return -1;
-            }
-
-            size_t block_fill = additional_size < BLOCK_SIZE ? additional_size : BLOCK_SIZE;
-            memset(new_block->memory, 0, block_fill);
-            new_block->occupied = block_fill;
-            new_block->next = NULL;
-            new_block->prev = last_block;
-
-            if (last_block != NULL) {
-                last_block->next = new_block;
-            } else {
-                file->block_list = new_block;
-            }
-
-            file->last_block = new_block;
-            last_block = new_block;
-
-            additional_size -= block_fill;
-        }
-    } else if (new_size < current_size) {
-        size_t remaining_size = new_size;
-        block = file->block_list;
-        while (block != NULL && remaining_size >= BLOCK_SIZE) {
-            remaining_size -= block->occupied;
-            block = block->next;
-        }
-
-        while (block != NULL) {
-            struct block *next_block = block->next;
-            free(block->memory);
-            free(block);
-            block = next_block;
-        }
-
-        if (last_block != NULL) {
-            last_block->next = NULL;
-        }
-        file->last_block = last_block;
-    }
-
-    return 0;
+static uint32_t
+name_hash(const char *name, size_t len)
+{
+	/* FNV-1a. */
+	uint32_t h = 2166136261u;
+	for (size_t i = 0; i < len; ++i)
+		h = (h ^ (unsigned char)name[i]) * 16777619u;
+	return h;
+}
+
+static char *
+name_new(const char *name, uint32_t len)
+{
+	char *res;
+	if (len < NAME_POOL_SIZE)
+		res = pool_alloc(&name_pool);
+	else
+		res = malloc(len + 1);
+	if (res == NULL)
+		return NULL;
+	memcpy(res, name, len);
+	res[len] = 0;
+	return res;
+}
+
+static void
+name_delete(char *name, uint32_t len)
+{
+	if (len < NAME_POOL_SIZE)
+		pool_free(&name_pool, name);
+	else
+		free(name);
+}
+
+static int
+dentry_create(struct dentry *d, const char *name, uint32_t len,
+	      uint32_t hash, bool is_dir)
+{
+	d->name = name_new(name, len);
+	if (d->name == NULL)
+		return -1;
+	d->name_len = len;
+	d->hash = hash;
+	d->parent = NULL;
+	d->is_dir = is_dir;
+	d->cache_slot = 0;
+	return 0;
+}
+
+static inline struct dir *
+dentry_dir(struct dentry *d)
+{
+	assert(d->is_dir);
+	return container_of(d, struct dir, dentry);
+}
+
+static inline struct file *
+dentry_file(struct dentry *d)
+{
+	assert(!d->is_dir);
+	return container_of(d, struct file, dentry);
+}
+
+static void
+path_cache_evict(struct dentry *d)
+{
+	uint32_t slot = __atomic_load_n(&d->cache_slot, __ATOMIC_RELAXED);
+	if (__atomic_load_n(&path_cache[slot], __ATOMIC_RELAXED) == d)
+		__atomic_store_n(&path_cache[slot], NULL, __ATOMIC_RELAXED);
+}
+
+/** Drop all the cached paths. The namespace must be write-locked. */
+static void
+path_cache_clear(void)
+{
+	memset(path_cache, 0, sizeof(path_cache));
+}
+
+/** Slot of the entry with the name, or of the free slot to put it to. */
+static uint32_t
+dir_slot(const struct dir *dir, const char *name, uint32_t len, uint32_t hash)
+{
+	uint32_t mask = dir->entry_capacity - 1;
+	uint32_t i = hash & mask;
+	for (struct dentry *d; (d = dir->entries[i]) != NULL;
+	     i = (i + 1) & mask) {
+		if (d->hash == hash && d->name_len == len &&
+		    memcmp(d->name, name, len) == 0)
+			break;
+	}
+	return i;
+}
+
+static struct dentry *
+dir_find(const struct dir *dir, const char *name, uint32_t len, uint32_t hash)
+{
+	if (dir->entry_count == 0)
+		return NULL;
+	return dir->entries[dir_slot(dir, name, len, hash)];
+}
+
+static int
+dir_grow(struct dir *dir)
+{
+	uint32_t capacity = dir->entry_capacity == 0 ?
+			    8 : dir->entry_capacity * 2;
+	struct dentry **entries = calloc(capacity, sizeof(*entries));
+	if (entries == NULL)
+		return -1;
+	for (uint32_t i = 0; i < dir->entry_capacity; ++i) {
+		struct dentry *d = dir->entries[i];
+		if (d == NULL)
+			continue;
+		uint32_t j = d->hash & (capacity - 1);
+		while (entries[j] != NULL)
+			j = (j + 1) & (capacity - 1);
+		entries[j] = d;
+	}
+	free(dir->entries);
+	dir->entries = entries;
+	dir->entry_capacity = capacity;
+	return 0;
+}
+
+/**
+ * Make room in the directory for @a count more entries. The namespace must
+ * be write-locked.
+ */
+static int
+dir_reserve(struct dir *dir, uint32_t count)
+{
+	/* Keep the load factor under 1/2 so as the probes are short. */
+	while ((dir->entry_count + count) * 2 > dir->entry_capacity) {
+		if (dir_grow(dir) != 0)
+			return -1;
+	}
+	return 0;
+}
+
+/** Add the entry to the directory. The room must be reserved. */
+static void
+dir_link(struct dir *dir, struct dentry *d)
+{
+	assert(d->parent == NULL);
+	dir->entries[dir_slot(dir, d->name, d->name_len, d->hash)] = d;
+	++dir->entry_count;
+	d->parent = dir;
+}
+
+/**
+ * Remove the entry from its directory. It can't be found by path anymore.
+ * The namespace must be write-locked.
+ */
+static void
+dir_unlink(struct dentry *d)
+{
+	struct dir *dir = d->parent;
+	uint32_t mask = dir->entry_capacity - 1;
+	uint32_t hole = dir_slot(dir, d->name, d->name_len, d->hash);
+	assert(dir->entries[hole] == d);
+	/*
+	 * Backward shift deletion: move the following entries of the same
+	 * probe chain into the hole, so as lookups need no tombstones.
+	 */
+	for (uint32_t i = (hole + 1) & mask; dir->entries[i] != NULL;
+	     i = (i + 1) & mask) {
+		uint32_t home = dir->entries[i]->hash & mask;
+		if (((i - home) & mask) >= ((i - hole) & mask)) {
+			dir->entries[hole] = dir->entries[i];
+			hole = i;
+		}
+	}
+	dir->entries[hole] = NULL;
+	--dir->entry_count;
+	d->parent = NULL;
+	path_cache_evict(d);
+}
+
+/** Create a directory not linked anywhere. */
+static struct dir *
+dir_create(const char *name, uint32_t len, uint32_t hash)
+{
+	struct dir *dir = calloc(1, sizeof(*dir));
+	if (dir == NULL)
+		return NULL;
+	if (dentry_create(&dir->dentry, name, len, hash, true) != 0) {
+		free(dir);
+		return NULL;
+	}
+	return dir;
+}
+
+/** Free an empty directory. */
+static void
+dir_delete(struct dir *dir)
+{
+	assert(dir->entry_count == 0);
+	free(dir->entries);
+	name_delete(dir->dentry.name, dir->dentry.name_len);
+	free(dir);
+}
+
+/**
+ * Create a directory in @a parent. The namespace must be write-locked.
+ */
+static struct dir *
+dir_new(struct dir *parent, const char *name, uint32_t len, uint32_t hash)
+{
+	if (dir_reserve(parent, 1) != 0)
+		return NULL;
+	struct dir *dir = dir_create(name, len, hash);
+	if (dir != NULL)
+		dir_link(parent, &dir->dentry);
+	return dir;
+}
+
+/**
+ * Remove everything from the directory. The subdirectories are freed, the
+ * files are given to @a drop.
+ */
+static void
+dir_clear(struct dir *dir, void (*drop)(struct file *f))
+{
+	for (uint32_t i = 0; i < dir->entry_capacity; ++i) {
+		struct dentry *d = dir->entries[i];
+		if (d == NULL)
+			continue;
+		d->parent = NULL;
+		if (d->is_dir) {
+			struct dir *sub = dentry_dir(d);
+			dir_clear(sub, drop);
+			dir_delete(sub);
+		} else {
+			drop(dentry_file(d));
+		}
+	}
+	free(dir->entries);
+	dir->entries = NULL;
+	dir->entry_count = 0;
+	dir->entry_capacity = 0;
+}
+
+/**
+ * Find the directory at the path, with the missing ones created, like
+ * mkdir -p. The namespace must be write-locked.
+ * @retval NULL A component is empty or is a file, or no memory.
+ */
+static struct dir *
+dir_make_path(const char *path, size_t len)
+{
+	struct dir *dir = &root_dir;
+	const char *end = path + len;
+	while (path < end) {
+		const char *slash = memchr(path, '/', end - path);
+		uint32_t name_len = (slash == NULL ? end : slash) - path;
+		if (name_len == 0)
+			return NULL;
+		uint32_t hash = name_hash(path, name_len);
+		struct dentry *d = dir_find(dir, path, name_len, hash);
+		if (d == NULL) {
+			struct dir *sub = dir_new(dir, path, name_len, hash);
+			if (sub == NULL)
+				return NULL;
+			d = &sub->dentry;
+		} else if (!d->is_dir) {
+			return NULL;
+		}
+		dir = dentry_dir(d);
+		path += name_len + 1;
+	}
+	return dir;
+}
+
+/** Check if the entry is at the path. */
+static bool
+dentry_is_at(const struct dentry *d, const char *path, size_t len)
+{
+	const char *end = path + len;
+	while (d->parent != NULL) {
+		if ((size_t)(end - path) < d->name_len ||
+		    memcmp(end - d->name_len, d->name, d->name_len) != 0)
+			return false;
+		end -= d->name_len;
+		d = &d->parent->dentry;
+		if (d == &root_dir.dentry)
+			return end == path;
+		if (end == path || *--end != '/')
+			return false;
+	}
+	return false;
+}
+
+/** Result of a path lookup. */
+struct path {
+	/** Directory of the last component. NULL for the root. */
+	struct dir *parent;
+	/** The last component. */
+	const char *name;
+	uint32_t len;
+	uint32_t hash;
+	/** Entry of the last component. NULL if there is none. */
+	struct dentry *dentry;
+};
+
+/**
+ * Find the entry at the path, or the directory where to create it. The
+ * namespace must be locked.
+ * @retval 0 Success. The entry can be absent.
+ * @retval -1 Error, the code is set.
+ */
+static int
+path_lookup(const char *path, struct path *res)
+{
+	memset(res, 0, sizeof(*res));
+	if (*path == '/')
+		++path;
+	if (*path == 0) {
+		res->dentry = &root_dir.dentry;
+		return 0;
+	}
+	size_t len = strlen(path);
+	uint32_t hash = name_hash(path, len);
+	struct dir *dir = &root_dir;
+	const char *name = path;
+	const char *slash = memchr(path, '/', len);
+	uint32_t slot = hash & (PATH_CACHE_SIZE - 1);
+	if (slash != NULL) {
+		struct dentry *d = __atomic_load_n(&path_cache[slot],
+						   __ATOMIC_RELAXED);
+		if (d != NULL && dentry_is_at(d, path, len)) {
+			res->parent = d->parent;
+			res->name = path + len - d->name_len;
+			res->len = d->name_len;
+			res->hash = d->hash;
+			res->dentry = d;
+			return 0;
+		}
+	}
+	for (; slash != NULL; slash = strchr(name, '/')) {
+		uint32_t name_len = slash - name;
+		if (name_len == 0)
+			goto invalid;
+		struct dentry *d = dir_find(dir, name, name_len,
+					    name_hash(name, name_len));
+		if (d == NULL) {
+			ufs_error_code = UFS_ERR_NO_FILE;
+			return -1;
+		}
+		if (!d->is_dir) {
+			ufs_error_code = UFS_ERR_NOT_DIR;
+			return -1;
+		}
+		dir = dentry_dir(d);
+		name = slash + 1;
+	}
+	res->parent = dir;
+	res->name = name;
+	res->len = path + len - name;
+	if (res->len == 0)
+		goto invalid;
+	/* Without slashes the path hash is the name hash. */
+	res->hash = name == path ? hash : name_hash(name, res->len);
+	res->dentry = dir_find(dir, name, res->len, res->hash);
+	if (name != path && res->dentry != NULL) {
+		__atomic_store_n(&res->dentry->cache_slot, slot,
+				 __ATOMIC_RELAXED);
+		__atomic_store_n(&path_cache[slot], res->dentry,
+				 __ATOMIC_RELAXED);
+	}
+	return 0;
+invalid:
+	ufs_error_code = UFS_ERR_INVALID_ARG;
+	return -1;
+}
+
+/** Create a file not linked anywhere. */
+static struct file *
+file_create(const char *name, uint32_t len, uint32_t hash)
+{
+	struct file *f = pool_alloc(&file_pool);
+	if (f == NULL)
+		return NULL;
+	memset(f, 0, sizeof(*f));
+	if (dentry_create(&f->dentry, name, len, hash, false) != 0) {
+		pool_free(&file_pool, f);
+		return NULL;
+	}
+	pthread_rwlock_init(&f->lock, NULL);
+	return f;
+}
+
+/** Create a file in @a dir. The namespace must be write-locked. */
+static struct file *
+file_new(struct dir *dir, const char *name, uint32_t len, uint32_t hash)
+{
+	if (dir_reserve(dir, 1) != 0)
+		return NULL;
+	struct file *f = file_create(name, len, hash);
+	if (f != NULL)
+		dir_link(dir, &f->dentry);
+	return f;
+}
+
+/** Free the extents starting from @a first. */
+static void
+file_drop_extents(struct file *f, uint32_t first)
+{
+	for (uint32_t i = first; i < f->extent_count; ++i) {
+		if (f->extents[i] == NULL)
+			continue;
+		if (extent_is_packed(f->extents[i]))
+			--f->packed_count;
+		extent_release(i, f->extents[i]);
+	}
+	if (first < f->extent_count)
+		f->extent_count = first;
+}
+
+static void
+file_delete(struct file *f)
+{
+	file_drop_extents(f, 0);
+	free(f->extents);
+	name_delete(f->dentry.name, f->dentry.name_len);
+	pthread_rwlock_destroy(&f->lock);
+	pool_free(&file_pool, f);
+}
+
+/**
+ * Free the data of a deleted file without descriptors. Nothing reaches the
+ * extents but via a descriptor under the file lock, so they go right away
+ * and only the struct waits for the epoch. An operation racing with the
+ * last close sees an empty file. The file must be write-locked.
+ */
+static void
+file_drop_data(struct file *f)
+{
+	file_drop_extents(f, 0);
+	free(f->extents);
+	f->extents = NULL;
+	f->extent_capacity = 0;
+	if (f->size > 0)
+		++f->shrink_count;
+	f->size = 0;
+}
+
+static void
+file_retired_delete(struct retired *r)
+{
+	file_delete(container_of(r, struct file, retired));
+}
+
+/**
+ * Drop a reference of a descriptor. The file is freed if it is deleted and
+ * it was the last one.
+ */
+static void
+file_unref(struct file *f)
+{
+	pthread_rwlock_wrlock(&f->lock);
+	bool is_dead = __atomic_sub_fetch(&f->refs, 1, __ATOMIC_RELAXED) == 0 &&
+		       f->is_deleted;
+	if (is_dead)
+		file_drop_data(f);
+	pthread_rwlock_unlock(&f->lock);
+	if (is_dead)
+		epoch_retire(&f->retired, file_retired_delete);
+}
+
+/**
+ * Free the file unlinked from its directory, or let the last descriptor do
+ * it.
+ */
+static void
+file_orphan(struct file *f)
+{
+	/* Nobody can open it anymore, the refs only go down. */
+	pthread_rwlock_wrlock(&f->lock);
+	f->is_deleted = true;
+	bool is_dead = __atomic_load_n(&f->refs, __ATOMIC_RELAXED) == 0;
+	if (is_dead)
+		file_drop_data(f);
+	pthread_rwlock_unlock(&f->lock);
+	if (is_dead)
+		epoch_retire(&f->retired, file_retired_delete);
+}
+
+/**
+ * Make the extent array cover the first @a size bytes of the file. The new
+ * extents are holes - NULL, they read as zeros and take no memory until
+ * written, see file_own().
+ * @retval 0 Success.
+ * @retval -1 No memory.
+ */
+static int
+file_cover(struct file *f, size_t size)
+{
+	if (size == 0)
+		return 0;
+	uint32_t count = extent_index(size - 1) + 1;
+	if (count <= f->extent_count)
+		return 0;
+	if (count > f->extent_capacity) {
+		uint32_t capacity = f->extent_capacity * 2;
+		if (capacity < count)
+			capacity = count;
+		char **extents = realloc(f->extents,
+					 capacity * sizeof(*extents));
+		if (extents == NULL)
+			return -1;
+		f->extents = extents;
+		f->extent_capacity = capacity;
+	}
+	memset(f->extents + f->extent_count, 0,
+	       (count - f->extent_count) * sizeof(*f->extents));
+	f->extent_count = count;
+	return 0;
+}
+
+/** Number of extents covering a file of the given size. */
+static inline uint32_t
+file_extent_count(size_t size)
+{
+	return size == 0 ? 0 : extent_index(size - 1) + 1;
+}
+
+/**
+ * Copy data between the file and a buffer, extent by extent. The range must
+ * be inside of the extent array, and owned by the file for a write.
+ */
+static void
+file_copy(struct file *f, size_t pos, char *buf, size_t size, bool is_write)
+{
+	uint32_t i = extent_index(pos);
+	size_t offset = pos - extent_start(i);
+	while (size > 0) {
+		size_t len = extent_size(i) - offset;
+		if (len > size)
+			len = size;
+		char *extent = f->extents[i];
+		/* The reads unpack the extents first, file_lock_read(). */
+		assert(!extent_is_packed(extent));
+		if (extent == NULL) {
+			assert(!is_write);
+			memset(buf, 0, len);
+		} else if (is_write) {
+			memcpy(extent_data(extent) + offset, buf, len);
+			image_touch(extent_data(extent), true);
+		} else {
+			memcpy(buf, extent_data(extent) + offset, len);
+			image_touch(extent_data(extent), false);
+		}
+		buf += len;
+		size -= len;
+		offset = 0;
+		++i;
+	}
+}
+
+/** Mark the file as used, so as ufs_compact() leaves it alone. */
+static inline void
+file_touch(struct file *f)
+{
+	if (!__atomic_load_n(&f->is_hot, __ATOMIC_RELAXED))
+		__atomic_store_n(&f->is_hot, true, __ATOMIC_RELAXED);
+}
+
+/**
+ * Replace the packed extent @a i with a plain one, owned by the file only.
+ * Does nothing for a plain extent. The file must be write-locked.
+ * @retval 0 Success.
+ * @retval -1 No memory.
+ */
+static int
+file_unpack(struct file *f, uint32_t i)
+{
+	char *extent = f->extents[i];
+	if (!extent_is_packed(extent))
+		return 0;
+	char *data = extent_alloc(i);
+	if (data == NULL)
+		return -1;
+	packed_read(extent, data, extent_size(i));
+	extent_release(i, extent);
+	f->extents[i] = data;
+	--f->packed_count;
+	return 0;
+}
+
+/**
+ * Unpack the extents with the data of [pos, pos + size). The file must be
+ * write-locked.
+ */
+static int
+file_unpack_range(struct file *f, size_t pos, size_t size)
+{
+	if (f->packed_count == 0 || pos >= f->size || size == 0)
+		return 0;
+	size_t end = size > f->size - pos ? f->size : pos + size;
+	uint32_t last = extent_index(end - 1);
+	for (uint32_t i = extent_index(pos); i <= last; ++i) {
+		if (file_unpack(f, i) != 0)
+			return -1;
+	}
+	return 0;
+}
+
+/**
+ * Lock the file to read [pos, pos + size). When there are packed extents in
+ * the range, it is the write lock and they are unpacked. So the reads only
+ * copy, and the file being read stays plain until it is cold again.
+ * @retval 0 Success, the file is locked.
+ * @retval -1 No memory, the file is not locked.
+ */
+static int
+file_lock_read(struct file *f, size_t pos, size_t size)
+{
+	pthread_rwlock_rdlock(&f->lock);
+	if (f->packed_count == 0)
+		return 0;
+	pthread_rwlock_unlock(&f->lock);
+	pthread_rwlock_wrlock(&f->lock);
+	if (file_unpack_range(f, pos, size) != 0) {
+		pthread_rwlock_unlock(&f->lock);
+		ufs_error_code = UFS_ERR_NO_MEM;
+		return -1;
+	}
+	return 0;
+}
+
+/**
+ * Make the extents covering [pos, end) owned by the file only, so as they can
+ * be written. The holes get memory, the shared extents are copied. The range
+ * must be inside of the extent array, and the file must be write-locked.
+ * @retval 0 Success.
+ * @retval -1 No memory.
+ */
+static int
+file_own(struct file *f, size_t pos, size_t end)
+{
+	if (pos >= end)
+		return 0;
+	uint32_t last = extent_index(end - 1);
+	for (uint32_t i = extent_index(pos); i <= last; ++i) {
+		if (file_unpack(f, i) != 0)
+			return -1;
+		char *extent = f->extents[i];
+		if (extent == NULL) {
+			char *data = extent_alloc(i);
+			if (data == NULL)
+				return -1;
+			/*
+			 * The range is going to be written. Around it the hole
+			 * has to stay zeros, but only up to the file end.
+			 */
+			size_t start = extent_start(i);
+			size_t stop = start + extent_size(i);
+			if (stop > f->size)
+				stop = f->size;
+			if (pos > start)
+				memset(data, 0, pos - start);
+			if (end < stop)
+				memset(data + (end - start), 0, stop - end);
+			f->extents[i] = data;
+			continue;
+		}
+		if (!extent_is_shared(extent))
+			continue;
+		char *data = extent_data(extent);
+		if (extent_ref_is_shared(data)) {
+			char *copy = extent_alloc(i);
+			if (copy == NULL)
+				return -1;
+			/* The owners never write it, it is safe to read. */
+			memcpy(copy, data, extent_size(i));
+			if (extent_ref_dec(data))
+				extent_free(i, data);
+			data = copy;
+		}
+		f->extents[i] = data;
+	}
+	return 0;
+}
+
+/**
+ * Zero the bytes after the file end in its last extent, before the file
+ * grows to @a new_size. The extents can keep garbage there. The other
+ * extents past the end are holes, they are zeros already.
+ */
+static int
+file_zero_tail(struct file *f, size_t new_size)
+{
+	uint32_t i = extent_index(f->size);
+	if (i >= f->extent_count || f->extents[i] == NULL)
+		return 0;
+	size_t start = extent_start(i);
+	size_t end = start + extent_size(i);
+	if (end > new_size)
+		end = new_size;
+	if (file_own(f, f->size, end) != 0)
+		return -1;
+	memset(f->extents[i] + (f->size - start), 0, end - f->size);
+	image_touch(f->extents[i], true);
+	return 0;
+}
+
+/** Write into the file. It must be write-locked. */
+static ssize_t
+file_write(struct file *f, size_t pos, const char *buf, size_t size)
+{
+	if (pos > MAX_FILE_SIZE || size > MAX_FILE_SIZE - pos) {
+		ufs_error_code = UFS_ERR_NO_MEM;
+		return -1;
+	}
+	if (size == 0)
+		return 0;
+	file_touch(f);
+	size_t end = pos + size;
+	if (file_cover(f, end) != 0 ||
+	    (pos > f->size && file_zero_tail(f, pos) != 0) ||
+	    file_own(f, pos, end) != 0) {
+		/* Nothing past the end is kept, the holes are zeros. */
+		file_drop_extents(f, file_extent_count(f->size));
+		ufs_error_code = UFS_ERR_NO_MEM;
+		return -1;
+	}
+	file_copy(f, pos, (char *)buf, size, true);
+	if (end > f->size)
+		f->size = end;
+	return size;
+}
+
+/** Read from the file. It must be locked at least for reading. */
+static ssize_t
+file_read(struct file *f, size_t pos, char *buf, size_t size)
+{
+	if (pos >= f->size)
+		return 0;
+	if (size > f->size - pos)
+		size = f->size - pos;
+	file_touch(f);
+	file_copy(f, pos, buf, size, false);
+	return size;
+}
+
+/**
+ * Make @a dst have the same content as @a src, sharing all the extents. The
+ * old content of @a dst is dropped, its descriptors see the new one.
+ * @retval 0 Success.
+ * @retval -1 No memory, nothing is changed.
+ */
+static int
+file_clone(struct file *dst, struct file *src)
+{
+	assert(dst != src);
+	/* Lock in the same order everywhere. */
+	struct file *first = dst < src ? dst : src;
+	struct file *second = dst < src ? src : dst;
+	pthread_rwlock_wrlock(&first->lock);
+	pthread_rwlock_wrlock(&second->lock);
+	int rc = -1;
+	uint32_t count = src->extent_count;
+	char **extents = NULL;
+	if (count > 0 && (extents = malloc(count * sizeof(*extents))) == NULL)
+		goto out;
+	pthread_mutex_lock(&extent_refs_mutex);
+	if (extent_refs_reserve(count) != 0) {
+		pthread_mutex_unlock(&extent_refs_mutex);
+		free(extents);
+		goto out;
+	}
+	for (uint32_t i = 0; i < count; ++i) {
+		char *data = extent_data(src->extents[i]);
+		if (data != NULL) {
+			extent_ref_inc(data);
+			src->extents[i] = (char *)((uintptr_t)src->extents[i] |
+						   EXTENT_SHARED);
+		}
+		extents[i] = src->extents[i];
+	}
+	pthread_mutex_unlock(&extent_refs_mutex);
+	file_drop_extents(dst, 0);
+	free(dst->extents);
+	dst->packed_count = src->packed_count;
+	dst->extents = extents;
+	dst->extent_count = count;
+	dst->extent_capacity = count;
+	if (dst->size > src->size)
+		++dst->shrink_count;
+	dst->size = src->size;
+	rc = 0;
+out:
+	pthread_rwlock_unlock(&second->lock);
+	pthread_rwlock_unlock(&first->lock);
+	return rc;
+}
+
+/**
+ * Find the descriptor. Its memory is valid until epoch_exit(), even if it is
+ * closed concurrently.
+ */
+static struct filedesc *
+filedesc_get(int fd)
+{
+	struct fd_table *t = __atomic_load_n(&fd_table, __ATOMIC_ACQUIRE);
+	struct filedesc *desc = NULL;
+	if (t != NULL && fd >= 0 && fd < t->capacity)
+		desc = __atomic_load_n(&t->descs[fd], __ATOMIC_ACQUIRE);
+	if (desc == NULL)
+		ufs_error_code = UFS_ERR_NO_FILE;
+	return desc;
+}
+
+/**
+ * Move the position to the file end if the file was truncated via another
+ * descriptor. The descriptor and the file must be locked.
+ */
+static void
+filedesc_sync(struct filedesc *desc)
+{
+	struct file *f = desc->file;
+	if (desc->shrink_count != f->shrink_count) {
+		if (desc->pos > f->size)
+			desc->pos = f->size;
+		desc->shrink_count = f->shrink_count;
+	}
+}
+
+/**
+ * Ask the kernel to read the image data of [start, end) of the file in
+ * background. The file must be locked.
+ */
+static void
+image_prefetch(struct file *f, size_t start, size_t end)
+{
+	const size_t page_mask = IMAGE_PAGE_SIZE - 1;
+	uint32_t last = extent_index(end - 1);
+	for (uint32_t i = extent_index(start); i <= last; ++i) {
+		char *data = extent_data(f->extents[i]);
+		if (data == NULL || !image_contains(data))
+			continue;
+		size_t from = extent_start(i);
+		size_t to = from + extent_size(i);
+		char *pos = data + (start > from ? start - from : 0);
+		char *stop = data + (end < to ? end - from : to - from);
+		uintptr_t page = (uintptr_t)pos & ~page_mask;
+		madvise((void *)page, stop - (char *)page, MADV_WILLNEED);
+		image_touch(data, false);
+		__atomic_add_fetch(&image.readahead, stop - pos,
+				   __ATOMIC_RELAXED);
+	}
+}
+
+/**
+ * Prefetch the image data ahead of the sequential reads via the descriptor.
+ * The window doubles on each prefetch, up to READAHEAD_MAX, and the next one
+ * is started when the reads get into the second half of the previous one,
+ * so as the data is in the memory before it is read. A read not where the
+ * previous one ended resets the window. The file must be locked.
+ */
+static void
+filedesc_readahead(struct filedesc *desc, size_t pos, ssize_t size)
+{
+	if (image.base == NULL || size <= 0)
+		return;
+	struct file *f = desc->file;
+	size_t end = pos + size;
+	size_t next = __atomic_exchange_n(&desc->ra_next, end,
+					  __ATOMIC_RELAXED);
+	size_t ra_end = __atomic_load_n(&desc->ra_end, __ATOMIC_RELAXED);
+	size_t window = __atomic_load_n(&desc->ra_window, __ATOMIC_RELAXED);
+	if (pos != next) {
+		if (window != 0) {
+			__atomic_store_n(&desc->ra_window, 0, __ATOMIC_RELAXED);
+			__atomic_store_n(&desc->ra_end, 0, __ATOMIC_RELAXED);
+		}
+		return;
+	}
+	if ((ra_end > end && ra_end - end > window / 2) || end >= f->size)
+		return;
+	window = window == 0 ? READAHEAD_MIN : window * 2;
+	if (window > READAHEAD_MAX)
+		window = READAHEAD_MAX;
+	size_t start = ra_end > end ? ra_end : end;
+	size_t stop = f->size - start > window ? start + window : f->size;
+	if (start < stop)
+		image_prefetch(f, start, stop);
+	__atomic_store_n(&desc->ra_window, window, __ATOMIC_RELAXED);
+	__atomic_store_n(&desc->ra_end, stop, __ATOMIC_RELAXED);
+}
+
+/**
+ * The descriptor operations behind ufs_write(), ufs_read(), ufs_pwrite() and
+ * ufs_pread(). The caller is inside an epoch and has found the descriptor, so
+ * a batch of operations on one descriptor does it once.
+ */
+static ssize_t
+filedesc_write(struct filedesc *desc, const char *buf, size_t size)
+{
+	struct file *f = desc->file;
+	pthread_mutex_lock(&desc->mutex);
+	pthread_rwlock_wrlock(&f->lock);
+	filedesc_sync(desc);
+	ssize_t rc = file_write(f, desc->pos, buf, size);
+	pthread_rwlock_unlock(&f->lock);
+	if (rc > 0)
+		desc->pos += rc;
+	pthread_mutex_unlock(&desc->mutex);
+	return rc;
+}
+
+static ssize_t
+filedesc_read(struct filedesc *desc, char *buf, size_t size)
+{
+	struct file *f = desc->file;
+	ssize_t rc = -1;
+	pthread_mutex_lock(&desc->mutex);
+	if (file_lock_read(f, desc->pos, size) == 0) {
+		filedesc_sync(desc);
+		rc = file_read(f, desc->pos, buf, size);
+		filedesc_readahead(desc, desc->pos, rc);
+		pthread_rwlock_unlock(&f->lock);
+		desc->pos += rc;
+	}
+	pthread_mutex_unlock(&desc->mutex);
+	return rc;
+}
+
+static ssize_t
+filedesc_pwrite(struct filedesc *desc, const char *buf, size_t size,
+		size_t offset)
+{
+	struct file *f = desc->file;
+	pthread_rwlock_wrlock(&f->lock);
+	ssize_t rc = file_write(f, offset, buf, size);
+	pthread_rwlock_unlock(&f->lock);
+	return rc;
+}
+
+static ssize_t
+filedesc_pread(struct filedesc *desc, char *buf, size_t size, size_t offset)
+{
+	struct file *f = desc->file;
+	ssize_t rc = -1;
+	if (file_lock_read(f, offset, size) == 0) {
+		rc = file_read(f, offset, buf, size);
+		filedesc_readahead(desc, offset, rc);
+		pthread_rwlock_unlock(&f->lock);
+	}
+	return rc;
+}
+
+static void
+filedesc_retired_delete(struct retired *r)
+{
+	struct filedesc *desc = container_of(r, struct filedesc, retired);
+	pthread_mutex_destroy(&desc->mutex);
+	pool_free(&filedesc_pool, desc);
+}
+
+static inline uint32_t
+fd_map_size(int capacity, int bits)
+{
+	return (capacity + bits - 1) / bits;
+}
+
+static void
+fd_table_retired_delete(struct retired *r)
+{
+	free(container_of(r, struct fd_table, retired));
+}
+
+/**
+ * Set the capacity of the descriptor table. Busy descriptors have to fit.
+ * fd_mutex must be locked.
+ * @retval 0 Success.
+ * @retval -1 No memory, nothing is changed.
+ */
+static int
+fd_table_resize(int capacity)
+{
+	struct fd_table *t = malloc(sizeof(*t) +
+				    capacity * sizeof(t->descs[0]));
+	uint64_t *busy = calloc(fd_map_size(capacity, FD_WORD_BITS),
+				sizeof(*busy));
+	uint64_t *full = calloc(fd_map_size(capacity, FD_SUMMARY_BITS),
+				sizeof(*full));
+	if (t == NULL || busy == NULL || full == NULL) {
+		free(t);
+		free(busy);
+		free(full);
+		return -1;
+	}
+	struct fd_table *old = fd_table;
+	int old_capacity = old == NULL ? 0 : old->capacity;
+	int keep = capacity < old_capacity ? capacity : old_capacity;
+	t->capacity = capacity;
+	if (keep > 0) {
+		memcpy(t->descs, old->descs, keep * sizeof(t->descs[0]));
+		memcpy(busy, fd_busy, fd_map_size(keep, FD_WORD_BITS) *
+		       sizeof(*busy));
+		memcpy(full, fd_full, fd_map_size(keep, FD_SUMMARY_BITS) *
+		       sizeof(*full));
+	}
+	memset(t->descs + keep, 0, (capacity - keep) * sizeof(t->descs[0]));
+	free(fd_busy);
+	free(fd_full);
+	fd_busy = busy;
+	fd_full = full;
+	__atomic_store_n(&fd_table, t, __ATOMIC_RELEASE);
+	/* Other threads can be reading the old table right now. */
+	if (old != NULL)
+		epoch_retire(&old->retired, fd_table_retired_delete);
+	fd_shrink_count = capacity / 4;
+	return 0;
+}
+
+/** Find the lowest free descriptor. The table must have one. */
+static int
+fd_find_free(void)
+{
+	uint32_t i = 0;
+	while (fd_full[i] == UINT64_MAX)
+		++i;
+	assert(i < fd_map_size(fd_table->capacity, FD_SUMMARY_BITS));
+	uint32_t word = i * FD_WORD_BITS + __builtin_ctzll(~fd_full[i]);
+	return word * FD_WORD_BITS + __builtin_ctzll(~fd_busy[word]);
+}
+
+static void
+fd_set_busy(int fd, bool is_busy)
+{
+	uint32_t word = fd / FD_WORD_BITS;
+	uint64_t bit = 1ULL << (fd % FD_WORD_BITS);
+	uint64_t full_bit = 1ULL << (word % FD_WORD_BITS);
+	if (is_busy) {
+		fd_busy[word] |= bit;
+		if (fd_busy[word] == UINT64_MAX)
+			fd_full[word / FD_WORD_BITS] |= full_bit;
+	} else {
+		fd_busy[word] &= ~bit;
+		fd_full[word / FD_WORD_BITS] &= ~full_bit;
+	}
+}
+
+/** Shrink the table if the busy descriptors fit into a smaller one. */
+static void
+fd_table_try_shrink(void)
+{
+	int capacity = fd_table->capacity;
+	if (capacity <= FD_MIN_CAPACITY ||
+	    file_descriptor_count > fd_shrink_count)
+		return;
+	/* Find the highest busy descriptor. */
+	int word = fd_map_size(capacity, FD_WORD_BITS) - 1;
+	while (word >= 0 && fd_busy[word] == 0)
+		--word;
+	int max_fd = word < 0 ? -1 : word * FD_WORD_BITS + 63 -
+		     __builtin_clzll(fd_busy[word]);
+	/* Leave room for twice as many descriptors as now. */
+	int new_capacity = capacity;
+	while (new_capacity > FD_MIN_CAPACITY &&
+	       new_capacity / 2 > max_fd &&
+	       new_capacity / 2 >= file_descriptor_count * 2)
+		new_capacity /= 2;
+	if (new_capacity == capacity || fd_table_resize(new_capacity) != 0)
+		fd_shrink_count = file_descriptor_count / 2;
+}
+
+/**
+ * Open a descriptor on the file, which already has a reference for it.
+ * @retval >= 0 The descriptor.
+ * @retval -1 No memory.
+ */
+static int
+filedesc_new(struct file *f)
+{
+	struct filedesc *desc = pool_alloc(&filedesc_pool);
+	if (desc == NULL)
+		return -1;
+	desc->file = f;
+	pthread_mutex_init(&desc->mutex, NULL);
+	desc->pos = 0;
+	desc->ra_next = 0;
+	desc->ra_end = 0;
+	desc->ra_window = 0;
+	pthread_rwlock_rdlock(&f->lock);
+	desc->shrink_count = f->shrink_count;
+	pthread_rwlock_unlock(&f->lock);
+
+	pthread_mutex_lock(&fd_mutex);
+	int capacity = fd_table == NULL ? 0 : fd_table->capacity;
+	if (file_descriptor_count == capacity &&
+	    fd_table_resize(capacity == 0 ? FD_MIN_CAPACITY :
+			    capacity * 2) != 0) {
+		pthread_mutex_unlock(&fd_mutex);
+		pthread_mutex_destroy(&desc->mutex);
+		pool_free(&filedesc_pool, desc);
+		return -1;
+	}
+	int fd = fd_find_free();
+	__atomic_store_n(&fd_table->descs[fd], desc, __ATOMIC_RELEASE);
+	fd_set_busy(fd, true);
+	++file_descriptor_count;
+	pthread_mutex_unlock(&fd_mutex);
+	return fd;
+}
+
+int
+ufs_open(const char *filename, int flags)
+{
+	pthread_rwlock_rdlock(&namespace_lock);
+	struct path path;
+	if (path_lookup(filename, &path) != 0)
+		goto error;
+	if (path.dentry == NULL && (flags & UFS_CREATE) != 0) {
+		/* Another thread can create the file while it is unlocked. */
+		pthread_rwlock_unlock(&namespace_lock);
+		pthread_rwlock_wrlock(&namespace_lock);
+		if (path_lookup(filename, &path) != 0)
+			goto error;
+		if (path.dentry == NULL) {
+			struct file *f = file_new(path.parent, path.name,
+						  path.len, path.hash);
+			if (f == NULL) {
+				ufs_error_code = UFS_ERR_NO_MEM;
+				goto error;
+			}
+			path.dentry = &f->dentry;
+		}
+	}
+	if (path.dentry == NULL) {
+		ufs_error_code = UFS_ERR_NO_FILE;
+		goto error;
+	}
+	if (path.dentry->is_dir) {
+		ufs_error_code = UFS_ERR_IS_DIR;
+		goto error;
+	}
+	struct file *f = dentry_file(path.dentry);
+	/* The file can't be deleted while the namespace is locked. */
+	__atomic_add_fetch(&f->refs, 1, __ATOMIC_RELAXED);
+	pthread_rwlock_unlock(&namespace_lock);
+	int fd = filedesc_new(f);
+	if (fd < 0) {
+		file_unref(f);
+		ufs_error_code = UFS_ERR_NO_MEM;
+	}
+	return fd;
+error:
+	pthread_rwlock_unlock(&namespace_lock);
+	return -1;
+}
+
+ssize_t
+ufs_write(int fd, const char *buf, size_t size)
+{
+	epoch_enter();
+	struct filedesc *desc = filedesc_get(fd);
+	ssize_t rc = desc != NULL ? filedesc_write(desc, buf, size) : -1;
+	epoch_exit();
+	return rc;
+}
+
+ssize_t
+ufs_read(int fd, char *buf, size_t size)
+{
+	epoch_enter();
+	struct filedesc *desc = filedesc_get(fd);
+	ssize_t rc = desc != NULL ? filedesc_read(desc, buf, size) : -1;
+	epoch_exit();
+	return rc;
+}
+
+ssize_t
+ufs_pwrite(int fd, const char *buf, size_t size, size_t offset)
+{
+	epoch_enter();
+	struct filedesc *desc = filedesc_get(fd);
+	ssize_t rc = -1;
+	if (desc != NULL)
+		rc = filedesc_pwrite(desc, buf, size, offset);
+	epoch_exit();
+	return rc;
+}
+
+ssize_t
+ufs_pread(int fd, char *buf, size_t size, size_t offset)
+{
+	epoch_enter();
+	struct filedesc *desc = filedesc_get(fd);
+	ssize_t rc = -1;
+	if (desc != NULL)
+		rc = filedesc_pread(desc, buf, size, offset);
+	epoch_exit();
+	return rc;
+}
+
+ssize_t
+ufs_readv(int fd, const struct iovec *iov, int iovcnt)
+{
+	if (iovcnt < 0) {
+		ufs_error_code = UFS_ERR_INVALID_ARG;
+		return -1;
+	}
+	epoch_enter();
+	struct filedesc *desc = filedesc_get(fd);
+	ssize_t rc = -1;
+	if (desc != NULL) {
+		struct file *f = desc->file;
+		size_t size = 0;
+		for (int i = 0; i < iovcnt; ++i)
+			size += iov[i].iov_len;
+		pthread_mutex_lock(&desc->mutex);
+		if (file_lock_read(f, desc->pos, size) == 0) {
+			filedesc_sync(desc);
+			rc = 0;
+			for (int i = 0; i < iovcnt; ++i) {
+				ssize_t len = file_read(f, desc->pos + rc,
+							iov[i].iov_base,
+							iov[i].iov_len);
+				rc += len;
+				if ((size_t)len < iov[i].iov_len)
+					break;
+			}
+			filedesc_readahead(desc, desc->pos, rc);
+			pthread_rwlock_unlock(&f->lock);
+			desc->pos += rc;
+		}
+		pthread_mutex_unlock(&desc->mutex);
+	}
+	epoch_exit();
+	return rc;
+}
+
+ssize_t
+ufs_writev(int fd, const struct iovec *iov, int iovcnt)
+{
+	if (iovcnt < 0) {
+		ufs_error_code = UFS_ERR_INVALID_ARG;
+		return -1;
+	}
+	epoch_enter();
+	struct filedesc *desc = filedesc_get(fd);
+	ssize_t rc = -1;
+	if (desc != NULL) {
+		struct file *f = desc->file;
+		pthread_mutex_lock(&desc->mutex);
+		pthread_rwlock_wrlock(&f->lock);
+		filedesc_sync(desc);
+		rc = 0;
+		for (int i = 0; i < iovcnt; ++i) {
+			ssize_t len = file_write(f, desc->pos + rc,
+						 iov[i].iov_base,
+						 iov[i].iov_len);
+			if (len < 0) {
+				if (rc == 0)
+					rc = -1;
+				break;
+			}
+			rc += len;
+		}
+		pthread_rwlock_unlock(&f->lock);
+		if (rc > 0)
+			desc->pos += rc;
+		pthread_mutex_unlock(&desc->mutex);
+	}
+	epoch_exit();
+	return rc;
+}
+
+/** What the views show for the holes. */
+static const char hole_data[EXTENT_MAX_SIZE];
+
+int
+ufs_read_view(int fd, size_t offset, size_t size, struct ufs_view *view)
+{
+	memset(view, 0, sizeof(*view));
+	view->offset = offset;
+	epoch_enter();
+	struct filedesc *desc = filedesc_get(fd);
+	if (desc == NULL) {
+		epoch_exit();
+		return -1;
+	}
+	struct file *f = desc->file;
+	int rc = -1;
+	/* Pinning marks the extents shared, it changes the file. */
+	pthread_rwlock_wrlock(&f->lock);
+	if (offset >= f->size || size == 0) {
+		rc = 0;
+		goto out;
+	}
+	if (size > f->size - offset)
+		size = f->size - offset;
+	if (file_unpack_range(f, offset, size) != 0)
+		goto no_mem;
+	file_touch(f);
+	uint32_t first = extent_index(offset);
+	uint32_t count = extent_index(offset + size - 1) - first + 1;
+	view->iov = view->inline_iov;
+	if (count > sizeof(view->inline_iov) / sizeof(view->inline_iov[0]) &&
+	    (view->iov = malloc(count * sizeof(*view->iov))) == NULL)
+		goto no_mem;
+	/* A pin is one more owner of the extents, like a clone. */
+	pthread_mutex_lock(&extent_refs_mutex);
+	if (extent_refs_reserve(count) != 0) {
+		pthread_mutex_unlock(&extent_refs_mutex);
+		if (view->iov != view->inline_iov)
+			free(view->iov);
+		goto no_mem;
+	}
+	size_t pos = offset;
+	size_t end = offset + size;
+	for (uint32_t i = first; i < first + count; ++i) {
+		char *data = extent_data(f->extents[i]);
+		if (data == NULL) {
+			data = (char *)hole_data;
+		} else {
+			extent_ref_inc(data);
+			f->extents[i] = (char *)((uintptr_t)data |
+						 EXTENT_SHARED);
+			image_touch(data, false);
+		}
+		size_t in_extent = pos - extent_start(i);
+		size_t len = extent_size(i) - in_extent;
+		if (len > end - pos)
+			len = end - pos;
+		view->iov[i - first].iov_base = data + in_extent;
+		view->iov[i - first].iov_len = len;
+		pos += len;
+	}
+	pthread_mutex_unlock(&extent_refs_mutex);
+	view->iovcnt = count;
+	view->size = size;
+	view->first_extent = first;
+	filedesc_readahead(desc, offset, size);
+	rc = 0;
+	goto out;
+no_mem:
+	memset(view, 0, sizeof(*view));
+	ufs_error_code = UFS_ERR_NO_MEM;
+out:
+	pthread_rwlock_unlock(&f->lock);
+	epoch_exit();
+	return rc;
+}
+
+void
+ufs_view_release(struct ufs_view *view)
+{
+	for (int k = 0; k < view->iovcnt; ++k) {
+		uint32_t i = view->first_extent + k;
+		char *data = view->iov[k].iov_base;
+		if (k == 0)
+			data -= view->offset - extent_start(i);
+		if (data == hole_data)
+			continue;
+		if (extent_ref_dec(data))
+			extent_free(i, data);
+	}
+	if (view->iov != view->inline_iov)
+		free(view->iov);
+	memset(view, 0, sizeof(*view));
+}
+
+off_t
+ufs_seek(int fd, off_t offset, int whence)
+{
+	epoch_enter();
+	struct filedesc *desc = filedesc_get(fd);
+	if (desc == NULL) {
+		epoch_exit();
+		return -1;
+	}
+	struct file *f = desc->file;
+	pthread_mutex_lock(&desc->mutex);
+	pthread_rwlock_rdlock(&f->lock);
+	filedesc_sync(desc);
+	off_t base = 0;
+	off_t rc = -1;
+	switch (whence) {
+	case UFS_SEEK_SET:
+		break;
+	case UFS_SEEK_CUR:
+		base = desc->pos;
+		break;
+	case UFS_SEEK_END:
+		base = f->size;
+		break;
+	default:
+		ufs_error_code = UFS_ERR_INVALID_ARG;
+		goto out;
+	}
+	if ((offset < 0 && -offset > base) ||
+	    (offset > 0 && offset > MAX_FILE_SIZE - base)) {
+		ufs_error_code = UFS_ERR_INVALID_ARG;
+		goto out;
+	}
+	desc->pos = base + offset;
+	rc = desc->pos;
+out:
+	pthread_rwlock_unlock(&f->lock);
+	pthread_mutex_unlock(&desc->mutex);
+	epoch_exit();
+	return rc;
+}
+
+int
+ufs_close(int fd)
+{
+	pthread_mutex_lock(&fd_mutex);
+	struct filedesc *desc = NULL;
+	if (fd_table != NULL && fd >= 0 && fd < fd_table->capacity)
+		desc = fd_table->descs[fd];
+	if (desc == NULL) {
+		pthread_mutex_unlock(&fd_mutex);
+		ufs_error_code = UFS_ERR_NO_FILE;
+		return -1;
+	}
+	__atomic_store_n(&fd_table->descs[fd], NULL, __ATOMIC_RELEASE);
+	fd_set_busy(fd, false);
+	--file_descriptor_count;
+	fd_table_try_shrink();
+	pthread_mutex_unlock(&fd_mutex);
+	/* Operations started before can still use the descriptor. */
+	file_unref(desc->file);
+	epoch_retire(&desc->retired, filedesc_retired_delete);
+	return 0;
+}
+
+int
+ufs_delete(const char *filename)
+{
+	pthread_rwlock_wrlock(&namespace_lock);
+	struct path path;
+	int rc = -1;
+	if (path_lookup(filename, &path) != 0)
+		goto out;
+	if (path.dentry == NULL) {
+		ufs_error_code = UFS_ERR_NO_FILE;
+		goto out;
+	}
+	if (path.dentry->is_dir) {
+		ufs_error_code = UFS_ERR_IS_DIR;
+		goto out;
+	}
+	dir_unlink(path.dentry);
+	rc = 0;
+out:
+	pthread_rwlock_unlock(&namespace_lock);
+	if (rc == 0)
+		file_orphan(dentry_file(path.dentry));
+	return rc;
+}
+
+int
+ufs_resize(int fd, size_t new_size)
+{
+	if (new_size > MAX_FILE_SIZE) {
+		ufs_error_code = UFS_ERR_NO_MEM;
+		return -1;
+	}
+	epoch_enter();
+	struct filedesc *desc = filedesc_get(fd);
+	if (desc == NULL) {
+		epoch_exit();
+		return -1;
+	}
+	struct file *f = desc->file;
+	int rc = 0;
+	pthread_mutex_lock(&desc->mutex);
+	pthread_rwlock_wrlock(&f->lock);
+	if (new_size < f->size) {
+		/* Whole extents go, the rest of the last one is ignored. */
+		file_drop_extents(f, file_extent_count(new_size));
+		f->size = new_size;
+		++f->shrink_count;
+		desc->shrink_count = f->shrink_count;
+		if (desc->pos > new_size)
+			desc->pos = new_size;
+	} else if (file_cover(f, new_size) != 0 ||
+		   file_zero_tail(f, new_size) != 0) {
+		ufs_error_code = UFS_ERR_NO_MEM;
+		rc = -1;
+	} else {
+		/* The new extents are holes, no memory is taken. */
+		f->size = new_size;
+	}
+	pthread_rwlock_unlock(&f->lock);
+	pthread_mutex_unlock(&desc->mutex);
+	epoch_exit();
+	return rc;
+}
+
+int
+ufs_mkdir(const char *path)
+{
+	pthread_rwlock_wrlock(&namespace_lock);
+	struct path p;
+	int rc = path_lookup(path, &p);
+	if (rc == 0 && p.dentry != NULL) {
+		ufs_error_code = UFS_ERR_EXISTS;
+		rc = -1;
+	} else if (rc == 0 && dir_new(p.parent, p.name, p.len,
+				      p.hash) == NULL) {
+		ufs_error_code = UFS_ERR_NO_MEM;
+		rc = -1;
+	}
+	pthread_rwlock_unlock(&namespace_lock);
+	return rc;
+}
+
+int
+ufs_rmdir(const char *path)
+{
+	pthread_rwlock_wrlock(&namespace_lock);
+	struct path p;
+	int rc = path_lookup(path, &p);
+	if (rc != 0)
+		goto out;
+	rc = -1;
+	if (p.dentry == NULL) {
+		ufs_error_code = UFS_ERR_NO_FILE;
+	} else if (!p.dentry->is_dir) {
+		ufs_error_code = UFS_ERR_NOT_DIR;
+	} else if (p.parent == NULL) {
+		ufs_error_code = UFS_ERR_INVALID_ARG;
+	} else if (dentry_dir(p.dentry)->entry_count != 0) {
+		ufs_error_code = UFS_ERR_NOT_EMPTY;
+	} else {
+		dir_unlink(p.dentry);
+		dir_delete(dentry_dir(p.dentry));
+		rc = 0;
+	}
+out:
+	pthread_rwlock_unlock(&namespace_lock);
+	return rc;
+}
+
+int
+ufs_readdir(const char *path, ufs_readdir_f cb, void *arg)
+{
+	pthread_rwlock_rdlock(&namespace_lock);
+	struct path p;
+	int rc = path_lookup(path, &p);
+	if (rc != 0)
+		goto out;
+	if (p.dentry == NULL || !p.dentry->is_dir) {
+		ufs_error_code = p.dentry == NULL ?
+				 UFS_ERR_NO_FILE : UFS_ERR_NOT_DIR;
+		rc = -1;
+		goto out;
+	}
+	struct dir *dir = dentry_dir(p.dentry);
+	for (uint32_t i = 0; i < dir->entry_capacity; ++i) {
+		struct dentry *d = dir->entries[i];
+		if (d == NULL)
+			continue;
+		struct ufs_dirent entry = {d->name, d->is_dir};
+		if (cb(&entry, arg) != 0)
+			break;
+	}
+out:
+	pthread_rwlock_unlock(&namespace_lock);
+	return rc;
+}
+
+int
+ufs_rename(const char *old_path, const char *new_path)
+{
+	pthread_rwlock_wrlock(&namespace_lock);
+	struct path from;
+	struct path to;
+	struct dentry *target = NULL;
+	int rc = -1;
+	if (path_lookup(old_path, &from) != 0 ||
+	    path_lookup(new_path, &to) != 0)
+		goto out;
+	struct dentry *d = from.dentry;
+	target = to.dentry;
+	if (d == NULL) {
+		ufs_error_code = UFS_ERR_NO_FILE;
+		goto out;
+	}
+	if (d->parent == NULL)
+		goto invalid;
+	if (d == target) {
+		rc = 0;
+		target = NULL;
+		goto out;
+	}
+	if (target != NULL && (target->is_dir || d->is_dir)) {
+		ufs_error_code = UFS_ERR_EXISTS;
+		goto out;
+	}
+	/* A directory can't move into itself. */
+	for (struct dir *p = to.parent; p != NULL; p = p->dentry.parent) {
+		if (&p->dentry == d)
+			goto invalid;
+	}
+	char *name = name_new(to.name, to.len);
+	if (name == NULL || dir_reserve(to.parent, 1) != 0) {
+		if (name != NULL)
+			name_delete(name, to.len);
+		ufs_error_code = UFS_ERR_NO_MEM;
+		goto out;
+	}
+	if (target != NULL)
+		dir_unlink(target);
+	dir_unlink(d);
+	name_delete(d->name, d->name_len);
+	d->name = name;
+	d->name_len = to.len;
+	d->hash = to.hash;
+	dir_link(to.parent, d);
+	/* The paths of everything inside have changed. */
+	if (d->is_dir)
+		path_cache_clear();
+	rc = 0;
+	goto out;
+invalid:
+	ufs_error_code = UFS_ERR_INVALID_ARG;
+out:
+	pthread_rwlock_unlock(&namespace_lock);
+	if (rc == 0 && target != NULL)
+		file_orphan(dentry_file(target));
+	return rc;
+}
+
+int
+ufs_clone(const char *src_name, const char *dst_name)
+{
+	pthread_rwlock_wrlock(&namespace_lock);
+	struct path src_path;
+	struct path dst_path;
+	int rc = -1;
+	if (path_lookup(src_name, &src_path) != 0 ||
+	    path_lookup(dst_name, &dst_path) != 0)
+		goto out;
+	if (src_path.dentry == NULL) {
+		ufs_error_code = UFS_ERR_NO_FILE;
+		goto out;
+	}
+	if (src_path.dentry->is_dir ||
+	    (dst_path.dentry != NULL && dst_path.dentry->is_dir)) {
+		ufs_error_code = UFS_ERR_IS_DIR;
+		goto out;
+	}
+	struct file *src = dentry_file(src_path.dentry);
+	if (dst_path.dentry == src_path.dentry) {
+		rc = 0;
+		goto out;
+	}
+	struct file *dst = NULL;
+	bool is_new = dst_path.dentry == NULL;
+	if (!is_new)
+		dst = dentry_file(dst_path.dentry);
+	if ((is_new && (dst = file_new(dst_path.parent, dst_path.name,
+				       dst_path.len, dst_path.hash)) == NULL) ||
+	    file_clone(dst, src) != 0) {
+		if (is_new && dst != NULL) {
+			dir_unlink(&dst->dentry);
+			file_delete(dst);
+		}
+		ufs_error_code = UFS_ERR_NO_MEM;
+		goto out;
+	}
+	rc = 0;
+out:
+	pthread_rwlock_unlock(&namespace_lock);
+	return rc;
+}
+
+enum {
+	/** Bigger pools gain nothing, the operations are mostly copies. */
+	QUEUE_MAX_WORKERS = 64,
+};
+
+/**
+ * Worker of the submission queue with its own list of operations. The
+ * operations on one descriptor always go to the same worker, so they run in
+ * the order of submission.
+ */
+struct queue_worker {
+	struct ufs_queue *queue;
+	pthread_t thread;
+	pthread_mutex_t mutex;
+	pthread_cond_t cond;
+	struct ufs_op *head;
+	struct ufs_op *tail;
+	bool is_stopping;
+};
+
+struct ufs_queue {
+	struct queue_worker *workers;
+	int worker_count;
+	/** Opens are spread over the workers round-robin. */
+	uint32_t open_next;
+	/** Protects the completions and the counter. */
+	pthread_mutex_t mutex;
+	pthread_cond_t cond;
+	/** Completed operations, not reaped yet. */
+	struct ufs_op *done_head;
+	struct ufs_op *done_tail;
+	int done_count;
+	/** Submitted and not completed operations. */
+	int in_progress;
+};
+
+static inline bool
+queue_op_is_io(const struct ufs_op *op)
+{
+	return op->code != UFS_OP_OPEN && op->code != UFS_OP_CLOSE;
+}
+
+static inline void
+queue_op_complete(struct ufs_op *op, ssize_t rc)
+{
+	op->result = rc;
+	op->error = rc == -1 ? ufs_error_code : UFS_ERR_NO_ERR;
+}
+
+static ssize_t
+queue_op_io(struct filedesc *desc, struct ufs_op *op)
+{
+	switch (op->code) {
+	case UFS_OP_READ:
+		return filedesc_read(desc, op->buf, op->size);
+	case UFS_OP_WRITE:
+		return filedesc_write(desc, op->buf, op->size);
+	case UFS_OP_PREAD:
+		return filedesc_pread(desc, op->buf, op->size, op->offset);
+	case UFS_OP_PWRITE:
+		return filedesc_pwrite(desc, op->buf, op->size, op->offset);
+	default:
+		abort();
+	}
+}
+
+/**
+ * Run a list of operations and publish the completions at once. A run of the
+ * reads and writes on one descriptor takes one epoch and one lookup.
+ */
+static void
+queue_run(struct ufs_queue *q, struct ufs_op *ops)
+{
+	struct ufs_op *op = ops;
+	struct ufs_op *last = NULL;
+	int count = 0;
+	while (op != NULL) {
+		if (!queue_op_is_io(op)) {
+			ssize_t rc = op->code == UFS_OP_OPEN ?
+				     ufs_open(op->filename, op->flags) :
+				     ufs_close(op->fd);
+			queue_op_complete(op, rc);
+			last = op;
+			op = op->next;
+			++count;
+			continue;
+		}
+		int fd = op->fd;
+		epoch_enter();
+		struct filedesc *desc = filedesc_get(fd);
+		do {
+			ssize_t rc = -1;
+			if (desc != NULL)
+				rc = queue_op_io(desc, op);
+			else
+				ufs_error_code = UFS_ERR_NO_FILE;
+			queue_op_complete(op, rc);
+			last = op;
+			op = op->next;
+			++count;
+		} while (op != NULL && op->fd == fd && queue_op_is_io(op));
+		epoch_exit();
+	}
+	pthread_mutex_lock(&q->mutex);
+	if (q->done_tail != NULL)
+		q->done_tail->next = ops;
+	else
+		q->done_head = ops;
+	q->done_tail = last;
+	q->done_count += count;
+	q->in_progress -= count;
+	pthread_cond_broadcast(&q->cond);
+	pthread_mutex_unlock(&q->mutex);
+}
+
+static void *
+queue_worker_f(void *arg)
+{
+	struct queue_worker *w = arg;
+	pthread_mutex_lock(&w->mutex);
+	while (true) {
+		while (w->head == NULL && !w->is_stopping)
+			pthread_cond_wait(&w->cond, &w->mutex);
+		if (w->head == NULL)
+			break;
+		struct ufs_op *ops = w->head;
+		w->head = NULL;
+		w->tail = NULL;
+		pthread_mutex_unlock(&w->mutex);
+		queue_run(w->queue, ops);
+		pthread_mutex_lock(&w->mutex);
+	}
+	pthread_mutex_unlock(&w->mutex);
+	return NULL;
+}
+
+/** Stop and join the first @a count workers. */
+static void
+queue_workers_stop(struct ufs_queue *q, int count)
+{
+	for (int i = 0; i < count; ++i) {
+		struct queue_worker *w = &q->workers[i];
+		pthread_mutex_lock(&w->mutex);
+		w->is_stopping = true;
+		pthread_cond_signal(&w->cond);
+		pthread_mutex_unlock(&w->mutex);
+		pthread_join(w->thread, NULL);
+	}
+	for (int i = 0; i < q->worker_count; ++i) {
+		pthread_mutex_destroy(&q->workers[i].mutex);
+		pthread_cond_destroy(&q->workers[i].cond);
+	}
+	pthread_mutex_destroy(&q->mutex);
+	pthread_cond_destroy(&q->cond);
+	free(q->workers);
+	free(q);
+}
+
+struct ufs_queue *
+ufs_queue_new(int worker_count)
+{
+	if (worker_count < 1) {
+		ufs_error_code = UFS_ERR_INVALID_ARG;
+		return NULL;
+	}
+	if (worker_count > QUEUE_MAX_WORKERS)
+		worker_count = QUEUE_MAX_WORKERS;
+	struct ufs_queue *q = calloc(1, sizeof(*q));
+	if (q == NULL)
+		goto error_no_mem;
+	q->workers = calloc(worker_count, sizeof(q->workers[0]));
+	if (q->workers == NULL) {
+		free(q);
+		goto error_no_mem;
+	}
+	q->worker_count = worker_count;
+	pthread_mutex_init(&q->mutex, NULL);
+	pthread_cond_init(&q->cond, NULL);
+	for (int i = 0; i < worker_count; ++i) {
+		struct queue_worker *w = &q->workers[i];
+		w->queue = q;
+		pthread_mutex_init(&w->mutex, NULL);
+		pthread_cond_init(&w->cond, NULL);
+	}
+	for (int i = 0; i < worker_count; ++i) {
+		if (pthread_create(&q->workers[i].thread, NULL, queue_worker_f,
+				   &q->workers[i]) != 0) {
+			queue_workers_stop(q, i);
+			goto error_no_mem;
+		}
+	}
+	return q;
+error_no_mem:
+	ufs_error_code = UFS_ERR_NO_MEM;
+	return NULL;
+}
+
+int
+ufs_queue_submit(struct ufs_queue *q, struct ufs_op *ops, int count)
+{
+	if (count < 0) {
+		ufs_error_code = UFS_ERR_INVALID_ARG;
+		return -1;
+	}
+	for (int i = 0; i < count; ++i) {
+		if ((unsigned)ops[i].code > UFS_OP_CLOSE) {
+			ufs_error_code = UFS_ERR_INVALID_ARG;
+			return -1;
+		}
+	}
+	pthread_mutex_lock(&q->mutex);
+	q->in_progress += count;
+	pthread_mutex_unlock(&q->mutex);
+	/* Sort the operations by workers first to lock each worker once. */
+	struct ufs_op *heads[QUEUE_MAX_WORKERS] = {NULL};
+	struct ufs_op *tails[QUEUE_MAX_WORKERS];
+	for (int i = 0; i < count; ++i) {
+		struct ufs_op *op = &ops[i];
+		uint32_t w;
+		if (op->code == UFS_OP_OPEN)
+			w = __atomic_fetch_add(&q->open_next, 1,
+					       __ATOMIC_RELAXED);
+		else
+			w = (unsigned)op->fd;
+		w %= q->worker_count;
+		op->next = NULL;
+		if (heads[w] == NULL)
+			heads[w] = op;
+		else
+			tails[w]->next = op;
+		tails[w] = op;
+	}
+	for (int i = 0; i < q->worker_count; ++i) {
+		if (heads[i] == NULL)
+			continue;
+		struct queue_worker *w = &q->workers[i];
+		pthread_mutex_lock(&w->mutex);
+		if (w->tail != NULL)
+			w->tail->next = heads[i];
+		else
+			w->head = heads[i];
+		w->tail = tails[i];
+		pthread_cond_signal(&w->cond);
+		pthread_mutex_unlock(&w->mutex);
+	}
+	return count;
+}
+
+int
+ufs_queue_reap(struct ufs_queue *q, struct ufs_op **done, int count,
+	       int min_count)
+{
+	pthread_mutex_lock(&q->mutex);
+	while (q->done_count < min_count && q->in_progress > 0)
+		pthread_cond_wait(&q->cond, &q->mutex);
+	int n = 0;
+	while (n < count && q->done_head != NULL) {
+		done[n++] = q->done_head;
+		q->done_head = q->done_head->next;
+	}
+	if (q->done_head == NULL)
+		q->done_tail = NULL;
+	q->done_count -= n;
+	pthread_mutex_unlock(&q->mutex);
+	return n;
+}
+
+void
+ufs_queue_delete(struct ufs_queue *q)
+{
+	pthread_mutex_lock(&q->mutex);
+	while (q->in_progress > 0)
+		pthread_cond_wait(&q->cond, &q->mutex);
+	pthread_mutex_unlock(&q->mutex);
+	queue_workers_stop(q, q->worker_count);
+}
+
+struct ufs_snapshot {
+	/** Clones of the files, in a tree not linked to the namespace. */
+	struct dir root;
+	/** All the snapshots are in a list, to free them in ufs_destroy(). */
+	struct ufs_snapshot *prev;
+	struct ufs_snapshot *next;
+};
+
+static struct ufs_snapshot *snapshots = NULL;
+static pthread_mutex_t snapshots_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+/**
+ * Clone the whole tree of @a src into the empty @a dst. The source files
+ * can't be deleted meanwhile. On failure @a dst has a part of the entries and
+ * has to be cleared.
+ */
+static int
+dir_clone(struct dir *dst, struct dir *src)
+{
+	if (dir_reserve(dst, src->entry_count) != 0)
+		return -1;
+	for (uint32_t i = 0; i < src->entry_capacity; ++i) {
+		struct dentry *d = src->entries[i];
+		if (d == NULL)
+			continue;
+		if (d->is_dir) {
+			struct dir *sub = dir_create(d->name, d->name_len,
+						     d->hash);
+			if (sub == NULL)
+				return -1;
+			dir_link(dst, &sub->dentry);
+			if (dir_clone(sub, dentry_dir(d)) != 0)
+				return -1;
+		} else {
+			struct file *f = file_create(d->name, d->name_len,
+						     d->hash);
+			if (f == NULL)
+				return -1;
+			dir_link(dst, &f->dentry);
+			if (file_clone(f, dentry_file(d)) != 0)
+				return -1;
+		}
+	}
+	return 0;
+}
+
+struct ufs_snapshot *
+ufs_snapshot(void)
+{
+	struct ufs_snapshot *snap = calloc(1, sizeof(*snap));
+	if (snap == NULL) {
+		ufs_error_code = UFS_ERR_NO_MEM;
+		return NULL;
+	}
+	snap->root.dentry.is_dir = true;
+	pthread_rwlock_rdlock(&namespace_lock);
+	int rc = dir_clone(&snap->root, &root_dir);
+	pthread_rwlock_unlock(&namespace_lock);
+	if (rc != 0) {
+		dir_clear(&snap->root, file_delete);
+		free(snap);
+		ufs_error_code = UFS_ERR_NO_MEM;
+		return NULL;
+	}
+	pthread_mutex_lock(&snapshots_mutex);
+	snap->next = snapshots;
+	if (snapshots != NULL)
+		snapshots->prev = snap;
+	snapshots = snap;
+	pthread_mutex_unlock(&snapshots_mutex);
+	return snap;
+}
+
+int
+ufs_snapshot_restore(struct ufs_snapshot *snap)
+{
+	pthread_rwlock_wrlock(&namespace_lock);
+	/* Prepare everything first, so as a failure changes nothing. */
+	struct dir root = {.dentry = {.is_dir = true}};
+	if (dir_clone(&root, &snap->root) != 0) {
+		pthread_rwlock_unlock(&namespace_lock);
+		dir_clear(&root, file_delete);
+		ufs_error_code = UFS_ERR_NO_MEM;
+		return -1;
+	}
+	/* The current files go away like deleted ones. */
+	dir_clear(&root_dir, file_orphan);
+	path_cache_clear();
+	root_dir.entries = root.entries;
+	root_dir.entry_count = root.entry_count;
+	root_dir.entry_capacity = root.entry_capacity;
+	for (uint32_t i = 0; i < root_dir.entry_capacity; ++i) {
+		if (root_dir.entries[i] != NULL)
+			root_dir.entries[i]->parent = &root_dir;
+	}
+	pthread_rwlock_unlock(&namespace_lock);
+	return 0;
+}
+
+void
+ufs_snapshot_delete(struct ufs_snapshot *snap)
+{
+	pthread_mutex_lock(&snapshots_mutex);
+	if (snap->prev != NULL)
+		snap->prev->next = snap->next;
+	else
+		snapshots = snap->next;
+	if (snap->next != NULL)
+		snap->next->prev = snap->prev;
+	pthread_mutex_unlock(&snapshots_mutex);
+	dir_clear(&snap->root, file_delete);
+	free(snap);
+}
+
+/**
+ * An extent seen by a compaction. It is pinned like by a view, so as it
+ * neither changes nor goes away until the compaction ends, while its file is
+ * unlocked.
+ */
+struct dedup_entry {
+	/** Hash of the content, see extent_hash(). */
+	uint64_t hash;
+	/** Tagged pointer, plain or packed, not shared. */
+	char *extent;
+	/** Index of the extent in its file, it defines the size. */
+	uint32_t index;
+	/** Bytes of the content, the last extent of a file is not full. */
+	uint32_t len;
+};
+
+/** Extents seen by a compaction, by the content. */
+struct dedup {
+	/** Open addressing with linear probing, a power of 2 capacity. */
+	struct dedup_entry *entries;
+	uint32_t count;
+	uint32_t capacity;
+	/** Output of the compression. */
+	char *buf;
+	/** Decompressed content of the packed extent @a plain_extent. */
+	char *plain;
+	const char *plain_extent;
+};
+
+static uint64_t
+extent_hash(const char *data, size_t len)
+{
+	uint64_t h = len;
+	size_t i = 0;
+	for (; i + sizeof(uint64_t) <= len; i += sizeof(uint64_t)) {
+		uint64_t v;
+		memcpy(&v, data + i, sizeof(v));
+		h = (h ^ v) * 0x9E3779B97F4A7C15ull;
+		h ^= h >> 29;
+	}
+	for (; i < len; ++i)
+		h = (h ^ (unsigned char)data[i]) * 1099511628211ull;
+	return h;
+}
+
+/** Find an extent with the same content as extent @a i with @a data. */
+static struct dedup_entry *
+dedup_find(struct dedup *t, uint64_t hash, uint32_t i, const char *data,
+	   uint32_t len)
+{
+	if (t->capacity == 0)
+		return NULL;
+	uint32_t mask = t->capacity - 1;
+	for (uint32_t k = hash & mask; t->entries[k].extent != NULL;
+	     k = (k + 1) & mask) {
+		struct dedup_entry *e = &t->entries[k];
+		if (e->hash != hash || e->len != len ||
+		    extent_size(e->index) != extent_size(i))
+			continue;
+		const char *content = extent_data(e->extent);
+		if (extent_is_packed(e->extent)) {
+			if (t->plain_extent != e->extent) {
+				packed_read(e->extent, t->plain,
+					    EXTENT_MAX_SIZE);
+				t->plain_extent = e->extent;
+			}
+			content = t->plain;
+		}
+		if (memcmp(content, data, len) == 0)
+			return e;
+	}
+	return NULL;
+}
+
+/** Remember the extent @a i and pin it. */
+static int
+dedup_insert(struct dedup *t, uint64_t hash, uint32_t i, char *extent,
+	     uint32_t len)
+{
+	if ((t->count + 1) * 2 > t->capacity) {
+		uint32_t capacity = t->capacity == 0 ? 64 : t->capacity * 2;
+		struct dedup_entry *entries = calloc(capacity,
+						     sizeof(*entries));
+		if (entries == NULL)
+			return -1;
+		for (uint32_t k = 0; k < t->capacity; ++k) {
+			struct dedup_entry *e = &t->entries[k];
+			if (e->extent == NULL)
+				continue;
+			uint32_t slot = e->hash & (capacity - 1);
+			while (entries[slot].extent != NULL)
+				slot = (slot + 1) & (capacity - 1);
+			entries[slot] = *e;
+		}
+		free(t->entries);
+		t->entries = entries;
+		t->capacity = capacity;
+	}
+	pthread_mutex_lock(&extent_refs_mutex);
+	int rc = extent_refs_reserve(1);
+	if (rc == 0)
+		extent_ref_inc(extent_data(extent));
+	pthread_mutex_unlock(&extent_refs_mutex);
+	if (rc != 0)
+		return -1;
+	uint32_t mask = t->capacity - 1;
+	uint32_t k = hash & mask;
+	while (t->entries[k].extent != NULL)
+		k = (k + 1) & mask;
+	t->entries[k] = (struct dedup_entry){hash, extent, i, len};
+	++t->count;
+	return 0;
+}
+
+/** Unpin the extents and free the table. */
+static void
+dedup_destroy(struct dedup *t)
+{
+	for (uint32_t k = 0; k < t->capacity; ++k) {
+		struct dedup_entry *e = &t->entries[k];
+		if (e->extent != NULL && extent_ref_dec(extent_data(e->extent)))
+			extent_destroy(e->index, e->extent);
+	}
+	free(t->entries);
+	free(t->buf);
+	free(t->plain);
+}
+
+/**
+ * Compact the file if it is not used since the previous compaction. An
+ * extent equal to one seen before is replaced with that one, shared.
+ * Otherwise it is compressed if that saves 1/8 of it at least, and is
+ * remembered for the next ones. The shared extents are left as is, they are
+ * clones already. The file must be write-locked.
+ */
+static int
+file_compact(struct file *f, struct dedup *t)
+{
+	if (__atomic_exchange_n(&f->is_hot, false, __ATOMIC_RELAXED))
+		return 0;
+	for (uint32_t i = 0; i < f->extent_count; ++i) {
+		char *extent = f->extents[i];
+		if (extent == NULL || extent_is_shared(extent) ||
+		    extent_is_packed(extent))
+			continue;
+		size_t start = extent_start(i);
+		uint32_t len = extent_size(i);
+		if (len > f->size - start)
+			len = f->size - start;
+		uint64_t hash = extent_hash(extent, len);
+		struct dedup_entry *e = dedup_find(t, hash, i, extent, len);
+		if (e != NULL) {
+			pthread_mutex_lock(&extent_refs_mutex);
+			int rc = extent_refs_reserve(1);
+			if (rc == 0)
+				extent_ref_inc(extent_data(e->extent));
+			pthread_mutex_unlock(&extent_refs_mutex);
+			if (rc != 0)
+				return -1;
+			extent_free(i, extent);
+			f->extents[i] = (char *)((uintptr_t)e->extent |
+						 EXTENT_SHARED);
+			if (extent_is_packed(e->extent))
+				++f->packed_count;
+			__atomic_add_fetch(&dedup_count, 1, __ATOMIC_RELAXED);
+			continue;
+		}
+		size_t size = lz_compress(extent, len, t->buf, len - len / 8);
+		if (size != 0) {
+			char *packed = packed_new(t->buf, size, len);
+			if (packed == NULL)
+				return -1;
+			extent_free(i, extent);
+			extent = packed;
+			f->extents[i] = extent;
+			++f->packed_count;
+		}
+		if (dedup_insert(t, hash, i, extent, len) != 0)
+			return -1;
+		f->extents[i] = (char *)((uintptr_t)extent | EXTENT_SHARED);
+	}
+	return 0;
+}
+
+static int
+dir_compact(struct dir *dir, struct dedup *t)
+{
+	for (uint32_t i = 0; i < dir->entry_capacity; ++i) {
+		struct dentry *d = dir->entries[i];
+		if (d == NULL)
+			continue;
+		int rc;
+		if (d->is_dir) {
+			rc = dir_compact(dentry_dir(d), t);
+		} else {
+			struct file *f = dentry_file(d);
+			pthread_rwlock_wrlock(&f->lock);
+			rc = file_compact(f, t);
+			pthread_rwlock_unlock(&f->lock);
+		}
+		if (rc != 0)
+			return -1;
+	}
+	return 0;
+}
+
+int
+ufs_compact(void)
+{
+	/* The image keeps the extents at their places. */
+	if (image.base != NULL)
+		return 0;
+	struct dedup t = {0};
+	t.buf = malloc(EXTENT_MAX_SIZE);
+	t.plain = malloc(EXTENT_MAX_SIZE);
+	int rc = -1;
+	if (t.buf != NULL && t.plain != NULL) {
+		/* No files can disappear meanwhile. */
+		pthread_rwlock_rdlock(&namespace_lock);
+		rc = dir_compact(&root_dir, &t);
+		pthread_rwlock_unlock(&namespace_lock);
+	}
+	dedup_destroy(&t);
+	if (rc != 0)
+		ufs_error_code = UFS_ERR_NO_MEM;
+	return rc;
+}
+
+static uint64_t
+dir_logical_size(struct dir *dir)
+{
+	uint64_t size = 0;
+	for (uint32_t i = 0; i < dir->entry_capacity; ++i) {
+		struct dentry *d = dir->entries[i];
+		if (d == NULL)
+			continue;
+		if (d->is_dir) {
+			size += dir_logical_size(dentry_dir(d));
+			continue;
+		}
+		struct file *f = dentry_file(d);
+		pthread_rwlock_rdlock(&f->lock);
+		size += f->size;
+		pthread_rwlock_unlock(&f->lock);
+	}
+	return size;
+}
+
+void
+ufs_space_stats(struct ufs_space_stats *stats)
+{
+	memset(stats, 0, sizeof(*stats));
+	/* Don't count the files which are already dropped. */
+	pthread_mutex_lock(&epoch_mutex);
+	epoch_reclaim_locked();
+	pthread_mutex_unlock(&epoch_mutex);
+	pthread_rwlock_rdlock(&namespace_lock);
+	stats->logical = dir_logical_size(&root_dir);
+	pthread_rwlock_unlock(&namespace_lock);
+	for (uint32_t i = 0; i < EXTENT_CLASS_COUNT; ++i) {
+		struct ufs_pool_stats pool;
+		pool_stats(&extent_pools[i], &pool);
+		stats->physical += (uint64_t)pool.used * pool.object_size;
+	}
+	stats->packed_count = __atomic_load_n(&packed_count, __ATOMIC_RELAXED);
+	stats->packed_size = __atomic_load_n(&packed_bytes, __ATOMIC_RELAXED);
+	stats->physical += stats->packed_size;
+	stats->deduplicated = __atomic_load_n(&dedup_count, __ATOMIC_RELAXED);
+}
+
+enum {
+	/** Version 2 added directories. */
+	IMAGE_VERSION = 2,
+	/** Each metadata area is 1/64 of the image, but not less than that. */
+	IMAGE_MIN_META_SIZE = 64 * 1024,
+	/** Max extents of a file. */
+	IMAGE_MAX_EXTENTS = EXTENT_MAX_SHIFT + 1 + (MAX_FILE_SIZE -
+			    EXTENT_MAX_START) / EXTENT_MAX_SIZE,
+	IMAGE_SLOTS_PER_CHUNK = EXTENT_MAX_SIZE / BLOCK_SIZE,
+};
+
+static const char image_magic[8] = {'U', 'F', 'S', 'I', 'M', 'A', 'G', 'E'};
+
+struct image_super {
+	char magic[8];
+	uint32_t version;
+	uint32_t chunk_size;
+	uint64_t size;
+	uint64_t chunk_count;
+	uint64_t map_offset;
+	uint64_t meta_offset[2];
+	uint64_t meta_size;
+	uint64_t chunk_offset;
+	/** Which of the metadata areas has the file list. */
+	uint32_t meta_active;
+	uint32_t padding;
+	/** Bytes of the file list and their checksum. */
+	uint64_t meta_used;
+	uint64_t meta_checksum;
+	uint64_t sync_count;
+	/** Checksum of the fields above. */
+	uint64_t checksum;
+};
+
+/**
+ * A file in the metadata area. It is followed by the offsets of the extents
+ * in the image, and by the full path. The records are 8 bytes aligned. A
+ * directory is a record with a slash in the end of the path, so as the empty
+ * ones are kept too.
+ */
+struct image_file {
+	uint64_t size;
+	uint32_t extent_count;
+	uint32_t name_len;
+};
+
+/** Serializes ufs_sync() calls, they alternate the metadata areas. */
+static pthread_mutex_t image_sync_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+static uint64_t
+image_checksum(const void *data, size_t size)
+{
+	/* FNV-1a. */
+	const unsigned char *pos = data;
+	uint64_t h = 14695981039346656037ull;
+	for (size_t i = 0; i < size; ++i)
+		h = (h ^ pos[i]) * 1099511628211ull;
+	return h;
+}
+
+static inline uint64_t
+image_super_checksum(const struct image_super *super)
+{
+	return image_checksum(super, offsetof(struct image_super, checksum));
+}
+
+static inline size_t
+image_file_size(const struct image_file *rec)
+{
+	size_t size = sizeof(*rec) + rec->extent_count * sizeof(uint64_t) +
+		      rec->name_len;
+	return (size + 7) & ~(size_t)7;
+}
+
+static inline uint64_t
+image_round_up(uint64_t size)
+{
+	return (size + IMAGE_PAGE_SIZE - 1) & ~(uint64_t)(IMAGE_PAGE_SIZE - 1);
+}
+
+/** Build the superblock of an empty image of the given size. */
+static void
+image_layout(uint64_t size, struct image_super *super)
+{
+	memset(super, 0, sizeof(*super));
+	memcpy(super->magic, image_magic, sizeof(image_magic));
+	super->version = IMAGE_VERSION;
+	super->chunk_size = EXTENT_MAX_SIZE;
+	super->size = size;
+	uint64_t meta_size = size / 64;
+	if (meta_size < IMAGE_MIN_META_SIZE)
+		meta_size = IMAGE_MIN_META_SIZE;
+	super->meta_size = image_round_up(meta_size);
+	super->map_offset = IMAGE_PAGE_SIZE;
+	super->meta_offset[0] = super->map_offset +
+				image_round_up(size / EXTENT_MAX_SIZE);
+	super->meta_offset[1] = super->meta_offset[0] + super->meta_size;
+	super->chunk_offset = super->meta_offset[1] + super->meta_size;
+	if (size > super->chunk_offset) {
+		super->chunk_count = (size - super->chunk_offset) /
+				     EXTENT_MAX_SIZE;
+	}
+	super->meta_checksum = image_checksum(NULL, 0);
+	super->checksum = image_super_checksum(super);
+}
+
+/**
+ * Clear the bits of the chunk.
+ * @retval Which of them were set.
+ */
+static uint8_t
+image_chunk_take(uint64_t i, uint8_t bits)
+{
+	uint8_t *state = &image.chunk_state[i];
+	if ((__atomic_load_n(state, __ATOMIC_RELAXED) & bits) == 0)
+		return 0;
+	uint8_t old = __atomic_fetch_and(state, ~bits, __ATOMIC_RELAXED);
+	if ((old & bits & CHUNK_DIRTY) != 0)
+		__atomic_sub_fetch(&image.dirty_count, 1, __ATOMIC_RELAXED);
+	return old & bits;
+}
+
+/**
+ * Clear the bits of all the chunks, and call @a cb for each run of the
+ * adjacent chunks which had any of them.
+ * @retval 0 Success.
+ * @retval -1 Some of the calls failed.
+ */
+static int
+image_chunk_runs(uint8_t bits, int (*cb)(uint64_t first, uint64_t count))
+{
+	int rc = 0;
+	uint64_t first = 0;
+	uint64_t count = 0;
+	for (uint64_t i = 0; i < image.chunk_count; ++i) {
+		if (image_chunk_take(i, bits) == 0)
+			continue;
+		if (count > 0 && first + count == i) {
+			++count;
+			continue;
+		}
+		if (count > 0 && cb(first, count) != 0)
+			rc = -1;
+		first = i;
+		count = 1;
+	}
+	if (count > 0 && cb(first, count) != 0)
+		rc = -1;
+	return rc;
+}
+
+/** Start writing the chunks to the disk, without waiting for it. */
+static int
+image_chunks_write_back(uint64_t first, uint64_t count)
+{
+	size_t size = count * EXTENT_MAX_SIZE;
+	char *data = image.chunks + first * EXTENT_MAX_SIZE;
+#ifdef SYNC_FILE_RANGE_WRITE
+	sync_file_range(image.fd, data - image.base, size,
+			SYNC_FILE_RANGE_WRITE);
+#else
+	msync(data, size, MS_ASYNC);
+#endif
+	__atomic_add_fetch(&image.flushed, size, __ATOMIC_RELAXED);
+	__atomic_add_fetch(&image.flush_count, 1, __ATOMIC_RELAXED);
+	return 0;
+}
+
+/** Write the chunks to the disk and wait for it. */
+static int
+image_chunks_sync(uint64_t first, uint64_t count)
+{
+	char *data = image.chunks + first * EXTENT_MAX_SIZE;
+	if (msync(data, count * EXTENT_MAX_SIZE, MS_SYNC) == 0)
+		return 0;
+	/* The next sync tries again. */
+	for (uint64_t i = first; i < first + count; ++i) {
+		__atomic_fetch_or(&image.chunk_state[i], CHUNK_UNSYNCED,
+				  __ATOMIC_RELAXED);
+	}
+	return -1;
+}
+
+/**
+ * Drop the least recently used chunks from the memory until the resident
+ * ones fit into the limit. It is CLOCK: the hand goes round the chunks, a
+ * referenced one loses the mark and gets another round, the one without it
+ * is dropped. Dirty chunks are skipped, they can go after the write back.
+ * The cache mutex must be locked.
+ */
+static void
+image_evict(void)
+{
+	uint64_t limit = __atomic_load_n(&image.resident_limit,
+					 __ATOMIC_RELAXED);
+	if (limit == 0)
+		return;
+	/* In two rounds all the marks are cleared, no sense to go on. */
+	for (uint64_t n = 0; n < 2 * image.chunk_count &&
+	     __atomic_load_n(&image.resident_count, __ATOMIC_RELAXED) > limit;
+	     ++n) {
+		uint64_t i = image.clock_hand;
+		image.clock_hand = (i + 1) % image.chunk_count;
+		uint8_t state = __atomic_load_n(&image.chunk_state[i],
+						__ATOMIC_RELAXED);
+		if ((state & CHUNK_RESIDENT) == 0 ||
+		    (state & CHUNK_DIRTY) != 0 ||
+		    image_chunk_take(i, CHUNK_REFERENCED) != 0)
+			continue;
+		/*
+		 * The mapping stays valid, the pages are read from the file
+		 * again on access. The kernel keeps the changed ones until
+		 * they are on the disk, nothing is lost even if the chunk is
+		 * written concurrently.
+		 */
+		char *data = image.chunks + i * EXTENT_MAX_SIZE;
+		madvise(data, EXTENT_MAX_SIZE, MADV_DONTNEED);
+		posix_fadvise(image.fd, data - image.base, EXTENT_MAX_SIZE,
+			      POSIX_FADV_DONTNEED);
+		if (image_chunk_take(i, CHUNK_RESIDENT) == 0)
+			continue;
+		__atomic_sub_fetch(&image.resident_count, 1, __ATOMIC_RELAXED);
+		__atomic_add_fetch(&image.evicted, EXTENT_MAX_SIZE,
+				   __ATOMIC_RELAXED);
+	}
+}
+
+/**
+ * Background writer. Each IMAGE_FLUSH_INTERVAL, or when woken up, it starts
+ * writing back the changed chunks and drops the ones above the limit. So the
+ * small random writes reach the disk in big batches, and ufs_sync() mostly
+ * waits for the writes already started.
+ */
+static void *
+image_flusher_f(void *arg)
+{
+	(void)arg;
+	pthread_mutex_lock(&image.flush_mutex);
+	while (!image.is_stopping) {
+		if (!image.is_flush_wanted) {
+			struct timespec deadline;
+			clock_gettime(CLOCK_REALTIME, &deadline);
+			deadline.tv_sec += IMAGE_FLUSH_INTERVAL;
+			pthread_cond_timedwait(&image.flush_cond,
+					       &image.flush_mutex, &deadline);
+			if (image.is_stopping)
+				break;
+		}
+		image.is_flush_wanted = false;
+		pthread_mutex_unlock(&image.flush_mutex);
+		pthread_mutex_lock(&image.cache_mutex);
+		image_chunk_runs(CHUNK_DIRTY, image_chunks_write_back);
+		image_evict();
+		pthread_mutex_unlock(&image.cache_mutex);
+		pthread_mutex_lock(&image.flush_mutex);
+	}
+	pthread_mutex_unlock(&image.flush_mutex);
+	return NULL;
+}
+
+static void
+image_flusher_stop(void)
+{
+	if (!image.is_flusher_started)
+		return;
+	pthread_mutex_lock(&image.flush_mutex);
+	image.is_stopping = true;
+	pthread_cond_signal(&image.flush_cond);
+	pthread_mutex_unlock(&image.flush_mutex);
+	pthread_join(image.flusher, NULL);
+	image.is_flusher_started = false;
+	image.is_stopping = false;
+	image.is_flush_wanted = false;
+}
+
+static void
+image_unmap(void)
+{
+	image_flusher_stop();
+	free(image.chunk_state);
+	image.chunk_state = NULL;
+	image.dirty_count = 0;
+	image.resident_count = 0;
+	image.clock_hand = 0;
+	image.flushed = 0;
+	image.flush_count = 0;
+	image.readahead = 0;
+	image.evicted = 0;
+	munmap(image.base, image.size);
+	close(image.fd);
+	image.fd = -1;
+	image.base = NULL;
+	image.size = 0;
+	image.super = NULL;
+	image.chunk_map = NULL;
+	image.chunks = NULL;
+	image.chunk_count = 0;
+	image.chunk_hint = 0;
+}
+
+/** Delete a file, but keep its data saved in the image. */
+static void
+file_unload(struct file *f)
+{
+	/* Freed extents are scribbled by the pools. */
+	if (image.base != NULL)
+		f->extent_count = 0;
+	file_delete(f);
+}
+
+/** Undo a failed image_load(). */
+static void
+image_load_rollback(void)
+{
+	dir_clear(&root_dir, file_unload);
+	free(extent_refs);
+	extent_refs = NULL;
+	extent_ref_capacity = 0;
+	extent_ref_count = 0;
+	for (uint32_t i = 0; i < EXTENT_CLASS_COUNT; ++i)
+		pool_destroy(&extent_pools[i]);
+}
+
+/**
+ * Find the extent @a i of a file at @a offset of the image and mark it used.
+ * @retval NULL The offset is not valid.
+ */
+static char *
+image_extent_use(uint32_t i, uint64_t offset, uint8_t *used)
+{
+	const struct image_super *super = image.super;
+	uint32_t cls = i < EXTENT_MAX_SHIFT ? i : EXTENT_MAX_SHIFT;
+	if (offset < super->chunk_offset)
+		return NULL;
+	offset -= super->chunk_offset;
+	uint64_t chunk = offset / EXTENT_MAX_SIZE;
+	uint64_t slot_offset = offset % EXTENT_MAX_SIZE;
+	if (chunk >= image.chunk_count || image.chunk_map[chunk] != cls + 1 ||
+	    slot_offset % extent_size(i) != 0)
+		return NULL;
+	char *data = image.chunks + offset;
+	uint64_t bit = chunk * IMAGE_SLOTS_PER_CHUNK +
+		       slot_offset / extent_size(i);
+	if ((used[bit / 8] & (1 << (bit % 8))) != 0) {
+		/* Another file has it too, it was cloned. */
+		if (extent_refs_reserve(1) != 0)
+			return NULL;
+		extent_ref_inc(data);
+	}
+	used[bit / 8] |= 1 << (bit % 8);
+	return data;
+}
+
+/** Create a file from its record in the metadata area. */
+static int
+image_file_load(const struct image_file *rec, uint8_t *used)
+{
+	if (rec->size > MAX_FILE_SIZE ||
+	    rec->extent_count != file_extent_count(rec->size))
+		return -1;
+	const uint64_t *offsets = (const uint64_t *)(rec + 1);
+	const char *path = (const char *)(offsets + rec->extent_count);
+	uint32_t len = rec->name_len;
+	if (len == 0 || memchr(path, 0, len) != NULL)
+		return -1;
+	if (path[len - 1] == '/') {
+		if (rec->size != 0 || len == 1)
+			return -1;
+		return dir_make_path(path, len - 1) == NULL ? -1 : 0;
+	}
+	const char *name = path + len;
+	while (name > path && name[-1] != '/')
+		--name;
+	struct dir *dir = &root_dir;
+	if (name > path && (dir = dir_make_path(path, name - path - 1)) == NULL)
+		return -1;
+	uint32_t name_len = path + len - name;
+	uint32_t hash = name_hash(name, name_len);
+	struct file *f = NULL;
+	if (dir_find(dir, name, name_len, hash) == NULL)
+		f = file_new(dir, name, name_len, hash);
+	if (f == NULL)
+		return -1;
+	f->size = rec->size;
+	if (rec->extent_count == 0)
+		return 0;
+	f->extents = malloc(rec->extent_count * sizeof(*f->extents));
+	if (f->extents == NULL)
+		return -1;
+	f->extent_capacity = rec->extent_count;
+	for (uint32_t i = 0; i < rec->extent_count; ++i) {
+		char *data = NULL;
+		if (offsets[i] != 0 &&
+		    (data = image_extent_use(i, offsets[i], used)) == NULL)
+			return -1;
+		f->extents[i] = data;
+		f->extent_count = i + 1;
+	}
+	return 0;
+}
+
+/** Mark the extents shared by several files in the loaded tree. */
+static void
+image_mark_shared(struct dir *dir)
+{
+	for (uint32_t i = 0; i < dir->entry_capacity; ++i) {
+		struct dentry *d = dir->entries[i];
+		if (d == NULL)
+			continue;
+		if (d->is_dir) {
+			image_mark_shared(dentry_dir(d));
+			continue;
+		}
+		struct file *f = dentry_file(d);
+		for (uint32_t j = 0; j < f->extent_count; ++j) {
+			char *data = f->extents[j];
+			if (data != NULL && extent_ref_is_shared(data)) {
+				f->extents[j] = (char *)((uintptr_t)data |
+							 EXTENT_SHARED);
+			}
+		}
+	}
+}
+
+/**
+ * Give the chunks with the used extents to the pools, and the free extents
+ * to their free lists. The chunks with nothing used become free.
+ */
+static int
+image_chunks_load(const uint8_t *used)
+{
+	for (uint64_t c = 0; c < image.chunk_count; ++c) {
+		if (image.chunk_map[c] == 0)
+			continue;
+		struct pool *p = &extent_pools[image.chunk_map[c] - 1];
+		char *chunk = image.chunks + c * EXTENT_MAX_SIZE;
+		uint32_t slot_count = EXTENT_MAX_SIZE / p->obj_size;
+		uint64_t first = c * IMAGE_SLOTS_PER_CHUNK;
+		uint32_t used_count = 0;
+		for (uint64_t bit = first; bit < first + slot_count; ++bit)
+			used_count += (used[bit / 8] >> (bit % 8)) & 1;
+		if (used_count == 0) {
+			image.chunk_map[c] = 0;
+			continue;
+		}
+		if (pool_adopt_chunk(p, chunk, slot_count) != 0)
+			return -1;
+		for (uint32_t i = 0; i < slot_count; ++i) {
+			uint64_t bit = first + i;
+			if (((used[bit / 8] >> (bit % 8)) & 1) == 0)
+				pool_free(p, chunk + i * p->obj_size);
+		}
+	}
+	return 0;
+}
+
+/**
+ * Validate the mapped image and create its files.
+ * @retval 0 Success.
+ * @retval -1 Error, the code is set.
+ */
+static int
+image_load(void)
+{
+	struct image_super *super = image.super;
+	struct image_super expected;
+	if (image.size < IMAGE_PAGE_SIZE)
+		goto bad_image;
+	image_layout(image.size, &expected);
+	if (memcmp(super->magic, image_magic, sizeof(image_magic)) != 0 ||
+	    super->version != IMAGE_VERSION ||
+	    super->checksum != image_super_checksum(super) ||
+	    super->size != image.size ||
+	    super->chunk_size != expected.chunk_size ||
+	    super->chunk_count != expected.chunk_count ||
+	    super->chunk_count == 0 ||
+	    super->map_offset != expected.map_offset ||
+	    super->meta_offset[0] != expected.meta_offset[0] ||
+	    super->meta_offset[1] != expected.meta_offset[1] ||
+	    super->meta_size != expected.meta_size ||
+	    super->chunk_offset != expected.chunk_offset ||
+	    super->meta_active > 1 || super->meta_used > super->meta_size)
+		goto bad_image;
+	const char *meta = image.base + super->meta_offset[super->meta_active];
+	if (image_checksum(meta, super->meta_used) != super->meta_checksum)
+		goto bad_image;
+	for (uint64_t c = 0; c < image.chunk_count; ++c) {
+		if (image.chunk_map[c] > EXTENT_CLASS_COUNT)
+			goto bad_image;
+	}
+	uint8_t *used = calloc(image.chunk_count, IMAGE_SLOTS_PER_CHUNK / 8);
+	if (used == NULL) {
+		ufs_error_code = UFS_ERR_NO_MEM;
+		return -1;
+	}
+	for (uint64_t pos = 0; pos < super->meta_used;) {
+		const struct image_file *rec = (const void *)(meta + pos);
+		if (super->meta_used - pos < sizeof(*rec) ||
+		    rec->extent_count > IMAGE_MAX_EXTENTS ||
+		    rec->name_len > super->meta_size ||
+		    image_file_size(rec) > super->meta_used - pos ||
+		    image_file_load(rec, used) != 0) {
+			free(used);
+			image_load_rollback();
+			goto bad_image;
+		}
+		pos += image_file_size(rec);
+	}
+	if (extent_ref_count > 0)
+		image_mark_shared(&root_dir);
+	int rc = image_chunks_load(used);
+	free(used);
+	if (rc != 0) {
+		image_load_rollback();
+		ufs_error_code = UFS_ERR_NO_MEM;
+		return -1;
+	}
+	return 0;
+bad_image:
+	ufs_error_code = UFS_ERR_BAD_IMAGE;
+	return -1;
+}
+
+int
+ufs_mount(const char *path, size_t size)
+{
+	/* The data already in the memory would not get into the image. */
+	pthread_mutex_lock(&epoch_mutex);
+	epoch_reclaim_locked();
+	pthread_mutex_unlock(&epoch_mutex);
+	bool is_busy = image.base != NULL || root_dir.entry_count != 0 ||
+		       snapshots != NULL;
+	for (uint32_t i = 0; i < EXTENT_CLASS_COUNT; ++i)
+		is_busy = is_busy || extent_pools[i].used != 0;
+	if (is_busy) {
+		ufs_error_code = UFS_ERR_INVALID_ARG;
+		return -1;
+	}
+	for (uint32_t i = 0; i < EXTENT_CLASS_COUNT; ++i)
+		pool_destroy(&extent_pools[i]);
+	int fd = open(path, O_RDWR | O_CREAT, 0644);
+	if (fd < 0) {
+		ufs_error_code = UFS_ERR_IO;
+		return -1;
+	}
+	struct stat st;
+	if (fstat(fd, &st) != 0) {
+		close(fd);
+		ufs_error_code = UFS_ERR_IO;
+		return -1;
+	}
+	struct image_super super;
+	bool is_new = st.st_size == 0;
+	if (is_new) {
+		image_layout(size, &super);
+		if (super.chunk_count == 0) {
+			close(fd);
+			ufs_error_code = UFS_ERR_INVALID_ARG;
+			return -1;
+		}
+		if (ftruncate(fd, size) != 0) {
+			close(fd);
+			ufs_error_code = UFS_ERR_IO;
+			return -1;
+		}
+	} else {
+		size = st.st_size;
+	}
+	char *base = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED,
+			  fd, 0);
+	if (base == MAP_FAILED) {
+		close(fd);
+		ufs_error_code = UFS_ERR_IO;
+		return -1;
+	}
+	image.fd = fd;
+	image.base = base;
+	image.size = size;
+	image.super = (struct image_super *)base;
+	if (is_new)
+		*image.super = super;
+	else
+		image_layout(size, &super);
+	image.chunk_map = (uint8_t *)base + super.map_offset;
+	image.chunks = base + super.chunk_offset;
+	image.chunk_count = super.chunk_count;
+	image.chunk_state = calloc(image.chunk_count, 1);
+	if (image.chunk_state == NULL) {
+		image_unmap();
+		ufs_error_code = UFS_ERR_NO_MEM;
+		return -1;
+	}
+	if (!is_new && image_load() != 0) {
+		image_unmap();
+		return -1;
+	}
+	/* Without it the write backs and the evictions are on sync only. */
+	image.is_flusher_started = pthread_create(&image.flusher, NULL,
+						  image_flusher_f, NULL) == 0;
+	return 0;
+}
+
+/** State of writing the tree into a metadata area. */
+struct image_writer {
+	char *meta;
+	uint64_t used;
+	uint64_t size;
+	/** Path of the current directory, with a slash in the end. */
+	char *path;
+	size_t path_len;
+	size_t path_capacity;
+};
+
+/** Append the record of the entry to the metadata area. */
+static int
+image_write_entry(struct image_writer *w, struct dentry *d)
+{
+	struct file *f = d->is_dir ? NULL : dentry_file(d);
+	struct image_file rec = {0};
+	if (f != NULL) {
+		pthread_rwlock_rdlock(&f->lock);
+		rec.size = f->size;
+		rec.extent_count = f->extent_count;
+	}
+	rec.name_len = w->path_len + d->name_len + d->is_dir;
+	size_t rec_size = image_file_size(&rec);
+	int rc = -1;
+	if (rec_size <= w->size - w->used) {
+		char *pos = w->meta + w->used;
+		memset(pos, 0, rec_size);
+		memcpy(pos, &rec, sizeof(rec));
+		uint64_t *offsets = (uint64_t *)(pos + sizeof(rec));
+		for (uint32_t j = 0; j < rec.extent_count; ++j) {
+			char *data = extent_data(f->extents[j]);
+			/* The superblock is at 0, it means a hole. */
+			offsets[j] = data == NULL ? 0 : data - image.base;
+		}
+		char *name = (char *)(offsets + rec.extent_count);
+		if (w->path_len > 0)
+			memcpy(name, w->path, w->path_len);
+		memcpy(name + w->path_len, d->name, d->name_len);
+		if (d->is_dir)
+			name[rec.name_len - 1] = '/';
+		w->used += rec_size;
+		rc = 0;
+	}
+	if (f != NULL)
+		pthread_rwlock_unlock(&f->lock);
+	return rc;
+}
+
+/** Write the records of everything in the directory. */
+static int
+image_write_dir(struct image_writer *w, struct dir *dir)
+{
+	for (uint32_t i = 0; i < dir->entry_capacity; ++i) {
+		struct dentry *d = dir->entries[i];
+		if (d == NULL)
+			continue;
+		if (image_write_entry(w, d) != 0)
+			return -1;
+		if (!d->is_dir)
+			continue;
+		size_t len = w->path_len;
+		size_t new_len = len + d->name_len + 1;
+		if (new_len > w->path_capacity) {
+			char *path = realloc(w->path, new_len * 2);
+			if (path == NULL)
+				return -1;
+			w->path = path;
+			w->path_capacity = new_len * 2;
+		}
+		memcpy(w->path + len, d->name, d->name_len);
+		w->path[new_len - 1] = '/';
+		w->path_len = new_len;
+		int rc = image_write_dir(w, dentry_dir(d));
+		w->path_len = len;
+		if (rc != 0)
+			return -1;
+	}
+	return 0;
+}
+
+int
+ufs_sync(void)
+{
+	if (image.base == NULL)
+		return 0;
+	pthread_mutex_lock(&image_sync_mutex);
+	struct image_super *super = image.super;
+	uint32_t next = 1 - super->meta_active;
+	struct image_writer w = {
+		.meta = image.base + super->meta_offset[next],
+		.size = super->meta_size,
+	};
+	/* No files can appear or disappear meanwhile. */
+	pthread_rwlock_rdlock(&namespace_lock);
+	int rc = image_write_dir(&w, &root_dir);
+	pthread_rwlock_unlock(&namespace_lock);
+	free(w.path);
+	if (rc != 0) {
+		ufs_error_code = UFS_ERR_NO_MEM;
+		goto out;
+	}
+	/* The data and the list go to the disk before the superblock. */
+	pthread_mutex_lock(&image.cache_mutex);
+	bool is_synced = image_chunk_runs(CHUNK_DIRTY | CHUNK_UNSYNCED,
+					  image_chunks_sync) == 0;
+	if (is_synced)
+		image_evict();
+	pthread_mutex_unlock(&image.cache_mutex);
+	rc = -1;
+	if (!is_synced || msync(image.base, super->chunk_offset, MS_SYNC) != 0)
+		goto io_error;
+	super->meta_active = next;
+	super->meta_used = w.used;
+	super->meta_checksum = image_checksum(w.meta, w.used);
+	++super->sync_count;
+	super->checksum = image_super_checksum(super);
+	if (msync(image.base, IMAGE_PAGE_SIZE, MS_SYNC) != 0)
+		goto io_error;
+	rc = 0;
+	goto out;
+io_error:
+	ufs_error_code = UFS_ERR_IO;
+out:
+	pthread_mutex_unlock(&image_sync_mutex);
+	return rc;
+}
+
+void
+ufs_cache_limit(size_t size)
+{
+	uint64_t limit = (size + EXTENT_MAX_SIZE - 1) / EXTENT_MAX_SIZE;
+	__atomic_store_n(&image.resident_limit, limit, __ATOMIC_RELAXED);
+	if (image.base != NULL && limit != 0)
+		image_flusher_wake();
+}
+
+void
+ufs_cache_stats(struct ufs_cache_stats *stats)
+{
+	memset(stats, 0, sizeof(*stats));
+	if (image.base == NULL)
+		return;
+	stats->resident = __atomic_load_n(&image.resident_count,
+					  __ATOMIC_RELAXED) * EXTENT_MAX_SIZE;
+	stats->dirty = __atomic_load_n(&image.dirty_count,
+				       __ATOMIC_RELAXED) * EXTENT_MAX_SIZE;
+	stats->flushed = __atomic_load_n(&image.flushed, __ATOMIC_RELAXED);
+	stats->flush_count = __atomic_load_n(&image.flush_count,
+					     __ATOMIC_RELAXED);
+	stats->readahead = __atomic_load_n(&image.readahead,
+					   __ATOMIC_RELAXED);
+	stats->evicted = __atomic_load_n(&image.evicted, __ATOMIC_RELAXED);
+}
+
+void
+ufs_destroy(void)
+{
+	if (image.base != NULL)
+		ufs_sync();
+	/* Deleted files live until their last descriptor is closed. */
+	while (fd_table != NULL && file_descriptor_count > 0) {
+		for (int fd = 0; fd < fd_table->capacity; ++fd) {
+			if (fd_table->descs[fd] != NULL)
+				ufs_close(fd);
+		}
+	}
+	free(fd_table);
+	free(fd_busy);
+	free(fd_full);
+	fd_table = NULL;
+	fd_busy = NULL;
+	fd_full = NULL;
+	file_descriptor_count = 0;
+	fd_shrink_count = 0;
+	dir_clear(&root_dir, file_unload);
+	path_cache_clear();
+	while (snapshots != NULL)
+		ufs_snapshot_delete(snapshots);
+	/* No threads are inside of the operations, everything can go. */
+	while (epoch_retired != NULL) {
+		struct retired *r = epoch_retired;
+		epoch_retired = r->next;
+		r->destroy(r);
+	}
+	epoch_retired_count = 0;
+	while (epoch_readers != NULL) {
+		struct epoch_reader *r = epoch_readers;
+		epoch_readers = r->next;
+		free(r);
+	}
+	++epoch_generation;
+	free(extent_refs);
+	extent_refs = NULL;
+	extent_ref_capacity = 0;
+	extent_ref_count = 0;
+	pool_destroy(&file_pool);
+	pool_destroy(&name_pool);
+	pool_destroy(&filedesc_pool);
+	for (uint32_t i = 0; i < EXTENT_CLASS_COUNT; ++i)
+		pool_destroy(&extent_pools[i]);
+	if (image.base != NULL)
+		image_unmap();
+	image.resident_limit = 0;
+}
+
+int
+ufs_pool_stats(struct ufs_pool_stats *stats, int count)
+{
+	/* Don't count the objects which are already dropped. */
+	pthread_mutex_lock(&epoch_mutex);
+	epoch_reclaim_locked();
+	pthread_mutex_unlock(&epoch_mutex);
+	struct pool *pools[] = {&file_pool, &name_pool, &filedesc_pool};
+	int pool_count = sizeof(pools) / sizeof(pools[0]);
+	int i = 0;
+	for (; i < pool_count && i < count; ++i)
+		pool_stats(pools[i], &stats[i]);
+	for (int j = 0; j < EXTENT_CLASS_COUNT && i < count; ++j, ++i)
+		pool_stats(&extent_pools[j], &stats[i]);
+	return pool_count + EXTENT_CLASS_COUNT;
 }
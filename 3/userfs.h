@@ -1,12 +1,21 @@
 #pragma once
 
+#include <stdbool.h>
+#include <stdint.h>
 #include <sys/types.h>
+#include <sys/uio.h>
 
 /**
  * User-defined in-memory filesystem. It is as simple as possible.
- * Each file lies in the memory as an array of blocks. A file
- * has an unique file name, and there are no directories, so the
- * FS is a monolithic flat contiguous folder.
+ * Each file lies in the memory as an array of blocks. Files are
+ * organized in directories. A path consists of names separated by
+ * slashes, the leading slash is optional, and an empty path means
+ * the root directory. The parent directories of a file have to be
+ * created with ufs_mkdir() before the file. There are no special
+ * "." and ".." names.
+ *
+ * All the functions except ufs_destroy() can be called from many
+ * threads at once. Reads of the same file go in parallel.
  */
 
 /**
@@ -24,6 +33,8 @@
  * because it is used by tests.
  */
 
+#define NEED_RESIZE
+
 /**
  * Flags for ufs_open call.
  */
@@ -60,6 +71,19 @@ enum ufs_error_code {
 	UFS_ERR_NO_FILE,
 	UFS_ERR_NO_MEM,
 	UFS_ERR_NOT_IMPLEMENTED,
+	UFS_ERR_INVALID_ARG,
+	/** A system call on the image file failed, see errno. */
+	UFS_ERR_IO,
+	/** The image file is not a valid userfs image. */
+	UFS_ERR_BAD_IMAGE,
+	/** The path is taken already. */
+	UFS_ERR_EXISTS,
+	/** A component of the path is a file, not a directory. */
+	UFS_ERR_NOT_DIR,
+	/** The path is a directory, not a file. */
+	UFS_ERR_IS_DIR,
+	/** The directory has entries. */
+	UFS_ERR_NOT_EMPTY,
 
 #ifdef NEED_OPEN_FLAGS
 
@@ -67,7 +91,7 @@ enum ufs_error_code {
 #endif
 };
 
-/** Get code of the last error. */
+/** Get code of the last error in the calling thread. */
 enum ufs_error_code
 ufs_errno();
 
@@ -79,7 +103,10 @@ ufs_errno();
  * @retval > 0 File descriptor.
  * @retval -1 Error occurred. Check ufs_errno() for a code.
  *     - UFS_ERR_NO_FILE - no such file, and UFS_CREATE flag is
- *       not specified.
+ *       not specified. Or no parent directory.
+ *     - UFS_ERR_NOT_DIR - a parent is not a directory.
+ *     - UFS_ERR_IS_DIR - the path is a directory.
+ *     - UFS_ERR_INVALID_ARG - the path has an empty name.
  */
 int
 ufs_open(const char *filename, int flags);
@@ -108,6 +135,7 @@ ufs_write(int fd, const char *buf, size_t size);
  * @retval 0 EOF.
  * @retval -1 Error occurred. Check ufs_errno() for a code.
  *     - UFS_ERR_NO_FILE - invalid file descriptor.
+ *     - UFS_ERR_NO_MEM - not enough memory to decompress the data.
  */
 ssize_t
 ufs_read(int fd, char *buf, size_t size);
@@ -133,10 +161,149 @@ ufs_close(int fd);
  * @param filename Name of a file to delete.
  * @retval -1 Error occurred. Check ufs_errno() for a code.
  *     - UFS_ERR_NO_FILE - no such file.
+ *     - UFS_ERR_IS_DIR - the path is a directory, see ufs_rmdir().
  */
 int
 ufs_delete(const char *filename);
 
+/** Origin of the offset in ufs_seek(). */
+enum ufs_seek_whence {
+	/** From the file beginning. */
+	UFS_SEEK_SET = 0,
+	/** From the current position of the descriptor. */
+	UFS_SEEK_CUR,
+	/** From the file end. */
+	UFS_SEEK_END,
+};
+
+/**
+ * Move the descriptor position. The position can be beyond the
+ * file end, then a write there fills the gap with zeros. It takes
+ * the same time regardless of the file size and the distance.
+ * @param fd File descriptor from ufs_open().
+ * @param offset Offset relative to @a whence.
+ * @param whence One of enum ufs_seek_whence.
+ *
+ * @retval >= 0 New position.
+ * @retval -1 Error occurred. Check ufs_errno() for a code.
+ *     - UFS_ERR_NO_FILE - invalid file descriptor.
+ *     - UFS_ERR_INVALID_ARG - invalid @a whence, or the new
+ *       position is negative or beyond the max file size.
+ */
+off_t
+ufs_seek(int fd, off_t offset, int whence);
+
+/**
+ * Read data from the given offset. The descriptor position is not
+ * used and not changed.
+ * @param fd File descriptor from ufs_open().
+ * @param buf Buffer to read into.
+ * @param size Maximum bytes to read.
+ * @param offset Offset in the file to read from.
+ *
+ * @retval >= 0 How many bytes were read. 0 means the offset is at
+ *         or beyond the file end.
+ * @retval -1 Error occurred. Check ufs_errno() for a code.
+ *     - UFS_ERR_NO_FILE - invalid file descriptor.
+ *     - UFS_ERR_NO_MEM - not enough memory to decompress the data.
+ */
+ssize_t
+ufs_pread(int fd, char *buf, size_t size, size_t offset);
+
+/**
+ * Write data at the given offset. The descriptor position is not
+ * used and not changed. A gap between the file end and the offset
+ * is filled with zeros.
+ * @param fd File descriptor from ufs_open().
+ * @param buf Buffer to write.
+ * @param size Size of @a buf.
+ * @param offset Offset in the file to write to.
+ *
+ * @retval >= 0 How many bytes were written.
+ * @retval -1 Error occurred. Check ufs_errno() for a code.
+ *     - UFS_ERR_NO_FILE - invalid file descriptor.
+ *     - UFS_ERR_NO_MEM - not enough memory, or the write would
+ *       exceed the max file size.
+ */
+ssize_t
+ufs_pwrite(int fd, const char *buf, size_t size, size_t offset);
+
+/**
+ * Read data into several buffers, filling them one by one, from
+ * the descriptor position. Like ufs_read(), but the whole read is
+ * done at once.
+ * @param fd File descriptor from ufs_open().
+ * @param iov Buffers.
+ * @param iovcnt Number of the buffers.
+ *
+ * @retval >= 0 How many bytes were read.
+ * @retval -1 Error occurred. Check ufs_errno() for a code.
+ *     - UFS_ERR_NO_FILE - invalid file descriptor.
+ *     - UFS_ERR_NO_MEM - not enough memory to decompress the data.
+ *     - UFS_ERR_INVALID_ARG - @a iovcnt is negative.
+ */
+ssize_t
+ufs_readv(int fd, const struct iovec *iov, int iovcnt);
+
+/**
+ * Write data from several buffers, one after another, at the
+ * descriptor position. Other writers can't get in between.
+ * @param fd File descriptor from ufs_open().
+ * @param iov Buffers.
+ * @param iovcnt Number of the buffers.
+ *
+ * @retval >= 0 How many bytes were written. Less than the total
+ *         size only if the file can't grow anymore.
+ * @retval -1 Error occurred. Check ufs_errno() for a code.
+ *     - UFS_ERR_NO_FILE - invalid file descriptor.
+ *     - UFS_ERR_INVALID_ARG - @a iovcnt is negative.
+ *     - UFS_ERR_NO_MEM - not enough memory, nothing is written.
+ */
+ssize_t
+ufs_writev(int fd, const struct iovec *iov, int iovcnt);
+
+/**
+ * File data right in the memory of the file system. The data is
+ * pinned: it does not change and stays valid until the view is
+ * released, even if the file is written, truncated or deleted.
+ * The writers don't wait for it, they write into a copy of the
+ * pinned blocks.
+ */
+struct ufs_view {
+	/**
+	 * Pieces of the data in the file order. Can be passed right
+	 * to writev(2) or sendmsg(2).
+	 */
+	struct iovec *iov;
+	int iovcnt;
+	/** Total size. Less than requested at the file end. */
+	size_t size;
+	/** The rest is internal. */
+	size_t offset;
+	uint32_t first_extent;
+	struct iovec inline_iov[4];
+};
+
+/**
+ * Get a view of the file data, without copying it. The descriptor
+ * position is not used and not changed.
+ * @param fd File descriptor from ufs_open().
+ * @param offset Offset in the file.
+ * @param size How many bytes to view.
+ * @param[out] view The view. Free it with ufs_view_release().
+ *
+ * @retval 0 Success.
+ * @retval -1 Error occurred. Check ufs_errno() for a code.
+ *     - UFS_ERR_NO_FILE - invalid file descriptor.
+ *     - UFS_ERR_NO_MEM - not enough memory.
+ */
+int
+ufs_read_view(int fd, size_t offset, size_t size, struct ufs_view *view);
+
+/** Unpin the data of the view. */
+void
+ufs_view_release(struct ufs_view *view);
+
 #ifdef NEED_RESIZE
 
 /**
@@ -162,10 +329,387 @@ ufs_resize(int fd, size_t new_size);
 
 #endif
 
+/**
+ * Make file @a dst a copy of file @a src. The copy takes no memory
+ * for the data and O(number of extents) time: the files share the
+ * memory blocks until one of them writes into a block. If @a dst
+ * exists, its content is replaced, and its opened descriptors see
+ * the new one.
+ * @param src Name of the file to copy.
+ * @param dst Name of the copy.
+ *
+ * @retval 0 Success.
+ * @retval -1 Error occurred. Check ufs_errno() for a code.
+ *     - UFS_ERR_NO_FILE - no file @a src, or no parent directory
+ *       of @a dst.
+ *     - UFS_ERR_IS_DIR - @a src or @a dst is a directory.
+ *     - UFS_ERR_NO_MEM - not enough memory.
+ */
+int
+ufs_clone(const char *src, const char *dst);
+
+/**
+ * Create a directory.
+ * @param path Path of the new directory.
+ *
+ * @retval 0 Success.
+ * @retval -1 Error occurred. Check ufs_errno() for a code.
+ *     - UFS_ERR_EXISTS - the path is taken.
+ *     - UFS_ERR_NO_FILE - no parent directory.
+ *     - UFS_ERR_NOT_DIR - a parent is not a directory.
+ *     - UFS_ERR_INVALID_ARG - the path has an empty name.
+ *     - UFS_ERR_NO_MEM - not enough memory.
+ */
+int
+ufs_mkdir(const char *path);
+
+/**
+ * Delete an empty directory.
+ * @param path Path of the directory.
+ *
+ * @retval 0 Success.
+ * @retval -1 Error occurred. Check ufs_errno() for a code.
+ *     - UFS_ERR_NO_FILE - no such directory.
+ *     - UFS_ERR_NOT_DIR - the path is not a directory.
+ *     - UFS_ERR_NOT_EMPTY - the directory has entries.
+ *     - UFS_ERR_INVALID_ARG - it is the root, or the path has an
+ *       empty name.
+ */
+int
+ufs_rmdir(const char *path);
+
+/** An entry of a directory listing. */
+struct ufs_dirent {
+	/** Name inside of the directory, valid during the callback. */
+	const char *name;
+	bool is_dir;
+};
+
+/**
+ * Called by ufs_readdir() for each entry. Non-zero result stops
+ * the listing.
+ */
+typedef int
+(*ufs_readdir_f)(const struct ufs_dirent *entry, void *arg);
+
+/**
+ * List a directory. The order of the entries is unspecified. The
+ * time depends only on the size of this directory. The namespace
+ * is locked for reading meanwhile, so the callback must not
+ * create, delete or rename anything.
+ * @param path Path of the directory.
+ * @param cb Callback for each entry.
+ * @param arg Argument for @a cb.
+ *
+ * @retval 0 Success.
+ * @retval -1 Error occurred. Check ufs_errno() for a code.
+ *     - UFS_ERR_NO_FILE - no such directory.
+ *     - UFS_ERR_NOT_DIR - the path is not a directory.
+ *     - UFS_ERR_INVALID_ARG - the path has an empty name.
+ */
+int
+ufs_readdir(const char *path, ufs_readdir_f cb, void *arg);
+
+/**
+ * Move a file or a directory to another path. When a file is
+ * moved, an existing file at @a new_path is replaced like with
+ * ufs_delete(). Opened descriptors of the moved file stay valid.
+ * @param old_path Path of a file or a directory.
+ * @param new_path New path.
+ *
+ * @retval 0 Success.
+ * @retval -1 Error occurred. Check ufs_errno() for a code.
+ *     - UFS_ERR_NO_FILE - no @a old_path, or no parent directory
+ *       of @a new_path.
+ *     - UFS_ERR_NOT_DIR - a parent is not a directory.
+ *     - UFS_ERR_EXISTS - @a new_path is a directory, or a
+ *       directory is moved to an existing file.
+ *     - UFS_ERR_INVALID_ARG - the root is moved, a directory is
+ *       moved into itself, or a path has an empty name.
+ *     - UFS_ERR_NO_MEM - not enough memory.
+ */
+int
+ufs_rename(const char *old_path, const char *new_path);
+
+/** Operation codes of the submission queue, see ufs_queue_submit(). */
+enum ufs_op_code {
+	/** Like ufs_read(). */
+	UFS_OP_READ,
+	/** Like ufs_write(). */
+	UFS_OP_WRITE,
+	/** Like ufs_pread(). */
+	UFS_OP_PREAD,
+	/** Like ufs_pwrite(). */
+	UFS_OP_PWRITE,
+	/** Like ufs_open(). */
+	UFS_OP_OPEN,
+	/** Like ufs_close(). */
+	UFS_OP_CLOSE,
+};
+
+/** One operation of the submission queue. */
+struct ufs_op {
+	enum ufs_op_code code;
+	/** Descriptor, for all but UFS_OP_OPEN. */
+	int fd;
+	/** File name and open_flags, for UFS_OP_OPEN. */
+	const char *filename;
+	int flags;
+	/** Data to write or space to read into. */
+	char *buf;
+	size_t size;
+	/** File position, for UFS_OP_PREAD and UFS_OP_PWRITE. */
+	size_t offset;
+	/** Not used by the queue, it is for the caller. */
+	void *user_data;
+	/**
+	 * Result like of the same ufs function: byte count, a new
+	 * descriptor or 0 for close. On -1 the code is in @a error.
+	 */
+	ssize_t result;
+	enum ufs_error_code error;
+	/** Internal, the queue links the operations with it. */
+	struct ufs_op *next;
+};
+
+/**
+ * Queue of operations run by a pool of worker threads. The caller
+ * fills an array of operations, submits it in one call, and reaps
+ * the completions later. The operations on one descriptor run in
+ * the order of submission, one after another, so the descriptor is
+ * looked up once per such run. The operations on different
+ * descriptors go in parallel. Opens are not ordered with anything.
+ */
+struct ufs_queue;
+
+/**
+ * Create a queue and start its workers.
+ * @param worker_count Number of threads, at least 1. More than
+ *        64 are not started.
+ *
+ * @retval Not NULL Queue. Free it with ufs_queue_delete().
+ * @retval NULL Error occurred. Check ufs_errno() for a code.
+ *     - UFS_ERR_INVALID_ARG - @a worker_count is less than 1.
+ *     - UFS_ERR_NO_MEM - not enough memory or threads.
+ */
+struct ufs_queue *
+ufs_queue_new(int worker_count);
+
+/**
+ * Submit operations. They must not be changed or freed until they
+ * are reaped by ufs_queue_reap().
+ * @param ops Array of the operations.
+ * @param count Size of @a ops.
+ *
+ * @retval >= 0 Number of the submitted operations, @a count.
+ * @retval -1 Error occurred. Check ufs_errno() for a code.
+ *     - UFS_ERR_INVALID_ARG - @a count is negative, or an
+ *       operation code is unknown. Nothing is submitted then.
+ */
+int
+ufs_queue_submit(struct ufs_queue *q, struct ufs_op *ops, int count);
+
+/**
+ * Take the completed operations, in the order of completion.
+ * @param done Array to fill with pointers to the operations.
+ * @param count Size of @a done.
+ * @param min_count Wait until that many operations are completed,
+ *        or until nothing is in progress.
+ *
+ * @retval Number of the operations put into @a done.
+ */
+int
+ufs_queue_reap(struct ufs_queue *q, struct ufs_op **done, int count,
+	       int min_count);
+
+/**
+ * Wait for all the submitted operations, stop the workers and free
+ * the queue. The operations not reaped yet are just forgotten. The
+ * queues have to be deleted before ufs_destroy().
+ */
+void
+ufs_queue_delete(struct ufs_queue *q);
+
+/** A frozen copy of all the files and directories. */
+struct ufs_snapshot;
+
+/**
+ * Take a snapshot of all the files. Like ufs_clone(), it shares
+ * the data with the files, and costs memory only for the blocks
+ * written afterwards. Each file is captured at some moment during
+ * the call.
+ *
+ * @retval Not NULL Snapshot. Free it with ufs_snapshot_delete().
+ * @retval NULL Error occurred. Check ufs_errno() for a code.
+ *     - UFS_ERR_NO_MEM - not enough memory.
+ */
+struct ufs_snapshot *
+ufs_snapshot(void);
+
+/**
+ * Bring all the files and directories back to the state of the
+ * snapshot. The current files are deleted like with ufs_delete():
+ * their opened descriptors keep working on the old content. The
+ * snapshot stays and can be restored again.
+ *
+ * @retval 0 Success.
+ * @retval -1 Error occurred. Check ufs_errno() for a code.
+ *     - UFS_ERR_NO_MEM - not enough memory. Nothing is changed.
+ */
+int
+ufs_snapshot_restore(struct ufs_snapshot *snap);
+
+/** Free the snapshot. The files are not affected. */
+void
+ufs_snapshot_delete(struct ufs_snapshot *snap);
+
+/**
+ * Compact the content of the files not read nor written since the
+ * previous call. Equal extents are merged into one shared copy,
+ * and the rest are compressed if that saves 1/8 of them at least.
+ * Reading or writing a compressed extent decompresses it back, so
+ * the files in use stay plain. Does nothing when an image is
+ * mounted, it keeps the data in place.
+ *
+ * @retval 0 Success.
+ * @retval -1 Error occurred. Check ufs_errno() for a code.
+ *     - UFS_ERR_NO_MEM - not enough memory. A part of the files can
+ *       be compacted.
+ */
+int
+ufs_compact(void);
+
+/** Memory taken by the content of the files, see ufs_compact(). */
+struct ufs_space_stats {
+	/** Sum of the sizes of the files in the tree. */
+	uint64_t logical;
+	/**
+	 * Bytes of the content of all the files in the memory. A shared
+	 * extent is counted once, a compressed one by its compressed
+	 * size.
+	 */
+	uint64_t physical;
+	/** Compressed extents and their bytes. */
+	uint64_t packed_count;
+	uint64_t packed_size;
+	/** How many extents the compactions merged with equal ones. */
+	uint64_t deduplicated;
+};
+
+void
+ufs_space_stats(struct ufs_space_stats *stats);
+
+/**
+ * Keep the data in an image file instead of the memory, so as it
+ * survives restarts. The file is mmap()-ed, and the file content
+ * is read and written right there. The names and sizes of the
+ * files are saved on ufs_sync() and on ufs_destroy(). Snapshots
+ * are not saved. A background thread writes the changed data
+ * back meanwhile, see ufs_cache_limit().
+ *
+ * The image has a fixed size. A new one is created if @a path does
+ * not exist or is empty. An existing image is validated and its
+ * files become available, that is all the loading.
+ *
+ * It has to be called before any file is created. The process must
+ * not fork() after it: the child would have no background thread,
+ * and could inherit its mutex locked. Daemons mount after the fork.
+ * @param path Image file path.
+ * @param size Size of a new image. Ignored for an existing one.
+ *
+ * @retval 0 Success.
+ * @retval -1 Error occurred. Check ufs_errno() for a code.
+ *     - UFS_ERR_INVALID_ARG - an image is mounted already, there are
+ *       files, or @a size is too small.
+ *     - UFS_ERR_IO - could not open, resize or map the file.
+ *     - UFS_ERR_BAD_IMAGE - the file is not a valid image.
+ *     - UFS_ERR_NO_MEM - not enough memory.
+ */
+int
+ufs_mount(const char *path, size_t size);
+
+/**
+ * Save the list of the files and flush all the data of the image
+ * to the disk. After a crash the files are as of the last sync,
+ * except that the content written after it can be seen partially.
+ * Does nothing when no image is mounted.
+ *
+ * @retval 0 Success.
+ * @retval -1 Error occurred. Check ufs_errno() for a code.
+ *     - UFS_ERR_NO_MEM - the file list does not fit into the
+ *       metadata area of the image, or not enough memory.
+ *     - UFS_ERR_IO - msync() failed.
+ */
+int
+ufs_sync(void);
+
+/**
+ * Limit the memory the data of the image can take. The data is
+ * cached in chunks of 1MB. Above the limit the least recently
+ * used chunks are dropped from the memory by a background thread
+ * and by ufs_sync(), after their changes are on the disk. The
+ * changes are written back in batches in background anyway, and
+ * sequential reads prefetch the data ahead.
+ * @param size Limit in bytes, 0 means no limit. That is the default.
+ */
+void
+ufs_cache_limit(size_t size);
+
+/** State of the cache of the image data, see ufs_cache_limit(). */
+struct ufs_cache_stats {
+	/** Bytes of the chunks accessed and not dropped since. */
+	size_t resident;
+	/** Bytes of the chunks changed and not written back yet. */
+	size_t dirty;
+	/** Bytes of the chunks written back in background. */
+	uint64_t flushed;
+	/** How many batches the background write backs took. */
+	uint64_t flush_count;
+	/** Bytes prefetched ahead of sequential reads. */
+	uint64_t readahead;
+	/** Bytes dropped from the memory. */
+	uint64_t evicted;
+};
+
+/**
+ * Get the state of the cache of the image data. All zeros when no
+ * image is mounted.
+ */
+void
+ufs_cache_stats(struct ufs_cache_stats *stats);
+
+/** Memory usage of one of the internal object pools. */
+struct ufs_pool_stats {
+	/** Which objects are in the pool, like "file" or "extent_4K". */
+	const char *name;
+	size_t object_size;
+	/** How many objects are in use now. */
+	size_t used;
+	/** How many chunks are taken from the system. */
+	size_t chunk_count;
+	/** Bytes taken from the system. */
+	size_t reserved;
+};
+
+/**
+ * Get memory usage of the internal object pools. The memory is
+ * taken from the system in big chunks and is given back only in
+ * ufs_destroy().
+ * @param stats Array to fill.
+ * @param count Size of @a stats.
+ *
+ * @retval Number of the pools. If it is bigger than @a count, only
+ *         the first @a count pools are reported.
+ */
+int
+ufs_pool_stats(struct ufs_pool_stats *stats, int count);
+
 /**
  * Destroy all the global variables, free all the memory, close and delete all
- * the files. After the destruction neither of the ufs functions are supposed to
- * be used. Purpose of the destruction is to reclaim all the dynamic memory.
+ * the files and snapshots. A mounted image is synced and unmapped, the files
+ * stay in it. After the destruction neither of the ufs functions are supposed
+ * to be used. Purpose of the destruction is to reclaim all the dynamic memory.
+ * No other threads can be inside of ufs functions during the call.
  */
 void
 ufs_destroy(void);
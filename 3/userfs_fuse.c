@@ -0,0 +1,908 @@
+/**
+ * FUSE frontend of userfs. It mounts userfs as a real filesystem, so as the
+ * standard tools like cp, tar and fio work on it, and it can be compared with
+ * tmpfs. Build with 'make fuse', needs libfuse3:
+ *
+ *     ./userfs_fuse <mountpoint> [-f] [-s]
+ *                   [--image=<path>] [--image-size=<MB>]
+ *
+ * Requests are handled by many threads unless -s is given, userfs is
+ * thread-safe. With --image the files are kept in an image file, see
+ * ufs_mount().
+ *
+ * The kernel addresses files by inode numbers, and userfs - by paths. So the
+ * daemon keeps a node for each path the kernel has looked up and not yet
+ * forgotten, and the address of the node is the inode number. Renames and
+ * deletions update the nodes. Opened files are accessed by userfs descriptors
+ * only, so they keep working after a rename or a deletion, like in POSIX.
+ *
+ * Reads are replied with the pieces of the file returned by ufs_read_view()
+ * directly, so the data goes to the kernel without a copy in userspace.
+ */
+#define FUSE_USE_VERSION 31
+
+#include "userfs.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <fuse_lowlevel.h>
+#include <pthread.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+enum {
+	/** How long the kernel can cache names and attributes, seconds. */
+	FS_CACHE_TIMEOUT = 1,
+};
+
+/** A path known to the kernel. */
+struct node {
+	/** Path in userfs. Empty for the root. */
+	char *path;
+	uint32_t hash;
+	bool is_dir;
+	/** The path still leads to this node, it is in the node table. */
+	bool is_linked;
+	/** How many times the kernel has got the node, see fs_forget(). */
+	uint64_t nlookup;
+	/** Next node in the same bucket of the table. */
+	struct node *next;
+};
+
+/**
+ * Nodes by path. A hash table with chaining, its capacity is a power of 2.
+ * The root is not in it, its inode number is fixed.
+ */
+static struct node **node_table = NULL;
+static uint32_t node_count = 0;
+static uint32_t node_capacity = 0;
+static pthread_mutex_t node_mutex = PTHREAD_MUTEX_INITIALIZER;
+static struct node root_node = {.path = "", .is_dir = true, .is_linked = true};
+
+/** The times of all the files, userfs has no times. */
+static time_t fs_start_time;
+
+static struct node *
+node_of(fuse_ino_t ino)
+{
+	if (ino == FUSE_ROOT_ID)
+		return &root_node;
+	return (struct node *)(uintptr_t)ino;
+}
+
+static fuse_ino_t
+node_ino(struct node *node)
+{
+	if (node == &root_node)
+		return FUSE_ROOT_ID;
+	return (fuse_ino_t)(uintptr_t)node;
+}
+
+static uint32_t
+path_hash(const char *path)
+{
+	/* FNV-1a. */
+	uint32_t h = 2166136261u;
+	for (; *path != 0; ++path)
+		h = (h ^ (unsigned char)*path) * 16777619u;
+	return h;
+}
+
+static struct node **
+node_bucket(uint32_t hash)
+{
+	return &node_table[hash & (node_capacity - 1)];
+}
+
+static struct node *
+node_find_locked(const char *path, uint32_t hash)
+{
+	if (node_count == 0)
+		return NULL;
+	struct node *node = *node_bucket(hash);
+	for (; node != NULL; node = node->next) {
+		if (node->hash == hash && strcmp(node->path, path) == 0)
+			break;
+	}
+	return node;
+}
+
+static void
+node_insert_locked(struct node *node)
+{
+	struct node **bucket = node_bucket(node->hash);
+	node->next = *bucket;
+	*bucket = node;
+	node->is_linked = true;
+	++node_count;
+}
+
+static void
+node_remove_locked(struct node *node)
+{
+	struct node **pos = node_bucket(node->hash);
+	while (*pos != node)
+		pos = &(*pos)->next;
+	*pos = node->next;
+	node->next = NULL;
+	node->is_linked = false;
+	--node_count;
+}
+
+static int
+node_table_grow_locked(void)
+{
+	uint32_t capacity = node_capacity == 0 ? 1024 : node_capacity * 2;
+	struct node **table = calloc(capacity, sizeof(*table));
+	if (table == NULL)
+		return -1;
+	for (uint32_t i = 0; i < node_capacity; ++i) {
+		struct node *node = node_table[i];
+		while (node != NULL) {
+			struct node *next = node->next;
+			struct node **bucket =
+				&table[node->hash & (capacity - 1)];
+			node->next = *bucket;
+			*bucket = node;
+			node = next;
+		}
+	}
+	free(node_table);
+	node_table = table;
+	node_capacity = capacity;
+	return 0;
+}
+
+static void
+node_delete(struct node *node)
+{
+	free(node->path);
+	free(node);
+}
+
+/**
+ * Get the node of the path for the kernel, creating it if needed. The path
+ * is taken by the node.
+ */
+static struct node *
+node_get(char *path, bool is_dir)
+{
+	uint32_t hash = path_hash(path);
+	pthread_mutex_lock(&node_mutex);
+	struct node *node = node_find_locked(path, hash);
+	if (node != NULL) {
+		free(path);
+	} else if (node_count >= node_capacity &&
+		   node_table_grow_locked() != 0) {
+		free(path);
+	} else if ((node = calloc(1, sizeof(*node))) == NULL) {
+		free(path);
+	} else {
+		node->path = path;
+		node->hash = hash;
+		node_insert_locked(node);
+	}
+	if (node != NULL) {
+		node->is_dir = is_dir;
+		++node->nlookup;
+	}
+	pthread_mutex_unlock(&node_mutex);
+	return node;
+}
+
+/** The path does not lead to its node anymore. */
+static void
+node_unlink(const char *path)
+{
+	pthread_mutex_lock(&node_mutex);
+	struct node *node = node_find_locked(path, path_hash(path));
+	if (node != NULL)
+		node_remove_locked(node);
+	pthread_mutex_unlock(&node_mutex);
+}
+
+/** Move the node of @a old_path and the ones under it to @a new_path. */
+static void
+node_rename(const char *old_path, const char *new_path)
+{
+	size_t old_len = strlen(old_path);
+	size_t new_len = strlen(new_path);
+	pthread_mutex_lock(&node_mutex);
+	struct node *target = node_find_locked(new_path, path_hash(new_path));
+	if (target != NULL)
+		node_remove_locked(target);
+	/* Take the moved nodes out first, they can land in any bucket. */
+	struct node *moved = NULL;
+	for (uint32_t i = 0; i < node_capacity; ++i) {
+		struct node **pos = &node_table[i];
+		while (*pos != NULL) {
+			struct node *node = *pos;
+			if (strncmp(node->path, old_path, old_len) != 0 ||
+			    (node->path[old_len] != 0 &&
+			     node->path[old_len] != '/')) {
+				pos = &node->next;
+				continue;
+			}
+			*pos = node->next;
+			node->next = moved;
+			moved = node;
+			--node_count;
+		}
+	}
+	while (moved != NULL) {
+		struct node *node = moved;
+		moved = node->next;
+		node->is_linked = false;
+		size_t tail_len = strlen(node->path) - old_len;
+		char *path = malloc(new_len + tail_len + 1);
+		if (path == NULL) {
+			/* Unreachable by path, the kernel looks it up again. */
+			node->next = NULL;
+			continue;
+		}
+		memcpy(path, new_path, new_len);
+		memcpy(path + new_len, node->path + old_len, tail_len + 1);
+		free(node->path);
+		node->path = path;
+		node->hash = path_hash(path);
+		node_insert_locked(node);
+	}
+	pthread_mutex_unlock(&node_mutex);
+}
+
+static void
+node_forget(struct node *node, uint64_t nlookup)
+{
+	if (node == &root_node)
+		return;
+	pthread_mutex_lock(&node_mutex);
+	node->nlookup -= nlookup;
+	bool is_dead = node->nlookup == 0;
+	if (is_dead && node->is_linked)
+		node_remove_locked(node);
+	pthread_mutex_unlock(&node_mutex);
+	if (is_dead)
+		node_delete(node);
+}
+
+/**
+ * Path of the node, or of the entry @a name in it, if not NULL. The result is
+ * to be freed.
+ * @retval NULL The node is deleted, or no memory. Errno is set.
+ */
+static char *
+node_path(fuse_ino_t ino, const char *name)
+{
+	struct node *node = node_of(ino);
+	pthread_mutex_lock(&node_mutex);
+	char *path = NULL;
+	if (!node->is_linked) {
+		errno = ENOENT;
+	} else if (name == NULL) {
+		path = strdup(node->path);
+	} else {
+		size_t len = strlen(node->path);
+		size_t name_len = strlen(name);
+		path = malloc(len + name_len + 2);
+		if (path != NULL) {
+			memcpy(path, node->path, len);
+			if (len > 0)
+				path[len++] = '/';
+			memcpy(path + len, name, name_len + 1);
+		}
+	}
+	pthread_mutex_unlock(&node_mutex);
+	return path;
+}
+
+/** Errno of the last userfs error in this thread. */
+static int
+fs_errno(void)
+{
+	switch (ufs_errno()) {
+	case UFS_ERR_NO_ERR:
+		return 0;
+	case UFS_ERR_NO_FILE:
+		return ENOENT;
+	case UFS_ERR_NO_MEM:
+		return ENOMEM;
+	case UFS_ERR_NOT_IMPLEMENTED:
+		return ENOSYS;
+	case UFS_ERR_INVALID_ARG:
+		return EINVAL;
+	case UFS_ERR_EXISTS:
+		return EEXIST;
+	case UFS_ERR_NOT_DIR:
+		return ENOTDIR;
+	case UFS_ERR_IS_DIR:
+		return EISDIR;
+	case UFS_ERR_NOT_EMPTY:
+		return ENOTEMPTY;
+#ifdef NEED_OPEN_FLAGS
+	case UFS_ERR_NO_PERMISSION:
+		return EACCES;
+#endif
+	default:
+		return EIO;
+	}
+}
+
+static void
+fs_fill_attr(struct stat *st, fuse_ino_t ino, bool is_dir, off_t size)
+{
+	memset(st, 0, sizeof(*st));
+	st->st_ino = ino;
+	st->st_uid = getuid();
+	st->st_gid = getgid();
+	st->st_atime = st->st_mtime = st->st_ctime = fs_start_time;
+	if (is_dir) {
+		st->st_mode = S_IFDIR | 0755;
+		st->st_nlink = 2;
+		return;
+	}
+	st->st_mode = S_IFREG | 0644;
+	st->st_nlink = 1;
+	st->st_size = size;
+	st->st_blocks = (size + 511) / 512;
+}
+
+/** Get the attributes of the opened file. */
+static int
+fs_fd_attr(int fd, fuse_ino_t ino, struct stat *st)
+{
+	/* The position does not matter, the IO is done with pread/pwrite. */
+	off_t size = ufs_seek(fd, 0, UFS_SEEK_END);
+	if (size < 0)
+		return fs_errno();
+	fs_fill_attr(st, ino, false, size);
+	return 0;
+}
+
+/** Get the attributes of the file or the directory by the path. */
+static int
+fs_path_attr(const char *path, fuse_ino_t ino, struct stat *st)
+{
+	int fd = ufs_open(path, 0);
+	if (fd < 0) {
+		if (ufs_errno() != UFS_ERR_IS_DIR)
+			return fs_errno();
+		fs_fill_attr(st, ino, true, 0);
+		return 0;
+	}
+	int rc = fs_fd_attr(fd, ino, st);
+	ufs_close(fd);
+	return rc;
+}
+
+/**
+ * Give the node of the path to the kernel. The path is taken. With @a fi it
+ * is a reply to create, and the opened file is closed on failure.
+ */
+static void
+fs_reply_entry(fuse_req_t req, char *path, struct fuse_file_info *fi)
+{
+	struct fuse_entry_param e;
+	memset(&e, 0, sizeof(e));
+	int rc = fi != NULL ? fs_fd_attr(fi->fh, 0, &e.attr) :
+			      fs_path_attr(path, 0, &e.attr);
+	struct node *node = NULL;
+	if (rc != 0)
+		free(path);
+	else if ((node = node_get(path, S_ISDIR(e.attr.st_mode))) == NULL)
+		rc = ENOMEM;
+	if (rc != 0) {
+		if (fi != NULL)
+			ufs_close(fi->fh);
+		fuse_reply_err(req, rc);
+		return;
+	}
+	e.ino = node_ino(node);
+	e.attr.st_ino = e.ino;
+	e.attr_timeout = FS_CACHE_TIMEOUT;
+	e.entry_timeout = FS_CACHE_TIMEOUT;
+	if (fi == NULL) {
+		rc = fuse_reply_entry(req, &e);
+	} else if ((rc = fuse_reply_create(req, &e, fi)) != 0) {
+		ufs_close(fi->fh);
+	}
+	/* The kernel did not get it, nobody will forget it. */
+	if (rc != 0)
+		node_forget(node, 1);
+}
+
+static void
+fs_destroy(void *userdata)
+{
+	(void)userdata;
+	ufs_destroy();
+}
+
+static void
+fs_lookup(fuse_req_t req, fuse_ino_t parent, const char *name)
+{
+	char *path = node_path(parent, name);
+	if (path == NULL) {
+		fuse_reply_err(req, errno);
+		return;
+	}
+	fs_reply_entry(req, path, NULL);
+}
+
+static void
+fs_forget(fuse_req_t req, fuse_ino_t ino, uint64_t nlookup)
+{
+	node_forget(node_of(ino), nlookup);
+	fuse_reply_none(req);
+}
+
+static void
+fs_getattr(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi)
+{
+	struct stat st;
+	int rc;
+	if (fi != NULL && !node_of(ino)->is_dir) {
+		rc = fs_fd_attr(fi->fh, ino, &st);
+	} else {
+		char *path = node_path(ino, NULL);
+		if (path == NULL) {
+			fuse_reply_err(req, errno);
+			return;
+		}
+		rc = fs_path_attr(path, ino, &st);
+		free(path);
+	}
+	if (rc != 0)
+		fuse_reply_err(req, rc);
+	else
+		fuse_reply_attr(req, &st, FS_CACHE_TIMEOUT);
+}
+
+static void
+fs_setattr(fuse_req_t req, fuse_ino_t ino, struct stat *attr, int to_set,
+	   struct fuse_file_info *fi)
+{
+	/* Only the size is kept, the rest is accepted and ignored. */
+	if ((to_set & FUSE_SET_ATTR_SIZE) == 0 || node_of(ino)->is_dir) {
+		fs_getattr(req, ino, fi);
+		return;
+	}
+	int fd = fi != NULL ? (int)fi->fh : -1;
+	if (fd < 0) {
+		char *path = node_path(ino, NULL);
+		if (path == NULL) {
+			fuse_reply_err(req, errno);
+			return;
+		}
+		fd = ufs_open(path, 0);
+		free(path);
+		if (fd < 0) {
+			fuse_reply_err(req, fs_errno());
+			return;
+		}
+	}
+	struct stat st;
+	int rc = ufs_resize(fd, attr->st_size) != 0 ? fs_errno() :
+		 fs_fd_attr(fd, ino, &st);
+	if (fi == NULL)
+		ufs_close(fd);
+	if (rc != 0)
+		fuse_reply_err(req, rc);
+	else
+		fuse_reply_attr(req, &st, FS_CACHE_TIMEOUT);
+}
+
+static void
+fs_mkdir(fuse_req_t req, fuse_ino_t parent, const char *name, mode_t mode)
+{
+	(void)mode;
+	char *path = node_path(parent, name);
+	if (path == NULL) {
+		fuse_reply_err(req, errno);
+		return;
+	}
+	if (ufs_mkdir(path) != 0) {
+		free(path);
+		fuse_reply_err(req, fs_errno());
+		return;
+	}
+	fs_reply_entry(req, path, NULL);
+}
+
+/** Delete a file or a directory. */
+static void
+fs_remove(fuse_req_t req, fuse_ino_t parent, const char *name, bool is_dir)
+{
+	char *path = node_path(parent, name);
+	if (path == NULL) {
+		fuse_reply_err(req, errno);
+		return;
+	}
+	int rc = is_dir ? ufs_rmdir(path) : ufs_delete(path);
+	if (rc == 0)
+		node_unlink(path);
+	free(path);
+	fuse_reply_err(req, rc == 0 ? 0 : fs_errno());
+}
+
+static void
+fs_unlink(fuse_req_t req, fuse_ino_t parent, const char *name)
+{
+	fs_remove(req, parent, name, false);
+}
+
+static void
+fs_rmdir(fuse_req_t req, fuse_ino_t parent, const char *name)
+{
+	fs_remove(req, parent, name, true);
+}
+
+static void
+fs_rename(fuse_req_t req, fuse_ino_t parent, const char *name,
+	  fuse_ino_t new_parent, const char *new_name, unsigned int flags)
+{
+	/* RENAME_NOREPLACE and RENAME_EXCHANGE are not supported. */
+	if (flags != 0) {
+		fuse_reply_err(req, EINVAL);
+		return;
+	}
+	char *path = node_path(parent, name);
+	char *new_path = node_path(new_parent, new_name);
+	int rc = 0;
+	if (path == NULL || new_path == NULL)
+		rc = errno;
+	else if (ufs_rename(path, new_path) != 0)
+		rc = fs_errno();
+	else
+		node_rename(path, new_path);
+	free(path);
+	free(new_path);
+	fuse_reply_err(req, rc);
+}
+
+static void
+fs_open(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi)
+{
+	char *path = node_path(ino, NULL);
+	if (path == NULL) {
+		fuse_reply_err(req, errno);
+		return;
+	}
+	int fd = ufs_open(path, 0);
+	free(path);
+	if (fd < 0) {
+		fuse_reply_err(req, fs_errno());
+		return;
+	}
+	if ((fi->flags & O_TRUNC) != 0 && ufs_resize(fd, 0) != 0) {
+		int rc = fs_errno();
+		ufs_close(fd);
+		fuse_reply_err(req, rc);
+		return;
+	}
+	fi->fh = fd;
+	if (fuse_reply_open(req, fi) != 0)
+		ufs_close(fd);
+}
+
+static void
+fs_create(fuse_req_t req, fuse_ino_t parent, const char *name, mode_t mode,
+	  struct fuse_file_info *fi)
+{
+	(void)mode;
+	char *path = node_path(parent, name);
+	if (path == NULL) {
+		fuse_reply_err(req, errno);
+		return;
+	}
+	int fd = ufs_open(path, UFS_CREATE);
+	if (fd < 0 ||
+	    ((fi->flags & O_TRUNC) != 0 && ufs_resize(fd, 0) != 0)) {
+		int rc = fs_errno();
+		if (fd >= 0)
+			ufs_close(fd);
+		free(path);
+		fuse_reply_err(req, rc);
+		return;
+	}
+	fi->fh = fd;
+	fs_reply_entry(req, path, fi);
+}
+
+static void
+fs_release(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi)
+{
+	(void)ino;
+	ufs_close(fi->fh);
+	fuse_reply_err(req, 0);
+}
+
+static void
+fs_read(fuse_req_t req, fuse_ino_t ino, size_t size, off_t off,
+	struct fuse_file_info *fi)
+{
+	(void)ino;
+	/* The extents can't be freed while the view is held. */
+	struct ufs_view view;
+	if (ufs_read_view(fi->fh, off, size, &view) != 0) {
+		fuse_reply_err(req, fs_errno());
+		return;
+	}
+	fuse_reply_iov(req, view.iov, view.iovcnt);
+	ufs_view_release(&view);
+}
+
+static void
+fs_write(fuse_req_t req, fuse_ino_t ino, const char *buf, size_t size,
+	 off_t off, struct fuse_file_info *fi)
+{
+	(void)ino;
+	ssize_t rc = ufs_pwrite(fi->fh, buf, size, off);
+	if (rc < 0)
+		fuse_reply_err(req, fs_errno());
+	else
+		fuse_reply_write(req, rc);
+}
+
+static void
+fs_fsync(fuse_req_t req, fuse_ino_t ino, int datasync,
+	 struct fuse_file_info *fi)
+{
+	(void)ino;
+	(void)datasync;
+	(void)fi;
+	fuse_reply_err(req, ufs_sync() == 0 ? 0 : fs_errno());
+}
+
+/**
+ * Listing of a directory, taken on opendir. The kernel reads it by parts
+ * with offsets, which have to stay valid whatever happens with the directory
+ * meanwhile.
+ */
+struct dir_listing {
+	struct dir_listing_entry {
+		/** Offset of the name in the names. */
+		size_t name_offset;
+		bool is_dir;
+	} *entries;
+	size_t count;
+	size_t capacity;
+	/** All the names one after another. */
+	char *names;
+	size_t names_size;
+	size_t names_capacity;
+	bool is_failed;
+};
+
+static int
+dir_listing_add(const struct ufs_dirent *entry, void *arg)
+{
+	struct dir_listing *l = arg;
+	size_t len = strlen(entry->name) + 1;
+	if (l->count == l->capacity) {
+		size_t capacity = l->capacity == 0 ? 16 : l->capacity * 2;
+		void *entries = realloc(l->entries,
+					capacity * sizeof(*l->entries));
+		if (entries == NULL)
+			goto fail;
+		l->entries = entries;
+		l->capacity = capacity;
+	}
+	if (l->names_size + len > l->names_capacity) {
+		size_t capacity = (l->names_size + len) * 2;
+		char *names = realloc(l->names, capacity);
+		if (names == NULL)
+			goto fail;
+		l->names = names;
+		l->names_capacity = capacity;
+	}
+	memcpy(l->names + l->names_size, entry->name, len);
+	l->entries[l->count].name_offset = l->names_size;
+	l->entries[l->count].is_dir = entry->is_dir;
+	l->names_size += len;
+	++l->count;
+	return 0;
+fail:
+	l->is_failed = true;
+	return -1;
+}
+
+static void
+dir_listing_delete(struct dir_listing *l)
+{
+	free(l->entries);
+	free(l->names);
+	free(l);
+}
+
+static void
+fs_opendir(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi)
+{
+	struct dir_listing *l = calloc(1, sizeof(*l));
+	char *path = node_path(ino, NULL);
+	int rc = 0;
+	if (path == NULL) {
+		rc = errno;
+	} else if (l == NULL) {
+		rc = ENOMEM;
+	} else {
+		struct ufs_dirent dots[] = {{".", true}, {"..", true}};
+		dir_listing_add(&dots[0], l);
+		dir_listing_add(&dots[1], l);
+		if (ufs_readdir(path, dir_listing_add, l) != 0)
+			rc = fs_errno();
+		else if (l->is_failed)
+			rc = ENOMEM;
+	}
+	free(path);
+	if (rc != 0) {
+		if (l != NULL)
+			dir_listing_delete(l);
+		fuse_reply_err(req, rc);
+		return;
+	}
+	fi->fh = (uintptr_t)l;
+	if (fuse_reply_open(req, fi) != 0)
+		dir_listing_delete(l);
+}
+
+static void
+fs_readdir(fuse_req_t req, fuse_ino_t ino, size_t size, off_t off,
+	   struct fuse_file_info *fi)
+{
+	(void)ino;
+	struct dir_listing *l = (struct dir_listing *)(uintptr_t)fi->fh;
+	char *buf = malloc(size);
+	if (buf == NULL) {
+		fuse_reply_err(req, ENOMEM);
+		return;
+	}
+	size_t used = 0;
+	for (size_t i = off; i < l->count; ++i) {
+		struct stat st;
+		memset(&st, 0, sizeof(st));
+		/* The inode numbers come from lookup, the type is enough. */
+		st.st_ino = FUSE_UNKNOWN_INO;
+		st.st_mode = l->entries[i].is_dir ? S_IFDIR : S_IFREG;
+		const char *name = l->names + l->entries[i].name_offset;
+		size_t len = fuse_add_direntry(req, buf + used, size - used,
+					       name, &st, i + 1);
+		if (len > size - used)
+			break;
+		used += len;
+	}
+	fuse_reply_buf(req, buf, used);
+	free(buf);
+}
+
+static void
+fs_releasedir(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi)
+{
+	(void)ino;
+	dir_listing_delete((struct dir_listing *)(uintptr_t)fi->fh);
+	fuse_reply_err(req, 0);
+}
+
+static const struct fuse_lowlevel_ops fs_ops = {
+	.destroy = fs_destroy,
+	.lookup = fs_lookup,
+	.forget = fs_forget,
+	.getattr = fs_getattr,
+	.setattr = fs_setattr,
+	.mkdir = fs_mkdir,
+	.unlink = fs_unlink,
+	.rmdir = fs_rmdir,
+	.rename = fs_rename,
+	.open = fs_open,
+	.create = fs_create,
+	.release = fs_release,
+	.read = fs_read,
+	.write = fs_write,
+	.fsync = fs_fsync,
+	.opendir = fs_opendir,
+	.readdir = fs_readdir,
+	.releasedir = fs_releasedir,
+};
+
+struct fs_options {
+	const char *image;
+	unsigned long image_size_mb;
+};
+
+static const struct fuse_opt fs_opts[] = {
+	{"--image=%s", offsetof(struct fs_options, image), 1},
+	{"--image-size=%lu", offsetof(struct fs_options, image_size_mb), 1},
+	FUSE_OPT_END,
+};
+
+/**
+ * The image path as it is after fuse_daemonize(), which changes the working
+ * directory to the root. A relative path is joined with the current one.
+ */
+static char *
+fs_image_path(const char *path)
+{
+	if (path[0] == '/')
+		return strdup(path);
+	char *cwd = getcwd(NULL, 0);
+	if (cwd == NULL)
+		return NULL;
+	size_t size = strlen(cwd) + strlen(path) + 2;
+	char *res = malloc(size);
+	if (res != NULL)
+		snprintf(res, size, "%s/%s", cwd, path);
+	free(cwd);
+	return res;
+}
+
+int
+main(int argc, char **argv)
+{
+	struct fuse_args args = FUSE_ARGS_INIT(argc, argv);
+	struct fs_options options = {.image = NULL, .image_size_mb = 1024};
+	struct fuse_cmdline_opts opts;
+	memset(&opts, 0, sizeof(opts));
+	char *image = NULL;
+	int rc = 1;
+	if (fuse_opt_parse(&args, &options, fs_opts, NULL) != 0 ||
+	    fuse_parse_cmdline(&args, &opts) != 0)
+		goto out;
+	if (opts.show_help || opts.mountpoint == NULL) {
+		printf("Usage: %s <mountpoint> [options]\n"
+		       "    --image=<path>       keep the files in an image\n"
+		       "    --image-size=<MB>    size of a new image\n",
+		       argv[0]);
+		fuse_cmdline_help();
+		fuse_lowlevel_help();
+		rc = opts.show_help ? 0 : 1;
+		goto out;
+	}
+	fs_start_time = time(NULL);
+	if (options.image != NULL &&
+	    (image = fs_image_path(options.image)) == NULL) {
+		perror(options.image);
+		goto out;
+	}
+	struct fuse_session *se = fuse_session_new(&args, &fs_ops,
+						   sizeof(fs_ops), NULL);
+	if (se == NULL)
+		goto out;
+	size_t image_size = options.image_size_mb << 20;
+	if (fuse_set_signal_handlers(se) == 0) {
+		if (fuse_session_mount(se, opts.mountpoint) == 0) {
+			fuse_daemonize(opts.foreground);
+			/*
+			 * Only after the fork - the image flusher thread
+			 * would not exist in the daemon otherwise. The
+			 * kernel queues the requests meanwhile. Without -f
+			 * the error goes nowhere, the mount point just
+			 * disappears.
+			 */
+			if (image != NULL &&
+			    ufs_mount(image, image_size) != 0) {
+				fprintf(stderr, "Can't mount the image %s, "
+					"error %d\n", image, (int)ufs_errno());
+				rc = 1;
+			} else if (opts.singlethread) {
+				rc = fuse_session_loop(se);
+			} else {
+				rc = fuse_session_loop_mt(se, opts.clone_fd);
+			}
+			fuse_session_unmount(se);
+		}
+		fuse_remove_signal_handlers(se);
+	}
+	/* Calls fs_destroy(), which syncs the image. */
+	fuse_session_destroy(se);
+	rc = rc != 0 ? 1 : 0;
+out:
+	free(image);
+	free(opts.mountpoint);
+	fuse_opt_free_args(&args);
+	return rc;
+}
@@ -0,0 +1,333 @@
+/**
+ * Benchmark of the thread pool. Each workload is run with 1, 2, 4, ... threads
+ * up to the given count. Prints one JSON object per workload and thread count.
+ *
+ * Workloads:
+ * - push_join - one producer pushes batches of empty tasks and joins them;
+ * - multi_producer - as many producers as workers, each pushes and joins an
+ *   own share of the tasks;
+ * - latency - one task at a time into an idle pool, the time from the push
+ *   until the task starts. The workers are parked then, so it is mostly the
+ *   wakeup cost;
+ * - merge_sort - recursive fork-join merge sort. Each task pushes the left
+ *   half as a subtask, sorts the right half itself, joins and merges. The
+ *   speedup is against the same recursion without the pool.
+ */
+#include "thread_pool.h"
+
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+enum {
+	BENCH_BATCH = 1000,
+	BENCH_LATENCY_SAMPLES = 2000,
+	BENCH_SORT_SIZE = 1 << 22,
+	/** Smaller pieces are sorted without subtasks. */
+	BENCH_SORT_CUTOFF = 8192,
+};
+
+static uint64_t
+bench_now_ns(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+static void *
+bench_empty_f(void *arg)
+{
+	return arg;
+}
+
+/** Push and join @a count tasks in batches. Returns the error count. */
+static int
+bench_push_join(struct thread_pool *pool, uint64_t count)
+{
+	struct thread_task *tasks[BENCH_BATCH];
+	for (int i = 0; i < BENCH_BATCH; ++i)
+		thread_task_new(&tasks[i], bench_empty_f, NULL);
+	int errors = 0;
+	for (uint64_t done = 0; done < count; done += BENCH_BATCH) {
+		for (int i = 0; i < BENCH_BATCH; ++i) {
+			if (thread_pool_push_task(pool, tasks[i]) != 0)
+				++errors;
+		}
+		for (int i = 0; i < BENCH_BATCH; ++i)
+			thread_task_join(tasks[i], NULL);
+	}
+	for (int i = 0; i < BENCH_BATCH; ++i)
+		thread_task_delete(tasks[i]);
+	return errors;
+}
+
+struct bench_producer {
+	pthread_t thread;
+	struct thread_pool *pool;
+	uint64_t count;
+	int errors;
+};
+
+static void *
+bench_producer_f(void *arg)
+{
+	struct bench_producer *p = arg;
+	p->errors = bench_push_join(p->pool, p->count);
+	return NULL;
+}
+
+static void
+bench_report(const char *workload, int threads, uint64_t tasks,
+	     uint64_t ns, int errors)
+{
+	double seconds = ns / 1e9;
+	printf("{\"workload\": \"%s\", \"threads\": %d, \"tasks\": %llu, "
+	       "\"seconds\": %.6f, \"tasks_per_sec\": %.0f, \"errors\": %d}\n",
+	       workload, threads, (unsigned long long)tasks, seconds,
+	       tasks / seconds, errors);
+	fflush(stdout);
+}
+
+static int
+bench_throughput(const char *workload, int thread_count, int producer_count,
+		 uint64_t tasks)
+{
+	struct thread_pool *pool;
+	if (thread_pool_new(thread_count, &pool) != 0)
+		return -1;
+	struct bench_producer producers[TPOOL_MAX_THREADS];
+	uint64_t share = tasks / producer_count;
+	uint64_t start = bench_now_ns();
+	int errors = 0;
+	if (producer_count == 1) {
+		errors = bench_push_join(pool, tasks);
+	} else {
+		for (int i = 0; i < producer_count; ++i) {
+			producers[i].pool = pool;
+			producers[i].count = share;
+			pthread_create(&producers[i].thread, NULL,
+				       bench_producer_f, &producers[i]);
+		}
+		for (int i = 0; i < producer_count; ++i) {
+			pthread_join(producers[i].thread, NULL);
+			errors += producers[i].errors;
+		}
+		tasks = share * producer_count;
+	}
+	uint64_t ns = bench_now_ns() - start;
+	bench_report(workload, thread_count, tasks, ns, errors);
+	thread_pool_delete(pool);
+	return errors == 0 ? 0 : -1;
+}
+
+static void *
+bench_stamp_f(void *arg)
+{
+	*(uint64_t *)arg = bench_now_ns();
+	return NULL;
+}
+
+static int
+bench_cmp_u64(const void *a, const void *b)
+{
+	uint64_t x = *(const uint64_t *)a;
+	uint64_t y = *(const uint64_t *)b;
+	return x < y ? -1 : x > y;
+}
+
+static int
+bench_latency(int thread_count)
+{
+	struct thread_pool *pool;
+	if (thread_pool_new(thread_count, &pool) != 0)
+		return -1;
+	/* Start all the threads, they are started only on demand. */
+	bench_push_join(pool, BENCH_BATCH);
+	static uint64_t samples[BENCH_LATENCY_SAMPLES];
+	uint64_t started;
+	struct thread_task *task;
+	thread_task_new(&task, bench_stamp_f, &started);
+	int errors = 0;
+	for (int i = 0; i < BENCH_LATENCY_SAMPLES; ++i) {
+		/* Let the workers park. */
+		usleep(50);
+		uint64_t pushed = bench_now_ns();
+		if (thread_pool_push_task(pool, task) != 0 ||
+		    thread_task_join(task, NULL) != 0)
+			++errors;
+		samples[i] = started - pushed;
+	}
+	thread_task_delete(task);
+	thread_pool_delete(pool);
+	qsort(samples, BENCH_LATENCY_SAMPLES, sizeof(samples[0]),
+	      bench_cmp_u64);
+	printf("{\"workload\": \"latency\", \"threads\": %d, \"tasks\": %d, "
+	       "\"p50_us\": %.2f, \"p99_us\": %.2f, \"max_us\": %.2f, "
+	       "\"errors\": %d}\n", thread_count, BENCH_LATENCY_SAMPLES,
+	       samples[BENCH_LATENCY_SAMPLES / 2] / 1e3,
+	       samples[BENCH_LATENCY_SAMPLES * 99 / 100] / 1e3,
+	       samples[BENCH_LATENCY_SAMPLES - 1] / 1e3, errors);
+	fflush(stdout);
+	return errors == 0 ? 0 : -1;
+}
+
+struct bench_sort {
+	/** NULL to sort in the calling thread only. */
+	struct thread_pool *pool;
+	int *data;
+	int *tmp;
+	size_t size;
+};
+
+static int
+bench_cmp_int(const void *a, const void *b)
+{
+	int x = *(const int *)a;
+	int y = *(const int *)b;
+	return x < y ? -1 : x > y;
+}
+
+static void *
+bench_sort_f(void *arg)
+{
+	struct bench_sort *s = arg;
+	if (s->size <= BENCH_SORT_CUTOFF) {
+		qsort(s->data, s->size, sizeof(s->data[0]), bench_cmp_int);
+		return NULL;
+	}
+	size_t half = s->size / 2;
+	struct bench_sort left = {s->pool, s->data, s->tmp, half};
+	struct bench_sort right = {s->pool, s->data + half, s->tmp + half,
+				   s->size - half};
+	struct thread_task *task = NULL;
+	if (s->pool != NULL) {
+		thread_task_new(&task, bench_sort_f, &left);
+		thread_pool_push_task(s->pool, task);
+	} else {
+		bench_sort_f(&left);
+	}
+	bench_sort_f(&right);
+	if (task != NULL) {
+		thread_task_join(task, NULL);
+		thread_task_delete(task);
+	}
+	size_t i = 0, j = half, k = 0;
+	while (i < half && j < s->size) {
+		if (s->data[j] < s->data[i])
+			s->tmp[k++] = s->data[j++];
+		else
+			s->tmp[k++] = s->data[i++];
+	}
+	while (i < half)
+		s->tmp[k++] = s->data[i++];
+	while (j < s->size)
+		s->tmp[k++] = s->data[j++];
+	memcpy(s->data, s->tmp, s->size * sizeof(s->data[0]));
+	return NULL;
+}
+
+/** Sort random numbers. Returns the time, 0 on an error. */
+static uint64_t
+bench_sort_run(struct thread_pool *pool)
+{
+	int *data = malloc(BENCH_SORT_SIZE * sizeof(data[0]));
+	int *tmp = malloc(BENCH_SORT_SIZE * sizeof(tmp[0]));
+	if (data == NULL || tmp == NULL) {
+		free(data);
+		free(tmp);
+		return 0;
+	}
+	uint32_t r = 2463534242u;
+	for (size_t i = 0; i < BENCH_SORT_SIZE; ++i) {
+		r ^= r << 13;
+		r ^= r >> 17;
+		r ^= r << 5;
+		data[i] = r;
+	}
+	struct bench_sort s = {pool, data, tmp, BENCH_SORT_SIZE};
+	uint64_t start = bench_now_ns();
+	if (pool == NULL) {
+		bench_sort_f(&s);
+	} else {
+		struct thread_task *task;
+		thread_task_new(&task, bench_sort_f, &s);
+		thread_pool_push_task(pool, task);
+		thread_task_join(task, NULL);
+		thread_task_delete(task);
+	}
+	uint64_t ns = bench_now_ns() - start;
+	for (size_t i = 1; i < BENCH_SORT_SIZE && ns != 0; ++i) {
+		if (data[i - 1] > data[i])
+			ns = 0;
+	}
+	free(data);
+	free(tmp);
+	return ns;
+}
+
+static int
+bench_merge_sort(int thread_count, uint64_t sequential_ns)
+{
+	struct thread_pool *pool;
+	if (thread_pool_new(thread_count, &pool) != 0)
+		return -1;
+	uint64_t ns = bench_sort_run(pool);
+	thread_pool_delete(pool);
+	printf("{\"workload\": \"merge_sort\", \"threads\": %d, "
+	       "\"elements\": %d, \"seconds\": %.6f, \"speedup\": %.2f, "
+	       "\"errors\": %d}\n", thread_count, BENCH_SORT_SIZE, ns / 1e9,
+	       ns == 0 ? 0 : (double)sequential_ns / ns, ns == 0);
+	fflush(stdout);
+	return ns != 0 ? 0 : -1;
+}
+
+static void
+usage(const char *name)
+{
+	fprintf(stderr, "Usage: %s [-t max_threads] [-n tasks]\n", name);
+}
+
+int
+main(int argc, char **argv)
+{
+	int max_threads = TPOOL_MAX_THREADS;
+	uint64_t tasks = 1000000;
+	int opt;
+	while ((opt = getopt(argc, argv, "t:n:h")) != -1) {
+		switch (opt) {
+		case 't': max_threads = atoi(optarg); break;
+		case 'n': tasks = strtoull(optarg, NULL, 10); break;
+		default:
+			usage(argv[0]);
+			return opt == 'h' ? 0 : 1;
+		}
+	}
+	if (max_threads < 1)
+		max_threads = 1;
+	if (max_threads > TPOOL_MAX_THREADS)
+		max_threads = TPOOL_MAX_THREADS;
+	int rc = 0;
+	for (int n = 1; n <= max_threads; n *= 2) {
+		if (bench_throughput("push_join", n, 1, tasks) != 0)
+			rc = 1;
+	}
+	for (int n = 1; n <= max_threads; n *= 2) {
+		if (bench_throughput("multi_producer", n, n, tasks) != 0)
+			rc = 1;
+	}
+	for (int n = 1; n <= max_threads; n *= 2) {
+		if (bench_latency(n) != 0)
+			rc = 1;
+	}
+	uint64_t sequential_ns = bench_sort_run(NULL);
+	for (int n = 1; n <= max_threads; n *= 2) {
+		if (bench_merge_sort(n, sequential_ns) != 0)
+			rc = 1;
+	}
+	return rc;
+}
@@ -243,6 +243,69 @@ test_thread_pool_max_tasks(void)
 }
 
 
+struct fork_join_arg {
+	struct thread_pool *pool;
+	int depth;
+	int *leaf_count;
+};
+
+static void *
+task_fork_join_f(void *arg)
+{
+	struct fork_join_arg *a = arg;
+	if (a->depth == 0) {
+		__atomic_add_fetch(a->leaf_count, 1, __ATOMIC_RELAXED);
+		return arg;
+	}
+	struct fork_join_arg args[2];
+	struct thread_task *tasks[2];
+	for (int i = 0; i < 2; ++i) {
+		args[i] = *a;
+		--args[i].depth;
+		unit_fail_if(thread_task_new(&tasks[i], task_fork_join_f,
+					     &args[i]) != 0);
+		unit_fail_if(thread_pool_push_task(a->pool, tasks[i]) != 0);
+	}
+	for (int i = 0; i < 2; ++i) {
+		void *result;
+		unit_fail_if(thread_task_join(tasks[i], &result) != 0);
+		unit_fail_if(result != &args[i]);
+		unit_fail_if(thread_task_delete(tasks[i]) != 0);
+	}
+	return arg;
+}
+
+static void
+test_push_from_task(void)
+{
+	unit_test_start();
+
+	/*
+	 * The tasks push their children and join them. With one thread it
+	 * works only if the joining worker runs the children itself.
+	 */
+	int thread_counts[] = {1, 4};
+	for (int i = 0; i < 2; ++i) {
+		struct thread_pool *p;
+		unit_fail_if(thread_pool_new(thread_counts[i], &p) != 0);
+		int leaf_count = 0;
+		struct fork_join_arg arg = {p, 10, &leaf_count};
+		struct thread_task *t;
+		void *result;
+		unit_fail_if(thread_task_new(&t, task_fork_join_f, &arg) != 0);
+		unit_fail_if(thread_pool_push_task(p, t) != 0);
+		unit_fail_if(thread_task_join(t, &result) != 0);
+		unit_check(leaf_count == 1024 && result == &arg,
+			   "all the subtasks are done");
+		unit_check(thread_pool_thread_count(p) <= thread_counts[i],
+			   "thread count is in the limit");
+		unit_fail_if(thread_task_delete(t) != 0);
+		unit_fail_if(thread_pool_delete(p) != 0);
+	}
+
+	unit_test_finish();
+}
+
 static void
 test_timed_join(void)
 {
@@ -361,6 +424,7 @@ main(void)
 	test_push();
 	test_thread_pool_delete();
 	test_thread_pool_max_tasks();
+	test_push_from_task();
 	test_timed_join();
 	test_detach_stress();
 	test_detach_long();
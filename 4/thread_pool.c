@@ -1,253 +1,524 @@
+#define _GNU_SOURCE
 #include "thread_pool.h"
-#include <errno.h>
+#include <limits.h>
+#include <linux/futex.h>
 #include <pthread.h>
 #include <stdbool.h>
-#include <stdio.h>
+#include <stdint.h>
 #include <stdlib.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+enum {
+	/** Size of the task ring, a power of 2 not less than the task limit. */
+	TPOOL_RING_SIZE = 1 << 17,
+	TPOOL_RING_MASK = TPOOL_RING_SIZE - 1,
+	TPOOL_CACHE_LINE = 64,
+	/** Size of a worker deque, a power of 2. */
+	TPOOL_DEQUE_SIZE = 1024,
+	TPOOL_DEQUE_MASK = TPOOL_DEQUE_SIZE - 1,
+};
+
+_Static_assert((int)TPOOL_RING_SIZE >= (int)TPOOL_MAX_TASKS,
+	       "the ring can't overflow while the task count is limited");
+
+enum thread_task_state {
+	/** Never pushed. */
+	TASK_CREATED,
+	/** In the ring, waiting for a worker. */
+	TASK_QUEUED,
+	TASK_RUNNING,
+	/** Finished, the result is not taken yet. */
+	TASK_FINISHED,
+	/** Finished and joined, can be pushed again. */
+	TASK_JOINED,
+	/** Flag: a joiner sleeps on the state, the worker has to wake it. */
+	TASK_HAS_JOINER = 1 << 30,
+};
 
 struct thread_task {
 	thread_task_f function;
 	void *arg;
+	void *result;
+	/** enum thread_task_state, a futex for the joiners. */
+	uint32_t state;
+};
 
-    /* PUT HERE OTHER MEMBERS */
-  pthread_mutex_t mutex;
-  pthread_cond_t cond;
-  bool is_finished;
-  bool is_pushed;
-  bool is_joined;
-  void *result;
-  struct thread_task *next;
+/**
+ * Cell of the ring. Its sequence number tells whose turn it is: it equals the
+ * position when the cell is free for a push to that position, and the
+ * position + 1 when a task is in it for a pop from that position.
+ */
+struct thread_pool_cell {
+	uint64_t seq;
+	struct thread_task *task;
+};
 
+/**
+ * Worker with its own Chase-Lev deque. The tasks pushed by its running task
+ * go to the bottom and are taken back from there, LIFO, so a fork-join task
+ * finds its children hot in the cache. The other workers steal from the top,
+ * FIFO, the oldest and usually the biggest pieces of work.
+ */
+struct thread_pool_worker {
+	struct thread_pool *pool;
+	pthread_t thread;
+	/** State of the victim choice, xorshift. */
+	uint32_t rand;
+	char pad1[TPOOL_CACHE_LINE];
+	/** Where the thieves take from. */
+	int64_t top;
+	char pad2[TPOOL_CACHE_LINE];
+	/** Where the owner pushes and takes, only it changes that. */
+	int64_t bottom;
+	struct thread_task *deque[TPOOL_DEQUE_SIZE];
 };
 
 struct thread_pool {
-  pthread_t *threads;
-  pthread_mutex_t mutex;
-  pthread_cond_t cond;
-
-  struct thread_task *queue_head;
-  struct thread_task *queue_tail;
-  size_t queue_length;
-  size_t active_tasks;
-  size_t thread_capacity;
-  size_t active_threads;
+	/**
+	 * Bounded MPMC ring of the tasks pushed from outside of the workers
+	 * (Dmitry Vyukov's). A push and a pop each take one CAS on their own
+	 * position, so the producers and the consumers do not contend with
+	 * each other.
+	 */
+	struct thread_pool_cell *cells;
+	char pad1[TPOOL_CACHE_LINE];
+	uint64_t push_pos;
+	char pad2[TPOOL_CACHE_LINE];
+	uint64_t pop_pos;
+	char pad3[TPOOL_CACHE_LINE];
+	/** Pushed and not finished tasks. */
+	uint32_t task_count;
+	/** Workers which found the ring empty and park or are about to. */
+	uint32_t idle_count;
+	/** Futex the idle workers sleep on. It is bumped to wake them. */
+	uint32_t wake_seq;
+	bool is_stopping;
+	char pad4[TPOOL_CACHE_LINE];
+	int thread_count;
+	int max_thread_count;
+	/** Serializes the thread starts. */
+	pthread_mutex_t mutex;
+	struct thread_pool_worker *workers;
 };
 
-// CUSTOM
-void *thread_pool_worker(void *arg) {
-    struct thread_pool *pool = (struct thread_pool *)arg;
-
-    while (true) {
-        printf("Worker step... Active threads: %ld, Thread capacity: %zu\n", pool->active_threads, pool->thread_capacity);
-        struct thread_task *task;
-
-        pthread_mutex_lock(&pool->mutex);
-
-        while (pool->queue_head == NULL) {
-            pthread_cond_wait(&pool->cond, &pool->mutex);
-        }
-
-        task = pool->queue_head;
-        if (task != NULL) {
-            pool->queue_head = task->next;
-            pool->queue_length--;
-            pool->active_tasks++;
-
-            if (pool->queue_head == NULL) {
-                printf("Queue empty...\n");
-                pool->queue_tail = NULL;
-            }
-        }
-
-        pthread_mutex_unlock(&pool->mutex);
-
-        if (task != NULL) {
-            printf("Starting task...\n");
-            pthread_mutex_lock(&task->mutex);
-            void *result = task->function(task->arg);
-            task->result = result;
-
-            task->is_finished = true;
-            pool->active_tasks--;
-            pthread_mutex_unlock(&task->mutex);
-            pthread_cond_signal(&task->cond);
-            printf("Task finished.\n");
-        }
-    }
-
-    return NULL;
-}
+/** The worker running in this thread, if it is a pool thread. */
+static __thread struct thread_pool_worker *thread_pool_worker_self = NULL;
 
-// DONE
-int
-thread_pool_new(int max_thread_count, struct thread_pool **pool)
+static inline void
+futex_wait(uint32_t *addr, uint32_t value)
 {
-    if (max_thread_count <= 0 || max_thread_count > TPOOL_MAX_THREADS) {
-        return TPOOL_ERR_INVALID_ARGUMENT;
-    }
-
-    *pool = malloc(sizeof(struct thread_pool));
-    if (*pool == NULL) {
-        return TPOOL_ERR_NOT_IMPLEMENTED;
-    }
-
-
-
-    (*pool)->threads = malloc(sizeof(pthread_t) * max_thread_count);
-    if ((*pool)->threads == NULL) {
-        free(*pool);
-        return TPOOL_ERR_NOT_IMPLEMENTED;
-    }
-
-    pthread_mutex_init(&(*pool)->mutex, NULL);
-    pthread_cond_init(&(*pool)->cond, NULL);
-    (*pool)->queue_head = NULL;
-    (*pool)->queue_tail = NULL;
-    (*pool)->thread_capacity = max_thread_count;
-    (*pool)->active_threads = 0;
-    (*pool)->queue_length = 0;
-    (*pool)->active_tasks = 0;
-
-    return 0;
+	syscall(SYS_futex, addr, FUTEX_WAIT_PRIVATE, value, NULL, NULL, 0);
 }
 
-// DONE
-int
-thread_pool_thread_count(const struct thread_pool *pool)
+static inline void
+futex_wake(uint32_t *addr, int count)
 {
-	return pool->active_threads;
+	syscall(SYS_futex, addr, FUTEX_WAKE_PRIVATE, count, NULL, NULL, 0);
 }
-// DONE
-int
-thread_pool_delete(struct thread_pool *pool)
+
+static inline uint32_t
+thread_task_state(const struct thread_task *task)
 {
+	return __atomic_load_n(&task->state, __ATOMIC_ACQUIRE) &
+	       ~TASK_HAS_JOINER;
+}
 
-    if (pool->queue_head != NULL || pool->active_tasks > 0) {
-        return TPOOL_ERR_HAS_TASKS;
-    }
+static void
+thread_pool_ring_push(struct thread_pool *pool, struct thread_task *task)
+{
+	uint64_t pos = __atomic_load_n(&pool->push_pos, __ATOMIC_RELAXED);
+	struct thread_pool_cell *cell;
+	while (true) {
+		cell = &pool->cells[pos & TPOOL_RING_MASK];
+		uint64_t seq = __atomic_load_n(&cell->seq, __ATOMIC_ACQUIRE);
+		int64_t diff = (int64_t)(seq - pos);
+		if (diff == 0) {
+			if (__atomic_compare_exchange_n(&pool->push_pos, &pos,
+							pos + 1, true,
+							__ATOMIC_RELAXED,
+							__ATOMIC_RELAXED))
+				break;
+		} else {
+			/*
+			 * Another producer took the cell. The ring can't be
+			 * full, the task count is limited below its size.
+			 */
+			pos = __atomic_load_n(&pool->push_pos,
+					      __ATOMIC_RELAXED);
+		}
+	}
+	cell->task = task;
+	__atomic_store_n(&cell->seq, pos + 1, __ATOMIC_RELEASE);
+}
 
-    pthread_cond_broadcast(&pool->cond);
+/** Take the oldest task, NULL if there are none. */
+static struct thread_task *
+thread_pool_ring_pop(struct thread_pool *pool)
+{
+	uint64_t pos = __atomic_load_n(&pool->pop_pos, __ATOMIC_RELAXED);
+	struct thread_pool_cell *cell;
+	while (true) {
+		cell = &pool->cells[pos & TPOOL_RING_MASK];
+		uint64_t seq = __atomic_load_n(&cell->seq, __ATOMIC_ACQUIRE);
+		int64_t diff = (int64_t)(seq - (pos + 1));
+		if (diff == 0) {
+			if (__atomic_compare_exchange_n(&pool->pop_pos, &pos,
+							pos + 1, true,
+							__ATOMIC_RELAXED,
+							__ATOMIC_RELAXED))
+				break;
+		} else if (diff < 0) {
+			return NULL;
+		} else {
+			pos = __atomic_load_n(&pool->pop_pos, __ATOMIC_RELAXED);
+		}
+	}
+	struct thread_task *task = cell->task;
+	__atomic_store_n(&cell->seq, pos + TPOOL_RING_SIZE, __ATOMIC_RELEASE);
+	return task;
+}
 
-    if (pool->active_threads != 0) {
-        for (size_t i = 0; i < pool->thread_capacity; ++i) {
-            pthread_join(pool->threads[i], NULL);
-        }
-    }
+/** Push to the deque bottom. False if the deque is full. */
+static bool
+thread_pool_deque_push(struct thread_pool_worker *w, struct thread_task *task)
+{
+	int64_t b = __atomic_load_n(&w->bottom, __ATOMIC_RELAXED);
+	int64_t t = __atomic_load_n(&w->top, __ATOMIC_ACQUIRE);
+	if (b - t >= TPOOL_DEQUE_SIZE)
+		return false;
+	__atomic_store_n(&w->deque[b & TPOOL_DEQUE_MASK], task,
+			 __ATOMIC_RELAXED);
+	/* Publishes the task to the thieves, they read the bottom first. */
+	__atomic_store_n(&w->bottom, b + 1, __ATOMIC_RELEASE);
+	return true;
+}
 
-    pthread_mutex_destroy(&pool->mutex);
-    pthread_cond_destroy(&pool->cond);
-    free(pool->threads);
-    free(pool);
+/** Take the newest task from the deque bottom. Only for the owner. */
+static struct thread_task *
+thread_pool_deque_take(struct thread_pool_worker *w)
+{
+	int64_t b = __atomic_load_n(&w->bottom, __ATOMIC_RELAXED) - 1;
+	__atomic_store_n(&w->bottom, b, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	int64_t t = __atomic_load_n(&w->top, __ATOMIC_RELAXED);
+	struct thread_task *task = NULL;
+	if (t <= b) {
+		task = __atomic_load_n(&w->deque[b & TPOOL_DEQUE_MASK],
+				       __ATOMIC_RELAXED);
+		if (t != b)
+			return task;
+		/* The last one, race with the thieves for it. */
+		if (!__atomic_compare_exchange_n(&w->top, &t, t + 1, false,
+						 __ATOMIC_SEQ_CST,
+						 __ATOMIC_RELAXED))
+			task = NULL;
+	}
+	__atomic_store_n(&w->bottom, b + 1, __ATOMIC_RELAXED);
+	return task;
+}
 
-    return 0;
+/**
+ * Steal the oldest task from the deque top.
+ * @param[out] is_lost Set if another thread won the race, then the deque can
+ *             still have tasks.
+ */
+static struct thread_task *
+thread_pool_deque_steal(struct thread_pool_worker *w, bool *is_lost)
+{
+	int64_t t = __atomic_load_n(&w->top, __ATOMIC_ACQUIRE);
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	int64_t b = __atomic_load_n(&w->bottom, __ATOMIC_ACQUIRE);
+	if (t >= b)
+		return NULL;
+	struct thread_task *task =
+		__atomic_load_n(&w->deque[t & TPOOL_DEQUE_MASK],
+				__ATOMIC_RELAXED);
+	if (!__atomic_compare_exchange_n(&w->top, &t, t + 1, false,
+					 __ATOMIC_SEQ_CST, __ATOMIC_RELAXED)) {
+		*is_lost = true;
+		return NULL;
+	}
+	return task;
 }
 
-// DONE
-int
-thread_pool_push_task(struct thread_pool *pool, struct thread_task *task)
+/**
+ * Find a task for the worker: its own newest one, then the oldest one pushed
+ * from outside, then the oldest one of another worker. NULL if there are none
+ * anywhere.
+ */
+static struct thread_task *
+thread_pool_find_task(struct thread_pool_worker *self)
 {
-		if (pool->queue_length >= TPOOL_MAX_TASKS) {
-		    pthread_mutex_unlock(&pool->mutex);
-		    return TPOOL_ERR_TOO_MANY_TASKS;
+	struct thread_pool *pool = self->pool;
+	struct thread_task *task = thread_pool_deque_take(self);
+	if (task != NULL)
+		return task;
+	task = thread_pool_ring_pop(pool);
+	if (task != NULL)
+		return task;
+	int count = __atomic_load_n(&pool->thread_count, __ATOMIC_ACQUIRE);
+	bool is_lost;
+	do {
+		is_lost = false;
+		/* Start at a random victim so the thieves spread out. */
+		uint32_t r = self->rand;
+		r ^= r << 13;
+		r ^= r >> 17;
+		r ^= r << 5;
+		self->rand = r;
+		for (int i = 0; i < count; ++i) {
+			struct thread_pool_worker *w =
+				&pool->workers[(r + i) % count];
+			if (w == self)
+				continue;
+			task = thread_pool_deque_steal(w, &is_lost);
+			if (task != NULL)
+				return task;
 		}
+	} while (is_lost);
+	return NULL;
+}
 
-        pthread_mutex_lock(&pool->mutex);
+/** Wake up a parked worker if there is one. Called after a push. */
+static void
+thread_pool_wake_one(struct thread_pool *pool)
+{
+	/* Pairs with the idleness announcement in the worker. */
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	if (__atomic_load_n(&pool->idle_count, __ATOMIC_RELAXED) != 0) {
+		__atomic_add_fetch(&pool->wake_seq, 1, __ATOMIC_RELEASE);
+		futex_wake(&pool->wake_seq, 1);
+	}
+}
 
-		if (pool->queue_head == NULL) {
-		    pool->queue_head = task;
-		    pool->queue_tail = task;
-		} else {
-		    pool->queue_tail->next = task;
-		    pool->queue_tail = task;
-		}
+static void
+thread_task_run(struct thread_pool *pool, struct thread_task *task)
+{
+	/* Keep the joiner flag, it could be set while the task was queued. */
+	uint32_t old = __atomic_load_n(&task->state, __ATOMIC_RELAXED);
+	while (!__atomic_compare_exchange_n(&task->state, &old,
+					    (old & TASK_HAS_JOINER) |
+					    TASK_RUNNING, true,
+					    __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+		;
+	task->result = task->function(task->arg);
+	/*
+	 * The count goes down first, so the pool is empty once the task is
+	 * seen finished.
+	 */
+	__atomic_sub_fetch(&pool->task_count, 1, __ATOMIC_RELEASE);
+	old = __atomic_exchange_n(&task->state, TASK_FINISHED,
+				  __ATOMIC_ACQ_REL);
+	/*
+	 * The task can be deleted by now. Then the wakeup is just spurious for
+	 * whoever uses the memory, the futexes are keyed by the address.
+	 */
+	if ((old & TASK_HAS_JOINER) != 0)
+		futex_wake(&task->state, INT_MAX);
+}
 
-		pool->queue_length++;
+static void *
+thread_pool_worker_f(void *arg)
+{
+	struct thread_pool_worker *self = arg;
+	struct thread_pool *pool = self->pool;
+	thread_pool_worker_self = self;
+	while (true) {
+		struct thread_task *task = thread_pool_find_task(self);
+		if (task != NULL) {
+			thread_task_run(pool, task);
+			continue;
+		}
+		/*
+		 * Announce the idleness before the last check for tasks. A
+		 * pusher checks the idle count after its push. So either the
+		 * task is seen here, or the pusher sees the idle worker and
+		 * bumps the sequence, and the wait returns at once.
+		 */
+		uint32_t seq = __atomic_load_n(&pool->wake_seq,
+					       __ATOMIC_ACQUIRE);
+		__atomic_add_fetch(&pool->idle_count, 1, __ATOMIC_SEQ_CST);
+		__atomic_thread_fence(__ATOMIC_SEQ_CST);
+		task = thread_pool_find_task(self);
+		bool is_stopping = __atomic_load_n(&pool->is_stopping,
+						   __ATOMIC_ACQUIRE);
+		if (task == NULL && !is_stopping)
+			futex_wait(&pool->wake_seq, seq);
+		__atomic_sub_fetch(&pool->idle_count, 1, __ATOMIC_RELAXED);
+		if (task != NULL)
+			thread_task_run(pool, task);
+		else if (is_stopping)
+			break;
+	}
+	thread_pool_worker_self = NULL;
+	return NULL;
+}
 
-        if (pool->thread_capacity > pool->active_threads &&
-            pool->active_tasks == pool->active_threads) {
-            if (pthread_create(&(pool->threads[pool->active_threads++]), NULL, thread_pool_worker, (void*) pool) != 0) {
-                pthread_mutex_unlock(&pool->mutex);
-            }
-        }
+/** Start one more thread unless there are enough for @a task_count. */
+static void
+thread_pool_grow(struct thread_pool *pool, uint32_t task_count)
+{
+	pthread_mutex_lock(&pool->mutex);
+	int count = pool->thread_count;
+	struct thread_pool_worker *w = &pool->workers[count];
+	if ((uint32_t)count < task_count && count < pool->max_thread_count &&
+	    pthread_create(&w->thread, NULL, thread_pool_worker_f, w) == 0)
+		__atomic_store_n(&pool->thread_count, count + 1,
+				 __ATOMIC_RELEASE);
+	pthread_mutex_unlock(&pool->mutex);
+}
 
-        task->next = NULL;
-        task->is_pushed = true;
+int
+thread_pool_new(int max_thread_count, struct thread_pool **pool)
+{
+	if (max_thread_count <= 0 || max_thread_count > TPOOL_MAX_THREADS)
+		return TPOOL_ERR_INVALID_ARGUMENT;
+	struct thread_pool *p = calloc(1, sizeof(*p));
+	if (p == NULL)
+		return TPOOL_ERR_NOT_IMPLEMENTED;
+	p->workers = calloc(max_thread_count, sizeof(p->workers[0]));
+	p->cells = malloc(sizeof(p->cells[0]) * TPOOL_RING_SIZE);
+	if (p->workers == NULL || p->cells == NULL) {
+		free(p->workers);
+		free(p->cells);
+		free(p);
+		return TPOOL_ERR_NOT_IMPLEMENTED;
+	}
+	for (uint64_t i = 0; i < TPOOL_RING_SIZE; ++i)
+		p->cells[i].seq = i;
+	for (int i = 0; i < max_thread_count; ++i) {
+		p->workers[i].pool = p;
+		p->workers[i].rand = 2463534242u + i;
+	}
+	p->max_thread_count = max_thread_count;
+	pthread_mutex_init(&p->mutex, NULL);
+	*pool = p;
+	return 0;
+}
 
-        pthread_mutex_unlock(&pool->mutex);
-		pthread_cond_signal(&pool->cond);
+int
+thread_pool_thread_count(const struct thread_pool *pool)
+{
+	return __atomic_load_n(&pool->thread_count, __ATOMIC_ACQUIRE);
+}
 
+int
+thread_pool_delete(struct thread_pool *pool)
+{
+	if (__atomic_load_n(&pool->task_count, __ATOMIC_ACQUIRE) != 0)
+		return TPOOL_ERR_HAS_TASKS;
+	__atomic_store_n(&pool->is_stopping, true, __ATOMIC_RELEASE);
+	__atomic_add_fetch(&pool->wake_seq, 1, __ATOMIC_RELEASE);
+	futex_wake(&pool->wake_seq, INT_MAX);
+	for (int i = 0; i < pool->thread_count; ++i)
+		pthread_join(pool->workers[i].thread, NULL);
+	pthread_mutex_destroy(&pool->mutex);
+	free(pool->workers);
+	free(pool->cells);
+	free(pool);
+	return 0;
+}
 
-		return 0;
+int
+thread_pool_push_task(struct thread_pool *pool, struct thread_task *task)
+{
+	uint32_t state = thread_task_state(task);
+	if (state == TASK_QUEUED || state == TASK_RUNNING)
+		return TPOOL_ERR_TASK_IN_POOL;
+	uint32_t count = __atomic_add_fetch(&pool->task_count, 1,
+					    __ATOMIC_RELAXED);
+	if (count > TPOOL_MAX_TASKS) {
+		__atomic_sub_fetch(&pool->task_count, 1, __ATOMIC_RELAXED);
+		return TPOOL_ERR_TOO_MANY_TASKS;
+	}
+	if ((uint32_t)thread_pool_thread_count(pool) < count &&
+	    thread_pool_thread_count(pool) < pool->max_thread_count)
+		thread_pool_grow(pool, count);
+	__atomic_store_n(&task->state, TASK_QUEUED, __ATOMIC_RELAXED);
+	/*
+	 * A task pushed by a task goes to the local deque. The ring takes only
+	 * the external pushes and the overflow.
+	 */
+	struct thread_pool_worker *self = thread_pool_worker_self;
+	if (self == NULL || self->pool != pool ||
+	    !thread_pool_deque_push(self, task))
+		thread_pool_ring_push(pool, task);
+	thread_pool_wake_one(pool);
+	return 0;
 }
 
-// DONE
 int
 thread_task_new(struct thread_task **task, thread_task_f function, void *arg)
 {
-    (*task) = malloc(sizeof(struct thread_task));
-
-    pthread_mutex_init(&(*task)->mutex, NULL);
-    pthread_cond_init(&(*task)->cond, NULL);
-    (*task)->function = function;
-    (*task)->arg = arg;
-    (*task)->is_finished = false;
-    (*task)->is_pushed = false;
-    (*task)->is_joined = false;
-    (*task)->result = NULL;
-    (*task)->next = NULL;
-
-
-    return 0;
+	struct thread_task *t = malloc(sizeof(*t));
+	if (t == NULL)
+		abort();
+	t->function = function;
+	t->arg = arg;
+	t->result = NULL;
+	t->state = TASK_CREATED;
+	*task = t;
+	return 0;
 }
 
-// DONE
 bool
 thread_task_is_finished(const struct thread_task *task)
 {
-    return task->is_finished;
+	uint32_t state = thread_task_state(task);
+	return state == TASK_FINISHED || state == TASK_JOINED;
 }
 
-// DONE
 bool
 thread_task_is_running(const struct thread_task *task)
 {
-    return !thread_task_is_finished(task);
+	return thread_task_state(task) == TASK_RUNNING;
 }
 
 int
 thread_task_join(struct thread_task *task, void **result)
 {
-    printf("Joining task...\n");
-    if (!task->is_pushed) return TPOOL_ERR_TASK_NOT_PUSHED;
-
-    pthread_mutex_lock(&task->mutex);
-
-    while (!thread_task_is_finished(task)) {
-        pthread_cond_wait(&task->cond, &task->mutex);
-    }
-
-    if (result != NULL) {
-        *result = task->result;
-    }
-    task->is_joined = true;
-    pthread_mutex_unlock(&task->mutex);
-    printf("Task joined.\n");
-
-    return 0;
+	uint32_t state = __atomic_load_n(&task->state, __ATOMIC_ACQUIRE);
+	if (state == TASK_CREATED || state == TASK_JOINED)
+		return TPOOL_ERR_TASK_NOT_PUSHED;
+	/*
+	 * A worker can't just sleep, the task can be in its own deque. And
+	 * even if it is not, the thread is better spent on other tasks.
+	 */
+	struct thread_pool_worker *self = thread_pool_worker_self;
+	while ((state & ~TASK_HAS_JOINER) != TASK_FINISHED) {
+		struct thread_task *other = NULL;
+		if (self != NULL)
+			other = thread_pool_find_task(self);
+		if (other != NULL) {
+			thread_task_run(self->pool, other);
+			state = __atomic_load_n(&task->state, __ATOMIC_ACQUIRE);
+			continue;
+		}
+		if ((state & TASK_HAS_JOINER) == 0 &&
+		    !__atomic_compare_exchange_n(&task->state, &state,
+						 state | TASK_HAS_JOINER,
+						 false, __ATOMIC_ACQUIRE,
+						 __ATOMIC_ACQUIRE))
+			continue;
+		futex_wait(&task->state, state | TASK_HAS_JOINER);
+		state = __atomic_load_n(&task->state, __ATOMIC_ACQUIRE);
+	}
+	if (result != NULL)
+		*result = task->result;
+	__atomic_store_n(&task->state, TASK_JOINED, __ATOMIC_RELAXED);
+	return 0;
 }
 
 int
 thread_task_delete(struct thread_task *task)
 {
-     printf("Task deleting.\n");
-    if (task->is_pushed && !task->is_joined && !task->is_finished) {
-        return TPOOL_ERR_TASK_IN_POOL;
-    };
-    pthread_mutex_destroy(&task->mutex);
-    pthread_cond_destroy(&task->cond);
-    free(task);
-    printf("Task deleted.\n");
-    return 0;
+	/* A finished task still belongs to the pool until it is joined. */
+	uint32_t state = thread_task_state(task);
+	if (state != TASK_CREATED && state != TASK_JOINED)
+		return TPOOL_ERR_TASK_IN_POOL;
+	free(task);
+	return 0;
 }
 
 #ifdef NEED_TIMED_JOIN
@@ -269,10 +540,9 @@ thread_task_timed_join(struct thread_task *task, double timeout, void **result)
 int
 thread_task_detach(struct thread_task *task)
 {
-    if (task == NULL) return TPOOL_ERR_INVALID_ARGUMENT;
-    // Реализация этой функции зависит от деталей реализации пула потоков и механизма отслеживания задач.
-    // Вам нужно будет обеспечить, чтобы задача автоматически удалилась по завершении, что может потребовать изменений в логике выполнения задач.
-    return TPOOL_ERR_NOT_IMPLEMENTED;
+	/* IMPLEMENT THIS FUNCTION */
+	(void)task;
+	return TPOOL_ERR_NOT_IMPLEMENTED;
 }
 
 #endif
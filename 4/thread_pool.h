@@ -22,7 +22,7 @@ struct thread_task;
 typedef void *(*thread_task_f)(void *);
 
 enum {
-	TPOOL_MAX_THREADS = 20,
+	TPOOL_MAX_THREADS = 64,
 	TPOOL_MAX_TASKS = 100000,
 };
 
@@ -80,6 +80,8 @@ thread_pool_delete(struct thread_pool *pool);
  * @retval != Error code.
  *     - TPOOL_ERR_TOO_MANY_TASKS - pool has too many tasks
  *       already.
+ *     - TPOOL_ERR_TASK_IN_POOL - the task is queued or running
+ *       already.
  */
 int
 thread_pool_push_task(struct thread_pool *pool, struct thread_task *task);
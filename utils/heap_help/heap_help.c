@@ -196,7 +196,10 @@ alloc_trace_new(void *ptr, size_t size)
 
 	a->mem = ptr;
 	a->size = size;
-	if (depth == 1)
+	// The traces are only needed for the reports. Collecting them is very
+	// expensive, so the quiet mode skips them. It makes the tool usable
+	// for allocation counting in benchmarks.
+	if (depth == 1 && report_mode != REPORT_MODE_QUIET)
 		a->trace_size = backtrace(a->trace, MAX_BACKTRACE_LEN);
 	else
 		a->trace_size = 0;
@@ -643,3 +646,12 @@ heaph_get_alloc_count(void)
 	spinlock_rel(&allocs_lock);
 	return res;
 }
+
+uint64_t
+heaph_get_alloc_count_total(void)
+{
+	spinlock_acq(&allocs_lock);
+	uint64_t res = alloc_count_total;
+	spinlock_rel(&allocs_lock);
+	return res;
+}
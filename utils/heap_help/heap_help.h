@@ -4,3 +4,10 @@
 
 uint64_t
 heaph_get_alloc_count(void);
+
+/**
+ * Number of allocations done since the process start, including the already
+ * freed ones. Useful to count allocations done by a piece of code.
+ */
+uint64_t
+heaph_get_alloc_count_total(void);